@@ -178,7 +178,8 @@ int saw_open_device(struct devmodule* dev, const char* optv[])
 	cap.device_id = saw_device_id;
 	cap.num_mappings = 2;
 	cap.mappings = mappings;
-	cap.flags = EGDCAP_NOCP_DEVTYPE | EGDCAP_NOCP_DEVID;
+	cap.flags = EGDCAP_NOCP_DEVTYPE | EGDCAP_NOCP_DEVID
+	            | EGDCAP_WHOLE_SAMPLES;
 	dev->ci.set_cap(dev, &cap);
 	dev->ci.set_input_samlen(dev, NCH*sizeof(int32_t));
 
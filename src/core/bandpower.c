@@ -0,0 +1,521 @@
+/*
+    Copyright (C) 2010-2012  EPFL (Ecole Polytechnique Fédérale de Lausanne)
+    Laboratory CNBI (Chair in Non-Invasive Brain-Machine Interface)
+    Nicolas Bourdaud <nicolas.bourdaud@epfl.ch>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mmthread.h>
+#include "coreinternals.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_SIMD	1
+# include <immintrin.h>
+#else
+# define HAVE_X86_SIMD	0
+#endif
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+/* The band-power stage computes, every step samples, the power of the
+ * monitored channels in each band over the last window samples of the
+ * ring. The window is Hann-weighted and the power of the bins of the bands
+ * is obtained by a bank of Goertzel resonators, run on several channels
+ * with each SIMD instruction. The computation is done by a thread of the
+ * stage that reads the samples directly from the ring: the thread that
+ * writes the ring only announces how far it is about to write before
+ * casting (see egdi_reserve_bandpower()) and signals when a window is
+ * complete. If the samples of a window have been overwritten while they
+ * were read (the consumer being too slow), the result is dropped. */
+
+#define CHBLOCK		32	// channels processed at once
+
+// Run one sample v of nc channels through the nbin resonators whose
+// coefficients are in coef, their state being in s
+typedef void (*goertzel_function)(const double* coef, unsigned int nbin,
+                                  double* s, const double* v,
+                                  unsigned int nc);
+
+struct bandpower {
+	unsigned int nspan, nch, nband, nbin, window, step;
+	struct egd_chspan* spans;
+	unsigned int* bandbin;	// first bin of each band (and end of last)
+	double* coef;		// 2cos(w) of each bin
+	double* psdsc;		// scale from the squared modulus to PSD
+	double* win;
+	goertzel_function run_bins;
+
+	// Ring read by the thread
+	const char* buffer;
+	size_t buffsize, samlen, buff_ns;
+
+	// Written by the thread of the ring only
+	uint64_t total, start, next;
+	uint64_t limit;		// written with atomics
+
+	// Window to process and published results, protected by lock
+	int pending, quit;
+	unsigned int gen;
+	uint64_t pend_end, pend_rel;
+	size_t pend_pos;
+	double* res;
+	size_t res_ns;
+
+	double *work, *state;	// owned by the thread
+	mm_thr_mutex_t lock;
+	mm_thr_cond_t cond;
+	mm_thread_t thid;
+};
+
+
+static
+void run_bins(const double* coef, unsigned int nbin, double* s,
+              const double* v, unsigned int nc)
+{
+	unsigned int k, c;
+	double *s1, *s2, y, cf;
+
+	for (k=0; k<nbin; k++) {
+		s1 = s + 2*k*CHBLOCK;
+		s2 = s1 + CHBLOCK;
+		cf = coef[k];
+		for (c=0; c<nc; c++) {
+			y = v[c] + cf*s1[c] - s2[c];
+			s2[c] = s1[c];
+			s1[c] = y;
+		}
+	}
+}
+
+
+#if HAVE_X86_SIMD
+
+// Prototype of a SIMD resonator kernel processing W channels per step, the
+// remaining channels being processed by the scalar code
+#define DEFINE_SIMD_GOERTZEL_FN(isa, tgt, W, vtype, set1,		\
+                                load, store, mul, add, sub)		\
+static __attribute__((target(tgt)))					\
+void isa##_run_bins(const double* coef, unsigned int nbin, double* s,	\
+                    const double* v, unsigned int nc)			\
+{									\
+	unsigned int k, c;						\
+	double *s1, *s2, y;						\
+	vtype cf, x1;							\
+									\
+	for (k=0; k<nbin; k++) {					\
+		s1 = s + 2*k*CHBLOCK;					\
+		s2 = s1 + CHBLOCK;					\
+		cf = set1(coef[k]);					\
+		for (c=0; c+W<=nc; c+=W) {				\
+			x1 = load(s1+c);				\
+			store(s1+c, sub(add(load(v+c), mul(cf, x1)),	\
+			                load(s2+c)));			\
+			store(s2+c, x1);				\
+		}							\
+		for (; c<nc; c++) {					\
+			y = v[c] + coef[k]*s1[c] - s2[c];		\
+			s2[c] = s1[c];					\
+			s1[c] = y;					\
+		}							\
+	}								\
+}
+
+DEFINE_SIMD_GOERTZEL_FN(sse2, "sse2", 2, __m128d, _mm_set1_pd,
+                        _mm_loadu_pd, _mm_storeu_pd,
+                        _mm_mul_pd, _mm_add_pd, _mm_sub_pd)
+DEFINE_SIMD_GOERTZEL_FN(avx2, "avx2", 4, __m256d, _mm256_set1_pd,
+                        _mm256_loadu_pd, _mm256_storeu_pd,
+                        _mm256_mul_pd, _mm256_add_pd, _mm256_sub_pd)
+DEFINE_SIMD_GOERTZEL_FN(avx512, "avx512f", 8, __m512d, _mm512_set1_pd,
+                        _mm512_loadu_pd, _mm512_storeu_pd,
+                        _mm512_mul_pd, _mm512_add_pd, _mm512_sub_pd)
+
+
+// Returns the resonator kernel of the most capable instruction set
+static
+goertzel_function get_goertzel_fn(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		return avx512_run_bins;
+	if (__builtin_cpu_supports("avx2"))
+		return avx2_run_bins;
+	if (__builtin_cpu_supports("sse2"))
+		return sse2_run_bins;
+	return run_bins;
+}
+
+#else // HAVE_X86_SIMD
+
+static
+goertzel_function get_goertzel_fn(void)
+{
+	return run_bins;
+}
+
+#endif // HAVE_X86_SIMD
+
+
+// Set the bins of the bands of spec for a window of n samples at fs.
+// Returns the number of bins. If bp->bandbin is NULL, only count them.
+static
+unsigned int setup_bins(struct bandpower* bp,
+                        const struct bandpower_spec* spec,
+                        unsigned int n, double fs)
+{
+	unsigned int b, k, kmin, kmax, nbin = 0;
+	double wsq = 0.0;
+
+	if (bp->bandbin) {
+		for (k=0; k<n; k++) {
+			bp->win[k] = 0.5 - 0.5*cos(2.0*M_PI*(k+0.5)/n);
+			wsq += bp->win[k]*bp->win[k];
+		}
+	}
+
+	for (b=0; b<spec->nband; b++) {
+		// Bins in the band or, if none, the closest to its center
+		kmin = ceil(spec->lo[b]*n/fs);
+		kmax = floor(spec->hi[b]*n/fs);
+		if (kmax > n/2)
+			kmax = n/2;
+		if (kmin > kmax)
+			kmin = kmax = (spec->lo[b] + spec->hi[b])*n/(2.0*fs)
+			              + 0.5;
+
+		if (!bp->bandbin) {
+			nbin += kmax - kmin + 1;
+			continue;
+		}
+
+		bp->bandbin[b] = nbin;
+		for (k=kmin; k<=kmax; k++, nbin++) {
+			bp->coef[nbin] = 2.0*cos(2.0*M_PI*k/n);
+			bp->psdsc[nbin] = ((k == 0 || 2*k == n) ? 1.0 : 2.0)
+			                  / (fs*wsq*(kmax-kmin+1));
+		}
+	}
+	if (bp->bandbin)
+		bp->bandbin[spec->nband] = nbin;
+
+	return nbin;
+}
+
+
+// Prototype of the function computing the log band power of the
+// channels [c0, c1) of a span located at offset in the window of samples
+// starting at the position pos of the ring. The results are written in
+// res, nband values per channel.
+#define DEFINE_BANDPOWER_FN(type)					\
+static									\
+void bandpower_##type(struct bandpower* bp, size_t pos,		\
+                      unsigned int offset, size_t c0, size_t c1,	\
+                      double* res)					\
+{									\
+	double v[CHBLOCK], *s = bp->state, *s1, *s2, p;			\
+	type x[CHBLOCK];						\
+	unsigned int b, c, k, nc;					\
+	size_t i, p0;							\
+									\
+	for (; c0<c1; c0+=nc) {						\
+		nc = (c1-c0 < CHBLOCK) ? c1-c0 : CHBLOCK;		\
+		memset(s, 0, 2*bp->nbin*CHBLOCK*sizeof(*s));		\
+		p0 = pos;						\
+		for (i=0; i<bp->window; i++) {				\
+			/* samples may not be aligned in the ring */	\
+			memcpy(x, bp->buffer + p0 + offset		\
+			          + c0*sizeof(type), nc*sizeof(type));	\
+			for (c=0; c<nc; c++)				\
+				v[c] = bp->win[i]*x[c];			\
+			bp->run_bins(bp->coef, bp->nbin, s, v, nc);	\
+			p0 += bp->samlen;				\
+			if (p0 == bp->buffsize)				\
+				p0 = 0;					\
+		}							\
+									\
+		for (c=0; c<nc; c++) {					\
+			for (b=0; b<bp->nband; b++) {			\
+				p = 0.0;				\
+				for (k=bp->bandbin[b];			\
+				     k<bp->bandbin[b+1]; k++) {		\
+					s1 = s + 2*k*CHBLOCK;		\
+					s2 = s1 + CHBLOCK;		\
+					p += bp->psdsc[k]		\
+					     * (s1[c]*s1[c] + s2[c]*s2[c]\
+					       - bp->coef[k]*s1[c]*s2[c]);\
+				}					\
+				res[(c0+c)*bp->nband + b] = (p > 0.0)	\
+				                       ? log(p) : -INFINITY;\
+			}						\
+		}							\
+	}								\
+}
+
+DEFINE_BANDPOWER_FN(float)
+DEFINE_BANDPOWER_FN(double)
+
+
+// Compute in bp->work the band power of all channels over the window
+// starting at the position pos of the ring
+static
+void compute_window(struct bandpower* bp, size_t pos)
+{
+	unsigned int i, first = 0;
+	const struct egd_chspan* sp;
+
+	for (i=0; i<bp->nspan; i++) {
+		sp = bp->spans + i;
+		if (sp->type == EGD_FLOAT)
+			bandpower_float(bp, pos, sp->offset, 0, sp->nch,
+			                bp->work + first*bp->nband);
+		else
+			bandpower_double(bp, pos, sp->offset, 0, sp->nch,
+			                 bp->work + first*bp->nband);
+		first += sp->nch;
+	}
+}
+
+
+static
+void* bandpower_proc(void* arg)
+{
+	struct bandpower* bp = arg;
+	uint64_t end, limit;
+	size_t pos, rel;
+	unsigned int gen;
+
+	mm_thr_mutex_lock(&bp->lock);
+	while (1) {
+		while (!bp->pending && !bp->quit)
+			mm_thr_cond_wait(&bp->cond, &bp->lock);
+		if (bp->quit)
+			break;
+
+		end = bp->pend_end;
+		rel = bp->pend_rel;
+		pos = bp->pend_pos;
+		gen = bp->gen;
+		bp->pending = 0;
+		mm_thr_mutex_unlock(&bp->lock);
+
+		compute_window(bp, pos);
+
+		// Drop the result if the writer may have reached the window
+		// while it was read
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		limit = __atomic_load_n(&bp->limit, __ATOMIC_RELAXED);
+
+		mm_thr_mutex_lock(&bp->lock);
+		if (limit <= end - bp->window + bp->buff_ns
+		   && gen == bp->gen) {
+			memcpy(bp->res, bp->work,
+			       bp->nch*bp->nband*sizeof(*bp->res));
+			bp->res_ns = rel;
+		}
+	}
+	mm_thr_mutex_unlock(&bp->lock);
+
+	return NULL;
+}
+
+
+LOCAL_FN
+void egdi_destroy_bandpower(struct bandpower* bp)
+{
+	if (!bp)
+		return;
+
+	mm_thr_mutex_lock(&bp->lock);
+	bp->quit = 1;
+	mm_thr_cond_signal(&bp->cond);
+	mm_thr_mutex_unlock(&bp->lock);
+	mm_thr_join(bp->thid, NULL);
+
+	mm_thr_cond_deinit(&bp->cond);
+	mm_thr_mutex_deinit(&bp->lock);
+	free(bp->spans);
+	free(bp->bandbin);
+	free(bp->coef);
+	free(bp->psdsc);
+	free(bp->win);
+	free(bp->res);
+	free(bp->work);
+	free(bp->state);
+	free(bp);
+}
+
+
+/* Create the band-power stage of spec for the nspan spans of channels of
+ * the ring buffer of buffsize bytes (samples of samlen bytes) sampled at
+ * fs. The window must be shorter than the ring. */
+LOCAL_FN
+struct bandpower* egdi_create_bandpower(const struct bandpower_spec* spec,
+                                        double fs, unsigned int nspan,
+                                        const struct egd_chspan* spans,
+                                        const char* buffer, size_t buffsize,
+                                        size_t samlen)
+{
+	struct bandpower* bp;
+	unsigned int i, nch = 0, nbin, n;
+	int stinit = 0;
+
+	for (i=0; i<nspan; i++)
+		nch += spans[i].nch;
+
+	if (!(bp = calloc(1, sizeof(*bp))))
+		return NULL;
+
+	n = spec->window*fs + 0.5;
+	bp->window = n ? n : 1;
+	bp->step = spec->step*fs + 0.5;
+	if (!bp->step)
+		bp->step = 1;
+	nbin = setup_bins(bp, spec, bp->window, fs);
+
+	if (!(bp->spans = malloc(nspan*sizeof(*spans)))
+	   || !(bp->bandbin = malloc((spec->nband+1)*sizeof(*bp->bandbin)))
+	   || !(bp->coef = malloc(nbin*sizeof(*bp->coef)))
+	   || !(bp->psdsc = malloc(nbin*sizeof(*bp->psdsc)))
+	   || !(bp->win = malloc(bp->window*sizeof(*bp->win)))
+	   || !(bp->res = malloc(nch*spec->nband*sizeof(*bp->res)))
+	   || !(bp->work = malloc(nch*spec->nband*sizeof(*bp->work)))
+	   || !(bp->state = malloc(2*nbin*CHBLOCK*sizeof(*bp->state)))
+	   || mm_thr_mutex_init(&bp->lock, 0) || !(++stinit)
+	   || mm_thr_cond_init(&bp->cond, 0) || !(++stinit))
+		goto fail;
+
+	bp->nspan = nspan;
+	bp->nch = nch;
+	bp->nband = spec->nband;
+	bp->nbin = nbin;
+	bp->run_bins = get_goertzel_fn();
+	bp->buffer = buffer;
+	bp->buffsize = buffsize;
+	bp->samlen = samlen;
+	bp->buff_ns = buffsize / samlen;
+	memcpy(bp->spans, spans, nspan*sizeof(*spans));
+	setup_bins(bp, spec, bp->window, fs);
+
+	if (mm_thr_create(&bp->thid, bandpower_proc, bp))
+		goto fail;
+
+	return bp;
+
+fail:
+	if (stinit--)
+		mm_thr_cond_deinit(&bp->cond);
+	if (stinit--)
+		mm_thr_mutex_deinit(&bp->lock);
+	if (bp) {
+		free(bp->spans);
+		free(bp->bandbin);
+		free(bp->coef);
+		free(bp->psdsc);
+		free(bp->win);
+		free(bp->res);
+		free(bp->work);
+		free(bp->state);
+	}
+	free(bp);
+	return NULL;
+}
+
+
+/* Announce that at most ns samples are about to be written in the ring
+ * (must be called before writing them) */
+LOCAL_FN
+void egdi_reserve_bandpower(struct bandpower* bp, size_t ns)
+{
+	__atomic_store_n(&bp->limit, bp->total + ns, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+/* Account for the ns complete samples written in the ring, the position
+ * following the last one being end. If prime is set, the first sample
+ * starts the acquisition. The thread of the stage is woken up if a window
+ * ending on a multiple of step samples since the start is complete. */
+LOCAL_FN
+void egdi_update_bandpower(struct bandpower* bp, size_t ns, size_t end,
+                           int prime)
+{
+	uint64_t last;
+
+	if (prime) {
+		bp->start = bp->total;
+		bp->next = bp->start + (bp->window + bp->step-1)
+		                         / bp->step * bp->step;
+		mm_thr_mutex_lock(&bp->lock);
+		bp->gen++;
+		bp->pending = 0;
+		bp->res_ns = 0;
+		mm_thr_mutex_unlock(&bp->lock);
+	}
+
+	bp->total += ns;
+	if (bp->total < bp->next)
+		return;
+
+	// Window ending on the last multiple of step
+	last = bp->start + (bp->total - bp->start) / bp->step * bp->step;
+	bp->next = last + bp->step;
+
+	mm_thr_mutex_lock(&bp->lock);
+	bp->pend_end = last;
+	bp->pend_rel = last - bp->start;
+	bp->pend_pos = (end + bp->buffsize
+	                - ((bp->total - last + bp->window) % bp->buff_ns)
+	                  * bp->samlen) % bp->buffsize;
+	bp->pending = 1;
+	mm_thr_cond_signal(&bp->cond);
+	mm_thr_mutex_unlock(&bp->lock);
+}
+
+
+/* Write the log band power of the last window computed for the channels
+ * of the sensor type stype in logpow, nband values per channel at the
+ * index of the channels among those of stype. Returns the number of
+ * samples acquired at the end of the window (0 if none). */
+LOCAL_FN
+size_t egdi_read_bandpower(struct bandpower* bp, int stype, double* logpow)
+{
+	unsigned int i, first = 0;
+	const struct egd_chspan* sp;
+	size_t ns;
+
+	mm_thr_mutex_lock(&bp->lock);
+	ns = bp->res_ns;
+	for (i=0; i<bp->nspan && ns; i++) {
+		sp = bp->spans + i;
+		if (sp->stype == stype)
+			memcpy(logpow + sp->index*bp->nband,
+			       bp->res + first*bp->nband,
+			       sp->nch*bp->nband*sizeof(*logpow));
+		first += sp->nch;
+	}
+	mm_thr_mutex_unlock(&bp->lock);
+
+	return ns;
+}
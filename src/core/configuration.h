@@ -33,6 +33,7 @@ struct egdi_config {
 	int numsettings, nmaxsettings;
 	struct dynarray ar_settings;
 	struct dynarray ar_channels;
+	struct dynarray ar_exprs;	// expression of the derived channels
 	struct dynarray ar_mappings;
 	struct strpage *start, *last;
 };
@@ -44,6 +45,8 @@ const char* egdi_get_setting_value(struct egdi_config* cf,
                                    const char* name);
 struct egdi_chinfo* egdi_get_cfmapping(struct egdi_config* cf,
                                        const char* name, int* nch);
+const char* const* egdi_get_cfexpressions(struct egdi_config* cf,
+                                          const char* name);
 int egdi_parse_conffile(struct egdi_config* cf, const char* filename);
 int egdi_parse_confline(struct egdi_config* cf, const char* confstr);
 
@@ -54,7 +54,8 @@ typedef void* yyscan_t;
 
 static int yyerror(struct cfdata *pp, const char* s);
 static int egdi_add_setting(struct egdi_config*, const char*, const char*);
-static int egdi_add_channel(struct egdi_config*, int, const char*);
+static int egdi_add_channel(struct egdi_config*, int, const char*,
+                            const char*, const char*);
 static int egdi_start_mapping(struct egdi_config*, const char*);
 static void egdi_end_mapping(struct egdi_config*);
 
@@ -97,9 +98,19 @@ end_mapping: ENDMAP EOL { egdi_end_mapping(pp->cf); }
 chlist:
   | chlist WORD WORD EOL {
 				int type = egd_sensor_type($2);
-				egdi_add_channel(pp->cf, type,  $3);
+				egdi_add_channel(pp->cf, type,  $3, NULL, NULL);
 				cfd_pop_string(pp, 2);
 			 }
+  | chlist WORD WORD WORD EOL {
+				int type = egd_sensor_type($2);
+				egdi_add_channel(pp->cf, type,  $3, $4, NULL);
+				cfd_pop_string(pp, 3);
+			 }
+  | chlist WORD WORD WORD WORD EOL {
+				int type = egd_sensor_type($2);
+				egdi_add_channel(pp->cf, type,  $3, $4, $5);
+				cfd_pop_string(pp, 4);
+			 }
  ;
 %%
 
@@ -239,12 +250,47 @@ int egdi_add_setting(struct egdi_config* cf,
 
 
 static
-int egdi_add_channel(struct egdi_config* cf, int stype, const char* label)
+int parse_calibration_value(const char* str, double* val)
 {
-	struct egdi_chinfo ch = {.stype = stype};
+	char* end;
+
+	*val = strtod(str, &end);
+	if (end == str || *end != '\0') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static
+int egdi_add_channel(struct egdi_config* cf, int stype, const char* label,
+                     const char* gain, const char* offset)
+{
+	struct egdi_chinfo ch = {.stype = stype, .cal_gain = 1.0};
+	const char* expr = NULL;
+
+	// A derived channel is defined by an expression instead of a
+	// calibration (see egdi_parse_derivation())
+	if (stype == egd_sensor_type("derived")) {
+		if (!gain || offset) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (!(expr = egdi_add_string(cf, gain)))
+			return -1;
+	} else if (gain || offset) {
+		// Optional calibration applied to the channel data
+		if ( (gain && parse_calibration_value(gain, &ch.cal_gain))
+		  || (offset && parse_calibration_value(offset,
+		                                        &ch.cal_offset)) )
+			return -1;
+		ch.bcal = 1;
+	}
 
 	ch.label = egdi_add_string(cf, label);
-	if (!ch.label)
+	if (!ch.label || dynarray_push(&cf->ar_exprs, &expr) < 0)
 		return -1;
 
 	return (dynarray_push(&cf->ar_channels, &ch) > 0) ? 0 : -1;
@@ -291,6 +337,7 @@ void egdi_free_config(struct egdi_config* cf)
 
 	dynarray_free(&cf->ar_settings);
 	dynarray_free(&cf->ar_channels);
+	dynarray_free(&cf->ar_exprs);
 	dynarray_free(&cf->ar_mappings);
 }
 
@@ -302,6 +349,7 @@ void egdi_init_config(struct egdi_config* cf)
 	cf->last = NULL;
 	dynarray_init(&cf->ar_settings, sizeof(struct setting), INCSIZE);
 	dynarray_init(&cf->ar_channels, sizeof(struct egdi_chinfo), INCSIZE);
+	dynarray_init(&cf->ar_exprs, sizeof(const char*), INCSIZE);
 	dynarray_init(&cf->ar_mappings, sizeof(struct mapping), INCSIZE);
 }
 
@@ -315,6 +363,7 @@ void egdi_reinit_config(struct egdi_config* cf)
 
 	dynarray_reinit(&cf->ar_settings);
 	dynarray_reinit(&cf->ar_channels);
+	dynarray_reinit(&cf->ar_exprs);
 	dynarray_reinit(&cf->ar_mappings);
 }
 
@@ -337,28 +386,52 @@ const char* egdi_get_setting_value(struct egdi_config* cf, const char* name)
 }
 
 
-LOCAL_FN
-struct egdi_chinfo* egdi_get_cfmapping(struct egdi_config* cf,
-                                       const char* name, int* nch)
+static
+const struct mapping* find_mapping(struct egdi_config* cf, const char* name)
 {
 	unsigned int i = cf->ar_mappings.num;
 	struct mapping *mappings = cf->ar_mappings.array;
-	struct egdi_chinfo *channels = cf->ar_channels.array;
 
 	// Search backward for the setting of the specified name: all prior
 	// definitions of a setting are overriden by the latest definition
 	while (i) {
 		i--;
-		if (!strcmp(mappings[i].name, name)) {
-			*nch = mappings[i].nch;
-			return channels + mappings[i].start;
-		}
+		if (!strcmp(mappings[i].name, name))
+			return mappings + i;
 	}
 
 	return NULL;
 }
 
 
+LOCAL_FN
+struct egdi_chinfo* egdi_get_cfmapping(struct egdi_config* cf,
+                                       const char* name, int* nch)
+{
+	struct egdi_chinfo *channels = cf->ar_channels.array;
+	const struct mapping* map = find_mapping(cf, name);
+
+	if (!map)
+		return NULL;
+
+	*nch = map->nch;
+	return channels + map->start;
+}
+
+
+// Returns the expressions of the channels of a mapping (NULL for the
+// channels that are not derived)
+LOCAL_FN
+const char* const* egdi_get_cfexpressions(struct egdi_config* cf,
+                                          const char* name)
+{
+	const char** exprs = cf->ar_exprs.array;
+	const struct mapping* map = find_mapping(cf, name);
+
+	return map ? exprs + map->start : NULL;
+}
+
+
 LOCAL_FN
 int egdi_parse_conffile(struct egdi_config* cf, const char* filename)
 {
@@ -21,6 +21,8 @@
 #endif
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <mmdlfcn.h>
 #include <mmthread.h>
 #include <stdarg.h>
@@ -31,6 +33,7 @@
 #include "coreinternals.h"
 
 #define BUFF_SIZE	10	//in seconds
+#define CACHELINE	64
 
 /*******************************************************************
  *                Implementation of internals                      *
@@ -66,7 +69,9 @@ void optimize_inbufgrp(struct input_buffer_group* ibgrp, unsigned int* ngrp)
 			            == ibgrp[i].buff_offset+ibgrp[i].inlen)
 			  && (ibgrp[j].sc.valdouble
 			            == ibgrp[i].sc.valdouble)
-			  && (ibgrp[j].cast_fn == ibgrp[i].cast_fn) ) {
+			  && (ibgrp[j].cast_fn == ibgrp[i].cast_fn)
+			  && !ibgrp[i].xform_fn && !ibgrp[j].xform_fn
+			  && !ibgrp[i].decode_fn && !ibgrp[j].decode_fn ) {
 				ibgrp[i].inlen += ibgrp[j].inlen;
 				memmove(ibgrp + j, ibgrp + j+1,
 				            (num-j-1)*sizeof(*ibgrp));
@@ -79,101 +84,1272 @@ void optimize_inbufgrp(struct input_buffer_group* ibgrp, unsigned int* ngrp)
 }
 
 
+// Select the copy function of each transfer from the ringbuffer to arrays
+// according to the layout of the destination array (none if the array is
+// resampled)
+static
+void select_copy_functions(const struct eegdev* dev, struct ringbuffer* rb)
+{
+	unsigned int i;
+	struct array_config* ac = rb->arrconf;
+	const struct array_layout* lay;
+
+	for (i=0; i<rb->nconf; i++) {
+		lay = dev->arrlayout + ac[i].iarray;
+		ac[i].copy_fn = NULL;
+		if (lay->layout == EGD_CHANNEL_MAJOR) {
+			// Cast is already done: only transpose
+			ac[i].dst_offset = (ac[i].arr_offset / ac[i].tsize)
+			                   * lay->chstride;
+			ac[i].dst_samstride = ac[i].tsize;
+			ac[i].dst_stride = lay->chstride;
+			if (!lay->rs)
+				ac[i].copy_fn =
+				        egdi_get_transpose_fn(ac[i].tsize);
+		} else {
+			ac[i].dst_offset = ac[i].arr_offset;
+			ac[i].dst_samstride = dev->strides[ac[i].iarray];
+			ac[i].dst_stride = dev->strides[ac[i].iarray];
+			if (!lay->rs)
+				ac[i].copy_fn = egdi_get_copy_fn(ac[i].len,
+				                        ac[i].dst_stride,
+				                        rb->buff_samlen);
+		}
+	}
+}
+
+
+// Merge the transfers from the ringbuffer to arrays that are contiguous on
+// both side and select the copy function of each remaining transfer
+static
+void setup_transfer_plan(const struct eegdev* dev, struct ringbuffer* rb)
+{
+	unsigned int i, j, num = rb->nconf;
+	struct array_config* ac = rb->arrconf;
+
+	for (i=0; i<num; i++) {
+		for (j=i+1; j<num; j++) {
+			if ( (ac[j].iarray == ac[i].iarray)
+			  && (ac[j].type == ac[i].type)
+			  && (ac[j].arr_offset == ac[i].arr_offset+ac[i].len)
+			  && (ac[j].buff_offset
+			            == ac[i].buff_offset+ac[i].len) ) {
+				ac[i].len += ac[j].len;
+				memmove(ac + j, ac + j+1,
+				            (num-j-1)*sizeof(*ac));
+				num--;
+				j = i;
+			}
+		}
+	}
+	rb->nconf = num;
+
+	select_copy_functions(dev, rb);
+}
+
+
+static
+struct ringbuffer* get_ring(const struct eegdev* dev, unsigned int div)
+{
+	unsigned int i;
+
+	if (div <= 1)
+		return dev->rings;
+
+	for (i=1; i<dev->nring; i++)
+		if (dev->rings[i].div == div)
+			return dev->rings + i;
+
+	return NULL;
+}
+
+
+static
+unsigned int get_channel_div(const struct eegdev* dev, int stype,
+                             unsigned int index)
+{
+	unsigned int i, ich = 0;
+	const struct egdi_chinfo* chmap = dev->cap.chmap;
+
+	if (!dev->cap.chdiv)
+		return 1;
+
+	for (i=0; i<dev->cap.nch; i++)
+		if (chmap[i].stype == stype && ich++ == index)
+			break;
+
+	// Channels not in the map (derived) are at the device rate
+	return (i < dev->cap.nch) ? dev->cap.chdiv[i] : 1;
+}
+
+
+// Index of the channel ich of the channel map among the channels of its
+// type
+static
+unsigned int get_type_index(const struct eegdev* dev, unsigned int ich)
+{
+	unsigned int i, index = 0;
+	const struct egdi_chinfo* chmap = dev->cap.chmap;
+
+	for (i=0; i<ich; i++)
+		if (chmap[i].stype == chmap[ich].stype)
+			index++;
+
+	return index;
+}
+
+
+static
+int is_derived_type(const struct eegdev* dev, int stype)
+{
+	return dev->deriv && stype == egd_sensor_type("derived");
+}
+
+
+// Returns the number of samples (at device rate) that can be read from all
+// the rings with selected channels
+static
+unsigned long get_ns_written(const struct eegdev* dev)
+{
+	unsigned int i;
+	unsigned long ns, ns_written = dev->rings[0].ns_written;
+
+	for (i=1; i<dev->nring; i++) {
+		if (!dev->rings[i].nconf)
+			continue;
+		ns = dev->rings[i].ns_written * dev->rings[i].div;
+		if (ns < ns_written)
+			ns_written = ns;
+	}
+
+	return ns_written;
+}
+
+
+static
+double get_signal_scale(const struct egdi_signal_info* si)
+{
+	return si->bsc ? si->scale : 1.0;
+}
+
+
+// Returns the size of the per-channel arrays needed by the transform of
+// the selected channels isel (0 if a plain cast is enough). If xfbuff is
+// not NULL, the transform of ibgrp is set up using it as storage.
+static
+size_t setup_xform(const struct eegdev* dev, unsigned int isel,
+                   struct input_buffer_group* ibgrp, char* xfbuff)
+{
+	const struct selected_channels* sel = dev->selch + isel;
+	const struct egdi_chinfo* ch;
+	const struct egdi_signal_info* si;
+	unsigned int k, nch, tb = sel->typeout;
+	size_t bsiz = egd_get_data_size(egdi_get_calc_type(tb));
+	double gain, sc0;
+	union gval val;
+	int needed = 0;
+
+	if (dev->selchmap[isel] < 0)
+		return 0;
+
+	ch = dev->cap.chmap + dev->selchmap[isel];
+	nch = sel->inlen / egd_get_data_size(sel->typein);
+	sc0 = get_signal_scale(ch[0].si);
+	for (k=0; k<nch; k++) {
+		si = ch[k].si;
+		if (ch[k].bcal || si->offset != 0.0 || si->mask || si->shift
+		   || get_signal_scale(si) != sc0)
+			needed = 1;
+	}
+	if (!needed)
+		return 0;
+
+	if (xfbuff) {
+		// sc is stored in the first nch elements, off in the next
+		for (k=0; k<nch; k++) {
+			si = ch[k].si;
+			gain = ch[k].bcal ? ch[k].cal_gain : 1.0;
+			egdi_set_gval(&val, tb, gain*get_signal_scale(si));
+			memcpy(xfbuff + k*bsiz, &val, bsiz);
+			egdi_set_gval(&val, tb, gain*si->offset
+			                + (ch[k].bcal ? ch[k].cal_offset : 0.0));
+			memcpy(xfbuff + (nch+k)*bsiz, &val, bsiz);
+		}
+		ibgrp->xf.sc = xfbuff;
+		ibgrp->xf.off = xfbuff + nch*bsiz;
+		ibgrp->xf_tsize = bsiz;
+		ibgrp->xf.mask = ch[0].si->mask ? ch[0].si->mask : 0xFFFFFFFF;
+		ibgrp->xf.shift = ch[0].si->shift;
+		ibgrp->xform_fn = egdi_get_xform_fn(sel->typein, tb);
+	}
+
+	// Keep the arrays of the next group aligned for any type
+	return (2*nch*bsiz + sizeof(double)-1) & ~(sizeof(double)-1);
+}
+
+
+// Append to the transfers of the device-rate ring those of the groups of
+// derived channels, the derived channels being stored from offset in the
+// samples of the ring. Returns the number of transfers added.
+static
+unsigned int setup_derived_transfers(struct eegdev* dev,
+                                     struct array_config* ac,
+                                     unsigned int offset)
+{
+	unsigned int i, tsize;
+	const struct grpconf* grp = dev->dvgrp;
+	struct derivation* dv = dev->deriv;
+
+	tsize = egd_get_data_size(dv->type);
+	dv->dst_offset = offset;
+	for (i=0; i<dev->ndvgrp; i++) {
+		ac[i].len = grp[i].nch * tsize;
+		ac[i].tsize = tsize;
+		ac[i].type = dv->type;
+		ac[i].iarray = grp[i].iarray;
+		ac[i].arr_offset = grp[i].arr_offset;
+		ac[i].buff_offset = offset + grp[i].index*tsize;
+	}
+
+	return dev->ndvgrp;
+}
+
+
 static 
 int setup_ringbuffer_mapping(struct eegdev* dev)
 {
-	unsigned int i, offset = 0;
+	unsigned int i, j, k, r, n, nc, igrp = 0, iconf = 0, offset;
 	unsigned int isiz, bsiz, ti, tb;
+	size_t xfsize = 0, xfoff = 0;
 	struct selected_channels* selch = dev->selch;
-	struct input_buffer_group* ibgrp = dev->inbuffgrp;
+	struct input_buffer_group* ibgrp;
+	struct array_config* ac;
+	struct ringbuffer* rb;
 
 	for (i=0; i<dev->nsel; i++) {
-		ti = selch[i].typein;
-		tb = selch[i].typeout;
-		isiz = egd_get_data_size(ti);
-		bsiz = egd_get_data_size(tb);
-		if (isiz == 0 || bsiz == 0)
-			return -1;
+		if (!get_ring(dev, selch[i].rate_div))
+			return reterrno(EINVAL);
+		if (!dev->seldec[i].fn)
+			xfsize += setup_xform(dev, i, NULL, NULL);
+	}
 
-		// Set parameters of (input (device) -> ringbuffer)
-		ibgrp[i].in_offset = selch[i].in_offset;
-		ibgrp[i].inlen = selch[i].inlen;
-		ibgrp[i].buff_offset = offset;
-		ibgrp[i].in_tsize = isiz;
-		ibgrp[i].buff_tsize = bsiz;
-		ibgrp[i].sc = selch[i].sc;
-		ibgrp[i].cast_fn = egd_get_cast_fn(ti, tb, selch[i].bsc);
+	free(dev->xfbuff);
+	dev->xfbuff = NULL;
+	if (xfsize && !(dev->xfbuff = malloc(xfsize)))
+		return -1;
 
-		// Set parameters of (ringbuffer -> arrays)
-		dev->arrconf[i].len = bsiz * selch[i].inlen / isiz;
-		dev->arrconf[i].iarray = selch[i].iarray;
-		dev->arrconf[i].arr_offset = selch[i].arr_offset;
-		dev->arrconf[i].buff_offset = offset;
-		offset += dev->arrconf[i].len;
-	}
-	dev->buff_samlen = offset;
+	// Room for the transfers of the derived channels
+	ac = realloc(dev->arrconf, (dev->nsel+dev->ndvgrp+1)*sizeof(*ac));
+	if (!ac)
+		return -1;
+	dev->arrconf = ac;
+
+	// Each ring gets the contiguous part of inbuffgrp and arrconf that
+	// maps the selected channels sampled at its rate
+	for (r=0; r<dev->nring; r++) {
+		rb = dev->rings + r;
+		ibgrp = rb->inbuffgrp = dev->inbuffgrp + igrp;
+		ac = rb->arrconf = dev->arrconf + iconf;
+		rb->deriv = NULL;
+		offset = n = nc = 0;
+
+		for (i=0; i<dev->nsel; i++) {
+			if (get_ring(dev, selch[i].rate_div) != rb)
+				continue;
 
-	// Optimization should take place here
-	optimize_inbufgrp(dev->inbuffgrp, &(dev->ngrp));
+			ti = selch[i].typein;
+			tb = selch[i].typeout;
+			isiz = egd_get_data_size(ti);
+			bsiz = egd_get_data_size(tb);
+			if (isiz == 0 || bsiz == 0)
+				return -1;
+
+			// Set parameters of (input (device) -> ringbuffer)
+			ibgrp[n].in_offset = selch[i].in_offset;
+			ibgrp[n].inlen = selch[i].inlen;
+			ibgrp[n].buff_offset = offset;
+			ibgrp[n].in_tsize = isiz;
+			ibgrp[n].buff_tsize = bsiz;
+			ibgrp[n].sc = selch[i].sc;
+			ibgrp[n].cast_fn = egd_get_cast_fn(ti, tb,
+			                                   selch[i].bsc);
+			ibgrp[n].xform_fn = NULL;
+			ibgrp[n].decode_fn = dev->seldec[i].fn;
+			ibgrp[n].decode_data = dev->seldec[i].data;
+			ibgrp[n].sel = selch + i;
+
+			// The narrow types are not supported as input types
+			if (!ibgrp[n].cast_fn && !ibgrp[n].decode_fn)
+				return reterrno(EINVAL);
+			if (dev->xfbuff && !ibgrp[n].decode_fn)
+				xfoff += setup_xform(dev, i, ibgrp+n,
+				                     dev->xfbuff + xfoff);
+			n++;
+
+			// The inputs of the derived channels are not copied
+			// to any array (see setup_derived_groups())
+			if (selch[i].iarray >= dev->narr) {
+				k = selch[i].arr_offset / bsiz;
+				for (j=0; j<selch[i].inlen/isiz; j++)
+					dev->deriv->src_offset[k+j] = offset
+					                              + j*bsiz;
+				offset += bsiz * selch[i].inlen / isiz;
+				continue;
+			}
+
+			// Set parameters of (ringbuffer -> arrays)
+			ac[nc].len = bsiz * selch[i].inlen / isiz;
+			ac[nc].tsize = bsiz;
+			ac[nc].type = tb;
+			ac[nc].iarray = selch[i].iarray;
+			ac[nc].arr_offset = selch[i].arr_offset;
+			ac[nc].buff_offset = offset;
+			offset += ac[nc].len;
+			nc++;
+		}
+
+		// The derived channels follow the selected channels of the
+		// device-rate ring (aligned on their type)
+		if (r == 0 && dev->ndvgrp) {
+			bsiz = egd_get_data_size(dev->deriv->type);
+			offset = (offset + bsiz-1) / bsiz * bsiz;
+			nc += setup_derived_transfers(dev, ac+nc, offset);
+			offset += dev->deriv->nout * bsiz;
+			rb->deriv = dev->deriv;
+		}
+
+		rb->buff_samlen = offset;
+		rb->ngrp = n;
+		rb->nconf = nc;
+		igrp += n;
+		iconf += nc;
+
+		// Optimization should take place here
+		optimize_inbufgrp(rb->inbuffgrp, &(rb->ngrp));
+		setup_transfer_plan(dev, rb);
+	}
 
 	return 0;
 }
 
 
+// Cast the bytes [offset, offset+inlen) of ns input samples pointed by pi
+// (pi points to the byte at offset of the first one, the next ones being
+// sstride bytes apart) into the consecutive ring samples pointed by dst
 static
-unsigned int cast_data(struct eegdev* restrict dev, 
-                       const void* restrict in, size_t length)
+void cast_columns(const struct ringbuffer* restrict rb,
+                  char* restrict dst, const char* restrict pi,
+                  size_t offset, size_t inlen, size_t ns, size_t sstride)
 {
-	unsigned int i, ns = 0;
-	const char* pi = in;
-	char* restrict ringbuffer = dev->buffer;
-	const struct input_buffer_group* ibgrp = dev->inbuffgrp;
-	size_t offset = dev->in_offset, ind = dev->ind;
-	ssize_t len, inoff, buffoff, rest, inlen = length;
-
-	while (inlen) {
-		for (i=0; i<dev->ngrp; i++) {
-			len = ibgrp[i].inlen;
-			inoff = ibgrp[i].in_offset - offset;
-			buffoff = ibgrp[i].buff_offset;
-			if (inoff < 0) {
-				len += inoff;
-				if (len <= 0)
+	size_t dstride = rb->buff_samlen;
+	unsigned int i;
+	const struct input_buffer_group* ibgrp = rb->inbuffgrp;
+	ssize_t len, inoff, buffoff, rest, nskip, iskip;
+	struct cast_xform xf;
+
+	for (i=0; i<rb->ngrp; i++) {
+		len = ibgrp[i].inlen;
+		inoff = ibgrp[i].in_offset - offset;
+		buffoff = ibgrp[i].buff_offset;
+		nskip = iskip = 0;
+		if (inoff < 0) {
+			len += inoff;
+			if (len <= 0)
+				continue;
+			iskip = -inoff;
+			nskip = iskip / ibgrp[i].in_tsize;
+			buffoff += nskip * ibgrp[i].buff_tsize;
+			inoff = 0;
+		}
+		if ((rest = (ssize_t)inlen - inoff) <= 0)
+			continue;
+		len = (len <= rest) ?  len : rest;
+		if (ibgrp[i].decode_fn) {
+			ibgrp[i].decode_fn(dst + buffoff, pi + inoff, len, ns,
+			                   dstride, sstride, ibgrp[i].sel,
+			                   iskip, ibgrp[i].decode_data);
+			continue;
+		}
+		if (!ibgrp[i].xform_fn) {
+			ibgrp[i].cast_fn(dst + buffoff, pi + inoff,
+			                 ibgrp[i].sc, len, ns, dstride, sstride);
+			continue;
+		}
+
+		// Skip the transform of the channels already cast
+		xf = ibgrp[i].xf;
+		xf.sc = (const char*)xf.sc + nskip*ibgrp[i].xf_tsize;
+		xf.off = (const char*)xf.off + nskip*ibgrp[i].xf_tsize;
+		ibgrp[i].xform_fn(dst + buffoff, pi + inoff, &xf, len, ns,
+		                  dstride, sstride);
+	}
+}
+
+
+// Cast ns complete input samples into the ring starting at the position
+// ind. Each group is cast over the whole run of samples that fits before
+// the end of the ring in one call. Returns the new ring position.
+static
+size_t cast_samples(const struct ringbuffer* restrict rb, size_t ind,
+                    const char* restrict pi, size_t ns)
+{
+	unsigned int i;
+	size_t nrun;
+	char* restrict ringbuffer = rb->buffer;
+	const struct input_buffer_group* ibgrp = rb->inbuffgrp;
+
+	while (ns) {
+		nrun = (rb->buffsize - ind) / rb->buff_samlen;
+		if (nrun > ns)
+			nrun = ns;
+
+		for (i=0; i<rb->ngrp; i++) {
+			if (ibgrp[i].decode_fn)
+				ibgrp[i].decode_fn(
+				         ringbuffer + ind + ibgrp[i].buff_offset,
+				         pi + ibgrp[i].in_offset,
+				         ibgrp[i].inlen, nrun,
+				         rb->buff_samlen, rb->in_samlen,
+				         ibgrp[i].sel, 0, ibgrp[i].decode_data);
+			else if (ibgrp[i].xform_fn)
+				ibgrp[i].xform_fn(
+				         ringbuffer + ind + ibgrp[i].buff_offset,
+				         pi + ibgrp[i].in_offset, &ibgrp[i].xf,
+				         ibgrp[i].inlen, nrun,
+				         rb->buff_samlen, rb->in_samlen);
+			else
+				ibgrp[i].cast_fn(
+				         ringbuffer + ind + ibgrp[i].buff_offset,
+				         pi + ibgrp[i].in_offset, ibgrp[i].sc,
+				         ibgrp[i].inlen, nrun,
+				         rb->buff_samlen, rb->in_samlen);
+		}
+
+		pi += nrun * rb->in_samlen;
+		ns -= nrun;
+		ind = (ind + nrun*rb->buff_samlen) % rb->buffsize;
+	}
+
+	return ind;
+}
+
+
+// Returns the number of ring samples whose size is a multiple of the
+// cache line
+static
+size_t get_cacheline_block(size_t samlen)
+{
+	size_t a = samlen, b = CACHELINE, t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return CACHELINE / a;
+}
+
+
+// Returns the first sample of the part ipart when ns samples starting at
+// the ring sample s0 are split in npart. Each part is a contiguous run of
+// samples whose boundaries are moved to multiples of block ring samples,
+// so that two parts do not write to the same cache line.
+static
+size_t get_part_start(size_t ns, size_t s0, size_t block,
+                      unsigned int ipart, unsigned int npart)
+{
+	size_t s;
+
+	if (ipart == 0)
+		return 0;
+	if (ipart >= npart)
+		return ns;
+
+	s = s0 + ns*ipart/npart;
+	s = ((s + block/2) / block) * block;
+	if (s < s0)
+		s = s0;
+	return (s - s0 < ns) ? s - s0 : ns;
+}
+
+
+struct ring_job {
+	const struct ringbuffer* rb;
+	size_t ind, ns;
+	const char* pi;			// cast job
+	size_t offset, inlen;		// cast job of producer columns
+	char* const* buffout;		// copy job
+	int prime;			// filter job
+};
+
+
+static
+void cast_samples_part(void* arg, unsigned int ipart, unsigned int npart)
+{
+	const struct ring_job* job = arg;
+	const struct ringbuffer* rb = job->rb;
+	size_t first, last, s0, block;
+
+	s0 = job->ind / rb->buff_samlen;
+	block = get_cacheline_block(rb->buff_samlen);
+	first = get_part_start(job->ns, s0, block, ipart, npart);
+	last = get_part_start(job->ns, s0, block, ipart+1, npart);
+	if (first >= last)
+		return;
+
+	cast_samples(rb, (job->ind + first*rb->buff_samlen) % rb->buffsize,
+	             job->pi + first*rb->in_samlen, last - first);
+}
+
+
+// Cast the bytes [offset, offset+inlen) of ns input samples supplied
+// consecutively at pi into the ring starting at the position ind
+static
+void cast_producer_columns(const struct ringbuffer* rb, size_t ind,
+                           const char* pi, size_t offset, size_t inlen,
+                           size_t ns)
+{
+	size_t nrun;
+
+	for (; ns; ns -= nrun) {
+		nrun = (rb->buffsize - ind) / rb->buff_samlen;
+		if (nrun > ns)
+			nrun = ns;
+		cast_columns(rb, rb->buffer + ind, pi, offset,
+		             inlen, nrun, inlen);
+		pi += nrun * inlen;
+		ind = (ind + nrun*rb->buff_samlen) % rb->buffsize;
+	}
+}
+
+
+static
+void cast_columns_part(void* arg, unsigned int ipart, unsigned int npart)
+{
+	const struct ring_job* job = arg;
+	const struct ringbuffer* rb = job->rb;
+	size_t first, last, s0, block;
+
+	s0 = job->ind / rb->buff_samlen;
+	block = get_cacheline_block(rb->buff_samlen);
+	first = get_part_start(job->ns, s0, block, ipart, npart);
+	last = get_part_start(job->ns, s0, block, ipart+1, npart);
+	if (first >= last)
+		return;
+
+	cast_producer_columns(rb,
+	             (job->ind + first*rb->buff_samlen) % rb->buffsize,
+	             job->pi + first*job->inlen, job->offset, job->inlen,
+	             last - first);
+}
+
+
+// Same as cast_producer_columns() but split across the workers of the
+// device if the input is large enough
+static
+void cast_producer_columns_par(const struct eegdev* dev,
+                               const struct ringbuffer* rb, size_t ind,
+                               const char* pi, size_t offset,
+                               size_t inlen, size_t ns)
+{
+	struct ring_job job = {.rb = rb, .ind = ind, .ns = ns, .pi = pi,
+	                       .offset = offset, .inlen = inlen};
+
+	if (!dev->workers || ns*inlen < dev->par_minsize) {
+		cast_producer_columns(rb, ind, pi, offset, inlen, ns);
+		return;
+	}
+
+	egdi_run_job(dev->workers, cast_columns_part, &job);
+}
+
+
+// Same as cast_samples() but split across the workers of the device if
+// the input is large enough
+static
+size_t cast_samples_par(const struct eegdev* dev,
+                        const struct ringbuffer* rb, size_t ind,
+                        const char* pi, size_t ns)
+{
+	struct ring_job job = {.rb = rb, .ind = ind, .ns = ns, .pi = pi};
+
+	if (!dev->workers || ns*rb->in_samlen < dev->par_minsize)
+		return cast_samples(rb, ind, pi, ns);
+
+	egdi_run_job(dev->workers, cast_samples_part, &job);
+	return (ind + ns*rb->buff_samlen) % rb->buffsize;
+}
+
+
+// Copy ns samples of the ring starting at the position ind into the
+// arrays starting at their sample s. Returns the new ring position.
+static
+size_t copy_samples(const struct ringbuffer* rb, char* const* buffout,
+                    size_t ind, size_t s, size_t ns)
+{
+	unsigned int i, iarr;
+	size_t nrun;
+	const struct array_config* restrict ac = rb->arrconf;
+
+	// Copy by runs of samples not crossing the end of ring
+	while (ns) {
+		nrun = (rb->buffsize - ind) / rb->buff_samlen;
+		if (nrun > ns)
+			nrun = ns;
+
+		for (i=0; i<rb->nconf; i++) {
+			if (!ac[i].copy_fn)
+				continue;
+			iarr = ac[i].iarray;
+			ac[i].copy_fn(buffout[iarr] + ac[i].dst_offset
+			                 + s*ac[i].dst_samstride,
+			              rb->buffer + ind + ac[i].buff_offset,
+			              ac[i].len, nrun,
+			              ac[i].dst_stride, rb->buff_samlen);
+		}
+		s += nrun;
+		ns -= nrun;
+		ind = (ind + nrun*rb->buff_samlen) % rb->buffsize;
+	}
+
+	return ind;
+}
+
+
+static
+void copy_samples_part(void* arg, unsigned int ipart, unsigned int npart)
+{
+	const struct ring_job* job = arg;
+	const struct ringbuffer* rb = job->rb;
+	size_t first, last, s0, block;
+
+	s0 = job->ind / rb->buff_samlen;
+	block = get_cacheline_block(rb->buff_samlen);
+	first = get_part_start(job->ns, s0, block, ipart, npart);
+	last = get_part_start(job->ns, s0, block, ipart+1, npart);
+	if (first >= last)
+		return;
+
+	copy_samples(rb, job->buffout,
+	             (job->ind + first*rb->buff_samlen) % rb->buffsize,
+	             first, last - first);
+}
+
+
+// Same as copy_samples() (from the sample 0 of the arrays) but split
+// across the workers of the device if the data is large enough
+static
+size_t copy_samples_par(const struct eegdev* dev,
+                        const struct ringbuffer* rb, char* const* buffout,
+                        size_t ind, size_t ns)
+{
+	struct ring_job job = {.rb = rb, .ind = ind, .ns = ns,
+	                       .buffout = buffout};
+
+	if (!dev->workers || ns*rb->buff_samlen < dev->par_minsize)
+		return copy_samples(rb, buffout, ind, 0, ns);
+
+	egdi_run_job(dev->workers, copy_samples_part, &job);
+	return (ind + ns*rb->buff_samlen) % rb->buffsize;
+}
+
+
+static
+void filter_samples_part(void* arg, unsigned int ipart, unsigned int npart)
+{
+	const struct ring_job* job = arg;
+	const struct ringbuffer* rb = job->rb;
+
+	egdi_filter_samples(rb->filt, rb->buffer, rb->buffsize,
+	                    rb->buff_samlen, job->ind, job->ns, job->prime,
+	                    ipart, npart);
+}
+
+
+// Filter the ns samples of the ring starting at the position ind, the
+// channels being split across the workers of the device if the data is
+// large enough. prime is set if the first sample starts the acquisition.
+static
+void filter_samples_par(const struct eegdev* dev,
+                        const struct ringbuffer* rb, size_t ind,
+                        size_t ns, int prime)
+{
+	struct ring_job job = {.rb = rb, .ind = ind, .ns = ns,
+	                       .prime = prime};
+
+	if (!dev->workers || ns*rb->buff_samlen < dev->par_minsize)
+		filter_samples_part(&job, 0, 1);
+	else
+		egdi_run_job(dev->workers, filter_samples_part, &job);
+}
+
+
+static
+void derive_samples_part(void* arg, unsigned int ipart, unsigned int npart)
+{
+	const struct ring_job* job = arg;
+	const struct ringbuffer* rb = job->rb;
+
+	egdi_derive_samples(rb->deriv, rb->buffer, rb->buffsize,
+	                    rb->buff_samlen, job->ind, job->ns, ipart, npart);
+}
+
+
+// Compute the derived channels of the ns samples of the ring starting at
+// the position ind, the samples being split across the workers of the
+// device if the data is large enough
+static
+void derive_samples_par(const struct eegdev* dev,
+                        const struct ringbuffer* rb, size_t ind, size_t ns)
+{
+	struct ring_job job = {.rb = rb, .ind = ind, .ns = ns};
+
+	if (!dev->workers || ns*rb->buff_samlen < dev->par_minsize)
+		derive_samples_part(&job, 0, 1);
+	else
+		egdi_run_job(dev->workers, derive_samples_part, &job);
+}
+
+
+static
+void quality_samples_part(void* arg, unsigned int ipart, unsigned int npart)
+{
+	const struct ring_job* job = arg;
+	const struct ringbuffer* rb = job->rb;
+
+	egdi_update_quality(rb->qual, rb->buffer, rb->buffsize,
+	                    rb->buff_samlen, job->ind, job->ns, ipart, npart);
+}
+
+
+// Update the quality statistics with the ns samples of the ring starting
+// at the position ind, the channels being split across the workers of the
+// device if the data is large enough. prime is set if the first sample
+// starts the acquisition.
+static
+void quality_samples_par(const struct eegdev* dev,
+                         const struct ringbuffer* rb, size_t ind,
+                         size_t ns, int prime)
+{
+	struct ring_job job = {.rb = rb, .ind = ind, .ns = ns};
+
+	if (prime)
+		egdi_reset_quality(rb->qual);
+
+	if (!dev->workers || ns*rb->buff_samlen < dev->par_minsize)
+		quality_samples_part(&job, 0, 1);
+	else
+		egdi_run_job(dev->workers, quality_samples_part, &job);
+
+	egdi_advance_quality(rb->qual, ns);
+}
+
+
+// Returns true if the channel ich of the channel map is filtered when it
+// is stored as floating point (i.e. it does not carry integer values)
+static
+int is_filtered_channel(const struct eegdev* dev, unsigned int ich)
+{
+	const struct egdi_chinfo* ch = dev->cap.chmap + ich;
+
+	if (ch->si)
+		return !ch->si->isint;
+	return ch->stype != egd_sensor_type("trigger");
+}
+
+
+// Create the filter bank of the ring rb. The spans are the runs of
+// filtered channels of the selected channels stored as float or double,
+// located as setup_ringbuffer_mapping() does. The channels supplied by a
+// plugin setting up its own groups are all filtered.
+static
+int setup_ring_filter(struct eegdev* dev, struct ringbuffer* rb)
+{
+	unsigned int i, k, nch, ich, offset = 0, nspan = 0, tb, bsiz;
+	struct filter_span *spans, *sp;
+	const struct selected_channels* sel;
+	double fs = (double)dev->cap.sampling_freq / rb->div;
+
+	egdi_destroy_filter_bank(rb->filt);
+	rb->filt = NULL;
+	if (!egdi_get_filter_nsec(&dev->filtspec, fs) || !rb->buff_samlen)
+		return 0;
+
+	// At most one span per channel
+	if (!(spans = malloc(rb->buff_samlen/sizeof(float)*sizeof(*spans))))
+		return -1;
+
+	for (i=0; i<dev->nsel; i++) {
+		sel = dev->selch + i;
+		if (get_ring(dev, sel->rate_div) != rb)
+			continue;
+
+		tb = sel->typeout;
+		bsiz = egd_get_data_size(tb);
+		nch = sel->inlen / egd_get_data_size(sel->typein);
+		if (tb == EGD_FLOAT || tb == EGD_DOUBLE) {
+			// Split the group in runs of filtered channels
+			for (k=0; k<nch; k++) {
+				ich = dev->selchmap[i] + k;
+				if (dev->selchmap[i] >= 0
+				   && !is_filtered_channel(dev, ich))
+					continue;
+				sp = nspan ? spans + nspan-1 : NULL;
+				if (sp && sp->type == (int)tb
+				   && sp->offset + sp->nch*bsiz
+				                   == offset + k*bsiz) {
+					sp->nch++;
 					continue;
-				buffoff -= ibgrp[i].buff_tsize * inoff
-				              / ibgrp[i].in_tsize;
-				inoff = 0;
+				}
+				sp = spans + nspan++;
+				sp->offset = offset + k*bsiz;
+				sp->nch = 1;
+				sp->type = tb;
 			}
-			if ((rest = inlen-inoff) <= 0)
+		}
+		offset += nch*bsiz;
+	}
+
+	if (nspan)
+		rb->filt = egdi_create_filter_bank(&dev->filtspec, fs,
+		                                   nspan, spans);
+	free(spans);
+	return (nspan && !rb->filt) ? -1 : 0;
+}
+
+
+// Set in lim the values below and above which a value of the channel ich
+// of the channel map is counted as saturated (infinite if unknown)
+static
+void get_saturation_limits(const struct eegdev* dev, unsigned int ich,
+                           double* lim)
+{
+	const struct egdi_chinfo* ch = dev->cap.chmap + ich;
+	const struct egdi_signal_info* si = ch->si;
+	double min, max, tmp;
+
+	lim[0] = -INFINITY;
+	lim[1] = INFINITY;
+	if (!si)
+		return;
+
+	min = get_typed_val(si->min, si->mmtype);
+	max = get_typed_val(si->max, si->mmtype);
+	if (min >= max)
+		return;
+
+	// The ring holds the values after the calibration of the channel
+	if (ch->bcal) {
+		min = ch->cal_gain*min + ch->cal_offset;
+		max = ch->cal_gain*max + ch->cal_offset;
+		if (min > max) {
+			tmp = min;
+			min = max;
+			max = tmp;
+		}
+	}
+	lim[0] = min;
+	lim[1] = max;
+}
+
+
+// Set in spans the runs of channels of the same type of the ring rb that
+// are not integer and are stored as float or double (or all of them if
+// all is set), located as setup_ringbuffer_mapping() does, and in chidx
+// the index in the channel map of each of these channels. The channels
+// supplied by a plugin setting up its own groups are skipped since they
+// cannot be identified. spans and chidx must have room for one element
+// per channel. Returns the number of spans.
+static
+unsigned int get_channel_spans(const struct eegdev* dev,
+                               const struct ringbuffer* rb,
+                               struct egd_chspan* spans,
+                               unsigned int* chidx, int all)
+{
+	unsigned int i, k, nch, ich, offset = 0, nspan = 0, tb, bsiz;
+	struct egd_chspan* sp;
+	const struct selected_channels* sel;
+
+	for (i=0; i<dev->nsel; i++) {
+		sel = dev->selch + i;
+		if (get_ring(dev, sel->rate_div) != rb)
+			continue;
+
+		tb = sel->typeout;
+		bsiz = egd_get_data_size(tb);
+		nch = sel->inlen / egd_get_data_size(sel->typein);
+		for (k=0; (all || tb == EGD_FLOAT || tb == EGD_DOUBLE)
+		          && dev->selchmap[i] >= 0 && k<nch; k++) {
+			ich = dev->selchmap[i] + k;
+			if (!all && !is_filtered_channel(dev, ich))
 				continue;
-			len = (len <= rest) ?  len : rest;
-			ibgrp[i].cast_fn(ringbuffer + ind + buffoff, 
-			               pi + inoff, ibgrp[i].sc, len);
+			*chidx++ = ich;
+
+			// Extend the previous span if contiguous in the ring
+			// and in the channels of the type
+			sp = nspan ? spans + nspan-1 : NULL;
+			if (sp && sp->type == (int)tb
+			   && sp->stype == dev->cap.chmap[ich].stype
+			   && sp->offset + sp->nch*bsiz == offset + k*bsiz
+			   && sp->index + sp->nch == get_type_index(dev, ich)) {
+				sp->nch++;
+				continue;
+			}
+			sp = spans + nspan++;
+			sp->offset = offset + k*bsiz;
+			sp->nch = 1;
+			sp->type = tb;
+			sp->stype = dev->cap.chmap[ich].stype;
+			sp->index = get_type_index(dev, ich);
 		}
-		rest = dev->in_samlen - offset;
-		if (inlen < rest) {
-			break;
+		offset += nch*bsiz;
+	}
+
+	return nspan;
+}
+
+
+// Create the quality monitor of the ring rb, monitoring the channels
+// returned by get_channel_spans()
+static
+int setup_ring_quality(struct eegdev* dev, struct ringbuffer* rb)
+{
+	unsigned int i, nch, nspan, window, *chidx;
+	struct egd_chspan* spans;
+	double *limits;
+	int retval = -1;
+
+	egdi_destroy_quality_monitor(rb->qual);
+	rb->qual = NULL;
+	if (!dev->qual_window || !rb->buff_samlen)
+		return 0;
+	window = dev->qual_window * dev->cap.sampling_freq / rb->div + 0.5;
+	if (!window)
+		window = 1;
+
+	// At most one span per channel
+	nch = rb->buff_samlen/sizeof(float);
+	spans = malloc(nch*sizeof(*spans));
+	chidx = malloc(nch*sizeof(*chidx));
+	limits = malloc(2*nch*sizeof(*limits));
+	if (!spans || !chidx || !limits)
+		goto exit;
+
+	nspan = get_channel_spans(dev, rb, spans, chidx, 0);
+	for (i=0, nch=0; i<nspan; i++)
+		nch += spans[i].nch;
+	for (i=0; i<nch; i++)
+		get_saturation_limits(dev, chidx[i], limits + 2*i);
+
+	if (nspan && !(rb->qual = egdi_create_quality_monitor(window, nspan,
+	                                                      spans, limits)))
+		goto exit;
+	retval = 0;
+
+exit:
+	free(spans);
+	free(chidx);
+	free(limits);
+	return retval;
+}
+
+
+// Create the band-power stage of the device-rate ring, computed on the
+// channels returned by get_channel_spans() and on the derived channels
+static
+int setup_ring_bandpower(struct eegdev* dev, struct ringbuffer* rb)
+{
+	unsigned int nch, nspan, *chidx;
+	struct egd_chspan* spans;
+	const struct derivation* dv = rb->deriv;
+	int retval = -1;
+
+	if (!dev->bpspec.nband || !rb->buff_samlen)
+		return 0;
+
+	// At most one span per channel
+	nch = rb->buff_samlen/sizeof(float);
+	spans = malloc(nch*sizeof(*spans));
+	chidx = malloc(nch*sizeof(*chidx));
+	if (!spans || !chidx)
+		goto exit;
+
+	nspan = get_channel_spans(dev, rb, spans, chidx, 0);
+	if (dv) {
+		spans[nspan].offset = dv->dst_offset;
+		spans[nspan].nch = dv->nout;
+		spans[nspan].index = 0;
+		spans[nspan].type = dv->type;
+		spans[nspan++].stype = egd_sensor_type("derived");
+	}
+
+	if (nspan && !(rb->bp = egdi_create_bandpower(&dev->bpspec,
+	                                  dev->cap.sampling_freq, nspan, spans,
+	                                  rb->buffer, rb->buffsize,
+	                                  rb->buff_samlen)))
+		goto exit;
+	retval = 0;
+
+exit:
+	free(spans);
+	free(chidx);
+	return retval;
+}
+
+
+// Tear down the stages that have been set up
+static
+void teardown_stages(struct eegdev* dev)
+{
+	unsigned int i;
+	struct stage_entry* st;
+
+	for (i=0; i<dev->nstage; i++) {
+		st = dev->stages + i;
+		if (st->ready && st->ops.teardown)
+			st->ops.teardown(st->data);
+		st->ready = 0;
+	}
+}
+
+
+// Set up the stages with the layout of the device-rate ring rb, which
+// contains all the channels returned by get_channel_spans() and the
+// derived channels
+static
+int setup_ring_stages(struct eegdev* dev, struct ringbuffer* rb)
+{
+	unsigned int i, nch, *chidx;
+	struct egd_stage_layout layout = {
+		.sampling_freq = dev->cap.sampling_freq,
+		.samlen = rb->buff_samlen,
+	};
+	struct egd_chspan* spans;
+	const struct derivation* dv = rb->deriv;
+	struct stage_entry* st;
+	int retval = -1;
+
+	teardown_stages(dev);
+	if (!dev->nstage)
+		return 0;
+
+	// At most one span per channel
+	nch = rb->buff_samlen;
+	spans = malloc((nch+1)*sizeof(*spans));
+	chidx = malloc((nch+1)*sizeof(*chidx));
+	if (!spans || !chidx)
+		goto exit;
+
+	layout.nspan = get_channel_spans(dev, rb, spans, chidx, 1);
+	if (dv) {
+		spans[layout.nspan].offset = dv->dst_offset;
+		spans[layout.nspan].nch = dv->nout;
+		spans[layout.nspan].index = 0;
+		spans[layout.nspan].type = dv->type;
+		spans[layout.nspan++].stype = egd_sensor_type("derived");
+	}
+	layout.spans = spans;
+
+	for (i=0; i<dev->nstage; i++) {
+		st = dev->stages + i;
+		if (st->ops.setup(st->data, &layout))
+			goto exit;
+		st->ready = 1;
+	}
+	retval = 0;
+
+exit:
+	free(spans);
+	free(chidx);
+	return retval;
+}
+
+
+// Run the stages on the ns samples of the ring starting at the position
+// ind, split in contiguous blocks at the end of the ring
+static
+void run_stages(struct eegdev* dev, struct ringbuffer* rb,
+                size_t ind, size_t ns, int restart)
+{
+	unsigned int i;
+	size_t n, nblk;
+	struct stage_entry* st;
+
+	for (n=0; n<ns; n+=nblk) {
+		nblk = (rb->buffsize - ind) / rb->buff_samlen;
+		if (nblk > ns-n)
+			nblk = ns-n;
+		for (i=0; i<dev->nstage; i++) {
+			st = dev->stages + i;
+			if (st->ready)
+				st->ops.process(st->data, rb->buffer + ind,
+				                nblk, restart);
 		}
+		ind = (ind + nblk*rb->buff_samlen) % rb->buffsize;
+		restart = 0;
+	}
+}
+
+
+// Write into the resampled arrays the output samples computed from the
+// ring samples [first, last), the sample first being at the position ind
+static
+void resample_ring(const struct eegdev* dev, const struct ringbuffer* rb,
+                   char* const* buffout, size_t ind,
+                   uint64_t first, uint64_t last)
+{
+	unsigned int i;
+	uint64_t j;
+	size_t nout, elstride;
+	const struct array_config* ac = rb->arrconf;
+	const struct array_layout* lay;
+	struct resample_src src = {
+		.buffer = rb->buffer,
+		.buffsize = rb->buffsize,
+		.samlen = rb->buff_samlen,
+		.pos_first = ind,
+		.first = first,
+	};
+
+	for (i=0; i<rb->nconf; i++) {
+		lay = dev->arrlayout + ac[i].iarray;
+		if (!lay->rs)
+			continue;
+
+		j = egdi_get_resampled_index(lay->rs, first);
+		nout = egdi_get_resampled_index(lay->rs, last) - j;
+		elstride = (lay->layout == EGD_CHANNEL_MAJOR)
+		                 ? lay->chstride : ac[i].tsize;
+		src.offset = ac[i].buff_offset;
+		src.nch = ac[i].len / ac[i].tsize;
+		egdi_resample(lay->rs, ac[i].type, &src,
+		              buffout[ac[i].iarray] + ac[i].dst_offset,
+		              ac[i].dst_samstride, elstride, j, nout);
+	}
+}
+
+
+// Set the resampler of the array iarray to produce rate samples per
+// second (0 meaning the rate of its channels) and update the history kept
+// in the rings
+static
+int setup_array_rate(struct eegdev* dev, unsigned int iarray,
+                     unsigned int rate)
+{
+	unsigned int i, r, h;
+	uint64_t up = 0, down = 1, a, b, t;
+	struct ringbuffer* rb;
+	struct resampler* rs = NULL;
+	struct array_layout* lay = dev->arrlayout + iarray;
+
+	// The groups of the array must be of floating point type and
+	// sampled at the same rate, i.e. belong to the same ring
+	for (r=0; r<dev->nring; r++) {
+		rb = dev->rings + r;
+		for (i=0; i<rb->nconf; i++) {
+			if (rb->arrconf[i].iarray != iarray)
+				continue;
+			if ((rb->arrconf[i].type != EGD_FLOAT
+			    && rb->arrconf[i].type != EGD_DOUBLE)
+			   || (up && up != (uint64_t)rate * rb->div))
+				return reterrno(EINVAL);
+			up = (uint64_t)rate * rb->div;
+			down = dev->cap.sampling_freq;
+		}
+	}
+
+	// Reduce the ratio rate/(sampling_freq/div) to up/down
+	for (a = up, b = down; b; t = a % b, a = b, b = t);
+	if (up && up != down) {
+		if (up/a > UINT_MAX || down/a > UINT_MAX)
+			return reterrno(EINVAL);
+		if (!(rs = egdi_create_resampler(up/a, down/a)))
+			return -1;
+	}
+
+	// Check that the rings can hold the history needed by the filter
+	for (r=0; r<dev->nring && rs; r++) {
+		rb = dev->rings + r;
+		for (i=0; i<rb->nconf; i++) {
+			if (rb->arrconf[i].iarray == iarray
+			   && egdi_get_resampler_history(rs) >= rb->buff_ns/2) {
+				egdi_destroy_resampler(rs);
+				return reterrno(EINVAL);
+			}
+		}
+	}
+
+	egdi_destroy_resampler(lay->rs);
+	lay->rs = rs;
+	lay->rate = rate;
+
+	// Keep in each ring the history needed by its resampled arrays
+	for (r=0; r<dev->nring; r++) {
+		rb = dev->rings + r;
+		rb->hist_ns = 0;
+		for (i=0; i<rb->nconf; i++) {
+			rs = dev->arrlayout[rb->arrconf[i].iarray].rs;
+			if (!rs)
+				continue;
+			h = egdi_get_resampler_history(rs);
+			if (h > rb->hist_ns)
+				rb->hist_ns = h;
+		}
+	}
+
+	return 0;
+}
+
+
+static
+unsigned int cast_data(const struct eegdev* dev, struct ringbuffer* restrict rb,
+                       const void* restrict in, size_t length)
+{
+	unsigned int ns = 0;
+	const char* pi = in;
+	size_t nfull, offset = rb->in_offset, ind = rb->ind;
+	size_t rest, inlen = length;
+
+	// Complete the sample started by the previous call
+	if (offset) {
+		rest = rb->in_samlen - offset;
+		cast_columns(rb, rb->buffer + ind, pi, offset,
+		             (inlen < rest) ? inlen : rest, 1, rb->in_samlen);
+		if (inlen < rest)
+			return 0;
 
 		inlen -= rest;
 		pi += rest;
-		offset = 0;
 		ns++;
-		ind = (ind + dev->buff_samlen) % dev->buffsize;
+		ind = (ind + rb->buff_samlen) % rb->buffsize;
 	}
-	dev->ind = ind;
 
+	// Run of complete samples
+	nfull = inlen / rb->in_samlen;
+	ind = cast_samples_par(dev, rb, ind, pi, nfull);
+	ns += nfull;
+
+	// Beginning of a sample that will be completed by the next call
+	rest = inlen - nfull*rb->in_samlen;
+	if (rest)
+		cast_columns(rb, rb->buffer + ind, pi + nfull*rb->in_samlen,
+		             0, rest, 1, rb->in_samlen);
+
+	rb->ind = ind;
 	return ns;
 }
 
 
 static
-int validate_groups_settings(struct eegdev* dev, unsigned int ngrp,
-                                    const struct grpconf* grp)
+int validate_groups_settings(struct eegdev* dev, unsigned int narr,
+                             unsigned int ngrp, const struct grpconf* grp)
 {
-	unsigned int i, stype;
+	unsigned int i, j, stype, div;
+	unsigned int arrdiv[narr ? narr : 1];
 	int sensind;
-	
+
+	memset(arrdiv, 0, sizeof(arrdiv));
+
 	// Groups validation
 	for (i=0; i<ngrp; i++) {
 		if (!grp[i].nch)
@@ -184,12 +1360,99 @@ int validate_groups_settings(struct eegdev* dev, unsigned int ngrp,
 		   ||((int)(grp[i].index+grp[i].nch)>dev->type_nch[sensind])
 		   ||(grp[i].datatype >= EGD_NUM_DTYPE)) 
 			return reterrno(EINVAL);
+
+		if (!dev->cap.chdiv)
+			continue;
+
+		// All the channels of a group, and all the groups of an
+		// array must be sampled at the same rate
+		div = get_channel_div(dev, stype, grp[i].index);
+		for (j=1; j<grp[i].nch; j++)
+			if (get_channel_div(dev, stype, grp[i].index+j) != div)
+				return reterrno(EINVAL);
+
+		if (grp[i].iarray >= narr
+		   || (arrdiv[grp[i].iarray] && arrdiv[grp[i].iarray] != div))
+			return reterrno(EINVAL);
+		arrdiv[grp[i].iarray] = div;
 	}
 	
 	return 0;
 }
 
 
+// Move the groups of derived channels of grp to dev->dvgrp. The other
+// groups are returned in devgrp (to be freed) followed by the groups of
+// the inputs of the derived channels, which are written in the array of
+// index narr (i.e. in no array).
+static
+int setup_derived_groups(struct eegdev* dev, unsigned int narr,
+                         unsigned int ngrp, const struct grpconf* grp,
+                         struct grpconf** devgrp, unsigned int* ndevgrp)
+{
+	unsigned int i, k, index, n = 0, ndv = 0, tsize;
+	int stype, type = -1;
+	struct derivation* dv = dev->deriv;
+	struct grpconf *g, *dvg;
+
+	// The groups of derived channels must all be of the same floating
+	// point type
+	for (i=0; i<ngrp; i++) {
+		if (!is_derived_type(dev, grp[i].sensortype) || !grp[i].nch)
+			continue;
+		if ((grp[i].datatype != EGD_FLOAT
+		    && grp[i].datatype != EGD_DOUBLE)
+		   || (type >= 0 && type != grp[i].datatype))
+			return reterrno(EINVAL);
+		type = grp[i].datatype;
+		ndv++;
+	}
+
+	g = malloc((ngrp + (ndv ? dv->nin : 0) + 1)*sizeof(*g));
+	dvg = malloc((ndv+1)*sizeof(*dvg));
+	if (!g || !dvg) {
+		free(g);
+		free(dvg);
+		return -1;
+	}
+	free(dev->dvgrp);
+	dev->dvgrp = dvg;
+	dev->ndvgrp = 0;
+
+	for (i=0; i<ngrp; i++) {
+		if (!is_derived_type(dev, grp[i].sensortype))
+			g[n++] = grp[i];
+		else if (grp[i].nch)
+			dvg[dev->ndvgrp++] = grp[i];
+	}
+
+	// One group per run of consecutive inputs of the same type
+	if (ndv) {
+		dv->type = type;
+		tsize = egd_get_data_size(type);
+		for (k=0; k<dv->nin; k++) {
+			stype = dev->cap.chmap[dv->srcch[k]].stype;
+			index = get_type_index(dev, dv->srcch[k]);
+			if (k && g[n-1].sensortype == stype
+			   && g[n-1].index + g[n-1].nch == index) {
+				g[n-1].nch++;
+				continue;
+			}
+			g[n].sensortype = stype;
+			g[n].index = index;
+			g[n].nch = 1;
+			g[n].iarray = narr;
+			g[n].arr_offset = k*tsize;
+			g[n++].datatype = type;
+		}
+	}
+
+	*devgrp = g;
+	*ndevgrp = n;
+	return 0;
+}
+
+
 static
 int wait_for_data(struct eegdev* dev, size_t* reqns)
 {
@@ -227,8 +1490,76 @@ static void safe_strncpy(char* dst, const char* src, size_t n)
 	dst[eos] = '\0';
 }
 
+// Append to the prefiltering information of si the filters applied by the
+// core on the channel (if any) using str as storage
+static
+void append_filter_info(const struct eegdev* dev,
+                        struct egdi_signal_info* si, unsigned int fs,
+                        char str[EGD_PREFILTERING_LEN])
+{
+	const char* prev = si->prefiltering;
+	int n = 0;
+
+	if (prev && *prev && strcmp(prev, "No filtering")) {
+		n = snprintf(str, EGD_PREFILTERING_LEN, "%s; ", prev);
+		if (n >= EGD_PREFILTERING_LEN)
+			return;
+	}
+
+	if (egdi_format_filter_spec(&dev->filtspec, fs, str+n,
+	                            EGD_PREFILTERING_LEN-n))
+		si->prefiltering = str;
+}
+
+
+// Fill the information of the derived channel ich from those of its
+// inputs: the unit and the filters are the ones of the first input and the
+// range is the one of the weighted sum of the ranges of the inputs
+static
+void fill_derived_chinfo(const struct eegdev* dev, unsigned int ich,
+                         struct egdi_chinfo* info,
+                         struct egdi_signal_info* si)
+{
+	const struct derivation* dv = dev->deriv;
+	struct egdi_signal_info insi;
+	struct egdi_chinfo inch = {.si = &insi};
+	unsigned int k, index, first = 1;
+	double w, inmin, inmax, min = 0.0, max = 0.0;
+	int stype;
+
+	for (k=0; k<dv->nin; k++) {
+		if ((w = dv->w[(size_t)ich*dv->nin + k]) == 0.0)
+			continue;
+
+		stype = dev->cap.chmap[dv->srcch[k]].stype;
+		index = get_type_index(dev, dv->srcch[k]);
+		memset(&insi, 0, sizeof(insi));
+		egdi_default_fill_chinfo(dev, stype, index, &inch, &insi);
+		if (dev->ops.fill_chinfo)
+			dev->ops.fill_chinfo(&dev->module, stype, index,
+			                     &inch, &insi);
+		if (first)
+			*si = insi;
+		first = 0;
+
+		inmin = get_typed_val(insi.min, insi.mmtype);
+		inmax = get_typed_val(insi.max, insi.mmtype);
+		min += (w > 0.0) ? w*inmin : w*inmax;
+		max += (w > 0.0) ? w*inmax : w*inmin;
+	}
+
+	si->isint = 0;
+	si->mmtype = EGD_DOUBLE;
+	si->min.valdouble = min;
+	si->max.valdouble = max;
+	info->label = dv->labels[ich][0] ? dv->labels[ich] : NULL;
+	info->stype = egd_sensor_type("derived");
+}
+
+
 static
-int get_field_info(struct egdi_chinfo* info, int index, int field, void* arg)
+int get_field_info(struct egdi_chinfo* info, int index, int field,
+                   unsigned int fs, void* arg)
 {
 	const struct egdi_signal_info* si = info->si;
 
@@ -255,6 +1586,8 @@ int get_field_info(struct egdi_chinfo* info, int index, int field, void* arg)
 		safe_strncpy(arg, si->transducer, EGD_TRANSDUCER_LEN);
 	else if (field == EGD_PREFILTERING) 
 		safe_strncpy(arg, si->prefiltering, EGD_PREFILTERING_LEN);
+	else if (field == EGD_FS)
+		*((unsigned int*)arg) = fs;
 	return 0;
 }
 
@@ -312,6 +1645,96 @@ int find_supported_sensor(struct eegdev* dev, unsigned int nch,
 }
 
 
+// Free the derivation dv if it is neither the one of the device nor the
+// one used by the device-rate ring
+static
+void release_derivation(struct eegdev* dev, struct derivation* dv)
+{
+	if (dv != dev->deriv && dv != dev->rings[0].deriv)
+		egdi_destroy_derivation(dv);
+}
+
+
+// Update the list of sensor types provided by the device (and their
+// number of channels) with the derived channels
+static
+int setup_sensor_types(struct eegdev* dev)
+{
+	int ntype, *types, *prevtypes = dev->provided_stypes;
+
+	dev->provided_stypes = NULL;
+	if (find_supported_sensor(dev, dev->cap.nch, dev->cap.chmap)) {
+		free(dev->provided_stypes);
+		dev->provided_stypes = prevtypes;
+		return -1;
+	}
+	free(prevtypes);
+	if (!dev->deriv)
+		return 0;
+
+	// Insert the type of derived channels at the end of the list
+	for (ntype=0; dev->provided_stypes[ntype] != -1; ntype++);
+	types = realloc(dev->provided_stypes, (2*ntype+3)*sizeof(*types));
+	if (!types)
+		return -1;
+	memmove(types+ntype+2, types+ntype+1, ntype*sizeof(*types));
+	types[ntype] = egd_sensor_type("derived");
+	types[ntype+1] = -1;
+	types[2*ntype+2] = dev->deriv->nout;
+	dev->provided_stypes = types;
+	dev->type_nch = types + ntype+2;
+	return 0;
+}
+
+
+// Replace the derived channels of the device by the nout channels
+// computed from the nin channels srcch of the channel map (none if nout is
+// 0). The derivation used by the rings is kept until the next setup.
+static
+int set_derivation(struct eegdev* dev, unsigned int nout, unsigned int nin,
+                   const unsigned int* srcch, const double* weights,
+                   const char* const* labels)
+{
+	struct derivation *dv = NULL, *prev = dev->deriv;
+	const unsigned int* chdiv = dev->cap.chdiv;
+	unsigned int k;
+
+	// Only the channels sampled at the device rate can be combined
+	for (k=0; k<nin; k++)
+		if (srcch[k] >= dev->cap.nch
+		   || (chdiv && chdiv[srcch[k]] > 1))
+			return reterrno(EINVAL);
+
+	if (nout && !(dv = egdi_create_derivation(nout, nin, srcch,
+	                                          weights, labels)))
+		return -1;
+
+	dev->deriv = dv;
+	if (setup_sensor_types(dev)) {
+		dev->deriv = prev;
+		setup_sensor_types(dev);
+		egdi_destroy_derivation(dv);
+		return -1;
+	}
+
+	release_derivation(dev, prev);
+	return 0;
+}
+
+
+static
+int is_multirate(const struct plugincap* cap)
+{
+	unsigned int i;
+
+	for (i=0; i < cap->num_mappings; i++)
+		if (cap->mappings[i].rate_div > 1)
+			return 1;
+
+	return 0;
+}
+
+
 static
 int validate_cap_flags(const struct plugincap* cap)
 {
@@ -320,7 +1743,8 @@ int validate_cap_flags(const struct plugincap* cap)
 	if ((flags & EGDCAP_NOCP_CHMAP) &&
 	        (cap->num_mappings > 1
 		  || cap->mappings[0].num_skipped
-		  || cap->mappings[0].default_info) )
+		  || cap->mappings[0].default_info
+		  || is_multirate(cap)) )
 		flags &= ~EGDCAP_NOCP_CHMAP;
 
 	if (!(flags & EGDCAP_NOCP_CHLABEL) && (flags & EGDCAP_NOCP_CHMAP))
@@ -343,6 +1767,8 @@ size_t calc_aux_capdata_size(int actual_flags, const struct plugincap* cap)
 			nch = cap->mappings[i].nch
 			      + cap->mappings[i].num_skipped;
 			auxlen += nch * sizeof(*chmap);
+			if (is_multirate(cap))
+				auxlen += nch * sizeof(unsigned int);
 		}
 
 	if ( !(actual_flags & EGDCAP_NOCP_DEVTYPE) )
@@ -378,6 +1804,8 @@ int fill_chmap_from_mappings(void** auxbuf, int num,
 			if (!chmap[j].si)
 				chmap[j].si = mappings[i].default_info;
 
+		memset(chmap + nch, 0,
+		       mappings[i].num_skipped * sizeof(*chmap));
 		for (j = 0; j < mappings[i].num_skipped; j++) {
 			chmap[j + nch].stype = mappings[i].skipped_stype;
 			chmap[j + nch].label = NULL;
@@ -392,6 +1820,25 @@ int fill_chmap_from_mappings(void** auxbuf, int num,
 }
 
 
+static
+void fill_chdiv_from_mappings(void** auxbuf, int num,
+                              const struct blockmapping* mappings)
+{
+	unsigned int* restrict chdiv = *auxbuf;
+	int i, j, nch;
+
+	for (i = 0; i < num; i++) {
+		nch = mappings[i].nch + mappings[i].num_skipped;
+		for (j = 0; j < nch; j++)
+			chdiv[j] = (mappings[i].rate_div > 1)
+			              ? mappings[i].rate_div : 1;
+		chdiv += nch;
+	}
+
+	*auxbuf = chdiv;
+}
+
+
 static
 void copy_labels_in_aux(void** auxbuf, int nch, struct egdi_chinfo* chmap)
 {
@@ -412,13 +1859,53 @@ void copy_labels_in_aux(void** auxbuf, int nch, struct egdi_chinfo* chmap)
 }
 
 
-/*******************************************************************
- *                        Systems common                           *
- *******************************************************************/
-static
-int noaction(struct devmodule* dev)
-{
-	(void)dev;
+/*******************************************************************
+ *                        Systems common                           *
+ *******************************************************************/
+static
+int noaction(struct devmodule* dev)
+{
+	(void)dev;
+	return 0;
+}
+
+
+// Create one ring per rate divider found in the channel map and compute
+// the size of their input samples
+static
+int setup_subrings(struct eegdev* dev)
+{
+	unsigned int i, j, nring = 1;
+	const unsigned int* chdiv = dev->cap.chdiv;
+	const struct egdi_chinfo* chmap = dev->cap.chmap;
+	struct ringbuffer* rings;
+
+	if (!chdiv)
+		return 0;
+
+	for (i=0; i<dev->cap.nch; i++) {
+		for (j=0; j<i; j++)
+			if (chdiv[j] == chdiv[i])
+				break;
+		if (j == i && chdiv[i] > 1)
+			nring++;
+	}
+
+	rings = realloc(dev->rings, nring*sizeof(*rings));
+	if (!rings)
+		return -1;
+	memset(rings+1, 0, (nring-1)*sizeof(*rings));
+	dev->rings = rings;
+
+	for (i=0; i<dev->cap.nch; i++) {
+		if (chdiv[i] <= 1)
+			continue;
+		if (!get_ring(dev, chdiv[i]))
+			rings[dev->nring++].div = chdiv[i];
+		get_ring(dev, chdiv[i])->in_samlen +=
+		                        egd_get_data_size(chmap[i].si->dtype);
+	}
+
 	return 0;
 }
 
@@ -439,6 +1926,7 @@ int egdi_set_cap(struct devmodule* mdev, const struct plugincap* cap)
 		return -1;
 
 	dev->cap.sampling_freq = cap->sampling_freq;
+	dev->cap.flags = flags;
 	dev->cap.device_type = cap->device_type;
 	dev->cap.device_id = cap->device_id;
 
@@ -449,6 +1937,12 @@ int egdi_set_cap(struct devmodule* mdev, const struct plugincap* cap)
 		nch = fill_chmap_from_mappings(&auxbuff, cap->num_mappings,
                                                          cap->mappings);
 
+		if (is_multirate(cap)) {
+			dev->cap.chdiv = auxbuff;
+			fill_chdiv_from_mappings(&auxbuff, cap->num_mappings,
+			                         cap->mappings);
+		}
+
 		if (!(flags & EGDCAP_NOCP_CHLABEL))
 			copy_labels_in_aux(&auxbuff, nch, chmap);
 
@@ -475,7 +1969,8 @@ int egdi_set_cap(struct devmodule* mdev, const struct plugincap* cap)
 	}
 
 	if (!dev->cap.nch
-	    || find_supported_sensor(dev, dev->cap.nch, dev->cap.chmap))
+	    || find_supported_sensor(dev, dev->cap.nch, dev->cap.chmap)
+	    || setup_subrings(dev))
 		return -1;
 
 	return 0;
@@ -492,9 +1987,11 @@ struct eegdev* egdi_create_eegdev(const struct egdi_plugin_info* info)
 	size_t dsize = info->struct_size+sizeof(*dev)-sizeof(dev->module);
 	
 	if (!(dev = calloc(1, dsize))
+	   || !(dev->rings = calloc(1, sizeof(*dev->rings)))
 	   || mm_thr_cond_init(&(dev->available), 0) || !(++stinit)
 	   || mm_thr_mutex_init(&(dev->synclock), 0) || !(++stinit)
-	   || mm_thr_mutex_init(&(dev->apilock), 0))
+	   || mm_thr_mutex_init(&(dev->apilock), 0) || !(++stinit)
+	   || mm_thr_mutex_init(&(dev->prodlock), 0))
 		goto fail;
 
 	//Register device methods
@@ -514,14 +2011,26 @@ struct eegdev* egdi_create_eegdev(const struct egdi_plugin_info* info)
 	ci->set_cap = egdi_set_cap;
 	ci->get_stype = egd_sensor_type;
 	ci->get_conf_mapping = egdi_get_conf_mapping;
+	ci->update_subring = egdi_update_subring;
+	ci->set_input_decoder = egdi_set_input_decoder;
+	ci->split_input_groups = egdi_split_input_groups;
+	ci->set_input_producers = egdi_set_input_producers;
+	ci->update_ringbuffer_column = egdi_update_ringbuffer_column;
+
+	dev->nring = 1;
+	dev->rings[0].div = 1;
 
 	return dev;
 
 fail:
+	if (stinit-- > 2)
+		mm_thr_mutex_deinit(&(dev->apilock));
 	if (stinit--)
 		mm_thr_mutex_deinit(&(dev->synclock));
 	if (stinit--)
 		mm_thr_cond_deinit(&(dev->available));
+	if (dev)
+		free(dev->rings);
 	free(dev);
 	return NULL;
 }
@@ -530,127 +2039,642 @@ fail:
 LOCAL_FN
 void egd_destroy_eegdev(struct eegdev* dev)
 {	
+	unsigned int i;
+
 	if (!dev)
 		return;
 
+	egdi_destroy_staging(dev->staging);
+	egdi_destroy_worker_pool(dev->workers);
+	teardown_stages(dev);
+	free(dev->stages);
 	free(dev->auxdata);
 	free(dev->provided_stypes);
 
 	mm_thr_cond_deinit(&(dev->available));
 	mm_thr_mutex_deinit(&(dev->synclock));
 	mm_thr_mutex_deinit(&(dev->apilock));
+	mm_thr_mutex_deinit(&(dev->prodlock));
+	free(dev->prod);
 	
 	free(dev->selch);
+	free(dev->selchmap);
+	free(dev->seldec);
+	free(dev->xfbuff);
 	free(dev->inbuffgrp);
 	free(dev->arrconf);
+	for (i=0; i<dev->narr; i++)
+		egdi_destroy_resampler(dev->arrlayout[i].rs);
 	free(dev->strides);
-	free(dev->buffer);
+	free(dev->arrlayout);
+	for (i=0; i<dev->nring; i++) {
+		egdi_destroy_bandpower(dev->rings[i].bp);
+		free(dev->rings[i].buffer);
+		egdi_destroy_filter_bank(dev->rings[i].filt);
+		egdi_destroy_quality_monitor(dev->rings[i].qual);
+	}
+	if (dev->rings[0].deriv != dev->deriv)
+		egdi_destroy_derivation(dev->rings[0].deriv);
+	egdi_destroy_derivation(dev->deriv);
+	free(dev->dvgrp);
+	free(dev->rings);
 
 	free(dev);
 }
 
 
+// Process the acquisition order for the ring rb (synclock must be held).
+// Returns if the device is acquiring.
+static
+int process_acq_order(struct eegdev* dev, const struct ringbuffer* rb)
+{
+	unsigned int i;
+
+	if (dev->acq_order == EGD_ORDER_START && rb == dev->rings) {
+		// The rings of lower rates are started with the device-rate
+		// ring so that their first samples are aligned
+		dev->acq_order = EGD_ORDER_NONE;
+		for (i=0; i<dev->nring; i++)
+			dev->rings[i].state = RING_STARTING;
+	} else if (dev->acq_order == EGD_ORDER_STOP) {
+		dev->acq_order = EGD_ORDER_NONE;
+		dev->acquiring = 0;
+	}
+
+	return dev->acquiring;
+}
+
+
+// Run the processing of the ns samples written in the ring at ind, then
+// make them available to the reader
+static
+void publish_samples(struct eegdev* dev, struct ringbuffer* rb,
+                     size_t ind, unsigned int ns)
+{
+	mm_thr_mutex_t* synclock = &(dev->synclock);
+
+	// Update the quality statistics before the filters remove
+	// the offsets, then filter the samples completed before
+	// making them available
+	if (rb->qual && ns)
+		quality_samples_par(dev, rb, ind, ns, !rb->ns_written);
+	if (rb->filt && ns)
+		filter_samples_par(dev, rb, ind, ns, !rb->ns_written);
+	if (rb->deriv && ns)
+		derive_samples_par(dev, rb, ind, ns);
+	if (rb == dev->rings && dev->nstage && rb->buffsize && ns)
+		run_stages(dev, rb, ind, ns, !rb->ns_written);
+	if (rb->bp && ns)
+		egdi_update_bandpower(rb->bp, ns,
+		                  (ind + ns*rb->buff_samlen) % rb->buffsize,
+		                  !rb->ns_written);
+
+	// Update number of sample available and signal if
+	// thread is waiting for data
+	mm_thr_mutex_lock(synclock);
+	rb->ns_written += ns;
+	dev->ns_written = get_ns_written(dev);
+	if (dev->nreadwait
+	   && (dev->nreadwait + dev->ns_read <= dev->ns_written))
+		mm_thr_cond_signal(&(dev->available));
+	mm_thr_mutex_unlock(synclock);
+}
+
+
+static
+int update_ring(struct eegdev* dev, struct ringbuffer* rb,
+                const void* in, size_t length)
+{
+	unsigned int ns, rest;
+	int acquiring;
+	size_t nsread, ns_be_written, ind;
+	mm_thr_mutex_t* synclock = &(dev->synclock);
+
+	// Process acquisition order
+	mm_thr_mutex_lock(synclock);
+	nsread = dev->ns_read / rb->div;
+	acquiring = process_acq_order(dev, rb);
+
+	if (acquiring && rb->state == RING_STARTING) {
+		// Check if we can start the acquisition now. If not
+		// postpone it to a later call of update_ringbuffer
+		rest = (rb->in_samlen - rb->in_offset) % rb->in_samlen;
+		if (rest <= length) {
+			rb->state = RING_RUNNING;
+
+			// realign on beginning of the next sample
+			// (avoid junk at the beginning of the acquisition)
+			in = (char*)in + rest;
+			length -= rest;
+			rb->in_offset = 0;
+		}
+	}
+	acquiring = acquiring && (rb->state == RING_RUNNING);
+	mm_thr_mutex_unlock(synclock);
+
+	if (acquiring) {
+		// Test for ringbuffer full
+		ns_be_written = length/rb->in_samlen + 2 + rb->ns_written;
+		if (ns_be_written - nsread + rb->hist_ns >= rb->buff_ns) {
+			egdi_report_error(&dev->module, ENOMEM);
+			return -1;
+		}
+
+		// Put data on the ringbuffer (if any channel is selected)
+		ind = rb->ind;
+		if (rb->bp)
+			egdi_reserve_bandpower(rb->bp,
+			                       length/rb->in_samlen + 2);
+		if (!rb->buffsize)
+			ns = (rb->in_offset + length) / rb->in_samlen;
+		else if (dev->cap.flags & EGDCAP_WHOLE_SAMPLES) {
+			ns = length / rb->in_samlen;
+			rb->ind = cast_samples_par(dev, rb, rb->ind, in, ns);
+		} else
+			ns = cast_data(dev, rb, in, length);
+
+		publish_samples(dev, rb, ind, ns);
+	}
+
+	rb->in_offset = (length + rb->in_offset) % rb->in_samlen;
+	return 0;
+}
+
+
+static int update_column(struct eegdev* dev, unsigned int iprod,
+                          const void* in, size_t length);
+
+// Tag of the data of a producer in the staging queue (the lower bits hold
+// the index of the producer)
+#define STAGED_COLUMN	0x80000000u
+
+// Called by the thread of the staging queue with the data supplied by the
+// plugin
+static
+void update_staged_ring(void* arg, unsigned int div,
+                        const void* in, size_t length)
+{
+	struct eegdev* dev = arg;
+
+	if (div & STAGED_COLUMN)
+		update_column(dev, div & ~STAGED_COLUMN, in, length);
+	else
+		update_ring(dev, get_ring(dev, div), in, length);
+}
+
+
+// Append the data to the staging queue (the cast being done by the thread
+// of the queue)
+static
+int stage_ring(struct eegdev* dev, const struct ringbuffer* rb,
+               const void* in, size_t length)
+{
+	if (egdi_stage_data(dev->staging, rb->div, in, length)) {
+		egdi_report_error(&dev->module, errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+LOCAL_FN
+int egdi_update_ringbuffer(struct devmodule* mdev, const void* in, size_t length)
+{
+	struct eegdev* dev = get_eegdev(mdev);
+
+	if (dev->staging)
+		return stage_ring(dev, dev->rings, in, length);
+
+	return update_ring(dev, dev->rings, in, length);
+}
+
+
+LOCAL_FN
+int egdi_update_subring(struct devmodule* mdev, unsigned int div,
+                        const void* in, size_t length)
+{
+	struct eegdev* dev = get_eegdev(mdev);
+	struct ringbuffer* rb = get_ring(dev, div);
+
+	if (!rb) {
+		egdi_report_error(mdev, EINVAL);
+		return -1;
+	}
+
+	if (dev->staging)
+		return stage_ring(dev, rb, in, length);
+
+	return update_ring(dev, rb, in, length);
+}
+
+
+/*******************************************************************
+ *                    Producers of input columns                   *
+ *******************************************************************/
+// Process the acquisition order for the producers (prodlock must be held).
+// The acquisition starts at the first sample that no producer has started
+// to write, the samples of each producer being counted since they were
+// set. Returns if the producers are acquiring.
+static
+int update_producers_state(struct eegdev* dev, unsigned long* nsread)
+{
+	unsigned int i;
+	int acquiring;
+	struct ringbuffer* rb = dev->rings;
+
+	mm_thr_mutex_lock(&(dev->synclock));
+	*nsread = dev->ns_read;
+	acquiring = process_acq_order(dev, rb);
+	if (acquiring && rb->state == RING_STARTING) {
+		rb->state = RING_RUNNING;
+		dev->prod_start = 0;
+		for (i=0; i<dev->nprod; i++) {
+			if (dev->prod_start < dev->prod[i].claimed)
+				dev->prod_start = dev->prod[i].claimed;
+		}
+		dev->prod_ind = rb->ind;
+		dev->prod_reserved = 0;
+	}
+	acquiring = acquiring && (rb->state == RING_RUNNING);
+	mm_thr_mutex_unlock(&(dev->synclock));
+
+	return acquiring;
+}
+
+
+// Publish the samples supplied by all the producers that are not yet
+// available (prodlock must be held)
+static
+void publish_produced(struct eegdev* dev)
+{
+	unsigned int i;
+	unsigned long end = ULONG_MAX, ns;
+	size_t ind;
+	struct ringbuffer* rb = dev->rings;
+
+	for (i=0; i<dev->nprod; i++) {
+		if (end > dev->prod[i].ns)
+			end = dev->prod[i].ns;
+	}
+	if (end <= dev->prod_start + rb->ns_written)
+		return;
+
+	ns = end - dev->prod_start - rb->ns_written;
+	ind = rb->ind;
+	if (rb->buffsize)
+		rb->ind = (ind + ns*rb->buff_samlen) % rb->buffsize;
+	publish_samples(dev, rb, ind, ns);
+}
+
+
+LOCAL_FN
+int egdi_set_input_producers(struct devmodule* mdev, unsigned int nprod,
+                             const struct egdi_input_column* cols)
+{
+	struct eegdev* dev = get_eegdev(mdev);
+	struct input_producer* prod = NULL;
+	size_t samlen = dev->rings[0].in_samlen, len = 0;
+	unsigned int i, j;
+
+	// The columns must partition the input sample
+	for (i=0; i<nprod; i++) {
+		if (!cols[i].len || cols[i].offset + cols[i].len > samlen)
+			return reterrno(EINVAL);
+		for (j=0; j<i; j++) {
+			if (cols[i].offset < cols[j].offset + cols[j].len
+			   && cols[j].offset < cols[i].offset + cols[i].len)
+				return reterrno(EINVAL);
+		}
+		len += cols[i].len;
+	}
+	if (nprod && len != samlen)
+		return reterrno(EINVAL);
+
+	if (nprod && !(prod = calloc(nprod, sizeof(*prod))))
+		return -1;
+	for (i=0; i<nprod; i++) {
+		prod[i].offset = cols[i].offset;
+		prod[i].len = cols[i].len;
+	}
+
+	mm_thr_mutex_lock(&(dev->prodlock));
+	free(dev->prod);
+	dev->prod = prod;
+	dev->nprod = nprod;
+	mm_thr_mutex_unlock(&(dev->prodlock));
+
+	return 0;
+}
+
+
+static
+int update_column(struct eegdev* dev, unsigned int iprod,
+                  const void* in, size_t length)
+{
+	struct ringbuffer* rb = dev->rings;
+	struct input_producer* prod = dev->prod + iprod;
+	unsigned long first, end, nsread, rel = 0, relend = 0;
+	size_t ind = 0;
+	const char* pi = in;
+	int acquiring;
+
+	// Claim the samples and locate those of the acquisition in the ring
+	mm_thr_mutex_lock(&(dev->prodlock));
+	first = prod->ns;
+	end = first + length/prod->len;
+	acquiring = update_producers_state(dev, &nsread);
+	prod->claimed = end;
+	if (acquiring && end > dev->prod_start) {
+		rel = (first > dev->prod_start) ? first - dev->prod_start : 0;
+		relend = end - dev->prod_start;
+		pi += (rel + dev->prod_start - first) * prod->len;
+
+		// Test for ringbuffer full
+		if (relend + 2 - nsread + rb->hist_ns >= rb->buff_ns) {
+			prod->ns = end;
+			mm_thr_mutex_unlock(&(dev->prodlock));
+			egdi_report_error(&dev->module, ENOMEM);
+			return -1;
+		}
+
+		if (rb->bp && relend > dev->prod_reserved) {
+			egdi_reserve_bandpower(rb->bp,
+			                       relend - rb->ns_written);
+			dev->prod_reserved = relend;
+		}
+		if (rb->buffsize)
+			ind = (dev->prod_ind + (rel % rb->buff_ns)
+			                       * rb->buff_samlen) % rb->buffsize;
+	}
+	mm_thr_mutex_unlock(&(dev->prodlock));
+
+	// Cast the columns without lock: the other producers write other
+	// bytes of the ring samples
+	if (rb->buffsize)
+		cast_producer_columns_par(dev, rb, ind, pi, prod->offset,
+		                          prod->len, relend - rel);
+
+	// Publish the samples written by all the producers
+	mm_thr_mutex_lock(&(dev->prodlock));
+	prod->ns = end;
+	if (update_producers_state(dev, &nsread))
+		publish_produced(dev);
+	mm_thr_mutex_unlock(&(dev->prodlock));
+
+	return 0;
+}
+
+
+LOCAL_FN
+int egdi_update_ringbuffer_column(struct devmodule* mdev, unsigned int iprod,
+                                  const void* in, size_t length)
+{
+	struct eegdev* dev = get_eegdev(mdev);
+	int error;
+
+	if (iprod >= dev->nprod || length % dev->prod[iprod].len) {
+		egdi_report_error(mdev, EINVAL);
+		return -1;
+	}
+
+	if (!dev->staging)
+		return update_column(dev, iprod, in, length);
+
+	// The staging queue accepts a single writer: the producers are
+	// serialized while appending their data
+	mm_thr_mutex_lock(&(dev->prodlock));
+	error = egdi_stage_data(dev->staging, STAGED_COLUMN | iprod,
+	                        in, length) ? errno : 0;
+	mm_thr_mutex_unlock(&(dev->prodlock));
+	if (error) {
+		egdi_report_error(mdev, error);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+LOCAL_FN
+void egdi_report_error(struct devmodule* mdev, int error)
+{
+	struct eegdev *dev = get_eegdev(mdev);
+	mm_thr_mutex_lock(&dev->synclock);
+
+	if (!dev->error)
+		dev->error = error;
+	
+	if (dev->nreadwait)
+		mm_thr_cond_signal(&(dev->available));
+
+	mm_thr_mutex_unlock(&dev->synclock);
+}
+
+
+LOCAL_FN
+struct selected_channels* egdi_alloc_input_groups(struct devmodule* mdev,
+                                                 unsigned int ngrp)
+{
+	struct eegdev* dev = get_eegdev(mdev);
+	unsigned int i;
+
+	free(dev->selch);
+	free(dev->selchmap);
+	free(dev->seldec);
+	free(dev->inbuffgrp);
+	free(dev->arrconf);
+
+	// Alloc ringbuffer mapping structures
+	dev->nsel = ngrp;
+	dev->selch = calloc(ngrp,sizeof(*(dev->selch)));
+	dev->selchmap = malloc(ngrp*sizeof(*(dev->selchmap)));
+	dev->seldec = calloc(ngrp,sizeof(*(dev->seldec)));
+	dev->inbuffgrp = calloc(ngrp,sizeof(*(dev->inbuffgrp)));
+	dev->arrconf = calloc(ngrp,sizeof(*(dev->arrconf)));
+	if (!dev->selch || !dev->selchmap || !dev->seldec
+	   || !dev->inbuffgrp || !dev->arrconf)
+		return NULL;
+
+	// Channels unknown unless set by egdi_split_alloc_chgroups()
+	for (i=0; i<ngrp; i++)
+		dev->selchmap[i] = -1;
+	
+	return dev->selch;
+}
+
+
+LOCAL_FN
+void egdi_set_input_samlen(struct devmodule* mdev, unsigned int samlen)
+{
+	get_eegdev(mdev)->rings[0].in_samlen = samlen;
+}
+
+
+LOCAL_FN
+int egdi_setup_workers(struct eegdev* dev, unsigned int nworker,
+                       size_t minsize)
+{
+	egdi_destroy_worker_pool(dev->workers);
+	dev->workers = NULL;
+	dev->par_minsize = minsize;
+
+	if (nworker && !(dev->workers = egdi_create_worker_pool(nworker)))
+		return -1;
+
+	return 0;
+}
+
+
+LOCAL_FN
+int egdi_setup_staging(struct eegdev* dev, size_t size)
+{
+	egdi_destroy_staging(dev->staging);
+	dev->staging = NULL;
+
+	if (size && !(dev->staging = egdi_create_staging(size,
+	                                       update_staged_ring, dev)))
+		return -1;
+
+	return 0;
+}
+
+
+LOCAL_FN
+int egdi_setup_filter(struct eegdev* dev, const struct filter_spec* spec)
+{
+	if (spec->hp < 0.0 || spec->lp < 0.0 || spec->notch < 0.0
+	   || !spec->order || spec->order % 2 || spec->order > 8
+	   || (spec->hp && spec->lp && spec->hp >= spec->lp))
+		return reterrno(EINVAL);
+
+	dev->filtspec = *spec;
+	return 0;
+}
+
+
+LOCAL_FN
+int egdi_setup_quality(struct eegdev* dev, double window)
+{
+	if (!(window >= 0.0))
+		return reterrno(EINVAL);
+
+	dev->qual_window = window;
+	return 0;
+}
+
+
 LOCAL_FN
-int egdi_update_ringbuffer(struct devmodule* mdev, const void* in, size_t length)
+int egdi_setup_bandpower(struct eegdev* dev,
+                         const struct bandpower_spec* spec)
 {
-	unsigned int ns, rest;
-	int acquiring;
-	size_t nsread, ns_be_written;
-	struct eegdev* dev = get_eegdev(mdev);
-	mm_thr_mutex_t* synclock = &(dev->synclock);
-
-	// Process acquisition order
-	mm_thr_mutex_lock(synclock);
-	nsread = dev->ns_read;
-	acquiring = dev->acquiring;
-	if (dev->acq_order == EGD_ORDER_START) {
-		// Check if we can start the acquisition now. If not
-		// postpone it to a later call of update_ringbuffer, i.e. do
-		// not reset the order
-		rest = (dev->in_samlen - dev->in_offset) % dev->in_samlen;
-		if (rest <= length) {
-			dev->acq_order = EGD_ORDER_NONE;
-
-			// realign on beginning of the next sample
-			// (avoid junk at the beginning of the acquisition)
-			in = (char*)in + rest;
-			length -= rest;
-			dev->in_offset = 0;
-		}
-	} else if (dev->acq_order == EGD_ORDER_STOP) {
-		dev->acq_order = EGD_ORDER_NONE;
-		acquiring = dev->acquiring = 0;
-	}
-	mm_thr_mutex_unlock(synclock);
-
-	if (acquiring) {
-		// Test for ringbuffer full
-		ns_be_written = length/dev->in_samlen + 2 + dev->ns_written;
-		if (ns_be_written - nsread >= dev->buff_ns) {
-			egdi_report_error(mdev, ENOMEM);
-			return -1;
-		}
+	unsigned int i;
+	double fs = dev->cap.sampling_freq;
 
-		// Put data on the ringbuffer
-		ns = cast_data(dev, in, length);
+	if (spec->nband > EGDI_MAX_BANDS
+	   || (spec->nband && (!(spec->window > 0.0) || !(spec->step > 0.0)
+	                       || spec->window > BUFF_SIZE/2.0)))
+		return reterrno(EINVAL);
 
-		// Update number of sample available and signal if
-		// thread is waiting for data
-		mm_thr_mutex_lock(synclock);
-		dev->ns_written += ns;
-		if (dev->nreadwait
-		   && (dev->nreadwait + dev->ns_read <= dev->ns_written))
-			mm_thr_cond_signal(&(dev->available));
-		mm_thr_mutex_unlock(synclock);
+	for (i=0; i<spec->nband; i++) {
+		if (!(spec->lo[i] >= 0.0) || spec->hi[i] <= spec->lo[i]
+		   || (fs && spec->hi[i] > fs/2.0))
+			return reterrno(EINVAL);
 	}
 
-	dev->in_offset = (length + dev->in_offset) % dev->in_samlen;
+	dev->bpspec = *spec;
 	return 0;
 }
 
 
+/* Set the derived channels of the device from the nch channels of a
+ * mapping of the configuration, each being defined by the expression of
+ * the same index in exprs (see egdi_parse_derivation()). Only the inputs
+ * having a non-zero weight are kept. */
 LOCAL_FN
-void egdi_report_error(struct devmodule* mdev, int error)
+int egdi_setup_conf_derivation(struct eegdev* dev, unsigned int nch,
+                               const struct egdi_chinfo* chmap,
+                               const char* const* exprs)
 {
-	struct eegdev *dev = get_eegdev(mdev);
-	mm_thr_mutex_lock(&dev->synclock);
+	unsigned int r, k, nin = 0, ndev = dev->cap.nch;
+	unsigned int* srcch;
+	const char** labels;
+	double* w;
+	int retval = -1;
 
-	if (!dev->error)
-		dev->error = error;
-	
-	if (dev->nreadwait)
-		mm_thr_cond_signal(&(dev->available));
+	if (!nch)
+		return reterrno(EINVAL);
 
-	mm_thr_mutex_unlock(&dev->synclock);
+	w = calloc((size_t)nch*ndev, sizeof(*w));
+	srcch = malloc(ndev*sizeof(*srcch));
+	labels = malloc(nch*sizeof(*labels));
+	if (!w || !srcch || !labels)
+		goto exit;
+
+	for (r=0; r<nch; r++) {
+		labels[r] = chmap[r].label;
+		if (!exprs[r]) {
+			errno = EINVAL;
+			goto exit;
+		}
+		if (egdi_parse_derivation(exprs[r], ndev, dev->cap.chmap,
+		                          dev->cap.chdiv, w + (size_t)r*ndev))
+			goto exit;
+	}
+
+	// Keep the columns of the channels used (in place since the index
+	// of a weight can only decrease)
+	for (k=0; k<ndev; k++) {
+		for (r=0; r<nch && w[(size_t)r*ndev + k] == 0.0; r++);
+		if (r < nch)
+			srcch[nin++] = k;
+	}
+	if (!nin) {
+		errno = EINVAL;
+		goto exit;
+	}
+	for (r=0; r<nch; r++)
+		for (k=0; k<nin; k++)
+			w[(size_t)r*nin + k] = w[(size_t)r*ndev + srcch[k]];
+
+	retval = set_derivation(dev, nch, nin, srcch, w, labels);
+
+exit:
+	free(w);
+	free(srcch);
+	free(labels);
+	return retval;
 }
 
 
 LOCAL_FN
-struct selected_channels* egdi_alloc_input_groups(struct devmodule* mdev,
-                                                 unsigned int ngrp)
+int egdi_set_input_decoder(struct devmodule* mdev, unsigned int igrp,
+                           egdi_decode_function fn, void* data)
 {
 	struct eegdev* dev = get_eegdev(mdev);
 
-	free(dev->selch);
-	free(dev->inbuffgrp);
-	free(dev->arrconf);
+	if (igrp >= dev->nsel || !dev->seldec)
+		return reterrno(EINVAL);
 
-	// Alloc ringbuffer mapping structures
-	dev->nsel = dev->nconf = dev->ngrp = ngrp;
-	dev->selch = calloc(ngrp,sizeof(*(dev->selch)));
-	dev->inbuffgrp = calloc(ngrp,sizeof(*(dev->inbuffgrp)));
-	dev->arrconf = calloc(ngrp,sizeof(*(dev->arrconf)));
-	if (!dev->selch || !dev->inbuffgrp || !dev->arrconf)
-		return NULL;
-	
-	return dev->selch;
+	dev->seldec[igrp].fn = fn;
+	dev->seldec[igrp].data = fn ? data : NULL;
+	return 0;
 }
 
 
 LOCAL_FN
-void egdi_set_input_samlen(struct devmodule* mdev, unsigned int samlen)
+struct selected_channels* egdi_split_input_groups(struct devmodule* mdev,
+                                                  unsigned int ngrp,
+                                                  const struct grpconf* grp,
+                                                  unsigned int* nsel)
 {
-	get_eegdev(mdev)->in_samlen = samlen;
+	struct eegdev* dev = get_eegdev(mdev);
+
+	if (egdi_split_alloc_chgroups(dev, ngrp, grp))
+		return NULL;
+
+	*nsel = dev->nsel;
+	return dev->selch;
 }
 
 /*******************************************************************
@@ -829,10 +2853,16 @@ int egd_get_numch(const struct eegdev* dev, int stype)
  *   hold 128 characters (including the null termination character).
  *
  * EGD_PREFILTERING ( char * )
- *   Information about the filters already applied on data. The pointed array
+ *   Information about the filters already applied on data, including those
+ *   applied by the library if set in the configuration. The pointed array
  *   should be long enough to hold 128 characters (including the null
  *   termination character).
  *
+ * EGD_FS ( unsigned int * )
+ *   Sampling frequency of the channel. Some devices sample some channels at
+ *   a rate lower than the one returned by egd_get_cap() with EGD_CAP_FS. See
+ *   egd_acq_setup() for the constraints on those channels.
+ *
  * egd_channel_info() is thread-safe.
  *
  * Return:
@@ -851,9 +2881,11 @@ int egd_channel_info(const struct eegdev* dev, int stype,
 {
 	va_list ap;
 	int field, itype, retval = 0;
+	unsigned int fs;
 	void* arg;
 	struct egdi_signal_info sinfo = {.unit = NULL};
 	struct egdi_chinfo chinfo = {.si = &sinfo};
+	char filtstr[EGD_PREFILTERING_LEN];
 	mm_thr_mutex_t* apilock = (mm_thr_mutex_t*)&(dev->apilock);
 
 	// Argument validation
@@ -865,9 +2897,17 @@ int egd_channel_info(const struct eegdev* dev, int stype,
 	mm_thr_mutex_lock(apilock);
 
 	// Get channel info from the backend
-	egdi_default_fill_chinfo(dev, stype, index, &chinfo, &sinfo);
-	if (dev->ops.fill_chinfo)
-		dev->ops.fill_chinfo(&dev->module, stype, index, &chinfo, &sinfo);
+	if (is_derived_type(dev, stype))
+		fill_derived_chinfo(dev, index, &chinfo, &sinfo);
+	else {
+		egdi_default_fill_chinfo(dev, stype, index, &chinfo, &sinfo);
+		if (dev->ops.fill_chinfo)
+			dev->ops.fill_chinfo(&dev->module, stype, index,
+			                     &chinfo, &sinfo);
+	}
+	fs = dev->cap.sampling_freq / get_channel_div(dev, stype, index);
+	if (!sinfo.isint)
+		append_filter_info(dev, &sinfo, fs, filtstr);
 
 	// field parsing
 	va_start(ap, fieldtype);
@@ -878,7 +2918,7 @@ int egd_channel_info(const struct eegdev* dev, int stype,
 			retval = reterrno(EINVAL);
 			break;
 		}
-		retval = get_field_info(&chinfo, index, field, arg);
+		retval = get_field_info(&chinfo, index, field, fs, arg);
 		field = va_arg(ap, int);
 	}
 	va_end(ap);
@@ -918,6 +2958,11 @@ int egd_close(struct eegdev* dev)
 	if (acquiring)
 		egd_stop(dev);
 
+	// The data still queued may be decoded by the plugin: it must be
+	// processed before the device is closed and the plugin unloaded
+	egdi_stop_staging(dev->staging);
+	egdi_stop_worker_pool(dev->workers);
+
 	dev->ops.close_device(&dev->module);
 	mm_dlclose(dev->handle);
 	egd_destroy_eegdev(dev);
@@ -980,7 +3025,20 @@ int egd_close(struct eegdev* dev)
  *
  * - datatype specifies the type of data that must be written to the
  *   buffer. It must be one of the following value: EGD_INT32,
- *   EGD_FLOAT or EGD_DOUBLE.
+ *   EGD_FLOAT, EGD_DOUBLE, EGD_INT16, EGD_FLOAT16 (IEEE 754 half
+ *   precision), EGD_UINT8 or EGD_UINT16. The values of the narrow types
+ *   (the last four) are computed in single precision and rounded to the
+ *   nearest, the integer types saturating at the bounds of their range.
+ *
+ * Some devices sample some of their channels at a rate lower than the
+ * device sampling frequency (see EGD_FS in egd_channel_info()). Those
+ * channels are provided at their native rate: all the channels of a group
+ * and all the groups of an array must then share the same sampling
+ * frequency. The stride of such an array is the size between two
+ * successive samples at this lower rate.
+ *
+ * All the arrays are set up with the sample-major layout. Use
+ * egd_array_config() after egd_acq_setup() to change it.
  *
  * egd_acq_setup() is thread-safe.
  *
@@ -990,7 +3048,8 @@ int egd_close(struct eegdev* dev)
  *
  * Errors:
  * EINVAL
- *   @dev is NULL.
+ *   @dev is NULL, or a group or an array mixes channels sampled at different
+ *   rates.
  *
  * EPERM
  *   The acquisition is running
@@ -1003,7 +3062,11 @@ int egd_acq_setup(struct eegdev* dev,
                   unsigned int narr, const size_t *strides,
 		  unsigned int ngrp, const struct grpconf *grp)
 {
+	unsigned int i, ndevgrp;
 	int acquiring, ret, retval = -1;
+	struct ringbuffer* rb;
+	struct grpconf* devgrp = NULL;
+	struct derivation* prevdv;
 
 	if (!dev || (ngrp && !grp) || (narr && !strides)) 
 		return reterrno(EINVAL);
@@ -1015,14 +3078,21 @@ int egd_acq_setup(struct eegdev* dev,
 		return reterrno(EPERM);
 
 	mm_thr_mutex_lock(&(dev->apilock));
+	prevdv = dev->rings[0].deriv;
 
-	if (validate_groups_settings(dev, ngrp, grp))
+	if (validate_groups_settings(dev, narr, ngrp, grp)
+	   || setup_derived_groups(dev, narr, ngrp, grp, &devgrp, &ndevgrp))
 		goto out;
 	
 	// Alloc transfer configuration structs
+	for (i=0; i<dev->narr; i++)
+		egdi_destroy_resampler(dev->arrlayout[i].rs);
 	free(dev->strides);
+	free(dev->arrlayout);
+	dev->narr = 0;
 	dev->strides = malloc(narr*sizeof(*strides));
-	if ( !dev->strides)
+	dev->arrlayout = calloc(narr, sizeof(*dev->arrlayout));
+	if ( !dev->strides || !dev->arrlayout)
 		goto out;
 
 	// Update arrays details
@@ -1031,9 +3101,10 @@ int egd_acq_setup(struct eegdev* dev,
 
 	// Setup transfer configuration (this call affects ringbuffer size)
 	if (dev->ops.set_channel_groups)
-		ret = dev->ops.set_channel_groups(&dev->module, ngrp, grp);
+		ret = dev->ops.set_channel_groups(&dev->module,
+		                                  ndevgrp, devgrp);
 	else
-		ret = egdi_split_alloc_chgroups(dev, ngrp, grp);
+		ret = egdi_split_alloc_chgroups(dev, ndevgrp, devgrp);
 	if (ret)
 		goto out;
 
@@ -1041,18 +3112,349 @@ int egd_acq_setup(struct eegdev* dev,
 	if (retval < 0)
 		goto out;
 
-	// Alloc ringbuffer
-	free(dev->buffer);
-	dev->buff_ns = BUFF_SIZE*dev->cap.sampling_freq;
-	dev->buffsize = BUFF_SIZE*dev->cap.sampling_freq * dev->buff_samlen;
-	dev->buffer = malloc(dev->buffsize);
-	if (!dev->buffer)
-		goto out;
+	// Alloc ringbuffers
+	retval = -1;
+	for (i=0; i<dev->nring; i++) {
+		rb = dev->rings + i;
+		egdi_destroy_bandpower(rb->bp);
+		rb->bp = NULL;
+		free(rb->buffer);
+		rb->buff_ns = BUFF_SIZE*dev->cap.sampling_freq / rb->div;
+		rb->buffsize = rb->buff_ns * rb->buff_samlen;
+		rb->buffer = NULL;
+		rb->ind = rb->last_read = 0;
+		rb->hist_ns = 0;
+		if ((rb->buffsize && !(rb->buffer = malloc(rb->buffsize)))
+		   || setup_ring_filter(dev, rb)
+		   || setup_ring_quality(dev, rb)
+		   || (i == 0 && setup_ring_bandpower(dev, rb))
+		   || (i == 0 && setup_ring_stages(dev, rb)))
+			goto out;
+	}
 	
 	retval = 0;
 
 out:
+	release_derivation(dev, prevdv);
+	free(devgrp);
+	mm_thr_mutex_unlock(&(dev->apilock));
+	return retval;
+}
+
+
+/**
+ * egd_array_config() - sets the layout of an array
+ * @dev: reference to the device that provide data
+ * @iarray: index of the array to configure
+ * @fieldtype: first field to set (followed by its value)
+ *
+ * egd_array_config() changes the way data is written in the array of
+ * index @iarray supplied to egd_get_data(). The configuration is specified
+ * by a list of pairs made of a field identifier and its value, terminated
+ * by EGD_EOL. The supported fields are:
+ *
+ * EGD_ARR_LAYOUT
+ *   (int) layout of the array: EGD_SAMPLE_MAJOR (default) or
+ *   EGD_CHANNEL_MAJOR.
+ *
+ * EGD_ARR_CHSTRIDE
+ *   (size_t) size in bytes between the data of two successive channels in
+ *   a channel-major array.
+ *
+ * EGD_ARR_RATE
+ *   (unsigned int) sampling rate in Hz of the data written in the array,
+ *   or 0 (default) to get the channels at their own rate.
+ *
+ * In a sample-major (interleaved) array, the data of the channel k of a
+ * group for the sample s is located at arr_offset + s*stride + k*tsize
+ * where stride is the value passed to egd_acq_setup() and tsize the size
+ * of the group's data type. In a channel-major (planar) array, it is
+ * located at (arr_offset/tsize + k)*chstride + s*tsize: arr_offset
+ * specifies then the row of the first channel of the group and each
+ * channel row holds the successive samples. The channel stride must be
+ * big enough to hold the number of samples requested in each call to
+ * egd_get_data(). The transposition is performed while copying data from
+ * the internal buffer, hence no separate pass is needed.
+ *
+ * If a rate is set, the channels of the array are converted to it by a
+ * polyphase low-pass filter while being copied: the groups of the array
+ * must then all be of type EGD_FLOAT or EGD_DOUBLE and sampled at the same
+ * rate fs. Since the filter only uses the past samples, the output is
+ * delayed by about 27 samples at the lowest of the two rates. A read of
+ * @ns samples following ns_read samples already read writes
+ * ceil((ns_read+@ns)*rate/fs) - ceil(ns_read*rate/fs) samples in the
+ * array. The same channels can be written in several arrays at different
+ * rates by listing them in several groups.
+ *
+ * The configuration of all arrays is reset to sample-major by
+ * egd_acq_setup(), so egd_array_config() must be called after it.
+ *
+ * egd_array_config() is thread-safe.
+ *
+ * Return:
+ * The function returns 0 in case of success. Otherwise, -1 is returned
+ * and errno is set accordingly.
+ *
+ * Errors:
+ * EINVAL
+ *   @dev is NULL, @iarray is not an array set by egd_acq_setup(), a field
+ *   or its value is invalid, a channel-major layout is requested with a
+ *   null channel stride, the offset of a group in the array is not a
+ *   multiple of the size of its data type, or the array cannot be
+ *   resampled to the requested rate.
+ *
+ * EPERM
+ *   The acquisition is running
+ */
+API_EXPORTED
+int egd_array_config(struct eegdev* dev, unsigned int iarray,
+                     int fieldtype, ...)
+{
+	va_list ap;
+	int field, retval = 0, acquiring;
+	unsigned int i, r, rate;
+	struct array_layout lay;
+	const struct ringbuffer* rb;
+
+	if (!dev)
+		return reterrno(EINVAL);
+
+	mm_thr_mutex_lock(&(dev->synclock));
+	acquiring = dev->acquiring;
+	mm_thr_mutex_unlock(&(dev->synclock));
+	if (acquiring)
+		return reterrno(EPERM);
+
+	mm_thr_mutex_lock(&(dev->apilock));
+
+	if (iarray >= dev->narr) {
+		retval = reterrno(EINVAL);
+		goto out;
+	}
+
+	// field parsing
+	lay = dev->arrlayout[iarray];
+	rate = lay.rate;
+	va_start(ap, fieldtype);
+	field = fieldtype;
+	while (field != EGD_EOL) {
+		if (field == EGD_ARR_LAYOUT) {
+			lay.layout = va_arg(ap, int);
+			if (lay.layout != EGD_SAMPLE_MAJOR
+			   && lay.layout != EGD_CHANNEL_MAJOR)
+				retval = -1;
+		} else if (field == EGD_ARR_CHSTRIDE) {
+			lay.chstride = va_arg(ap, size_t);
+		} else if (field == EGD_ARR_RATE) {
+			rate = va_arg(ap, unsigned int);
+		} else
+			retval = -1;
+
+		if (retval)
+			break;
+		field = va_arg(ap, int);
+	}
+	va_end(ap);
+
+	// Validate the settings against the groups written in the array
+	if (!retval && lay.layout == EGD_CHANNEL_MAJOR) {
+		if (!lay.chstride)
+			retval = -1;
+		for (r=0; r<dev->nring && !retval; r++) {
+			rb = dev->rings + r;
+			for (i=0; i<rb->nconf; i++)
+				if (rb->arrconf[i].iarray == iarray
+				  && rb->arrconf[i].arr_offset
+				                % rb->arrconf[i].tsize)
+					retval = -1;
+		}
+	}
+	if (retval) {
+		retval = reterrno(EINVAL);
+		goto out;
+	}
+
+	// Update the resampler then the transfer plan
+	if (rate != lay.rate) {
+		if ((retval = setup_array_rate(dev, iarray, rate)))
+			goto out;
+		lay.rate = rate;
+		lay.rs = dev->arrlayout[iarray].rs;
+	}
+	dev->arrlayout[iarray] = lay;
+	for (r=0; r<dev->nring; r++)
+		select_copy_functions(dev, dev->rings + r);
+
+out:
+	mm_thr_mutex_unlock(&(dev->apilock));
+	return retval;
+}
+
+
+/**
+ * egd_set_derivation() - defines channels derived from the device channels
+ * @dev: reference to a device
+ * @stype: type of the input channels
+ * @index: index of the first input channel
+ * @nin: number of input channels
+ * @nout: number of derived channels
+ * @weights: array of @nout x @nin weights (row-major)
+ * @labels: array of @nout labels of the derived channels (can be NULL)
+ *
+ * egd_set_derivation() replaces the derived channels of the device
+ * referenced by @dev by @nout channels computed as linear combinations of
+ * the @nin consecutive channels of type @stype starting at @index. The
+ * derived channel r is the sum over k of @weights[r*@nin + k] times the
+ * channel @index+k. This covers the re-referencing of signals: common
+ * average, bipolar derivations or surface Laplacian. If @nout is 0, the
+ * derived channels are removed. They can also be defined in the
+ * configuration (see the derivation setting in eegdev-open-options(5)).
+ *
+ * The derived channels are provided as channels of the sensor type
+ * returned by egd_sensor_type("derived"): they are selected in the groups
+ * passed to egd_acq_setup() like the channels of the device and their
+ * information is returned by egd_channel_info() (its label is the one in
+ * @labels or "derived:r" if NULL). They are computed once per sample in
+ * double precision when the data is received, after the filters set in the
+ * configuration have been applied to the inputs. The groups of derived
+ * channels must all have the same type, EGD_FLOAT or EGD_DOUBLE, which is
+ * also the type in which the inputs are stored to compute them.
+ *
+ * The new derived channels are used by the next call to egd_acq_setup():
+ * an acquisition set up before keeps the previous ones. Since the number
+ * of channels of each type may change, the list of types previously
+ * returned by egd_get_cap() with EGD_CAP_TYPELIST must not be used anymore.
+ *
+ * egd_set_derivation() is thread-safe.
+ *
+ * Return:
+ * The function returns 0 in case of success. Otherwise, -1 is returned
+ * and errno is set accordingly.
+ *
+ * Errors:
+ * EINVAL
+ *   @dev is NULL, @stype is not a type of the device, the input channels
+ *   exceed the number of channels of this type or are not sampled at the
+ *   device sampling frequency, @nin is 0 or @weights is NULL while @nout is
+ *   not 0.
+ *
+ * EPERM
+ *   The acquisition is running
+ */
+API_EXPORTED
+int egd_set_derivation(struct eegdev* dev, int stype, unsigned int index,
+                       unsigned int nin, unsigned int nout,
+                       const double* weights, const char* const* labels)
+{
+	unsigned int i, k = 0, ich = 0;
+	unsigned int* srcch;
+	int itype, acquiring, retval;
+
+	if (!dev || (nout && (!nin || !weights)))
+		return reterrno(EINVAL);
+
+	mm_thr_mutex_lock(&(dev->synclock));
+	acquiring = dev->acquiring;
+	mm_thr_mutex_unlock(&(dev->synclock));
+	if (acquiring)
+		return reterrno(EPERM);
+
+	mm_thr_mutex_lock(&(dev->apilock));
+
+	if (!nout) {
+		retval = set_derivation(dev, 0, 0, NULL, NULL, NULL);
+		goto out;
+	}
+
+	itype = get_device_sensorindex(dev, stype);
+	if (itype < 0 || is_derived_type(dev, stype)
+	   || (int)(index+nin) > dev->type_nch[itype]) {
+		retval = reterrno(EINVAL);
+		goto out;
+	}
+
+	if (!(srcch = malloc(nin*sizeof(*srcch)))) {
+		retval = -1;
+		goto out;
+	}
+	for (i=0; i<dev->cap.nch && k<nin; i++)
+		if (dev->cap.chmap[i].stype == stype && ich++ >= index)
+			srcch[k++] = i;
+
+	retval = set_derivation(dev, nout, nin, srcch, weights, labels);
+	free(srcch);
+
+out:
+	mm_thr_mutex_unlock(&(dev->apilock));
+	return retval;
+}
+
+
+/**
+ * egd_add_stage() - adds a processing stage to the data path
+ * @dev: reference to a device
+ * @stage: callbacks of the stage (see eegdev.h)
+ * @data: pointer passed to the callbacks of @stage
+ *
+ * egd_add_stage() appends a processing stage to those run on the data of
+ * the device referenced by @dev. The stages operate in place on the
+ * samples of the internal ring buffer of the channels sampled at the
+ * device rate, in the order they have been added, as soon as the samples
+ * are received and before they are made available to egd_get_data(). This
+ * lets custom filters, detectors or feature extractors run on the data
+ * while it is hot in cache, without reading it with egd_get_data().
+ *
+ * @stage is copied. Its setup() callback is called by the next call to
+ * egd_acq_setup() with the location of the selected channels in the
+ * samples of the ring buffer, its process() callback is then called with
+ * each block of samples received and its teardown() callback when the
+ * device is closed or reconfigured. The stages stay until the device is
+ * closed.
+ *
+ * egd_add_stage() is thread-safe.
+ *
+ * Return:
+ * The function returns 0 in case of success. Otherwise, -1 is returned
+ * and errno is set accordingly.
+ *
+ * Errors:
+ * EINVAL
+ *   @dev or @stage is NULL, or @stage has no setup() or process()
+ *   callback
+ *
+ * ENOMEM
+ *   Not enough memory is available
+ *
+ * EPERM
+ *   The acquisition is running
+ */
+API_EXPORTED
+int egd_add_stage(struct eegdev* dev, const struct egd_stage* stage,
+                  void* data)
+{
+	struct stage_entry* stages;
+	int acquiring, retval = -1;
+
+	if (!dev || !stage || !stage->setup || !stage->process)
+		return reterrno(EINVAL);
+
+	mm_thr_mutex_lock(&(dev->synclock));
+	acquiring = dev->acquiring;
+	mm_thr_mutex_unlock(&(dev->synclock));
+	if (acquiring)
+		return reterrno(EPERM);
+
+	mm_thr_mutex_lock(&(dev->apilock));
+	stages = realloc(dev->stages, (dev->nstage+1)*sizeof(*stages));
+	if (stages) {
+		dev->stages = stages;
+		stages[dev->nstage].ops = *stage;
+		stages[dev->nstage].data = data;
+		stages[dev->nstage++].ready = 0;
+		retval = 0;
+	}
 	mm_thr_mutex_unlock(&(dev->apilock));
+
 	return retval;
 }
 
@@ -1074,7 +3476,15 @@ out:
  * the formats specified by previous call to egd_acq_setup(). In
  * particular, the number of arrays supplied in the variable list of argument
  * and their size should be consistent with the number of arrays and strides
- * specified by the call to egd_acq_setup().
+ * specified by the call to egd_acq_setup() (and egd_array_config() for
+ * channel-major arrays).
+ *
+ * @ns and the return value are expressed in samples at the device sampling
+ * frequency. The arrays holding channels sampled at a lower rate (i.e. at
+ * fs/d) receive only the samples falling in the period read: the k-th
+ * sample of those channels is located at the sample k*d of the device.
+ * Hence, if @ns and all the previous reads are multiple of d, exactly
+ * @ns/d samples are written in those arrays.
  *
  * Please be aware that the user has no obligation to make all the calls to
  * egd_get_data() during the acquisition. He can also perform some of them
@@ -1172,11 +3582,11 @@ ssize_t egd_get_data(struct eegdev* dev, size_t ns, ...)
 	if (!dev)
 		return reterrno(EINVAL);
 
-	unsigned int i, s, iarr, curr_s = dev->last_read;
-	struct array_config* restrict ac = dev->arrconf;
-	char* restrict ringbuffer = dev->buffer;
+	unsigned int i, r;
+	unsigned long first, last;
+	struct ringbuffer* rb;
 	unsigned int narr = dev->narr;
-	char* restrict buffout[narr];
+	char* buffout[narr];
 	va_list ap;
 	int error;
 
@@ -1192,18 +3602,18 @@ ssize_t egd_get_data(struct eegdev* dev, size_t ns, ...)
 	if ((ns == 0) && error)
 		return reterrno(error);
 
-	// Copy data from ringbuffer to arrays
-	for (s=0; s<ns; s++) {
-		for (i=0; i<dev->nconf; i++) {
-			iarr = ac[i].iarray;
-			memcpy(buffout[iarr] + ac[i].arr_offset,
-			       ringbuffer + curr_s + ac[i].buff_offset,
-			       ac[i].len);
-		}
+	// Copy data from ringbuffers to arrays
+	for (r=0; r<dev->nring; r++) {
+		rb = dev->rings + r;
+		if (!rb->nconf)
+			continue;
 
-		curr_s = (curr_s + dev->buff_samlen) % dev->buffsize;
-		for (i=0; i<narr; i++)
-			buffout[i] += dev->strides[i];
+		// Samples of the ring falling in [ns_read, ns_read+ns)
+		first = (dev->ns_read + rb->div - 1) / rb->div;
+		last = (dev->ns_read + ns + rb->div - 1) / rb->div;
+		resample_ring(dev, rb, buffout, rb->last_read, first, last);
+		rb->last_read = copy_samples_par(dev, rb, buffout,
+		                                 rb->last_read, last - first);
 	}
 
 	// Update the reading status
@@ -1211,7 +3621,6 @@ ssize_t egd_get_data(struct eegdev* dev, size_t ns, ...)
 	dev->ns_read += ns;
 	mm_thr_mutex_unlock(&(dev->synclock));
 
-	dev->last_read = curr_s;
 	return ns;
 }
 
@@ -1277,6 +3686,128 @@ ssize_t egd_get_available(struct eegdev* dev)
 }
 
 
+/**
+ * egd_get_quality() - gets the signal-quality statistics of channels
+ * @dev: pointer to a device
+ * @stype: type of the channels whose statistics are retrieved
+ * @quality: array receiving the statistics of each channel of @stype
+ *
+ * egd_get_quality() writes in @quality the statistics of the channels of
+ * type @stype of the device referenced by @dev, the element i holding
+ * those of the channel of index i (@quality must have as many elements as
+ * reported by egd_get_numch()). The statistics are computed by the library
+ * while the data is acquired, over successive windows whose duration is
+ * set by the quality_window setting (see eegdev-open-options(5)). They
+ * are the ones of the last complete window and are made of the following
+ * fields of struct egd_quality:
+ *
+ * rms
+ *   root mean square of the deviation of the values from @dc
+ *
+ * dc
+ *   mean of the values
+ *
+ * nsat
+ *   number of values equal to or beyond the minimum or maximum value of
+ *   the channel (as reported by egd_channel_info())
+ *
+ * flat
+ *   non-zero if all the values of the window are equal
+ *
+ * ns
+ *   number of samples of the window, 0 if no window has been completed
+ *   since the start of the acquisition or if the channel is not monitored
+ *
+ * The statistics are computed before the filters of the library are
+ * applied. Only the channels selected by egd_acq_setup() that do not
+ * carry integer values and are acquired as EGD_FLOAT or EGD_DOUBLE are
+ * monitored.
+ *
+ * Return:
+ * 0 in case of success, otherwise -1 and errno is set accordingly.
+ *
+ * Errors:
+ * EINVAL
+ *   @dev or @quality is NULL
+ */
+API_EXPORTED
+int egd_get_quality(struct eegdev* dev, int stype,
+                    struct egd_quality* quality)
+{
+	unsigned int i;
+	int nch;
+
+	if (!dev || !quality)
+		return reterrno(EINVAL);
+
+	mm_thr_mutex_lock(&(dev->apilock));
+	nch = egd_get_numch(dev, stype);
+	memset(quality, 0, nch*sizeof(*quality));
+	for (i=0; i<dev->nring; i++)
+		if (dev->rings[i].qual)
+			egdi_read_quality(dev->rings[i].qual, stype, quality);
+	mm_thr_mutex_unlock(&(dev->apilock));
+
+	return 0;
+}
+
+
+/**
+ * egd_get_bandpower() - gets the power of channels in frequency bands
+ * @dev: pointer to a device
+ * @stype: type of the channels whose band power is retrieved
+ * @logpow: array receiving the band power of each channel of @stype
+ *
+ * egd_get_bandpower() writes in @logpow the natural logarithm of the power
+ * of the channels of type @stype of the device referenced by @dev in each
+ * frequency band set by the bandpower_bands setting (see
+ * eegdev-open-options(5)). @logpow must have as many elements as the
+ * number of channels reported by egd_get_numch() times the number of
+ * bands, the element i*nband+j holding the power of the channel of index
+ * i in the band j.
+ *
+ * The power is computed by the library while the data is acquired, over a
+ * Hann-weighted window of samples whose duration is set by the
+ * bandpower_window setting, a new window being processed every
+ * bandpower_step seconds. The values written are those of the last window
+ * processed. Only the channels acquired at the sampling rate of the device
+ * that are monitored by egd_get_quality() and the derived channels are
+ * processed, the values of the other channels being set to NAN. The power
+ * is computed after the filters of the library are applied.
+ *
+ * Return:
+ * the number of samples acquired since the start of the acquisition at the
+ * end of the window, 0 if no window has been processed yet (in that case
+ * @logpow is filled with NAN). In case of failure, -1 is returned and errno
+ * is set accordingly.
+ *
+ * Errors:
+ * EINVAL
+ *   @dev or @logpow is NULL
+ */
+API_EXPORTED
+ssize_t egd_get_bandpower(struct eegdev* dev, int stype, double* logpow)
+{
+	unsigned int i, nval;
+	size_t ns = 0;
+	int nch;
+
+	if (!dev || !logpow)
+		return reterrno(EINVAL);
+
+	mm_thr_mutex_lock(&(dev->apilock));
+	nch = egd_get_numch(dev, stype);
+	nval = (nch > 0 ? nch : 0) * dev->bpspec.nband;
+	for (i=0; i<nval; i++)
+		logpow[i] = NAN;
+	if (dev->rings[0].bp)
+		ns = egdi_read_bandpower(dev->rings[0].bp, stype, logpow);
+	mm_thr_mutex_unlock(&(dev->apilock));
+
+	return ns;
+}
+
+
 /**
  * egd_start() - starts buffered acquisition
  * @dev: pointer to a device
@@ -1299,6 +3830,7 @@ ssize_t egd_get_available(struct eegdev* dev)
 API_EXPORTED
 int egd_start(struct eegdev* dev)
 {
+	unsigned int i;
 	int acquiring;
 
 	if (!dev)
@@ -1312,6 +3844,10 @@ int egd_start(struct eegdev* dev)
 	
 	mm_thr_mutex_lock(&(dev->synclock));
 	dev->ns_read = dev->ns_written = 0;
+	for (i=0; i<dev->nring; i++) {
+		dev->rings[i].ns_written = 0;
+		dev->rings[i].state = RING_WAITING;
+	}
 	dev->ops.start_acq(&dev->module);
 
 	dev->acq_order = EGD_ORDER_START;
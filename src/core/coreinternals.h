@@ -29,6 +29,11 @@
 #define EGD_ORDER_START	1
 #define EGD_ORDER_STOP	2
 
+// States of a ring buffer regarding the acquisition start
+#define RING_WAITING	0	// wait for the device-rate ring to start
+#define RING_STARTING	1	// realign on the next input sample
+#define RING_RUNNING	2
+
 #define EGD_LABEL_LEN		32
 #define EGD_UNIT_LEN		16
 #define EGD_TRANSDUCER_LEN	128
@@ -40,9 +45,21 @@ LOCAL_FN void egd_destroy_eegdev(struct eegdev* dev);
 LOCAL_FN struct eegdev* egdi_create_eegdev(const struct egdi_plugin_info* info);
 
 LOCAL_FN int egdi_update_ringbuffer(struct devmodule* mdev, const void* in, size_t length);
+LOCAL_FN int egdi_update_subring(struct devmodule* mdev, unsigned int div, const void* in, size_t length);
 LOCAL_FN void egdi_report_error(struct devmodule* mdev, int error);
 LOCAL_FN struct selected_channels* egdi_alloc_input_groups(struct devmodule* mdev, unsigned int ngrp);
 LOCAL_FN void egdi_set_input_samlen(struct devmodule* mdev, unsigned int samlen);
+LOCAL_FN int egdi_set_input_decoder(struct devmodule* mdev, unsigned int igrp,
+                                    egdi_decode_function fn, void* data);
+LOCAL_FN struct selected_channels* egdi_split_input_groups(
+                                    struct devmodule* mdev, unsigned int ngrp,
+                                    const struct grpconf* grp,
+                                    unsigned int* nsel);
+LOCAL_FN int egdi_set_input_producers(struct devmodule* mdev, unsigned int nprod,
+                                    const struct egdi_input_column* cols);
+LOCAL_FN int egdi_update_ringbuffer_column(struct devmodule* mdev,
+                                    unsigned int iprod,
+                                    const void* in, size_t length);
 LOCAL_FN const char* egdi_getopt(const char* opt, const char* def, const char* optv[]);
 LOCAL_FN int egdi_split_alloc_chgroups(struct eegdev* dev,
                               unsigned int ngrp, const struct grpconf* grp);
@@ -52,16 +69,222 @@ LOCAL_FN void egdi_default_fill_chinfo(const struct eegdev*, int,
 ((type == EGD_INT32) ? gval.valint32_t : 			\
 	(type == EGD_FLOAT ? gval.valfloat : gval.valdouble))
 
+// Cast and scale ns blocks of len bytes (size of the input data) located
+// every sstride bytes in the source into blocks located every dstride bytes
+// in the destination
 typedef void (*cast_function)(void* restrict, const void* restrict,
-                              union gval, size_t);
+                              union gval, size_t len, size_t ns,
+                              size_t dstride, size_t sstride);
 
 LOCAL_FN
 cast_function egd_get_cast_fn(unsigned int intypes, unsigned int outtype,
                               unsigned int scaling);
+
+// Per-channel transform applied while casting. The channel k is computed
+// as sc[k]*in[k] + off[k] (sc and off being arrays of output type). For
+// integer input, in[k] is replaced by ((uint32_t)in[k] & mask) >> shift
+struct cast_xform {
+	const void* sc;
+	const void* off;
+	uint32_t mask;
+	unsigned int shift;
+};
+
+// Same as cast_function with a per-channel transform
+typedef void (*xform_function)(void* restrict, const void* restrict,
+                               const struct cast_xform*, size_t len,
+                               size_t ns, size_t dstride, size_t sstride);
+
+LOCAL_FN
+xform_function egdi_get_xform_fn(unsigned int intype, unsigned int outtype);
+
+// Instruction sets for which cast functions are implemented. They are
+// sorted by increasing capability
+#define EGDI_ISA_SCALAR	0
+#define EGDI_ISA_SSE2	1
+#define EGDI_ISA_AVX2	2
+#define EGDI_ISA_AVX512	3
+#define EGDI_NUM_ISA	4
+
+LOCAL_FN
+cast_function egdi_get_cast_fn_isa(unsigned int intypes, unsigned int outtype,
+                                   unsigned int scaling, int isa);
+// Copy ns blocks of len bytes located every sstride bytes in the source
+// into blocks located every dstride bytes in the destination
+typedef void (*copy_function)(char* restrict, const char* restrict,
+                              size_t len, size_t ns,
+                              size_t dstride, size_t sstride);
+
+LOCAL_FN
+copy_function egdi_get_copy_fn(size_t len, size_t dstride, size_t sstride);
+LOCAL_FN
+copy_function egdi_get_transpose_fn(size_t tsize);
 LOCAL_FN
 const struct egdi_chinfo* egdi_get_conf_mapping(struct devmodule* mdev,
                                                const char* name, int* pnch);
 
+// Pool of worker threads running jobs split in parts (see workers.c). A
+// job function processes the part ipart out of npart.
+struct worker_pool;
+typedef void (*job_function)(void* arg, unsigned int ipart,
+                             unsigned int npart);
+LOCAL_FN struct worker_pool* egdi_create_worker_pool(unsigned int nworker);
+LOCAL_FN void egdi_stop_worker_pool(struct worker_pool* pool);
+LOCAL_FN void egdi_destroy_worker_pool(struct worker_pool* pool);
+LOCAL_FN void egdi_run_job(struct worker_pool* pool, job_function fn,
+                           void* arg);
+LOCAL_FN int egdi_setup_workers(struct eegdev* dev, unsigned int nworker,
+                                size_t minsize);
+
+// Queue of raw input data cast by a dedicated thread (see staging.c). The
+// staging function receives the data in the order they have been staged.
+struct staging_queue;
+typedef void (*staging_function)(void* arg, unsigned int div,
+                                 const void* in, size_t len);
+LOCAL_FN struct staging_queue* egdi_create_staging(size_t size,
+                                          staging_function fn, void* arg);
+LOCAL_FN void egdi_stop_staging(struct staging_queue* sq);
+LOCAL_FN void egdi_destroy_staging(struct staging_queue* sq);
+LOCAL_FN int egdi_stage_data(struct staging_queue* sq, unsigned int div,
+                             const void* in, size_t len);
+LOCAL_FN int egdi_setup_staging(struct eegdev* dev, size_t size);
+
+// Polyphase resampler (see resample.c). The input of egdi_resample() are
+// the nch channels located at offset in the samples of a ring, the sample
+// of index first being at the position pos_first.
+struct resampler;
+struct resample_src {
+	const char* buffer;
+	size_t buffsize, samlen, offset, pos_first;
+	uint64_t first;
+	unsigned int nch;
+};
+LOCAL_FN struct resampler* egdi_create_resampler(unsigned int up,
+                                                 unsigned int down);
+LOCAL_FN void egdi_destroy_resampler(struct resampler* rs);
+LOCAL_FN unsigned int egdi_get_resampler_history(const struct resampler* rs);
+LOCAL_FN uint64_t egdi_get_resampled_index(const struct resampler* rs,
+                                           uint64_t n);
+LOCAL_FN void egdi_resample(const struct resampler* rs, int type,
+                            const struct resample_src* src, char* dst,
+                            size_t samstride, size_t elstride,
+                            uint64_t j, size_t nout);
+
+// Bank of biquad filters applied in place in a ring (see filter.c). The
+// frequencies are in Hz (0 if the filter is not used) and order is the
+// order of the high-pass and low-pass filters. A span is a run of nch
+// channels of type EGD_FLOAT or EGD_DOUBLE located at offset in the
+// samples of the ring.
+struct filter_spec {
+	double hp, lp, notch;
+	unsigned int order;
+};
+struct filter_span {
+	unsigned int offset, nch;
+	int type;
+};
+struct filter_bank;
+LOCAL_FN unsigned int egdi_get_filter_nsec(const struct filter_spec* spec,
+                                           double fs);
+LOCAL_FN struct filter_bank* egdi_create_filter_bank(
+                                const struct filter_spec* spec, double fs,
+                                unsigned int nspan,
+                                const struct filter_span* spans);
+LOCAL_FN void egdi_destroy_filter_bank(struct filter_bank* fb);
+LOCAL_FN void egdi_filter_samples(struct filter_bank* fb, char* buffer,
+                                  size_t buffsize, size_t samlen,
+                                  size_t ind, size_t ns, int prime,
+                                  unsigned int ipart, unsigned int npart);
+LOCAL_FN int egdi_format_filter_spec(const struct filter_spec* spec,
+                                     double fs, char* str, size_t len);
+LOCAL_FN int egdi_setup_filter(struct eegdev* dev,
+                               const struct filter_spec* spec);
+
+// Derived channels computed in the device-rate ring (see derive.c). The
+// channel r is the sum over k of w[r*nin + k] times the input k, which is
+// the channel srcch[k] of the channel map. In the samples of the ring, the
+// inputs are located at src_offset[k] and the nout derived channels from
+// dst_offset, all of them being of type (EGD_FLOAT or EGD_DOUBLE).
+struct derivation;
+typedef void (*derive_function)(const struct derivation* dv,
+                                const double* restrict x,
+                                double* restrict y);
+struct derivation {
+	unsigned int nin, nout;
+	unsigned int* srcch;
+	char (*labels)[EGD_LABEL_LEN];	// empty if no label
+	double* w;
+	unsigned int *rowptr, *col;	// sparse form of w (if not NULL)
+	double* val;
+	derive_function run_rows;
+
+	// Location in the ring (set by egd_acq_setup())
+	int type;
+	unsigned int dst_offset;
+	unsigned int* src_offset;
+};
+LOCAL_FN struct derivation* egdi_create_derivation(unsigned int nout,
+                                          unsigned int nin,
+                                          const unsigned int* srcch,
+                                          const double* weights,
+                                          const char* const* labels);
+LOCAL_FN void egdi_destroy_derivation(struct derivation* dv);
+LOCAL_FN void egdi_derive_samples(const struct derivation* dv, char* buffer,
+                                  size_t buffsize, size_t samlen,
+                                  size_t ind, size_t ns,
+                                  unsigned int ipart, unsigned int npart);
+LOCAL_FN int egdi_parse_derivation(const char* expr, unsigned int nch,
+                                   const struct egdi_chinfo* chmap,
+                                   const unsigned int* chdiv, double* row);
+LOCAL_FN int egdi_setup_conf_derivation(struct eegdev* dev, unsigned int nch,
+                                        const struct egdi_chinfo* chmap,
+                                        const char* const* exprs);
+
+// Signal-quality statistics of spans of channels of a ring over windows of
+// samples (see quality.c). The spans are made of channels of type
+// EGD_FLOAT or EGD_DOUBLE.
+struct quality_monitor;
+LOCAL_FN struct quality_monitor* egdi_create_quality_monitor(
+                                          unsigned int window,
+                                          unsigned int nspan,
+                                          const struct egd_chspan* spans,
+                                          const double* limits);
+LOCAL_FN void egdi_destroy_quality_monitor(struct quality_monitor* qm);
+LOCAL_FN void egdi_reset_quality(struct quality_monitor* qm);
+LOCAL_FN void egdi_update_quality(struct quality_monitor* qm,
+                                  const char* buffer, size_t buffsize,
+                                  size_t samlen, size_t ind, size_t ns,
+                                  unsigned int ipart, unsigned int npart);
+LOCAL_FN void egdi_advance_quality(struct quality_monitor* qm, size_t ns);
+LOCAL_FN void egdi_read_quality(struct quality_monitor* qm, int stype,
+                                struct egd_quality* quality);
+LOCAL_FN int egdi_setup_quality(struct eegdev* dev, double window);
+
+// Band-power stage computing the log power of spans of channels of a ring
+// in frequency bands over windows of samples (see bandpower.c). The window
+// and the step between windows are in seconds and the bands in Hz.
+#define EGDI_MAX_BANDS	16
+struct bandpower_spec {
+	unsigned int nband;
+	double lo[EGDI_MAX_BANDS], hi[EGDI_MAX_BANDS];
+	double window, step;
+};
+struct bandpower;
+LOCAL_FN struct bandpower* egdi_create_bandpower(
+                                        const struct bandpower_spec* spec,
+                                        double fs, unsigned int nspan,
+                                        const struct egd_chspan* spans,
+                                        const char* buffer, size_t buffsize,
+                                        size_t samlen);
+LOCAL_FN void egdi_destroy_bandpower(struct bandpower* bp);
+LOCAL_FN void egdi_reserve_bandpower(struct bandpower* bp, size_t ns);
+LOCAL_FN void egdi_update_bandpower(struct bandpower* bp, size_t ns,
+                                    size_t end, int prime);
+LOCAL_FN size_t egdi_read_bandpower(struct bandpower* bp, int stype,
+                                    double* logpow);
+LOCAL_FN int egdi_setup_bandpower(struct eegdev* dev,
+                                  const struct bandpower_spec* spec);
+
 
 struct input_buffer_group {
 	// Computed values
@@ -72,6 +295,26 @@ struct input_buffer_group {
 	int buff_tsize;
 	union gval sc;
 	cast_function cast_fn;
+	xform_function xform_fn;	// if not NULL, used instead of cast_fn
+	struct cast_xform xf;
+	int xf_tsize;	// size of the elements of xf.sc and xf.off
+	// Decode kernel of the plugin, used instead of any of the above
+	egdi_decode_function decode_fn;
+	void* decode_data;
+	const struct selected_channels* sel;
+};
+
+struct input_decoder {
+	egdi_decode_function fn;
+	void* data;
+};
+
+// Producer of a column of the input samples (see
+// egdi_update_ringbuffer_column())
+struct input_producer {
+	unsigned int offset, len;
+	unsigned long ns;	// samples supplied since the producers were set
+	unsigned long claimed;	// end of the samples being written
 };
 
 struct array_config {
@@ -79,6 +322,40 @@ struct array_config {
 	unsigned int arr_offset;
 	unsigned int buff_offset;
 	unsigned int len;
+	unsigned int tsize;
+	int type;
+
+	// Transfer plan: the data of the sample s is copied by copy_fn to
+	// dst_offset + s*dst_samstride, dst_stride being passed to copy_fn
+	size_t dst_offset, dst_samstride, dst_stride;
+	copy_function copy_fn;
+};
+
+struct array_layout {
+	int layout;
+	size_t chstride;
+	unsigned int rate;	// 0 if not resampled
+	struct resampler* rs;
+};
+
+// Ring buffer holding the channels sampled at sampling_freq/div. The ring
+// of index 0 is always the one sampled at the device sampling rate
+struct ringbuffer {
+	unsigned int div;
+	char* buffer;
+	size_t buffsize, in_samlen, buff_samlen, in_offset, buff_ns;
+	unsigned int ind, last_read;
+	unsigned long ns_written;
+	size_t hist_ns;	// samples kept behind the read position
+	int state;
+	struct filter_bank* filt;	// NULL if no channel is filtered
+	struct derivation* deriv;	// NULL if no channel is derived
+	struct quality_monitor* qual;	// NULL if no channel is monitored
+	struct bandpower* bp;		// NULL if no band power is computed
+
+	unsigned int ngrp, nconf;
+	struct input_buffer_group* inbuffgrp;
+	struct array_config* arrconf;
 };
 
 
@@ -152,13 +429,23 @@ struct eegdev_operations {
 
 struct systemcap {
 	unsigned int sampling_freq;
+	int flags;
 	unsigned int nch;
 	const struct egdi_chinfo* chmap;
+	const unsigned int* chdiv;	// NULL if all channels at sampling_freq
 	const char* device_type;
 	const char* device_id;
 };
 
 
+// Processing stage registered by egd_add_stage()
+struct stage_entry {
+	struct egd_stage ops;
+	void* data;
+	int ready;	// set if setup() has succeeded
+};
+
+
 struct eegdev {
 	const struct eegdev_operations ops;
 	struct systemcap cap;
@@ -168,9 +455,9 @@ struct eegdev {
 	void* auxdata;
 	struct conf* cf;
 
-	char* buffer;
-	size_t buffsize, in_samlen, buff_samlen, in_offset, buff_ns;
-	unsigned int ind, last_read, nreadwait;
+	unsigned int nring;
+	struct ringbuffer* rings;
+	unsigned int nreadwait;
 	unsigned long ns_written, ns_read;
 	mm_thr_mutex_t synclock;
 	mm_thr_mutex_t apilock;
@@ -180,11 +467,46 @@ struct eegdev {
 
 	unsigned int narr;
 	size_t *strides;
+	struct array_layout* arrlayout;
 
-	unsigned int ngrp, nsel, nconf;
+	unsigned int nsel;
 	struct input_buffer_group* inbuffgrp;
 	struct selected_channels* selch;
 	struct array_config* arrconf;
+	int* selchmap;	// first channel (in chmap) of selch, -1 if unknown
+	char* xfbuff;	// storage of the per-channel transform arrays
+	struct input_decoder* seldec;	// decode kernels of selch
+
+	// Casts and copies of at least par_minsize bytes are split across
+	// the workers (if any)
+	struct worker_pool* workers;
+	size_t par_minsize;
+	struct staging_queue* staging;	// if not NULL, input is cast by
+					// the thread of the queue
+	struct filter_spec filtspec;	// filters applied in the rings
+	double qual_window;		// duration in s of the windows of
+					// the quality statistics (0 if none)
+	struct bandpower_spec bpspec;	// band power of the device-rate
+					// ring (if nband is not 0)
+
+	// Derived channels (NULL if none) and the groups of them selected
+	// by egd_acq_setup()
+	struct derivation* deriv;
+	unsigned int ndvgrp;
+	struct grpconf* dvgrp;
+
+	// Stages run in the device-rate ring (in that order)
+	unsigned int nstage;
+	struct stage_entry* stages;
+
+	// Producers writing their columns of the input samples directly in
+	// the device-rate ring (if nprod is not 0). The samples of the
+	// acquisition start at prod_start which is written at prod_ind.
+	unsigned int nprod;
+	struct input_producer* prod;
+	mm_thr_mutex_t prodlock;
+	unsigned long prod_start, prod_reserved;
+	size_t prod_ind;
 
 	void* handle;
 	struct devmodule module;
@@ -0,0 +1,466 @@
+/*
+    Copyright (C) 2010-2012  EPFL (Ecole Polytechnique Fédérale de Lausanne)
+    Laboratory CNBI (Chair in Non-Invasive Brain-Machine Interface)
+    Nicolas Bourdaud <nicolas.bourdaud@epfl.ch>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "coreinternals.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_SIMD	1
+# include <immintrin.h>
+#else
+# define HAVE_X86_SIMD	0
+#endif
+
+/* The derived channels are computed in the device-rate ring once the
+ * samples are complete (and filtered). The inputs of SBLOCK successive
+ * samples are gathered in a block x where the values of an input are
+ * contiguous, so that a weight multiplies SBLOCK samples with each SIMD
+ * instruction. The rows with few non-zero weights (bipolar derivations)
+ * use a sparse form of the matrix instead. The computation is always done
+ * in double precision. */
+
+#define SBLOCK		8	// samples derived at once
+#define MAX_DENSITY	4	// sparse form used if nnz <= nout*nin/4
+
+
+static
+void dense_rows(const struct derivation* dv, const double* restrict x,
+                double* restrict y)
+{
+	unsigned int r, k, s;
+	const double* w;
+	double acc[SBLOCK];
+
+	for (r=0; r<dv->nout; r++) {
+		w = dv->w + (size_t)r*dv->nin;
+		for (s=0; s<SBLOCK; s++)
+			acc[s] = 0.0;
+		for (k=0; k<dv->nin; k++)
+			for (s=0; s<SBLOCK; s++)
+				acc[s] += w[k] * x[k*SBLOCK + s];
+		for (s=0; s<SBLOCK; s++)
+			y[r*SBLOCK + s] = acc[s];
+	}
+}
+
+
+static
+void sparse_rows(const struct derivation* dv, const double* restrict x,
+                 double* restrict y)
+{
+	unsigned int r, j, s;
+	const double* xk;
+	double acc[SBLOCK];
+
+	for (r=0; r<dv->nout; r++) {
+		for (s=0; s<SBLOCK; s++)
+			acc[s] = 0.0;
+		for (j=dv->rowptr[r]; j<dv->rowptr[r+1]; j++) {
+			xk = x + dv->col[j]*SBLOCK;
+			for (s=0; s<SBLOCK; s++)
+				acc[s] += dv->val[j] * xk[s];
+		}
+		for (s=0; s<SBLOCK; s++)
+			y[r*SBLOCK + s] = acc[s];
+	}
+}
+
+
+#if HAVE_X86_SIMD
+
+// Prototype of a SIMD dense kernel holding the SBLOCK samples of a row in
+// SBLOCK/W registers
+#define DEFINE_SIMD_DENSE_FN(isa, tgt, W, vtype, set1, setzero,		\
+                             load, store, mul, add)			\
+static __attribute__((target(tgt)))					\
+void isa##_dense_rows(const struct derivation* dv,			\
+                      const double* restrict x, double* restrict y)	\
+{									\
+	unsigned int r, k, v;						\
+	const double* w;						\
+	vtype acc[SBLOCK/W], wk;					\
+									\
+	for (r=0; r<dv->nout; r++) {					\
+		w = dv->w + (size_t)r*dv->nin;				\
+		for (v=0; v<SBLOCK/W; v++)				\
+			acc[v] = setzero();				\
+		for (k=0; k<dv->nin; k++) {				\
+			wk = set1(w[k]);				\
+			for (v=0; v<SBLOCK/W; v++)			\
+				acc[v] = add(acc[v], mul(wk,		\
+				         load(x + k*SBLOCK + v*W)));	\
+		}							\
+		for (v=0; v<SBLOCK/W; v++)				\
+			store(y + r*SBLOCK + v*W, acc[v]);		\
+	}								\
+}
+
+DEFINE_SIMD_DENSE_FN(sse2, "sse2", 2, __m128d, _mm_set1_pd,
+                     _mm_setzero_pd, _mm_loadu_pd, _mm_storeu_pd,
+                     _mm_mul_pd, _mm_add_pd)
+DEFINE_SIMD_DENSE_FN(avx2, "avx2", 4, __m256d, _mm256_set1_pd,
+                     _mm256_setzero_pd, _mm256_loadu_pd, _mm256_storeu_pd,
+                     _mm256_mul_pd, _mm256_add_pd)
+DEFINE_SIMD_DENSE_FN(avx512, "avx512f", 8, __m512d, _mm512_set1_pd,
+                     _mm512_setzero_pd, _mm512_loadu_pd, _mm512_storeu_pd,
+                     _mm512_mul_pd, _mm512_add_pd)
+
+
+// Returns the dense kernel of the most capable instruction set
+static
+derive_function get_dense_fn(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		return avx512_dense_rows;
+	if (__builtin_cpu_supports("avx2"))
+		return avx2_dense_rows;
+	if (__builtin_cpu_supports("sse2"))
+		return sse2_dense_rows;
+	return dense_rows;
+}
+
+#else // HAVE_X86_SIMD
+
+static
+derive_function get_dense_fn(void)
+{
+	return dense_rows;
+}
+
+#endif // HAVE_X86_SIMD
+
+
+LOCAL_FN
+void egdi_destroy_derivation(struct derivation* dv)
+{
+	if (!dv)
+		return;
+
+	free(dv->srcch);
+	free(dv->labels);
+	free(dv->w);
+	free(dv->rowptr);
+	free(dv->col);
+	free(dv->val);
+	free(dv->src_offset);
+	free(dv);
+}
+
+
+// Build the sparse form of the weights of dv if it has few enough non-zero
+// weights
+static
+int setup_sparse_form(struct derivation* dv)
+{
+	unsigned int r, k, j, nnz = 0;
+	const double* w = dv->w;
+
+	for (k=0; k<dv->nout*dv->nin; k++)
+		nnz += (w[k] != 0.0);
+	if ((size_t)nnz*MAX_DENSITY > (size_t)dv->nout*dv->nin)
+		return 0;
+
+	dv->rowptr = malloc((dv->nout+1)*sizeof(*dv->rowptr));
+	dv->col = malloc((nnz ? nnz : 1)*sizeof(*dv->col));
+	dv->val = malloc((nnz ? nnz : 1)*sizeof(*dv->val));
+	if (!dv->rowptr || !dv->col || !dv->val)
+		return -1;
+
+	for (r=0, j=0; r<dv->nout; r++) {
+		dv->rowptr[r] = j;
+		for (k=0; k<dv->nin; k++, w++) {
+			if (*w == 0.0)
+				continue;
+			dv->col[j] = k;
+			dv->val[j++] = *w;
+		}
+	}
+	dv->rowptr[dv->nout] = j;
+	dv->run_rows = sparse_rows;
+	return 0;
+}
+
+
+/* Create the derivation of nout channels from the nin channels of index
+ * srcch in the channel map: the channel r is the sum of weights[r*nin + k]
+ * times the input k. labels (or any of its elements) can be NULL. */
+LOCAL_FN
+struct derivation* egdi_create_derivation(unsigned int nout, unsigned int nin,
+                                          const unsigned int* srcch,
+                                          const double* weights,
+                                          const char* const* labels)
+{
+	struct derivation* dv;
+	unsigned int r;
+	size_t nw = (size_t)nout*nin;
+
+	if (!(dv = calloc(1, sizeof(*dv))))
+		return NULL;
+
+	dv->nout = nout;
+	dv->nin = nin;
+	dv->type = EGD_DOUBLE;
+	dv->srcch = malloc(nin*sizeof(*dv->srcch));
+	dv->src_offset = calloc(nin, sizeof(*dv->src_offset));
+	dv->labels = calloc(nout, sizeof(*dv->labels));
+	dv->w = malloc(nw*sizeof(*dv->w));
+	if (!dv->srcch || !dv->src_offset || !dv->labels || !dv->w)
+		goto error;
+
+	memcpy(dv->srcch, srcch, nin*sizeof(*srcch));
+	memcpy(dv->w, weights, nw*sizeof(*weights));
+	for (r=0; r<nout && labels; r++)
+		if (labels[r])
+			strncpy(dv->labels[r], labels[r], EGD_LABEL_LEN-1);
+
+	dv->run_rows = get_dense_fn();
+	if (setup_sparse_form(dv))
+		goto error;
+
+	return dv;
+
+error:
+	egdi_destroy_derivation(dv);
+	return NULL;
+}
+
+
+// Prototype of the function gathering the inputs of the samples of a block
+// (or scattering the outputs), ns being the number of samples at
+// positions starting at pos in the ring. The samples of the ring are not
+// necessarily aligned on the size of type, hence the memcpy
+#define DEFINE_GATHER_FN(type)						\
+static									\
+void gather_##type(const struct derivation* dv, const char* buffer,	\
+                   size_t buffsize, size_t samlen, size_t pos,		\
+                   unsigned int ns, double* restrict x)			\
+{									\
+	unsigned int k, s;						\
+	type v;								\
+									\
+	for (s=0; s<ns; s++) {						\
+		for (k=0; k<dv->nin; k++) {				\
+			memcpy(&v, buffer+pos+dv->src_offset[k], sizeof(v));\
+			x[k*SBLOCK + s] = v;				\
+		}							\
+		pos += samlen;						\
+		if (pos == buffsize)					\
+			pos = 0;					\
+	}								\
+}									\
+									\
+static									\
+void scatter_##type(const struct derivation* dv, char* buffer,		\
+                    size_t buffsize, size_t samlen, size_t pos,		\
+                    unsigned int ns, const double* restrict y)		\
+{									\
+	unsigned int r, s;						\
+	type v;								\
+	char* out;							\
+									\
+	for (s=0; s<ns; s++) {						\
+		out = buffer + pos + dv->dst_offset;			\
+		for (r=0; r<dv->nout; r++) {				\
+			v = y[r*SBLOCK + s];				\
+			memcpy(out + r*sizeof(v), &v, sizeof(v));	\
+		}							\
+		pos += samlen;						\
+		if (pos == buffsize)					\
+			pos = 0;					\
+	}								\
+}
+
+DEFINE_GATHER_FN(float)
+DEFINE_GATHER_FN(double)
+
+
+/* Compute the derived channels of the ns complete samples of the ring
+ * starting at the position ind. The samples are split in npart runs,
+ * ipart being processed by the call, so that the parts can be derived
+ * concurrently. */
+LOCAL_FN
+void egdi_derive_samples(const struct derivation* dv, char* buffer,
+                         size_t buffsize, size_t samlen, size_t ind,
+                         size_t ns, unsigned int ipart, unsigned int npart)
+{
+	double x[dv->nin*SBLOCK], y[dv->nout*SBLOCK];
+	size_t s0, s1, pos;
+	unsigned int nb;
+
+	// Runs of whole blocks, except for the last part
+	s0 = (ns*ipart/npart) & ~(size_t)(SBLOCK-1);
+	s1 = (ipart+1 == npart) ? ns
+	           : (ns*(ipart+1)/npart) & ~(size_t)(SBLOCK-1);
+
+	// The samples of an incomplete block not gathered must hold finite
+	// values (their results are not written)
+	memset(x, 0, sizeof(x));
+	pos = (ind + s0*samlen) % buffsize;
+	for (; s0 < s1; s0 += nb) {
+		nb = (s1-s0 < SBLOCK) ? s1-s0 : SBLOCK;
+		if (dv->type == EGD_FLOAT)
+			gather_float(dv, buffer, buffsize, samlen, pos, nb, x);
+		else
+			gather_double(dv, buffer, buffsize, samlen, pos, nb, x);
+
+		dv->run_rows(dv, x, y);
+
+		if (dv->type == EGD_FLOAT)
+			scatter_float(dv, buffer, buffsize, samlen, pos, nb, y);
+		else
+			scatter_double(dv, buffer, buffsize, samlen, pos, nb, y);
+		pos = (pos + nb*samlen) % buffsize;
+	}
+}
+
+
+// Returns the index in chmap of the device-rate channel called name (of
+// length len), either by its label or as "type:index" (like the default
+// label reported by egd_channel_info()). Returns -1 if not found.
+static
+int find_channel(const char* name, size_t len, unsigned int nch,
+                 const struct egdi_chinfo* chmap, const unsigned int* chdiv)
+{
+	unsigned int i, index, ich = 0;
+	const char *colon, *tname;
+	char* end;
+
+	for (i=0; i<nch; i++) {
+		if (chmap[i].label && strlen(chmap[i].label) == len
+		   && !strncmp(chmap[i].label, name, len))
+			return (!chdiv || chdiv[i] <= 1) ? (int)i : -1;
+	}
+
+	colon = memchr(name, ':', len);
+	if (!colon || colon == name)
+		return -1;
+	index = strtoul(colon+1, &end, 10);
+	if (end != name + len || end == colon+1)
+		return -1;
+
+	for (i=0; i<nch; i++) {
+		tname = egd_sensor_name(chmap[i].stype);
+		if (!tname || strlen(tname) != (size_t)(colon-name)
+		   || strncmp(tname, name, colon-name))
+			continue;
+		if (ich++ == index)
+			return (!chdiv || chdiv[i] <= 1) ? (int)i : -1;
+	}
+
+	return -1;
+}
+
+
+// Add coef/n to the weights of the n device-rate channels of the sensor
+// type called name (of length len)
+static
+int add_mean(double* row, double coef, const char* name, size_t len,
+             unsigned int nch, const struct egdi_chinfo* chmap,
+             const unsigned int* chdiv)
+{
+	unsigned int i, n = 0;
+	const char* tname;
+
+	for (i=0; i<2*nch; i++) {
+		tname = egd_sensor_name(chmap[i%nch].stype);
+		if (!tname || strlen(tname) != len || strncmp(tname, name, len)
+		   || (chdiv && chdiv[i%nch] > 1))
+			continue;
+
+		// Count in the first pass, add in the second
+		if (i < nch)
+			n++;
+		else
+			row[i-nch] += coef / n;
+	}
+
+	return n ? 0 : -1;
+}
+
+
+/* Parse the expression expr defining a derived channel and add the weights
+ * of the channels of the channel map (nch channels) in row. The
+ * expression is a sum of terms separated by '+' or '-', each term being a
+ * channel optionally preceded by a coefficient and '*'. A channel is
+ * referred by its label, by "type:index" or "mean:type" for the average
+ * of the channels of a type. Returns -1 with errno set to EINVAL if the
+ * expression is invalid or refers to an unknown channel or to a channel
+ * not sampled at the device rate. */
+LOCAL_FN
+int egdi_parse_derivation(const char* expr, unsigned int nch,
+                          const struct egdi_chinfo* chmap,
+                          const unsigned int* chdiv, double* row)
+{
+	const char *p = expr, *q;
+	char* end;
+	double sign = 1.0, coef;
+	size_t len;
+	int ich;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (*p == '+' || *p == '-')
+		sign = (*p++ == '-') ? -1.0 : 1.0;
+
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		// Optional coefficient of the term
+		coef = strtod(p, &end);
+		for (q = end; *q == ' ' || *q == '\t'; q++);
+		if (end != p && *q == '*') {
+			for (p = q+1; *p == ' ' || *p == '\t'; p++);
+		} else
+			coef = 1.0;
+
+		// Channel of the term
+		len = strcspn(p, " \t+-*");
+		if (!len)
+			goto error;
+		if (len > 5 && !strncmp(p, "mean:", 5)) {
+			if (add_mean(row, sign*coef, p+5, len-5,
+			             nch, chmap, chdiv))
+				goto error;
+		} else {
+			if ((ich = find_channel(p, len, nch, chmap, chdiv)) < 0)
+				goto error;
+			row[ich] += sign*coef;
+		}
+
+		// Operator introducing the next term
+		for (p += len; *p == ' ' || *p == '\t'; p++);
+		if (*p == '\0')
+			return 0;
+		if (*p != '+' && *p != '-')
+			goto error;
+		sign = (*p++ == '-') ? -1.0 : 1.0;
+	}
+
+error:
+	errno = EINVAL;
+	return -1;
+}
@@ -44,25 +44,37 @@ int egdi_next_chindex(const struct egdi_chinfo* ch, int stype, int tind)
 }
 
 
+// Offset of the channel ind in the input samples of its rate (if chdiv is
+// not NULL, only the channels sampled at the same rate are counted)
 static
-int egdi_in_offset(const struct egdi_chinfo* ch, int ind)
+int egdi_in_offset(const struct egdi_chinfo* ch, const unsigned int* chdiv,
+                   int ind)
 {
 	int chind, offset = 0;
 
-	for (chind=0; chind<ind; chind++) 
+	for (chind=0; chind<ind; chind++) {
+		if (chdiv && chdiv[chind] != chdiv[ind])
+			continue;
 		offset += egd_get_data_size(ch[chind].si->dtype);
+	}
 
 	return offset;
 }
 
 
+// Split the channel group grp into groups of contiguous channels of the
+// same type and bits selection. If not NULL, first receives the index in
+// cha of the first channel of each group
 static
-int split_chgroup(const struct egdi_chinfo* cha, const struct grpconf *grp,
-		       struct selected_channels *sch)
+int split_chgroup(const struct egdi_chinfo* cha, const unsigned int* chdiv,
+                  const struct grpconf *grp, struct selected_channels *sch,
+                  int* first)
 {
 	union gval sc = {.valdouble = 0.0};
 	int ich, nxt=0, is = 0, stype = grp->sensortype, index = grp->index;
 	int ti, bsc, to = grp->datatype;
+	uint32_t mask;
+	unsigned int shift;
 	unsigned int i, offset, len = 0;
 	unsigned int arr_offset = grp->arr_offset, nch = grp->nch;
 	unsigned int tosize = egd_get_data_size(to);
@@ -71,8 +83,10 @@ int split_chgroup(const struct egdi_chinfo* cha, const struct grpconf *grp,
 		return 0;
 
 	ich = egdi_next_chindex(cha, stype, index);
-	offset = egdi_in_offset(cha, ich);
+	offset = egdi_in_offset(cha, chdiv, ich);
 	ti = cha[ich].si->dtype;
+	mask = cha[ich].si->mask;
+	shift = cha[ich].si->shift;
 	bsc = cha[ich].si->bsc;
 	egdi_set_gval(&sc, to, cha[ich].si->scale);
 
@@ -80,7 +94,9 @@ int split_chgroup(const struct egdi_chinfo* cha, const struct grpconf *grp,
 	for (i = 0; i <= nch; i++) {
 		if ( (i == nch)
 		   || ((nxt = egdi_next_chindex(cha+ich, stype, 0)))
-		   || (ti != cha[ich].si->dtype)) {
+		   || (ti != cha[ich].si->dtype)
+		   || (mask != cha[ich].si->mask)
+		   || (shift != cha[ich].si->shift)) {
 		   	// Don't add empty group
 		   	if (!len)
 				break;
@@ -93,12 +109,17 @@ int split_chgroup(const struct egdi_chinfo* cha, const struct grpconf *grp,
 				sch[is].iarray = grp->iarray;
 				sch[is].bsc = bsc;
 				sch[is].sc = sc;
+				sch[is].rate_div = chdiv ? chdiv[ich-1] : 0;
 			}
+			if (first)
+				first[is] = ich - len;
 			is++;
 		   	ich += nxt;
 			arr_offset += len * tosize;
-			offset = (i!=nch) ? egdi_in_offset(cha, ich) : 0;
+			offset = (i!=nch) ? egdi_in_offset(cha, chdiv, ich) : 0;
 			ti = (i!=nch) ? cha[ich].si->dtype : 0;
+			mask = (i!=nch) ? cha[ich].si->mask : 0;
+			shift = (i!=nch) ? cha[ich].si->shift : 0;
 			len = 0;
 		}
 		len++;
@@ -119,7 +140,8 @@ int egdi_split_alloc_chgroups(struct eegdev* dev,
 
 	// Compute the number of needed groups
 	for (i=0; i<ngrp; i++)
-		nsel += split_chgroup(dev->cap.chmap, grp+i, NULL);
+		nsel += split_chgroup(dev->cap.chmap, dev->cap.chdiv,
+		                      grp+i, NULL, NULL);
 
 	if (!(selch = mdev->ci.alloc_input_groups(mdev, nsel)))
 		return -1;
@@ -127,7 +149,8 @@ int egdi_split_alloc_chgroups(struct eegdev* dev,
 	// Setup selch
 	nsel = 0;
 	for (i=0; i<ngrp; i++)
-		nsel += split_chgroup(dev->cap.chmap, grp+i, selch+nsel);
+		nsel += split_chgroup(dev->cap.chmap, dev->cap.chdiv,
+		                      grp+i, selch+nsel, dev->selchmap+nsel);
 		
 	return 0;
 }
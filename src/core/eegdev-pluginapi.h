@@ -20,11 +20,12 @@
 #define EEGDEV_PLUGINAPI_H
  
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "eegdev.h"
 
-#define EEGDEV_PLUGIN_ABI_VERSION  8 //last: plugincap w/ multiple chmap
+#define EEGDEV_PLUGIN_ABI_VERSION  15 //last: producers of input columns
 
 
 #ifdef __cplusplus
@@ -45,7 +46,7 @@ struct selected_channels {
 	unsigned int iarray;
 	unsigned int arr_offset;
 	int bsc;
-	int padding;
+	unsigned int rate_div; /* 0 or 1 if sampled at device rate */
 };
 
 struct egdi_signal_info {
@@ -53,6 +54,9 @@ struct egdi_signal_info {
 	int isint, bsc, dtype, mmtype;
 	double scale;
 	union gval min, max;
+	double offset;		/* added after scaling */
+	uint32_t mask;		/* if not 0, bits kept from integer input */
+	unsigned int shift;	/* right shift of integer input (after mask) */
 };
 
 
@@ -60,21 +64,41 @@ struct egdi_chinfo {
 	const char *label;
 	const struct egdi_signal_info* si;
 	int stype;
+	int bcal;		/* if not 0, calibration applied after si */
+	double cal_gain, cal_offset;
 };
 
 
+/* Input-only data types: integers stored on fewer bytes or in big-endian
+   order, as sent by many devices. They can be used as dtype of the signals
+   supplied by a plugin but not as type of the arrays filled by the core */
+#define EGDI_INT16LE	16
+#define EGDI_INT16BE	17
+#define EGDI_INT24LE	18
+#define EGDI_INT24BE	19
+#define EGDI_INT32BE	20
+#define EGDI_FIRST_INDTYPE	EGDI_INT16LE
+#define EGDI_NUM_INDTYPE	5
+
+
 /* EGDCAP_NOCP_*: use pointer directly (do not copy data) */
 #define EGDCAP_NOCP_CHMAP	0x00000001
 #define EGDCAP_NOCP_DEVID	0x00000002
 #define EGDCAP_NOCP_DEVTYPE	0x00000004
 #define EGDCAP_NOCP_CHLABEL	0x00000008
 
+/* EGDCAP_WHOLE_SAMPLES: the arrays passed to update_ringbuffer() and
+   update_subring() always hold a whole number of samples */
+#define EGDCAP_WHOLE_SAMPLES	0x00000010
+
 struct blockmapping {
 	int nch;
 	int num_skipped;
 	int skipped_stype;
 	const struct egdi_chinfo* chmap;
 	const struct egdi_signal_info* default_info;
+	unsigned int rate_div;	/* channels sampled at sampling_freq/rate_div
+				   (0 or 1 means sampled at sampling_freq) */
 };
 
 struct plugincap {
@@ -86,8 +110,32 @@ struct plugincap {
 	const char* device_id;
 };
 
+/* Bytes [offset, offset+len) of each input sample, supplied by one
+   producer (see set_input_producers()) */
+struct egdi_input_column {
+	unsigned int offset;
+	unsigned int len;
+};
+
 struct devmodule;
 
+/* Decode kernel registered by a plugin for an input group (see
+   set_input_decoder()). It must convert ns blocks of len bytes located every
+   sstride bytes in src into values of type sel->typeout located every
+   dstride bytes in dst. skip is the number of bytes of the group that
+   precede src in the input sample: it is not 0 only when the core decodes
+   the end of a sample whose beginning was supplied by a previous call
+   (ns is then 1) or the part of a group supplied by a producer of input
+   columns (see set_input_producers()). data is the pointer supplied at
+   registration. If the core workers are enabled or if the input is
+   supplied by several producers, the kernel may be called concurrently on
+   different samples. */
+typedef void (*egdi_decode_function)(void* dst, const void* src,
+                                     size_t len, size_t ns,
+                                     size_t dstride, size_t sstride,
+                                     const struct selected_channels* sel,
+                                     unsigned int skip, void* data);
+
 struct core_interface {
 /* \param dev		pointer to the devmodule struct of the device
  * \param in		pointer to an array of samples
@@ -146,6 +194,103 @@ struct core_interface {
  * IMPORTANT: This function can be called only while opening the device. */
 	const struct egdi_chinfo* (*get_conf_mapping)(struct devmodule* dev,
 	                                        const char* name, int* nch);
+
+
+/* \param dev		pointer to the devmodule struct of the device
+ * \param rate_div	rate divider of the channels supplied
+ * \param in		pointer to an array of samples
+ * \param length	size in bytes of the array
+ *
+ * Same as update_ringbuffer() but for the channels of the mappings
+ * declared with a rate_div bigger than 1. The samples supplied hold only
+ * the channels sampled at sampling_freq/rate_div, in the order of the
+ * channel map. Their size is computed by the core library from the
+ * channel map (no call to set_input_samlen() is needed).
+ *
+ * IMPORTANT: the data of a period of time must be supplied after the data
+ * of the same period sampled at the device rate (this is how the first
+ * sample of the sub-rate channels is aligned when the acquisition
+ * starts). */
+	int (*update_subring)(struct devmodule* dev, unsigned int rate_div,
+	                      const void* in, size_t len);
+
+
+/* \param dev		pointer to the devmodule struct of the device
+ * \param igrp		index of the input group in the array returned by
+ *                      alloc_input_groups()
+ * \param fn		decode kernel (NULL restores the built-in cast)
+ * \param data		pointer passed to fn at each call
+ *
+ * Makes the core library call fn instead of its built-in cast function
+ * to write the channels of the input group igrp into the ringbuffer. This
+ * lets a plugin supply data in its native wire format and decode it in the
+ * same pass as the cast. The scaling (sc, bsc) and the calibration of the
+ * channels are then left to fn.
+ *
+ * IMPORTANT: This function SHOULD be called by the device implementation
+ * while executing set_channel_groups method, after alloc_input_groups(). */
+	int (*set_input_decoder)(struct devmodule* dev, unsigned int igrp,
+	                         egdi_decode_function fn, void* data);
+
+
+/* \param dev		pointer to the devmodule struct of the device
+ * \param ngrp		number of channel groups requested
+ * \param grp		array of channel groups requested
+ * \param nsel		pointer to the value receiving the number of input
+ *                      groups
+ *
+ * Splits the requested channel groups into input groups according to the
+ * channel map of the device and allocates them, as the core library does
+ * when a plugin does not implement set_channel_groups method. This lets a
+ * plugin keep the default input groups while registering decode kernels
+ * for some of them.
+ *
+ * This function returns the array of input groups in case of success,
+ * NULL otherwise.
+ *
+ * IMPORTANT: This function SHOULD be called by the device implementation
+ * while executing set_channel_groups method. */
+	struct selected_channels* (*split_input_groups)(struct devmodule* dev,
+	                                           unsigned int ngrp,
+	                                           const struct grpconf* grp,
+	                                           unsigned int* nsel);
+
+
+/* \param dev		pointer to the devmodule struct of the device
+ * \param nprod		number of producers
+ * \param cols		array of the nprod columns supplied by the producers
+ *
+ * Declares that the input samples are supplied by nprod producers instead
+ * of update_ringbuffer(), the producer i supplying the bytes of the column
+ * cols[i] of each sample through update_ringbuffer_column(). The columns
+ * must not overlap, must cover the whole input sample and must not split
+ * a channel. Passing 0 as nprod restores the supply by update_ringbuffer().
+ *
+ * IMPORTANT: This function SHOULD be called by the device implementation
+ * after set_input_samlen() and before the first producer supplies data. */
+	int (*set_input_producers)(struct devmodule* dev, unsigned int nprod,
+	                           const struct egdi_input_column* cols);
+
+
+/* \param dev		pointer to the devmodule struct of the device
+ * \param iprod		index of the producer
+ * \param in		pointer to an array of columns
+ * \param length	size in bytes of the array
+ *
+ * Writes in the ringbuffer the columns supplied by the producer iprod, the
+ * array holding only the bytes of its column for a whole number of
+ * samples. Each producer has its own position in the ringbuffer and the
+ * samples are made available once all producers have supplied them: the
+ * n-th column supplied by a producer since set_input_producers() belongs to
+ * the same sample as the n-th column of the others.
+ *
+ * The producers may call this function concurrently, each one from a
+ * single thread at a time. The columns are cast by the calling thread
+ * (split across the core workers if enabled) unless the cast thread is
+ * enabled: they are then queued like the data of update_ringbuffer(). */
+	int (*update_ringbuffer_column)(struct devmodule* dev,
+	                                unsigned int iprod,
+	                                const void* in, size_t length);
 };
 
 struct egdi_optname {
@@ -183,13 +328,38 @@ unsigned int egd_get_data_size(unsigned int type)
 		size = sizeof(float);
 	else if (type == EGD_DOUBLE)
 		size = sizeof(double);
+	else if (type == EGD_INT16 || type == EGD_FLOAT16
+	         || type == EGD_UINT16)
+		size = 2;
+	else if (type == EGD_UINT8)
+		size = 1;
+	else if (type == EGDI_INT16LE || type == EGDI_INT16BE)
+		size = 2;
+	else if (type == EGDI_INT24LE || type == EGDI_INT24BE)
+		size = 3;
+	else if (type == EGDI_INT32BE)
+		size = 4;
 	
 	return size;
 }
 
+/* Narrow output types (EGD_INT16, EGD_FLOAT16, EGD_UINT8, EGD_UINT16) are
+   computed in single precision, then converted (with saturation for the
+   integer types). Returns the type in which values of type are computed */
+static inline
+int egdi_get_calc_type(int type)
+{
+	if (type == EGD_INT16 || type == EGD_FLOAT16
+	    || type == EGD_UINT8 || type == EGD_UINT16)
+		return EGD_FLOAT;
+
+	return type;
+}
+
 static inline
 void egdi_set_gval(union gval* dst, int type, double val)
 {
+	type = egdi_get_calc_type(type);
 	if (type == EGD_INT32)
 		dst->valint32_t = (int32_t) val;
 	else if (type == EGD_FLOAT)
@@ -32,7 +32,11 @@ extern "C" {
 #define EGD_INT32	0
 #define EGD_FLOAT	1
 #define EGD_DOUBLE	2
-#define EGD_NUM_DTYPE	3
+#define EGD_INT16	3
+#define EGD_FLOAT16	4
+#define EGD_UINT8	5
+#define EGD_UINT16	6
+#define EGD_NUM_DTYPE	7
 
 /* DEPRECATED: Do not use those constants in newly written code, use
    egd_sensor_type function */
@@ -52,7 +56,8 @@ extern "C" {
 #define EGD_TRANSDUCER		7
 #define EGD_TRANSDUCTER		7	//deprecated: spelling mistake
 #define EGD_PREFILTERING	8
-#define EGD_NUM_FIELDS		9
+#define EGD_FS			9
+#define EGD_NUM_FIELDS		10
 
 /* Supported capabilities fields */
 #define EGD_CAP_FS		0
@@ -61,6 +66,16 @@ extern "C" {
 #define EGD_CAP_DEVID		3
 #define EGD_NCAP		4
 
+/* Supported array configuration fields */
+#define EGD_ARR_LAYOUT		1
+#define EGD_ARR_CHSTRIDE	2
+#define EGD_ARR_RATE		3
+#define EGD_NUM_ARRFIELDS	4
+
+/* Supported array layouts */
+#define EGD_SAMPLE_MAJOR	0
+#define EGD_CHANNEL_MAJOR	1
+
 struct eegdev;
 
 struct grpconf {
@@ -72,6 +87,54 @@ struct grpconf {
 	int datatype;
 };
 
+struct egd_quality {
+	double rms;
+	double dc;
+	unsigned int nsat;
+	int flat;
+	unsigned int ns;
+};
+
+/* Run of nch channels of data type type located at offset bytes in the
+   samples of a ring buffer, which are the channels of sensor type stype
+   starting at the index index among the channels of this type */
+struct egd_chspan {
+	unsigned int offset, nch, index;
+	int type, stype;
+};
+
+/* Layout of the samples of the ring buffer seen by a processing stage */
+struct egd_stage_layout {
+	unsigned int sampling_freq;
+	size_t samlen;			/* size in bytes of a sample */
+	unsigned int nspan;
+	const struct egd_chspan* spans;
+};
+
+/* Processing stage registered by egd_add_stage(). The stages are run in
+ * the order of registration on the samples written in the ring buffer of
+ * the channels sampled at the device rate, after the filters and the
+ * derived channels, and before the samples are made available to
+ * egd_get_data(). data is the pointer supplied at registration.
+ *
+ * setup() is called by egd_acq_setup() with the layout of the ring (valid
+ * only during the call). A non zero return value makes egd_acq_setup()
+ * fail, errno being left to the value set by setup().
+ *
+ * process() is called with ns contiguous samples of the ring that it may
+ * modify in place, samlen bytes apart (the values are not necessarily
+ * aligned on their size). restart is not 0 for the first samples of an
+ * acquisition. It runs in the thread supplying the data and must not
+ * block.
+ *
+ * teardown() (may be NULL) is called before the next setup() and when the
+ * device is closed, if setup() has succeeded. */
+struct egd_stage {
+	int (*setup)(void* data, const struct egd_stage_layout* layout);
+	void (*process)(void* data, void* samples, size_t ns, int restart);
+	void (*teardown)(void* data);
+};
+
 int egd_sensor_type(const char* name);
 const char* egd_sensor_name(int stype);
 
@@ -84,9 +147,19 @@ int egd_close(struct eegdev* dev);
 int egd_acq_setup(struct eegdev* dev,
                   unsigned int narr, const size_t *strides,
                   unsigned int ngrp, const struct grpconf* grp);
+int egd_array_config(struct eegdev* dev, unsigned int iarray,
+                     int fieldtype, ...);
+int egd_set_derivation(struct eegdev* dev, int stype, unsigned int index,
+                       unsigned int nin, unsigned int nout,
+                       const double* weights, const char* const* labels);
 int egd_start(struct eegdev* dev);
 ssize_t egd_get_data(struct eegdev* dev, size_t ns, ...);
 ssize_t egd_get_available(struct eegdev* dev);
+int egd_get_quality(struct eegdev* dev, int stype,
+                    struct egd_quality* quality);
+ssize_t egd_get_bandpower(struct eegdev* dev, int stype, double* logpow);
+int egd_add_stage(struct eegdev* dev, const struct egd_stage* stage,
+                  void* data);
 int egd_stop(struct eegdev* dev);
 const char* egd_get_string(void);
 
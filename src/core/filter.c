@@ -0,0 +1,410 @@
+/*
+    Copyright (C) 2010-2012  EPFL (Ecole Polytechnique Fédérale de Lausanne)
+    Laboratory CNBI (Chair in Non-Invasive Brain-Machine Interface)
+    Nicolas Bourdaud <nicolas.bourdaud@epfl.ch>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "coreinternals.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_SIMD	1
+# include <immintrin.h>
+#else
+# define HAVE_X86_SIMD	0
+#endif
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+/* The filter bank of a ring is a cascade of biquads (Butterworth high-pass
+ * and low-pass sections, then a notch) applied in place on the spans of
+ * floating point channels of the ring, once the samples are complete. The
+ * sections are in transposed direct form II and their state is kept in
+ * double precision whatever the type of the ring. The state of a span is
+ * stored section by section, each holding z1 then z2 for all its channels,
+ * so that a section is run on several channels with each SIMD
+ * instruction. */
+
+#define NOTCH_Q		30.0
+#define CHBLOCK		64	// channels filtered at once
+#define CHALIGN		8	// channel boundary of the parts (cache line)
+
+struct biquad {
+	double b0, b1, b2, a1, a2;
+};
+
+// Run a section on the values v of nc channels whose state is in z1, z2
+typedef void (*section_function)(const struct biquad* q, double* z1,
+                                 double* z2, double* v, unsigned int nc);
+
+struct filter_bank {
+	unsigned int nsec, nspan;
+	struct biquad* sec;
+	struct filter_span* spans;
+	double* state;
+	section_function run_section;
+};
+
+
+static
+void set_butterworth(struct biquad* q, int highpass, double w0, double Q)
+{
+	double alpha = sin(w0) / (2.0*Q), c = cos(w0), a0 = 1.0 + alpha;
+	double b = highpass ? (1.0 + c)/2.0 : (1.0 - c)/2.0;
+
+	q->b0 = b / a0;
+	q->b1 = (highpass ? -2.0*b : 2.0*b) / a0;
+	q->b2 = b / a0;
+	q->a1 = -2.0*c / a0;
+	q->a2 = (1.0 - alpha) / a0;
+}
+
+
+static
+void set_notch(struct biquad* q, double w0)
+{
+	double alpha = sin(w0) / (2.0*NOTCH_Q), c = cos(w0), a0 = 1.0 + alpha;
+
+	q->b0 = 1.0 / a0;
+	q->b1 = -2.0*c / a0;
+	q->b2 = 1.0 / a0;
+	q->a1 = -2.0*c / a0;
+	q->a2 = (1.0 - alpha) / a0;
+}
+
+
+// Returns the number of sections of the filters of spec that can be
+// applied at the sampling rate fs (the cutoffs must be below fs/2). If sec
+// is not NULL, the coefficients are written into it.
+static
+unsigned int design_sections(const struct filter_spec* spec, double fs,
+                             struct biquad* sec)
+{
+	unsigned int k, n = 0, nbw = spec->order/2;
+	const double fc[2] = {spec->hp, spec->lp};
+	double Q;
+	int ip;
+
+	// Butterworth of order N: section k has Q = 1/(2cos((2k+1)pi/(2N)))
+	for (ip=0; ip<2; ip++) {
+		if (fc[ip] <= 0.0 || fc[ip] >= fs/2.0)
+			continue;
+		for (k=0; k<nbw; k++, n++) {
+			Q = 0.5 / cos((2*k+1)*M_PI / (4.0*nbw));
+			if (sec)
+				set_butterworth(sec+n, ip == 0,
+				                2.0*M_PI*fc[ip]/fs, Q);
+		}
+	}
+
+	if (spec->notch > 0.0 && spec->notch < fs/2.0) {
+		if (sec)
+			set_notch(sec+n, 2.0*M_PI*spec->notch/fs);
+		n++;
+	}
+
+	return n;
+}
+
+
+static
+void run_section(const struct biquad* q, double* restrict z1,
+                 double* restrict z2, double* restrict v, unsigned int nc)
+{
+	unsigned int c;
+	double y;
+
+	for (c=0; c<nc; c++) {
+		y = q->b0*v[c] + z1[c];
+		z1[c] = q->b1*v[c] - q->a1*y + z2[c];
+		z2[c] = q->b2*v[c] - q->a2*y;
+		v[c] = y;
+	}
+}
+
+
+#if HAVE_X86_SIMD
+
+// Prototype of a SIMD section kernel processing W channels per step, the
+// remaining channels being processed by the scalar kernel
+#define DEFINE_SIMD_SECTION_FN(isa, tgt, W, vtype, set1,			\
+                               load, store, mul, add, sub)		\
+static __attribute__((target(tgt)))					\
+void isa##_run_section(const struct biquad* q, double* restrict z1,	\
+                       double* restrict z2, double* restrict v,		\
+                       unsigned int nc)					\
+{									\
+	unsigned int c;							\
+	vtype b0 = set1(q->b0), b1 = set1(q->b1), b2 = set1(q->b2);	\
+	vtype a1 = set1(q->a1), a2 = set1(q->a2), x, y;			\
+									\
+	for (c=0; c+W<=nc; c+=W) {					\
+		x = load(v+c);						\
+		y = add(mul(b0, x), load(z1+c));			\
+		store(z1+c, add(sub(mul(b1, x), mul(a1, y)),		\
+		                load(z2+c)));				\
+		store(z2+c, sub(mul(b2, x), mul(a2, y)));		\
+		store(v+c, y);						\
+	}								\
+	run_section(q, z1+c, z2+c, v+c, nc-c);				\
+}
+
+DEFINE_SIMD_SECTION_FN(sse2, "sse2", 2, __m128d, _mm_set1_pd,
+                       _mm_loadu_pd, _mm_storeu_pd,
+                       _mm_mul_pd, _mm_add_pd, _mm_sub_pd)
+DEFINE_SIMD_SECTION_FN(avx2, "avx2", 4, __m256d, _mm256_set1_pd,
+                       _mm256_loadu_pd, _mm256_storeu_pd,
+                       _mm256_mul_pd, _mm256_add_pd, _mm256_sub_pd)
+DEFINE_SIMD_SECTION_FN(avx512, "avx512f", 8, __m512d, _mm512_set1_pd,
+                       _mm512_loadu_pd, _mm512_storeu_pd,
+                       _mm512_mul_pd, _mm512_add_pd, _mm512_sub_pd)
+
+
+// Returns the section kernel of the most capable instruction set
+static
+section_function get_section_fn(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		return avx512_run_section;
+	if (__builtin_cpu_supports("avx2"))
+		return avx2_run_section;
+	if (__builtin_cpu_supports("sse2"))
+		return sse2_run_section;
+	return run_section;
+}
+
+#else // HAVE_X86_SIMD
+
+static
+section_function get_section_fn(void)
+{
+	return run_section;
+}
+
+#endif // HAVE_X86_SIMD
+
+
+/* Write in str the description of the filters of spec applied to a
+ * channel sampled at fs, in the format of EGD_PREFILTERING. Returns the
+ * number of characters written (0 if no filter applies). */
+LOCAL_FN
+int egdi_format_filter_spec(const struct filter_spec* spec, double fs,
+                            char* str, size_t len)
+{
+	int n = 0;
+	const char* sep = "";
+
+	str[0] = '\0';
+	if (spec->hp > 0.0 && spec->hp < fs/2.0) {
+		n += snprintf(str+n, len-n, "HP: %.2f Hz", spec->hp);
+		sep = "; ";
+	}
+	if (spec->lp > 0.0 && spec->lp < fs/2.0 && (size_t)n < len) {
+		n += snprintf(str+n, len-n, "%sLP: %.1f Hz", sep, spec->lp);
+		sep = "; ";
+	}
+	if (spec->notch > 0.0 && spec->notch < fs/2.0 && (size_t)n < len)
+		n += snprintf(str+n, len-n, "%sNotch: %.1f Hz",
+		              sep, spec->notch);
+
+	return ((size_t)n < len) ? n : (int)len-1;
+}
+
+
+LOCAL_FN
+void egdi_destroy_filter_bank(struct filter_bank* fb)
+{
+	if (!fb)
+		return;
+
+	free(fb->sec);
+	free(fb->spans);
+	free(fb->state);
+	free(fb);
+}
+
+
+// Number of biquad sections of spec applied at the sampling rate fs
+LOCAL_FN
+unsigned int egdi_get_filter_nsec(const struct filter_spec* spec, double fs)
+{
+	return design_sections(spec, fs, NULL);
+}
+
+
+/* Create the filter bank applying spec at the sampling rate fs on the nspan
+ * spans of channels (at least one section must apply at this rate). */
+LOCAL_FN
+struct filter_bank* egdi_create_filter_bank(const struct filter_spec* spec,
+                                            double fs, unsigned int nspan,
+                                            const struct filter_span* spans)
+{
+	unsigned int i, nsec;
+	size_t nz = 0;
+	struct filter_bank* fb;
+
+	nsec = design_sections(spec, fs, NULL);
+	for (i=0; i<nspan; i++)
+		nz += 2*nsec*spans[i].nch;
+
+	if (!(fb = calloc(1, sizeof(*fb)))
+	   || !(fb->sec = malloc(nsec*sizeof(*fb->sec)))
+	   || !(fb->spans = malloc(nspan*sizeof(*fb->spans)))
+	   || !(fb->state = calloc(nz, sizeof(*fb->state)))) {
+		egdi_destroy_filter_bank(fb);
+		return NULL;
+	}
+
+	fb->nsec = nsec;
+	fb->nspan = nspan;
+	fb->run_section = get_section_fn();
+	design_sections(spec, fs, fb->sec);
+	memcpy(fb->spans, spans, nspan*sizeof(*spans));
+
+	return fb;
+}
+
+
+// Set the state of the sections so that the constant input v is in
+// steady state (avoids the transient of a high-pass on a DC offset)
+static
+void prime_sections(const struct filter_bank* fb, double* z, size_t nch,
+                    double v[], unsigned int nc)
+{
+	unsigned int c, k;
+	const struct biquad* q;
+	double* restrict z1;
+	double* restrict z2;
+	double g, y;
+
+	for (k=0; k<fb->nsec; k++) {
+		q = fb->sec + k;
+		z1 = z + 2*k*nch;
+		z2 = z1 + nch;
+		g = (q->b0 + q->b1 + q->b2) / (1.0 + q->a1 + q->a2);
+		for (c=0; c<nc; c++) {
+			y = g*v[c];
+			z2[c] = q->b2*v[c] - q->a2*y;
+			z1[c] = q->b1*v[c] - q->a1*y + z2[c];
+			v[c] = y;
+		}
+	}
+}
+
+
+// Prototype of the filtering function of a type. The channels [c0, c1)
+// of a span located at offset in ns successive samples (samlen bytes
+// apart) are processed by blocks of CHBLOCK channels. The samples of the
+// ring are not necessarily aligned on the size of type, hence the memcpy
+#define DEFINE_FILTER_FN(type)						\
+static									\
+void filter_##type(const struct filter_bank* fb, char* buff,		\
+                   size_t samlen, size_t ns, unsigned int offset,	\
+                   double* z, size_t nch, size_t c0, size_t c1,		\
+                   int prime)						\
+{									\
+	double v[CHBLOCK];						\
+	type x[CHBLOCK];						\
+	double* z1;							\
+	char* px;							\
+	unsigned int c, k, nc;						\
+	size_t s;							\
+									\
+	for (; c0<c1; c0+=nc) {						\
+		nc = (c1-c0 < CHBLOCK) ? c1-c0 : CHBLOCK;		\
+		for (s=0; s<ns; s++) {					\
+			px = buff + s*samlen + offset + c0*sizeof(type); \
+			memcpy(x, px, nc*sizeof(type));			\
+			for (c=0; c<nc; c++)				\
+				v[c] = x[c];				\
+			if (prime && s == 0) {				\
+				prime_sections(fb, z + c0, nch, v, nc);	\
+				for (c=0; c<nc; c++)			\
+					v[c] = x[c];			\
+			}						\
+									\
+			for (k=0; k<fb->nsec; k++) {			\
+				z1 = z + 2*k*nch + c0;			\
+				fb->run_section(fb->sec + k, z1,	\
+				                z1 + nch, v, nc);	\
+			}						\
+									\
+			for (c=0; c<nc; c++)				\
+				x[c] = v[c];				\
+			memcpy(px, x, nc*sizeof(type));			\
+		}							\
+	}								\
+}
+
+DEFINE_FILTER_FN(float)
+DEFINE_FILTER_FN(double)
+
+
+/* Filter in place the ns complete samples of the ring buffer starting at
+ * the position ind. If prime is set, the first sample is the first of the
+ * acquisition and the state is initialized from it. The channels of each
+ * span are split in npart contiguous parts, ipart being processed by the
+ * call, so that the parts can be filtered concurrently. */
+LOCAL_FN
+void egdi_filter_samples(struct filter_bank* fb, char* buffer,
+                         size_t buffsize, size_t samlen, size_t ind,
+                         size_t ns, int prime,
+                         unsigned int ipart, unsigned int npart)
+{
+	unsigned int i;
+	size_t nrun, pos, rest, c0, c1, nch;
+	double* z = fb->state;
+	const struct filter_span* sp;
+
+	for (i=0; i<fb->nspan; i++) {
+		sp = fb->spans + i;
+		nch = sp->nch;
+		c0 = (nch*ipart/npart) & ~(size_t)(CHALIGN-1);
+		c1 = (ipart+1 == npart) ? nch
+		         : (nch*(ipart+1)/npart) & ~(size_t)(CHALIGN-1);
+
+		// Filter by runs of samples not crossing the end of ring
+		pos = ind;
+		rest = ns;
+		while (rest && c0 < c1) {
+			nrun = (buffsize - pos) / samlen;
+			if (nrun > rest)
+				nrun = rest;
+			if (sp->type == EGD_FLOAT)
+				filter_float(fb, buffer+pos, samlen, nrun,
+				             sp->offset, z, nch, c0, c1,
+				             prime && rest == ns);
+			else
+				filter_double(fb, buffer+pos, samlen, nrun,
+				              sp->offset, z, nch, c0, c1,
+				              prime && rest == ns);
+			rest -= nrun;
+			pos = (pos + nrun*samlen) % buffsize;
+		}
+		z += 2*fb->nsec*nch;
+	}
+}
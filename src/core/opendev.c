@@ -24,6 +24,7 @@
 #include <mmerrno.h>
 #include <mmlib.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "configuration.h"
@@ -142,12 +143,87 @@ const struct egdi_chinfo* egdi_get_conf_mapping(struct devmodule* mdev,
 }
 
 
+// Returns the frequency in Hz of a filter setting, 0 if "none"
+static
+double get_filter_freq(struct conf* cf, const char* name)
+{
+	const char* val = get_conf_setting(cf, name, "none");
+
+	if (!strcmp(val, "none"))
+		return 0.0;
+	return strtod(val, NULL);
+}
+
+
+// Set the derived channels defined in the mapping named by the derivation
+// setting (if not "none")
+static
+int setup_derivation(struct eegdev* dev, struct conf* cf)
+{
+	int i, nch;
+	const struct egdi_chinfo* chmap;
+	const char* name = get_conf_setting(cf, "derivation", "none");
+
+	if (!strcmp(name, "none"))
+		return 0;
+
+	for (i=2; i>=0; i--) {
+		chmap = egdi_get_cfmapping(&cf->config[i], name, &nch);
+		if (chmap)
+			return egdi_setup_conf_derivation(dev, nch, chmap,
+			         egdi_get_cfexpressions(&cf->config[i], name));
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+
+// Set the band-power stage of the device from the bandpower_* settings.
+// The bands are a comma separated list of "LOW-HIGH" ranges in Hz (or
+// "none")
+static
+int setup_bandpower(struct eegdev* dev, struct conf* cf)
+{
+	struct bandpower_spec spec = {.nband = 0};
+	const char* val = get_conf_setting(cf, "bandpower_bands", "none");
+	char* end;
+
+	while (strcmp(val, "none") && *val) {
+		if (spec.nband == EGDI_MAX_BANDS)
+			goto error;
+		spec.lo[spec.nband] = strtod(val, &end);
+		if (end == val || *end != '-')
+			goto error;
+		val = end+1;
+		spec.hi[spec.nband++] = strtod(val, &end);
+		if (end == val || (*end != ',' && *end != '\0'))
+			goto error;
+		val = (*end == ',') ? end+1 : end;
+	}
+	spec.window = strtod(get_conf_setting(cf, "bandpower_window", "1"),
+	                     NULL);
+	spec.step = strtod(get_conf_setting(cf, "bandpower_step", "0.1"),
+	                   NULL);
+
+	return egdi_setup_bandpower(dev, &spec);
+
+error:
+	errno = EINVAL;
+	return -1;
+}
+
+
 static
 struct eegdev* open_init_device(const struct egdi_plugin_info* info,
                                 unsigned int nopt, struct conf* cf)
 {
 	struct eegdev* dev;
-	unsigned int i;
+	unsigned int i, nworker;
+	int error;
+	size_t minsize, stagesize;
+	struct filter_spec filt;
+	double quality;
 	const char* optval[nopt+1], *name, *defvalue;
 
 	// Get options values
@@ -163,9 +239,37 @@ struct eegdev* open_init_device(const struct egdi_plugin_info* info,
 		return NULL;
 	dev->cf = cf;
 
-	// then try to execute the device specific initialization
-	if (info->open_device(&dev->module, optval)) {
+	// Setup the core settings and then try to execute the device
+	// specific initialization
+	nworker = strtoul(get_conf_setting(cf, "workers", "0"), NULL, 0);
+	minsize = strtoul(get_conf_setting(cf, "workers_minsize", "65536"),
+	                  NULL, 0);
+	stagesize = 0;
+	if (!strcmp(get_conf_setting(cf, "cast_thread", "false"), "true"))
+		stagesize = strtoul(get_conf_setting(cf, "cast_thread_queue",
+		                                     "4194304"), NULL, 0);
+	filt.hp = get_filter_freq(cf, "filter_hp");
+	filt.lp = get_filter_freq(cf, "filter_lp");
+	filt.notch = get_filter_freq(cf, "filter_notch");
+	filt.order = strtoul(get_conf_setting(cf, "filter_order", "2"),
+	                     NULL, 0);
+	quality = strtod(get_conf_setting(cf, "quality_window", "0"), NULL);
+	if (egdi_setup_workers(dev, nworker, minsize)
+	   || egdi_setup_staging(dev, stagesize)
+	   || egdi_setup_filter(dev, &filt)
+	   || egdi_setup_quality(dev, quality)
+	   || info->open_device(&dev->module, optval)) {
+		egd_destroy_eegdev(dev);
+		return NULL;
+	}
+
+	// The derived channels refer to the channels of the device and the
+	// bands are checked against its sampling rate
+	if (setup_derivation(dev, cf) || setup_bandpower(dev, cf)) {
+		error = errno;
+		dev->ops.close_device(&dev->module);
 		egd_destroy_eegdev(dev);
+		errno = error;
 		return NULL;
 	}
 
@@ -0,0 +1,407 @@
+/*
+    Copyright (C) 2010-2012  EPFL (Ecole Polytechnique Fédérale de Lausanne)
+    Laboratory CNBI (Chair in Non-Invasive Brain-Machine Interface)
+    Nicolas Bourdaud <nicolas.bourdaud@epfl.ch>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mmthread.h>
+#include "coreinternals.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_SIMD	1
+# include <immintrin.h>
+#else
+# define HAVE_X86_SIMD	0
+#endif
+
+/* The quality monitor of a ring accumulates, for each monitored channel,
+ * the sum, the sum of squares, the extrema and the number of saturated
+ * values of the samples of the current window, as soon as they are cast
+ * in the ring. When a window is complete, its statistics are published
+ * and the accumulators restarted, so that reading them does not touch the
+ * data. The accumulators (and the saturation limits) of all channels are
+ * stored array by array, so that a sample of several channels is
+ * accumulated with each SIMD instruction. */
+
+#define CHBLOCK		64	// channels accumulated at once
+#define CHALIGN		8	// channel boundary of the parts (cache line)
+
+// Arrays of the accumulators, each of nch elements
+enum {ACC_SUM, ACC_SQ, ACC_MIN, ACC_MAX, ACC_NSAT, ACC_LO, ACC_HI, NACC};
+
+// Accumulate the values v of nc channels whose arrays start at acc, the
+// arrays being nch elements apart
+typedef void (*accumulate_function)(double* restrict acc, size_t nch,
+                                    const double* restrict v,
+                                    unsigned int nc);
+
+struct quality_monitor {
+	unsigned int window, n, nspan, nch;
+	struct egd_chspan* spans;
+	double* acc;
+	struct egd_quality* res;	// statistics of the last window
+	accumulate_function accumulate;
+	mm_thr_mutex_t lock;		// protects res
+};
+
+
+static
+void accumulate(double* restrict acc, size_t nch, const double* restrict v,
+                unsigned int nc)
+{
+	unsigned int c;
+	double x;
+
+	for (c=0; c<nc; c++) {
+		x = v[c];
+		acc[ACC_SUM*nch + c] += x;
+		acc[ACC_SQ*nch + c] += x*x;
+		if (x < acc[ACC_MIN*nch + c])
+			acc[ACC_MIN*nch + c] = x;
+		if (x > acc[ACC_MAX*nch + c])
+			acc[ACC_MAX*nch + c] = x;
+		if (x <= acc[ACC_LO*nch + c] || x >= acc[ACC_HI*nch + c])
+			acc[ACC_NSAT*nch + c] += 1.0;
+	}
+}
+
+
+#if HAVE_X86_SIMD
+
+// Saturation indicators (1.0 if saturated, 0.0 otherwise) of x
+static inline __attribute__((target("sse2")))
+__m128d sse2_saturated(__m128d x, __m128d lo, __m128d hi)
+{
+	return _mm_and_pd(_mm_or_pd(_mm_cmple_pd(x, lo), _mm_cmpge_pd(x, hi)),
+	                  _mm_set1_pd(1.0));
+}
+
+static inline __attribute__((target("avx2")))
+__m256d avx2_saturated(__m256d x, __m256d lo, __m256d hi)
+{
+	return _mm256_and_pd(_mm256_or_pd(_mm256_cmp_pd(x, lo, _CMP_LE_OQ),
+	                                  _mm256_cmp_pd(x, hi, _CMP_GE_OQ)),
+	                     _mm256_set1_pd(1.0));
+}
+
+static inline __attribute__((target("avx512f")))
+__m512d avx512_saturated(__m512d x, __m512d lo, __m512d hi)
+{
+	__mmask8 m = _mm512_cmp_pd_mask(x, lo, _CMP_LE_OQ)
+	             | _mm512_cmp_pd_mask(x, hi, _CMP_GE_OQ);
+
+	return _mm512_maskz_mov_pd(m, _mm512_set1_pd(1.0));
+}
+
+
+// Prototype of a SIMD accumulate kernel processing W channels per step,
+// the remaining channels being processed by the scalar kernel
+#define DEFINE_SIMD_ACCUMULATE_FN(isa, tgt, W, vtype, load, store,	\
+                                  add, mul, min, max)			\
+static __attribute__((target(tgt)))					\
+void isa##_accumulate(double* restrict acc, size_t nch,		\
+                      const double* restrict v, unsigned int nc)	\
+{									\
+	unsigned int c;							\
+	double *a;							\
+	vtype x;							\
+									\
+	for (c=0; c+W<=nc; c+=W) {					\
+		a = acc + c;						\
+		x = load(v+c);						\
+		store(a, add(load(a), x));				\
+		store(a + ACC_SQ*nch, add(load(a + ACC_SQ*nch),		\
+		                          mul(x, x)));			\
+		store(a + ACC_MIN*nch, min(load(a + ACC_MIN*nch), x));	\
+		store(a + ACC_MAX*nch, max(load(a + ACC_MAX*nch), x));	\
+		store(a + ACC_NSAT*nch, add(load(a + ACC_NSAT*nch),	\
+		      isa##_saturated(x, load(a + ACC_LO*nch),		\
+		                         load(a + ACC_HI*nch))));	\
+	}								\
+	accumulate(acc+c, nch, v+c, nc-c);				\
+}
+
+DEFINE_SIMD_ACCUMULATE_FN(sse2, "sse2", 2, __m128d,
+                          _mm_loadu_pd, _mm_storeu_pd,
+                          _mm_add_pd, _mm_mul_pd, _mm_min_pd, _mm_max_pd)
+DEFINE_SIMD_ACCUMULATE_FN(avx2, "avx2", 4, __m256d,
+                          _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd,
+                          _mm256_mul_pd, _mm256_min_pd, _mm256_max_pd)
+DEFINE_SIMD_ACCUMULATE_FN(avx512, "avx512f", 8, __m512d,
+                          _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd,
+                          _mm512_mul_pd, _mm512_min_pd, _mm512_max_pd)
+
+
+// Returns the accumulate kernel of the most capable instruction set
+static
+accumulate_function get_accumulate_fn(void)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		return avx512_accumulate;
+	if (__builtin_cpu_supports("avx2"))
+		return avx2_accumulate;
+	if (__builtin_cpu_supports("sse2"))
+		return sse2_accumulate;
+	return accumulate;
+}
+
+#else // HAVE_X86_SIMD
+
+static
+accumulate_function get_accumulate_fn(void)
+{
+	return accumulate;
+}
+
+#endif // HAVE_X86_SIMD
+
+
+// Restart the accumulators of the channels [c0, c1)
+static
+void reset_accumulators(struct quality_monitor* qm, size_t c0, size_t c1)
+{
+	size_t c, nch = qm->nch;
+	double* acc = qm->acc;
+
+	for (c=c0; c<c1; c++) {
+		acc[ACC_SUM*nch + c] = 0.0;
+		acc[ACC_SQ*nch + c] = 0.0;
+		acc[ACC_MIN*nch + c] = INFINITY;
+		acc[ACC_MAX*nch + c] = -INFINITY;
+		acc[ACC_NSAT*nch + c] = 0.0;
+	}
+}
+
+
+// Publish the statistics of the complete window of the channels [c0, c1)
+// and restart their accumulators
+static
+void publish_window(struct quality_monitor* qm, size_t c0, size_t c1)
+{
+	size_t c, nch = qm->nch;
+	const double* acc = qm->acc;
+	struct egd_quality* q;
+	double n = qm->window, var;
+
+	mm_thr_mutex_lock(&qm->lock);
+	for (c=c0; c<c1; c++) {
+		q = qm->res + c;
+		q->dc = acc[ACC_SUM*nch + c] / n;
+		var = acc[ACC_SQ*nch + c] / n - q->dc*q->dc;
+		q->rms = (var > 0.0) ? sqrt(var) : 0.0;
+		q->nsat = acc[ACC_NSAT*nch + c];
+		q->flat = (acc[ACC_MIN*nch + c] == acc[ACC_MAX*nch + c]);
+		q->ns = qm->window;
+	}
+	mm_thr_mutex_unlock(&qm->lock);
+
+	reset_accumulators(qm, c0, c1);
+}
+
+
+LOCAL_FN
+void egdi_destroy_quality_monitor(struct quality_monitor* qm)
+{
+	if (!qm)
+		return;
+
+	mm_thr_mutex_deinit(&qm->lock);
+	free(qm->spans);
+	free(qm->acc);
+	free(qm->res);
+	free(qm);
+}
+
+
+/* Create the monitor computing the statistics over windows of window
+ * samples of the channels of the nspan spans. limits holds the minimal
+ * and maximal values of each channel (in the order of the spans) below
+ * and above which a value is counted as saturated. */
+LOCAL_FN
+struct quality_monitor* egdi_create_quality_monitor(unsigned int window,
+                                          unsigned int nspan,
+                                          const struct egd_chspan* spans,
+                                          const double* limits)
+{
+	unsigned int i, c, nch = 0;
+	struct quality_monitor* qm;
+
+	for (i=0; i<nspan; i++)
+		nch += spans[i].nch;
+
+	if (!(qm = calloc(1, sizeof(*qm))))
+		return NULL;
+	if (mm_thr_mutex_init(&qm->lock, 0)) {
+		free(qm);
+		return NULL;
+	}
+	if (!(qm->spans = malloc(nspan*sizeof(*spans)))
+	   || !(qm->acc = malloc(NACC*nch*sizeof(*qm->acc)))
+	   || !(qm->res = calloc(nch, sizeof(*qm->res)))) {
+		egdi_destroy_quality_monitor(qm);
+		return NULL;
+	}
+
+	qm->window = window;
+	qm->nspan = nspan;
+	qm->nch = nch;
+	qm->accumulate = get_accumulate_fn();
+	memcpy(qm->spans, spans, nspan*sizeof(*spans));
+	for (c=0; c<nch; c++) {
+		qm->acc[ACC_LO*nch + c] = limits[2*c];
+		qm->acc[ACC_HI*nch + c] = limits[2*c+1];
+	}
+	reset_accumulators(qm, 0, nch);
+
+	return qm;
+}
+
+
+// Restart the current window and forget the statistics published (done
+// when an acquisition starts)
+LOCAL_FN
+void egdi_reset_quality(struct quality_monitor* qm)
+{
+	qm->n = 0;
+	reset_accumulators(qm, 0, qm->nch);
+
+	mm_thr_mutex_lock(&qm->lock);
+	memset(qm->res, 0, qm->nch*sizeof(*qm->res));
+	mm_thr_mutex_unlock(&qm->lock);
+}
+
+
+// Prototype of the function accumulating the channels [c0, c1) of a span
+// located at offset in ns successive samples (samlen bytes apart). The
+// channels are processed by blocks of CHBLOCK channels. The samples of the
+// ring are not necessarily aligned on the size of type, hence the memcpy
+#define DEFINE_QUALITY_FN(type)						\
+static									\
+void quality_##type(const struct quality_monitor* qm, const char* buff,\
+                    size_t samlen, size_t ns, unsigned int offset,	\
+                    double* acc, size_t c0, size_t c1)			\
+{									\
+	double v[CHBLOCK];						\
+	type x[CHBLOCK];						\
+	unsigned int c, nc;						\
+	size_t s;							\
+									\
+	for (; c0<c1; c0+=nc) {						\
+		nc = (c1-c0 < CHBLOCK) ? c1-c0 : CHBLOCK;		\
+		for (s=0; s<ns; s++) {					\
+			memcpy(x, buff + s*samlen + offset		\
+			          + c0*sizeof(type), nc*sizeof(type));	\
+			for (c=0; c<nc; c++)				\
+				v[c] = x[c];				\
+			qm->accumulate(acc + c0, qm->nch, v, nc);	\
+		}							\
+	}								\
+}
+
+DEFINE_QUALITY_FN(float)
+DEFINE_QUALITY_FN(double)
+
+
+/* Accumulate the ns complete samples of the ring buffer starting at the
+ * position ind and publish the windows completed by them. The channels of
+ * each span are split in npart contiguous parts, ipart being processed by
+ * the call, so that the parts can be processed concurrently. Once all the
+ * parts are done, egdi_advance_quality() must be called. */
+LOCAL_FN
+void egdi_update_quality(struct quality_monitor* qm, const char* buffer,
+                         size_t buffsize, size_t samlen, size_t ind,
+                         size_t ns, unsigned int ipart, unsigned int npart)
+{
+	unsigned int i;
+	size_t nrun, pos, rest, c0, c1, nch, n, first = 0;
+	const struct egd_chspan* sp;
+
+	for (i=0; i<qm->nspan; i++, first += nch) {
+		sp = qm->spans + i;
+		nch = sp->nch;
+		c0 = (nch*ipart/npart) & ~(size_t)(CHALIGN-1);
+		c1 = (ipart+1 == npart) ? nch
+		         : (nch*(ipart+1)/npart) & ~(size_t)(CHALIGN-1);
+
+		// Accumulate by runs of samples not crossing the end of ring
+		// nor the end of the window
+		pos = ind;
+		rest = ns;
+		n = qm->n;
+		while (rest && c0 < c1) {
+			nrun = (buffsize - pos) / samlen;
+			if (nrun > rest)
+				nrun = rest;
+			if (nrun > qm->window - n)
+				nrun = qm->window - n;
+			if (sp->type == EGD_FLOAT)
+				quality_float(qm, buffer+pos, samlen, nrun,
+				              sp->offset, qm->acc + first,
+				              c0, c1);
+			else
+				quality_double(qm, buffer+pos, samlen, nrun,
+				               sp->offset, qm->acc + first,
+				               c0, c1);
+
+			n += nrun;
+			if (n == qm->window) {
+				publish_window(qm, first+c0, first+c1);
+				n = 0;
+			}
+			rest -= nrun;
+			pos = (pos + nrun*samlen) % buffsize;
+		}
+	}
+}
+
+
+// Move the position in the current window after ns samples have been
+// accumulated by egdi_update_quality()
+LOCAL_FN
+void egdi_advance_quality(struct quality_monitor* qm, size_t ns)
+{
+	qm->n = (qm->n + ns) % qm->window;
+}
+
+
+/* Write the statistics of the last complete window of the monitored
+ * channels of the sensor type stype in quality, at the index of the
+ * channels among those of stype. */
+LOCAL_FN
+void egdi_read_quality(struct quality_monitor* qm, int stype,
+                       struct egd_quality* quality)
+{
+	unsigned int i, first = 0;
+	const struct egd_chspan* sp;
+
+	mm_thr_mutex_lock(&qm->lock);
+	for (i=0; i<qm->nspan; i++) {
+		sp = qm->spans + i;
+		if (sp->stype == stype)
+			memcpy(quality + sp->index, qm->res + first,
+			       sp->nch*sizeof(*quality));
+		first += sp->nch;
+	}
+	mm_thr_mutex_unlock(&qm->lock);
+}
@@ -0,0 +1,243 @@
+/*
+    Copyright (C) 2010-2012  EPFL (Ecole Polytechnique Fédérale de Lausanne)
+    Laboratory CNBI (Chair in Non-Invasive Brain-Machine Interface)
+    Nicolas Bourdaud <nicolas.bourdaud@epfl.ch>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "coreinternals.h"
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+/* Rational resampling by up/down with a polyphase FIR. The prototype
+ * low-pass filter is a Blackman windowed sinc of up*ntap coefficients
+ * whose stopband starts at the Nyquist frequency of the lowest of the
+ * input and output rates. The output sample j is
+ *
+ *     y[j] = sum_k h[p + k*up] * x[n - k],  n = (j*down)/up,
+ *                                          p = (j*down)%up
+ *
+ * so only past input samples are used (causal filter, delaying the signal
+ * by (up*ntap-1)/(2*up) input samples). Each phase is normalized to a
+ * unit gain at DC. Input samples preceding the start of the acquisition
+ * are replaced by the first one. */
+
+// Length of the filter in multiple of max(up, down): the transition band
+// of the window is then about a tenth of the lowest Nyquist frequency
+#define TAPS_PER_FACTOR	55
+#define MAX_FILTER_LEN	(1 << 20)
+#define CHBLOCK		64	// channels accumulated at once
+
+struct resampler {
+	unsigned int up, down, ntap;
+	double* hd;	// coefficients of the phase p at hd + p*ntap
+	float* hf;	// same in single precision
+};
+
+
+static
+double sinc(double x)
+{
+	return (x == 0.0) ? 1.0 : sin(M_PI*x) / (M_PI*x);
+}
+
+
+static
+void design_filter(struct resampler* rs, double* h)
+{
+	unsigned int i, p, k, len = rs->up * rs->ntap;
+	unsigned int fmax = (rs->up > rs->down) ? rs->up : rs->down;
+	double fc, x, w, sum;
+
+	// Cutoff (normalized to the upsampled rate) in the middle of the
+	// transition band ending at the lowest Nyquist frequency
+	fc = (0.5 - 2.75/TAPS_PER_FACTOR) / fmax;
+	for (i=0; i<len; i++) {
+		x = i - (len-1)/2.0;
+		w = 0.42 - 0.5*cos(2.0*M_PI*i/(len-1))
+		         + 0.08*cos(4.0*M_PI*i/(len-1));
+		h[i] = 2.0*fc*sinc(2.0*fc*x) * w;
+	}
+
+	// Reorder by phase and normalize each phase
+	for (p=0; p<rs->up; p++) {
+		sum = 0.0;
+		for (k=0; k<rs->ntap; k++)
+			sum += h[p + k*rs->up];
+		for (k=0; k<rs->ntap; k++) {
+			rs->hd[p*rs->ntap + k] = h[p + k*rs->up] / sum;
+			rs->hf[p*rs->ntap + k] = rs->hd[p*rs->ntap + k];
+		}
+	}
+}
+
+
+LOCAL_FN
+void egdi_destroy_resampler(struct resampler* rs)
+{
+	if (!rs)
+		return;
+
+	free(rs->hd);
+	free(rs->hf);
+	free(rs);
+}
+
+
+/* Create a resampler converting a rate into rate*up/down (up and down
+ * being coprime). Returns NULL with errno set to EINVAL if the filter
+ * would be too long. */
+LOCAL_FN
+struct resampler* egdi_create_resampler(unsigned int up, unsigned int down)
+{
+	struct resampler* rs;
+	unsigned int fmax = (up > down) ? up : down;
+	double* h = NULL;
+	size_t len;
+
+	if (!up || !down || fmax > MAX_FILTER_LEN/TAPS_PER_FACTOR) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(rs = calloc(1, sizeof(*rs))))
+		return NULL;
+
+	rs->up = up;
+	rs->down = down;
+	rs->ntap = (TAPS_PER_FACTOR*fmax + up-1) / up;
+	len = (size_t)up * rs->ntap;
+	if (!(rs->hd = malloc(len*sizeof(*rs->hd)))
+	   || !(rs->hf = malloc(len*sizeof(*rs->hf)))
+	   || !(h = malloc(len*sizeof(*h)))) {
+		free(h);
+		egdi_destroy_resampler(rs);
+		return NULL;
+	}
+
+	design_filter(rs, h);
+	free(h);
+	return rs;
+}
+
+
+// Number of input samples (including the current one) used to compute
+// an output sample
+LOCAL_FN
+unsigned int egdi_get_resampler_history(const struct resampler* rs)
+{
+	return rs->ntap;
+}
+
+
+// Index of the first output sample computed from the input samples
+// starting at the index n
+LOCAL_FN
+uint64_t egdi_get_resampled_index(const struct resampler* rs, uint64_t n)
+{
+	return (n*rs->up + rs->down-1) / rs->down;
+}
+
+
+// Ring position of the sample n of the ring described by src
+static inline
+size_t get_ring_pos(const struct resample_src* src, uint64_t n)
+{
+	int64_t d = (int64_t)(n - src->first);
+	int64_t pos = (int64_t)src->pos_first + d*(int64_t)src->samlen;
+
+	pos %= (int64_t)src->buffsize;
+	return (pos < 0) ? (size_t)(pos + (int64_t)src->buffsize) : (size_t)pos;
+}
+
+
+// Prototype of the resampling function of a type. The output samples are
+// written in blocks of CHBLOCK channels accumulated in acc. The samples of
+// the ring and of the output are not necessarily aligned on the size of
+// type, hence the memcpy
+#define DEFINE_RESAMPLE_FN(type, coefs)					\
+static									\
+void resample_##type(const struct resampler* rs,			\
+                     const struct resample_src* src,			\
+                     char* dst, size_t samstride, size_t elstride,	\
+                     uint64_t j, size_t nout)				\
+{									\
+	type acc[CHBLOCK];						\
+	type x[CHBLOCK];						\
+	const type* restrict h;						\
+	unsigned int c, c0, nc, k;					\
+	uint64_t n;							\
+	size_t s, pos, back;						\
+									\
+	for (s=0; s<nout; s++, j++) {					\
+		n = j*rs->down / rs->up;				\
+		h = rs->coefs + (j*rs->down % rs->up)*rs->ntap;		\
+		for (c0=0; c0<src->nch; c0+=CHBLOCK) {			\
+			nc = src->nch - c0;				\
+			nc = (nc < CHBLOCK) ? nc : CHBLOCK;		\
+			for (c=0; c<nc; c++)				\
+				acc[c] = 0;				\
+									\
+			/* Walk back from the sample n, holding the	\
+			   first sample of the acquisition */		\
+			pos = get_ring_pos(src, n);			\
+			for (k=0; k<rs->ntap; k++) {			\
+				memcpy(x, src->buffer + pos + src->offset \
+				          + c0*sizeof(type),		\
+				       nc*sizeof(type));		\
+				for (c=0; c<nc; c++)			\
+					acc[c] += h[k] * x[c];		\
+				back = (n > k) ? src->samlen : 0;	\
+				pos = (pos >= back) ? pos - back	\
+				            : pos + src->buffsize - back;\
+			}						\
+									\
+			for (c=0; c<nc; c++)				\
+				memcpy(dst + s*samstride		\
+				       + (c0+c)*elstride, acc + c,	\
+				       sizeof(type));			\
+		}							\
+	}								\
+}
+
+DEFINE_RESAMPLE_FN(float, hf)
+DEFINE_RESAMPLE_FN(double, hd)
+
+
+/* Compute nout output samples starting at the output sample j of the
+ * channels (of type EGD_FLOAT or EGD_DOUBLE) described by src. The value
+ * of the channel c of the output s is written at dst + s*samstride +
+ * c*elstride. The input samples needed must be in the ring. */
+LOCAL_FN
+void egdi_resample(const struct resampler* rs, int type,
+                   const struct resample_src* src, char* dst,
+                   size_t samstride, size_t elstride,
+                   uint64_t j, size_t nout)
+{
+	if (type == EGD_FLOAT)
+		resample_float(rs, src, dst, samstride, elstride, j, nout);
+	else
+		resample_double(rs, src, dst, samstride, elstride, j, nout);
+}
@@ -0,0 +1,243 @@
+/*
+    Copyright (C) 2010-2012  EPFL (Ecole Polytechnique Fédérale de Lausanne)
+    Laboratory CNBI (Chair in Non-Invasive Brain-Machine Interface)
+    Nicolas Bourdaud <nicolas.bourdaud@epfl.ch>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mmthread.h>
+#include "coreinternals.h"
+
+/* The staging queue is a single-producer single-consumer ring of records,
+ * each made of a header followed by the raw bytes supplied by the plugin.
+ * A record never wraps around the end of the ring: if it does not fit, a
+ * padding record fills the end and the record is written at the start.
+ * The producer only moves tail and the consumer only moves head, hence no
+ * lock is needed to exchange data. The mutex and the condition are only
+ * used to wake up the consumer when it sleeps on an empty queue. */
+
+#define PADDING_DIV	0
+#define RECORD_ALIGN	sizeof(struct record)
+
+struct record {
+	uint32_t div;
+	uint32_t len;
+	uint64_t size;	// size of the record including header and padding
+};
+
+struct staging_queue {
+	char* buffer;
+	size_t size;
+	size_t head, tail;	// written with atomics
+	int sleeping, quit;	// written with atomics
+	int stopped;		// set once the consumer has been joined
+
+	mm_thr_mutex_t lock;
+	mm_thr_cond_t cond;
+	mm_thread_t thid;
+
+	staging_function fn;
+	void* arg;
+};
+
+
+static
+void wake_consumer(struct staging_queue* sq)
+{
+	if (!__atomic_load_n(&sq->sleeping, __ATOMIC_SEQ_CST))
+		return;
+
+	mm_thr_mutex_lock(&sq->lock);
+	mm_thr_cond_signal(&sq->cond);
+	mm_thr_mutex_unlock(&sq->lock);
+}
+
+
+// Wait until the queue is not empty or the consumer must quit. Returns the
+// tail seen, equal to head if the consumer must quit.
+static
+size_t wait_for_records(struct staging_queue* sq, size_t head)
+{
+	size_t tail;
+
+	tail = __atomic_load_n(&sq->tail, __ATOMIC_ACQUIRE);
+	if (tail != head || __atomic_load_n(&sq->quit, __ATOMIC_ACQUIRE))
+		return tail;
+
+	mm_thr_mutex_lock(&sq->lock);
+	__atomic_store_n(&sq->sleeping, 1, __ATOMIC_SEQ_CST);
+	while ((tail = __atomic_load_n(&sq->tail, __ATOMIC_SEQ_CST)) == head
+	       && !__atomic_load_n(&sq->quit, __ATOMIC_SEQ_CST))
+		mm_thr_cond_wait(&sq->cond, &sq->lock);
+	__atomic_store_n(&sq->sleeping, 0, __ATOMIC_RELAXED);
+	mm_thr_mutex_unlock(&sq->lock);
+
+	return tail;
+}
+
+
+static
+void* consumer_proc(void* arg)
+{
+	struct staging_queue* sq = arg;
+	const struct record* rec;
+	size_t head = 0, tail;
+
+	while (1) {
+		tail = wait_for_records(sq, head);
+		if (tail == head)
+			break;
+
+		// Process all the records available, releasing the space of
+		// each one as soon as it is processed
+		while (head != tail) {
+			rec = (const struct record*)(sq->buffer
+			                              + head % sq->size);
+			if (rec->div != PADDING_DIV)
+				sq->fn(sq->arg, rec->div, rec+1, rec->len);
+			head += rec->size;
+			__atomic_store_n(&sq->head, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Process the records already queued and stop the consumer thread. The data
+ * staged afterwards is discarded. The queue stays allocated until
+ * egdi_destroy_staging() so that a producer still running can use it. */
+LOCAL_FN
+void egdi_stop_staging(struct staging_queue* sq)
+{
+	if (!sq || sq->stopped)
+		return;
+
+	mm_thr_mutex_lock(&sq->lock);
+	__atomic_store_n(&sq->quit, 1, __ATOMIC_SEQ_CST);
+	mm_thr_cond_signal(&sq->cond);
+	mm_thr_mutex_unlock(&sq->lock);
+	mm_thr_join(sq->thid, NULL);
+	sq->stopped = 1;
+}
+
+
+LOCAL_FN
+void egdi_destroy_staging(struct staging_queue* sq)
+{
+	if (!sq)
+		return;
+
+	egdi_stop_staging(sq);
+	mm_thr_cond_deinit(&sq->cond);
+	mm_thr_mutex_deinit(&sq->lock);
+	free(sq->buffer);
+	free(sq);
+}
+
+
+LOCAL_FN
+struct staging_queue* egdi_create_staging(size_t size, staging_function fn,
+                                          void* arg)
+{
+	int stinit = 0;
+	struct staging_queue* sq;
+
+	size = (size + RECORD_ALIGN-1) & ~(RECORD_ALIGN-1);
+	if (size < 2*RECORD_ALIGN) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(sq = calloc(1, sizeof(*sq)))
+	   || !(sq->buffer = malloc(size))
+	   || mm_thr_mutex_init(&sq->lock, 0) || !(++stinit)
+	   || mm_thr_cond_init(&sq->cond, 0) || !(++stinit))
+		goto fail;
+
+	sq->size = size;
+	sq->fn = fn;
+	sq->arg = arg;
+	if (mm_thr_create(&sq->thid, consumer_proc, sq))
+		goto fail;
+
+	return sq;
+
+fail:
+	if (stinit--)
+		mm_thr_cond_deinit(&sq->cond);
+	if (stinit--)
+		mm_thr_mutex_deinit(&sq->lock);
+	if (sq)
+		free(sq->buffer);
+	free(sq);
+	return NULL;
+}
+
+
+/* Append len bytes pointed by in to the queue and return immediately. The
+ * bytes will be passed to the function of the queue with div by the
+ * consumer thread (they are dropped if the queue has been stopped). Must be
+ * called always by the same thread. Returns -1 with errno set to ENOMEM if
+ * the queue is full. */
+LOCAL_FN
+int egdi_stage_data(struct staging_queue* sq, unsigned int div,
+                    const void* in, size_t len)
+{
+	struct record* rec;
+	size_t head, tail, pos, recsize, pad = 0;
+
+	if (__atomic_load_n(&sq->quit, __ATOMIC_ACQUIRE))
+		return 0;
+
+	recsize = (sizeof(*rec) + len + RECORD_ALIGN-1) & ~(RECORD_ALIGN-1);
+	tail = __atomic_load_n(&sq->tail, __ATOMIC_RELAXED);
+	head = __atomic_load_n(&sq->head, __ATOMIC_ACQUIRE);
+
+	// Pad the end of the ring if the record does not fit before it
+	pos = tail % sq->size;
+	if (pos + recsize > sq->size)
+		pad = sq->size - pos;
+
+	if (recsize > sq->size || tail + pad + recsize - head > sq->size) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (pad) {
+		rec = (struct record*)(sq->buffer + pos);
+		rec->div = PADDING_DIV;
+		rec->size = pad;
+		tail += pad;
+		pos = 0;
+	}
+
+	rec = (struct record*)(sq->buffer + pos);
+	rec->div = div;
+	rec->len = len;
+	rec->size = recsize;
+	memcpy(rec+1, in, len);
+
+	__atomic_store_n(&sq->tail, tail + recsize, __ATOMIC_SEQ_CST);
+	wake_consumer(sq);
+	return 0;
+}
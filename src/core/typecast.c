@@ -22,40 +22,66 @@
 #include <string.h>
 #include "coreinternals.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_SIMD	1
+# include <immintrin.h>
+#else
+# define HAVE_X86_SIMD	0
+#endif
+
 // Prototype of a generic type scale and cast function
 #define DEFINE_CAST_FN(tsrc, tdst)			\
-static void cast_##tsrc##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len)	\
+static void cast_##tsrc##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len, size_t ns, size_t dstride, size_t sstride)	\
 {									\
-	const tsrc* src = s;						\
-	tdst* dst = d;							\
+	const char* src = s;						\
+	char* dst = d;							\
 	tdst scale = sc.val##tdst ;					\
-	while(len) {							\
-		*dst = scale * ((tdst)(*src));				\
-		src++;							\
-		dst++;							\
-		len -= sizeof(*src);					\
+	size_t i, n = len / sizeof(tsrc);				\
+	while (ns--) {							\
+		const tsrc* restrict ps = (const tsrc*)src;		\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i<n; i++)					\
+			pd[i] = scale * ((tdst)ps[i]);			\
+		src += sstride;						\
+		dst += dstride;						\
 	}								\
 }						
 
 // Prototype of a generic type cast function
 #define DEFINE_CASTNOSC_FN(tsrc, tdst)				\
-static void castnosc_##tsrc##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len)	\
+static void castnosc_##tsrc##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len, size_t ns, size_t dstride, size_t sstride)	\
 {									\
 	(void)sc;							\
-	const tsrc* src = s;						\
-	tdst* dst = d;							\
-	while(len) {							\
-		*dst = ((tdst)(*src));					\
-		src++;							\
-		dst++;							\
-		len -= sizeof(*src);					\
+	const char* src = s;						\
+	char* dst = d;							\
+	size_t i, n = len / sizeof(tsrc);				\
+	while (ns--) {							\
+		const tsrc* restrict ps = (const tsrc*)src;		\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i<n; i++)					\
+			pd[i] = ((tdst)ps[i]);				\
+		src += sstride;						\
+		dst += dstride;						\
 	}								\
 }						
 
-static void identity(void* restrict d, const void* restrict s, union gval sc, size_t len)
+static void identity(void* restrict d, const void* restrict s, union gval sc, size_t len, size_t ns, size_t dstride, size_t sstride)
 {
+	const char* src = s;
+	char* dst = d;
 	(void)sc;
-	memcpy(d, s, len);
+
+	// Both side contiguous: copy everything at once
+	if (dstride == len && sstride == len) {
+		memcpy(d, s, len*ns);
+		return;
+	}
+
+	while (ns--) {
+		memcpy(dst, src, len);
+		src += sstride;
+		dst += dstride;
+	}
 }
 
 // Declaration/definition of type cast and scale functions
@@ -80,29 +106,1317 @@ DEFINE_CASTNOSC_FN(double, int32_t)
 DEFINE_CASTNOSC_FN(double, float)
 #define castnosc_double_double identity
 
-#define TABLE_ENTRY(egdtype, datatype) \
+
+/*******************************************************************
+ *                        Narrow output types                      *
+ *******************************************************************/
+/* Values are computed in single precision then converted to the narrow
+ * type. Integer types saturate. All conversions round to the nearest (ties
+ * to even), hence give the same results as the SIMD versions */
+typedef uint16_t half;
+
+// Round to nearest integer in the current rounding mode (|x| < 2^22)
+static inline int32_t round_float(float x)
+{
+	return (int32_t)((x + 12582912.0f) - 12582912.0f);
+}
+
+// Clamp x in [lo, hi], NaN giving lo (like SIMD max then min)
+static inline float clamp_float(float x, float lo, float hi)
+{
+	x = (x > lo) ? x : lo;
+	return (x < hi) ? x : hi;
+}
+
+static inline int16_t to_int16_t(float x)
+{
+	return round_float(clamp_float(x, -32768.0f, 32767.0f));
+}
+
+static inline uint16_t to_uint16_t(float x)
+{
+	return round_float(clamp_float(x, 0.0f, 65535.0f));
+}
+
+static inline uint8_t to_uint8_t(float x)
+{
+	return round_float(clamp_float(x, 0.0f, 255.0f));
+}
+
+// IEEE 754 binary16 conversion (same results as the F16C instructions)
+static inline half to_half(float x)
+{
+	uint32_t v, absv, h, rem, m, shift;
+	uint16_t sign;
+
+	memcpy(&v, &x, sizeof(v));
+	sign = (v >> 16) & 0x8000;
+	absv = v & 0x7FFFFFFF;
+
+	// Inf, NaN (made quiet) and overflow
+	if (absv >= 0x7F800000)
+		return sign | 0x7C00
+		       | ((absv > 0x7F800000) ? 0x200 | ((absv >> 13) & 0x3FF) : 0);
+	if (absv >= 0x477FF000)
+		return sign | 0x7C00;
+
+	// Subnormal half: the mantissa is shifted according to the exponent
+	if (absv < 0x38800000) {
+		shift = 126 - (absv >> 23);
+		if (shift > 24)
+			return sign;
+		m = (absv & 0x7FFFFF) | 0x800000;
+		h = m >> shift;
+		rem = m & ((1u << shift) - 1);
+		if (rem > (1u << (shift-1))
+		    || (rem == (1u << (shift-1)) && (h & 1)))
+			h++;
+		return sign | h;
+	}
+
+	// Normal half: rebias the exponent and round the mantissa
+	h = (absv - 0x38000000) >> 13;
+	rem = absv & 0x1FFF;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+		h++;
+	return sign | h;
+}
+
+// Read the element i of an input array as a float
+#define int32_t_SIZE	sizeof(int32_t)
+#define float_SIZE	sizeof(float)
+#define double_SIZE	sizeof(double)
+#define READ_int32_t(p, i)	((float)((const int32_t*)(p))[i])
+#define READ_float(p, i)	(((const float*)(p))[i])
+#define READ_double(p, i)	((float)((const double*)(p))[i])
+
+// Prototype of a cast function to a narrow type (scaled if bsc != 0)
+#define DEFINE_NARROW_CAST_FN(name, tsrc, tdst, bsc)			\
+static void name##_##tsrc##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	const char* src = s;						\
+	char* dst = d;							\
+	float scale = (bsc) ? sc.valfloat : 0;				\
+	size_t i, n = len / tsrc##_SIZE;				\
+	while (ns--) {							\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i<n; i++)					\
+			pd[i] = to_##tdst((bsc) ? scale*READ_##tsrc(src, i) \
+			                        : READ_##tsrc(src, i));	\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+#define DEFINE_NARROW_CAST_FNS(tsrc)					\
+DEFINE_NARROW_CAST_FN(cast, tsrc, int16_t, 1)				\
+DEFINE_NARROW_CAST_FN(cast, tsrc, half, 1)				\
+DEFINE_NARROW_CAST_FN(cast, tsrc, uint8_t, 1)				\
+DEFINE_NARROW_CAST_FN(cast, tsrc, uint16_t, 1)				\
+DEFINE_NARROW_CAST_FN(castnosc, tsrc, int16_t, 0)			\
+DEFINE_NARROW_CAST_FN(castnosc, tsrc, half, 0)				\
+DEFINE_NARROW_CAST_FN(castnosc, tsrc, uint8_t, 0)			\
+DEFINE_NARROW_CAST_FN(castnosc, tsrc, uint16_t, 0)
+
+DEFINE_NARROW_CAST_FNS(int32_t)
+DEFINE_NARROW_CAST_FNS(float)
+DEFINE_NARROW_CAST_FNS(double)
+
+/* Tables are indexed by [input type][scaling][output type]. The functions
+ * for the wide output types are prefixed by pre, those for the narrow
+ * ones by npre */
+#define NARROW_ENTRIES(npre, name, datatype)				\
+		       [EGD_INT16] = npre##name##_##datatype##_int16_t, \
+		       [EGD_FLOAT16] = npre##name##_##datatype##_half,	\
+		       [EGD_UINT8] = npre##name##_##datatype##_uint8_t,	\
+		       [EGD_UINT16] = npre##name##_##datatype##_uint16_t
+
+#define TABLE_ENTRY(pre, npre, egdtype, datatype) \
 	[egdtype] = {							\
-		[0] = {[EGD_INT32] = castnosc_##datatype##_int32_t,	\
-		       [EGD_FLOAT] = castnosc_##datatype##_float,	\
-		       [EGD_DOUBLE] = castnosc_##datatype##_double}, \
-		[1] = {[EGD_INT32] = cast_##datatype##_int32_t, 	\
-		       [EGD_FLOAT] = cast_##datatype##_float,	\
-		       [EGD_DOUBLE] = cast_##datatype##_double},	\
-	}
-static cast_function convtable[3][2][3] = {
-	TABLE_ENTRY(EGD_INT32, int32_t),
-	TABLE_ENTRY(EGD_FLOAT, float),
-	TABLE_ENTRY(EGD_DOUBLE, double)
+		[0] = {[EGD_INT32] = pre##castnosc_##datatype##_int32_t, \
+		       [EGD_FLOAT] = pre##castnosc_##datatype##_float,	\
+		       [EGD_DOUBLE] = pre##castnosc_##datatype##_double, \
+		       NARROW_ENTRIES(npre, castnosc, datatype)},	\
+		[1] = {[EGD_INT32] = pre##cast_##datatype##_int32_t, 	\
+		       [EGD_FLOAT] = pre##cast_##datatype##_float,	\
+		       [EGD_DOUBLE] = pre##cast_##datatype##_double,	\
+		       NARROW_ENTRIES(npre, cast, datatype)},		\
+	}
+
+#define DEFINE_CONVTABLE(pre, npre)					\
+static cast_function pre##convtable[3][2][EGD_NUM_DTYPE] = {		\
+	TABLE_ENTRY(pre, npre, EGD_INT32, int32_t),			\
+	TABLE_ENTRY(pre, npre, EGD_FLOAT, float),			\
+	TABLE_ENTRY(pre, npre, EGD_DOUBLE, double)			\
+};
+
+DEFINE_CONVTABLE(,)
+
+
+/*******************************************************************
+ *                   Packed and big-endian input                   *
+ *******************************************************************/
+/* The input-only types are unpacked to int32_t from their bytes, so the
+ * result does not depend on the endianness of the host */
+#define int16le_SIZE	2
+#define int16be_SIZE	2
+#define int24le_SIZE	3
+#define int24be_SIZE	3
+#define int32be_SIZE	4
+
+static inline int32_t unpack_int16le(const unsigned char* p)
+{
+	return (int16_t)(p[0] | (p[1] << 8));
+}
+
+static inline int32_t unpack_int16be(const unsigned char* p)
+{
+	return (int16_t)((p[0] << 8) | p[1]);
+}
+
+static inline int32_t unpack_int24le(const unsigned char* p)
+{
+	uint32_t v = ((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16)
+	             | ((uint32_t)p[2] << 24);
+	return ((int32_t)v) >> 8;
+}
+
+static inline int32_t unpack_int24be(const unsigned char* p)
+{
+	uint32_t v = ((uint32_t)p[2] << 8) | ((uint32_t)p[1] << 16)
+	             | ((uint32_t)p[0] << 24);
+	return ((int32_t)v) >> 8;
+}
+
+static inline int32_t unpack_int32be(const unsigned char* p)
+{
+	return (int32_t)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	                 | ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+// Prototype of a cast function from a packed type (scaled if bsc != 0)
+#define DEFINE_PACKED_CAST_FN(name, tin, tdst, bsc)			\
+static void name##_##tin##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	const unsigned char* src = s;					\
+	char* dst = d;							\
+	tdst scale = (bsc) ? sc.val##tdst : 0;				\
+	size_t i, n = len / tin##_SIZE;					\
+	while (ns--) {							\
+		const unsigned char* restrict ps = src;			\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i<n; i++)					\
+			pd[i] = (bsc)					\
+			  ? scale * ((tdst)unpack_##tin(ps+i*tin##_SIZE))\
+			  : ((tdst)unpack_##tin(ps+i*tin##_SIZE));	\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+#define DEFINE_PACKED_CAST_FNS(tin)					\
+DEFINE_PACKED_CAST_FN(cast, tin, int32_t, 1)				\
+DEFINE_PACKED_CAST_FN(cast, tin, float, 1)				\
+DEFINE_PACKED_CAST_FN(cast, tin, double, 1)				\
+DEFINE_PACKED_CAST_FN(castnosc, tin, int32_t, 0)			\
+DEFINE_PACKED_CAST_FN(castnosc, tin, float, 0)				\
+DEFINE_PACKED_CAST_FN(castnosc, tin, double, 0)
+
+DEFINE_PACKED_CAST_FNS(int16le)
+DEFINE_PACKED_CAST_FNS(int16be)
+DEFINE_PACKED_CAST_FNS(int24le)
+DEFINE_PACKED_CAST_FNS(int24be)
+DEFINE_PACKED_CAST_FNS(int32be)
+
+#define READ_PACKED(tin, p, i)	\
+	((float)unpack_##tin((const unsigned char*)(p) + (i)*tin##_SIZE))
+#define READ_int16le(p, i)	READ_PACKED(int16le, p, i)
+#define READ_int16be(p, i)	READ_PACKED(int16be, p, i)
+#define READ_int24le(p, i)	READ_PACKED(int24le, p, i)
+#define READ_int24be(p, i)	READ_PACKED(int24be, p, i)
+#define READ_int32be(p, i)	READ_PACKED(int32be, p, i)
+
+DEFINE_NARROW_CAST_FNS(int16le)
+DEFINE_NARROW_CAST_FNS(int16be)
+DEFINE_NARROW_CAST_FNS(int24le)
+DEFINE_NARROW_CAST_FNS(int24be)
+DEFINE_NARROW_CAST_FNS(int32be)
+
+#define DEFINE_PACKEDTABLE(pre, npre)					\
+static cast_function pre##packedtable[EGDI_NUM_INDTYPE][2][EGD_NUM_DTYPE] = { \
+	TABLE_ENTRY(pre, npre, EGDI_INT16LE-EGDI_FIRST_INDTYPE, int16le), \
+	TABLE_ENTRY(pre, npre, EGDI_INT16BE-EGDI_FIRST_INDTYPE, int16be), \
+	TABLE_ENTRY(pre, npre, EGDI_INT24LE-EGDI_FIRST_INDTYPE, int24le), \
+	TABLE_ENTRY(pre, npre, EGDI_INT24BE-EGDI_FIRST_INDTYPE, int24be), \
+	TABLE_ENTRY(pre, npre, EGDI_INT32BE-EGDI_FIRST_INDTYPE, int32be) \
+};
+
+DEFINE_PACKEDTABLE(,)
+
+
+#if HAVE_X86_SIMD
+/*******************************************************************
+ *                  SIMD versions of cast functions                *
+ *******************************************************************/
+/* Each ISA provides a step function per (input, output) type pair that
+ * casts (and scales if bsc is set) a fixed number of elements (<isa>_W).
+ * The cast functions of the ISA loop over this step and finish each block
+ * of channels with scalar code computing exactly what the scalar cast
+ * functions do (hence results are bit-identical whatever the ISA) */
+
+// Prototype of a SIMD type cast function (scaled if bsc != 0)
+#define DEFINE_SIMD_CAST_FN(isa, name, tsrc, tdst, bsc)		\
+static __attribute__((target(isa##_TARGET)))				\
+void isa##_##name##_##tsrc##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	const char* src = s;						\
+	char* dst = d;							\
+	tdst scale = (bsc) ? sc.val##tdst : 0;				\
+	size_t i, n = len / sizeof(tsrc);				\
+	while (ns--) {							\
+		const tsrc* restrict ps = (const tsrc*)src;		\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i+isa##_W<=n; i+=isa##_W)			\
+			isa##_##tsrc##_##tdst(pd+i, ps+i, scale, bsc);	\
+		for (; i<n; i++)					\
+			pd[i] = (bsc) ? scale * ((tdst)ps[i])		\
+			              : ((tdst)ps[i]);			\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+#define DEFINE_SIMD_CAST_FNS(isa)					\
+DEFINE_SIMD_CAST_FN(isa, cast, int32_t, int32_t, 1)			\
+DEFINE_SIMD_CAST_FN(isa, cast, int32_t, double, 1)			\
+DEFINE_SIMD_CAST_FN(isa, cast, double, int32_t, 1)			\
+DEFINE_SIMD_CAST_FN(isa, cast, int32_t, float, 1)			\
+DEFINE_SIMD_CAST_FN(isa, cast, float, int32_t, 1)			\
+DEFINE_SIMD_CAST_FN(isa, cast, float, double, 1)			\
+DEFINE_SIMD_CAST_FN(isa, cast, double, float, 1)			\
+DEFINE_SIMD_CAST_FN(isa, cast, float, float, 1)			\
+DEFINE_SIMD_CAST_FN(isa, cast, double, double, 1)			\
+DEFINE_SIMD_CAST_FN(isa, castnosc, int32_t, float, 0)			\
+DEFINE_SIMD_CAST_FN(isa, castnosc, int32_t, double, 0)		\
+DEFINE_SIMD_CAST_FN(isa, castnosc, float, int32_t, 0)			\
+DEFINE_SIMD_CAST_FN(isa, castnosc, float, double, 0)			\
+DEFINE_SIMD_CAST_FN(isa, castnosc, double, int32_t, 0)		\
+DEFINE_SIMD_CAST_FN(isa, castnosc, double, float, 0)
+
+
+/**************************** SSE2 *********************************/
+#define sse2_TARGET	"sse2"
+#define sse2_W		4
+#define SSE2_STEP	static inline __attribute__((target("sse2"))) void
+
+// SSE2 has no 32 bits integer multiplication keeping low part
+static inline __attribute__((target("sse2")))
+__m128i sse2_mullo_epi32(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32),
+	                            _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08),
+	                          _mm_shuffle_epi32(odd, 0x08));
+}
+
+SSE2_STEP sse2_int32_t_int32_t(int32_t* d, const int32_t* s, int32_t sc, int bsc)
+{
+	__m128i v = _mm_loadu_si128((const __m128i*)s);
+	if (bsc)
+		v = sse2_mullo_epi32(v, _mm_set1_epi32(sc));
+	_mm_storeu_si128((__m128i*)d, v);
+}
+
+SSE2_STEP sse2_int32_t_float(float* d, const int32_t* s, float sc, int bsc)
+{
+	__m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)s));
+	if (bsc)
+		v = _mm_mul_ps(v, _mm_set1_ps(sc));
+	_mm_storeu_ps(d, v);
+}
+
+SSE2_STEP sse2_int32_t_double(double* d, const int32_t* s, double sc, int bsc)
+{
+	__m128i vi = _mm_loadu_si128((const __m128i*)s);
+	__m128d lo = _mm_cvtepi32_pd(vi);
+	__m128d hi = _mm_cvtepi32_pd(_mm_unpackhi_epi64(vi, vi));
+	if (bsc) {
+		lo = _mm_mul_pd(lo, _mm_set1_pd(sc));
+		hi = _mm_mul_pd(hi, _mm_set1_pd(sc));
+	}
+	_mm_storeu_pd(d, lo);
+	_mm_storeu_pd(d+2, hi);
+}
+
+SSE2_STEP sse2_float_int32_t(int32_t* d, const float* s, int32_t sc, int bsc)
+{
+	__m128i v = _mm_cvttps_epi32(_mm_loadu_ps(s));
+	if (bsc)
+		v = sse2_mullo_epi32(v, _mm_set1_epi32(sc));
+	_mm_storeu_si128((__m128i*)d, v);
+}
+
+SSE2_STEP sse2_float_float(float* d, const float* s, float sc, int bsc)
+{
+	__m128 v = _mm_loadu_ps(s);
+	if (bsc)
+		v = _mm_mul_ps(v, _mm_set1_ps(sc));
+	_mm_storeu_ps(d, v);
+}
+
+SSE2_STEP sse2_float_double(double* d, const float* s, double sc, int bsc)
+{
+	__m128 v = _mm_loadu_ps(s);
+	__m128d lo = _mm_cvtps_pd(v);
+	__m128d hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+	if (bsc) {
+		lo = _mm_mul_pd(lo, _mm_set1_pd(sc));
+		hi = _mm_mul_pd(hi, _mm_set1_pd(sc));
+	}
+	_mm_storeu_pd(d, lo);
+	_mm_storeu_pd(d+2, hi);
+}
+
+SSE2_STEP sse2_double_int32_t(int32_t* d, const double* s, int32_t sc, int bsc)
+{
+	__m128i lo = _mm_cvttpd_epi32(_mm_loadu_pd(s));
+	__m128i hi = _mm_cvttpd_epi32(_mm_loadu_pd(s+2));
+	__m128i v = _mm_unpacklo_epi64(lo, hi);
+	if (bsc)
+		v = sse2_mullo_epi32(v, _mm_set1_epi32(sc));
+	_mm_storeu_si128((__m128i*)d, v);
+}
+
+SSE2_STEP sse2_double_float(float* d, const double* s, float sc, int bsc)
+{
+	__m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(s));
+	__m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(s+2));
+	__m128 v = _mm_movelh_ps(lo, hi);
+	if (bsc)
+		v = _mm_mul_ps(v, _mm_set1_ps(sc));
+	_mm_storeu_ps(d, v);
+}
+
+SSE2_STEP sse2_double_double(double* d, const double* s, double sc, int bsc)
+{
+	__m128d lo = _mm_loadu_pd(s);
+	__m128d hi = _mm_loadu_pd(s+2);
+	if (bsc) {
+		lo = _mm_mul_pd(lo, _mm_set1_pd(sc));
+		hi = _mm_mul_pd(hi, _mm_set1_pd(sc));
+	}
+	_mm_storeu_pd(d, lo);
+	_mm_storeu_pd(d+2, hi);
+}
+
+DEFINE_SIMD_CAST_FNS(sse2)
+#define sse2_castnosc_int32_t_int32_t identity
+#define sse2_castnosc_float_float identity
+#define sse2_castnosc_double_double identity
+DEFINE_CONVTABLE(sse2_,)
+
+
+/**************************** AVX2 *********************************/
+#define avx2_TARGET	"avx2"
+#define avx2_W		8
+#define AVX2_STEP	static inline __attribute__((target("avx2"))) void
+
+AVX2_STEP avx2_int32_t_int32_t(int32_t* d, const int32_t* s, int32_t sc, int bsc)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i*)s);
+	if (bsc)
+		v = _mm256_mullo_epi32(v, _mm256_set1_epi32(sc));
+	_mm256_storeu_si256((__m256i*)d, v);
+}
+
+AVX2_STEP avx2_int32_t_float(float* d, const int32_t* s, float sc, int bsc)
+{
+	__m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)s));
+	if (bsc)
+		v = _mm256_mul_ps(v, _mm256_set1_ps(sc));
+	_mm256_storeu_ps(d, v);
+}
+
+AVX2_STEP avx2_int32_t_double(double* d, const int32_t* s, double sc, int bsc)
+{
+	__m256d lo = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)s));
+	__m256d hi = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(s+4)));
+	if (bsc) {
+		lo = _mm256_mul_pd(lo, _mm256_set1_pd(sc));
+		hi = _mm256_mul_pd(hi, _mm256_set1_pd(sc));
+	}
+	_mm256_storeu_pd(d, lo);
+	_mm256_storeu_pd(d+4, hi);
+}
+
+AVX2_STEP avx2_float_int32_t(int32_t* d, const float* s, int32_t sc, int bsc)
+{
+	__m256i v = _mm256_cvttps_epi32(_mm256_loadu_ps(s));
+	if (bsc)
+		v = _mm256_mullo_epi32(v, _mm256_set1_epi32(sc));
+	_mm256_storeu_si256((__m256i*)d, v);
+}
+
+AVX2_STEP avx2_float_float(float* d, const float* s, float sc, int bsc)
+{
+	__m256 v = _mm256_loadu_ps(s);
+	if (bsc)
+		v = _mm256_mul_ps(v, _mm256_set1_ps(sc));
+	_mm256_storeu_ps(d, v);
+}
+
+AVX2_STEP avx2_float_double(double* d, const float* s, double sc, int bsc)
+{
+	__m256d lo = _mm256_cvtps_pd(_mm_loadu_ps(s));
+	__m256d hi = _mm256_cvtps_pd(_mm_loadu_ps(s+4));
+	if (bsc) {
+		lo = _mm256_mul_pd(lo, _mm256_set1_pd(sc));
+		hi = _mm256_mul_pd(hi, _mm256_set1_pd(sc));
+	}
+	_mm256_storeu_pd(d, lo);
+	_mm256_storeu_pd(d+4, hi);
+}
+
+AVX2_STEP avx2_double_int32_t(int32_t* d, const double* s, int32_t sc, int bsc)
+{
+	__m128i lo = _mm256_cvttpd_epi32(_mm256_loadu_pd(s));
+	__m128i hi = _mm256_cvttpd_epi32(_mm256_loadu_pd(s+4));
+	__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+	if (bsc)
+		v = _mm256_mullo_epi32(v, _mm256_set1_epi32(sc));
+	_mm256_storeu_si256((__m256i*)d, v);
+}
+
+AVX2_STEP avx2_double_float(float* d, const double* s, float sc, int bsc)
+{
+	__m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(s));
+	__m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(s+4));
+	__m256 v = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+	if (bsc)
+		v = _mm256_mul_ps(v, _mm256_set1_ps(sc));
+	_mm256_storeu_ps(d, v);
+}
+
+AVX2_STEP avx2_double_double(double* d, const double* s, double sc, int bsc)
+{
+	__m256d lo = _mm256_loadu_pd(s);
+	__m256d hi = _mm256_loadu_pd(s+4);
+	if (bsc) {
+		lo = _mm256_mul_pd(lo, _mm256_set1_pd(sc));
+		hi = _mm256_mul_pd(hi, _mm256_set1_pd(sc));
+	}
+	_mm256_storeu_pd(d, lo);
+	_mm256_storeu_pd(d+4, hi);
+}
+
+DEFINE_SIMD_CAST_FNS(avx2)
+#define avx2_castnosc_int32_t_int32_t identity
+#define avx2_castnosc_float_float identity
+#define avx2_castnosc_double_double identity
+
+
+/* Packed input: 8 values are unpacked in a vector of int32 then cast
+ * like int32_t input */
+#define Z	-128	// shuffle index zeroing the byte
+
+static inline __attribute__((target("avx2")))
+__m256i avx2_load_int16le(const unsigned char* p)
+{
+	return _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)p));
+}
+
+static inline __attribute__((target("avx2")))
+__m256i avx2_load_int16be(const unsigned char* p)
+{
+	const __m128i swap = _mm_setr_epi8(1,0,3,2,5,4,7,6,
+	                                   9,8,11,10,13,12,15,14);
+	__m128i v = _mm_loadu_si128((const __m128i*)p);
+	return _mm256_cvtepi16_epi32(_mm_shuffle_epi8(v, swap));
+}
+
+// The 24 bytes are loaded in 2 overlapping halves (bytes 0-15 and 8-23)
+// so that nothing is read past the 8 values. Each value is moved in the 3
+// upper bytes of its int32 then sign-extended by an arithmetic shift
+static inline __attribute__((target("avx2")))
+__m256i avx2_load_int24(const unsigned char* p, __m256i shuf)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i*)p);
+	__m128i hi = _mm_loadu_si128((const __m128i*)(p+8));
+	__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+	return _mm256_srai_epi32(_mm256_shuffle_epi8(v, shuf), 8);
+}
+
+static inline __attribute__((target("avx2")))
+__m256i avx2_load_int24le(const unsigned char* p)
+{
+	const __m256i shuf = _mm256_setr_epi8(Z,0,1,2, Z,3,4,5,
+	                                      Z,6,7,8, Z,9,10,11,
+	                                      Z,4,5,6, Z,7,8,9,
+	                                      Z,10,11,12, Z,13,14,15);
+	return avx2_load_int24(p, shuf);
+}
+
+static inline __attribute__((target("avx2")))
+__m256i avx2_load_int24be(const unsigned char* p)
+{
+	const __m256i shuf = _mm256_setr_epi8(Z,2,1,0, Z,5,4,3,
+	                                      Z,8,7,6, Z,11,10,9,
+	                                      Z,6,5,4, Z,9,8,7,
+	                                      Z,12,11,10, Z,15,14,13);
+	return avx2_load_int24(p, shuf);
+}
+
+static inline __attribute__((target("avx2")))
+__m256i avx2_load_int32be(const unsigned char* p)
+{
+	const __m256i swap = _mm256_setr_epi8(3,2,1,0, 7,6,5,4,
+	                                      11,10,9,8, 15,14,13,12,
+	                                      3,2,1,0, 7,6,5,4,
+	                                      11,10,9,8, 15,14,13,12);
+	__m256i v = _mm256_loadu_si256((const __m256i*)p);
+	return _mm256_shuffle_epi8(v, swap);
+}
+#undef Z
+
+AVX2_STEP avx2_store_epi32_int32_t(int32_t* d, __m256i v, int32_t sc, int bsc)
+{
+	if (bsc)
+		v = _mm256_mullo_epi32(v, _mm256_set1_epi32(sc));
+	_mm256_storeu_si256((__m256i*)d, v);
+}
+
+AVX2_STEP avx2_store_epi32_float(float* d, __m256i v, float sc, int bsc)
+{
+	__m256 vf = _mm256_cvtepi32_ps(v);
+	if (bsc)
+		vf = _mm256_mul_ps(vf, _mm256_set1_ps(sc));
+	_mm256_storeu_ps(d, vf);
+}
+
+AVX2_STEP avx2_store_epi32_double(double* d, __m256i v, double sc, int bsc)
+{
+	__m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+	__m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1));
+	if (bsc) {
+		lo = _mm256_mul_pd(lo, _mm256_set1_pd(sc));
+		hi = _mm256_mul_pd(hi, _mm256_set1_pd(sc));
+	}
+	_mm256_storeu_pd(d, lo);
+	_mm256_storeu_pd(d+4, hi);
+}
+
+// Prototype of an AVX2 cast function from a packed type
+#define DEFINE_AVX2_PACKED_CAST_FN(name, tin, tdst, bsc)		\
+static __attribute__((target("avx2")))					\
+void avx2_##name##_##tin##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	const unsigned char* src = s;					\
+	char* dst = d;							\
+	tdst scale = (bsc) ? sc.val##tdst : 0;				\
+	size_t i, n = len / tin##_SIZE;					\
+	while (ns--) {							\
+		const unsigned char* restrict ps = src;			\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i+avx2_W<=n; i+=avx2_W)			\
+			avx2_store_epi32_##tdst(pd+i,			\
+			       avx2_load_##tin(ps+i*tin##_SIZE), scale, bsc);\
+		for (; i<n; i++)					\
+			pd[i] = (bsc)					\
+			  ? scale * ((tdst)unpack_##tin(ps+i*tin##_SIZE))\
+			  : ((tdst)unpack_##tin(ps+i*tin##_SIZE));	\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+#define DEFINE_AVX2_PACKED_CAST_FNS(tin)				\
+DEFINE_AVX2_PACKED_CAST_FN(cast, tin, int32_t, 1)			\
+DEFINE_AVX2_PACKED_CAST_FN(cast, tin, float, 1)			\
+DEFINE_AVX2_PACKED_CAST_FN(cast, tin, double, 1)			\
+DEFINE_AVX2_PACKED_CAST_FN(castnosc, tin, int32_t, 0)			\
+DEFINE_AVX2_PACKED_CAST_FN(castnosc, tin, float, 0)			\
+DEFINE_AVX2_PACKED_CAST_FN(castnosc, tin, double, 0)
+
+DEFINE_AVX2_PACKED_CAST_FNS(int16le)
+DEFINE_AVX2_PACKED_CAST_FNS(int16be)
+DEFINE_AVX2_PACKED_CAST_FNS(int24le)
+DEFINE_AVX2_PACKED_CAST_FNS(int24be)
+DEFINE_AVX2_PACKED_CAST_FNS(int32be)
+
+
+/* Narrow output: 8 values are converted to float, scaled and converted to
+ * the narrow type after being clamped in its range. The conversion to
+ * half-precision uses F16C, present on all the CPUs supporting AVX2 */
+#define AVX2_READ	static inline __attribute__((target("avx2"))) __m256
+
+AVX2_READ avx2_read_int32_t(const char* p, size_t i)
+{
+	const int32_t* pi = (const int32_t*)p + i;
+	return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)pi));
+}
+
+AVX2_READ avx2_read_float(const char* p, size_t i)
+{
+	return _mm256_loadu_ps((const float*)p + i);
+}
+
+AVX2_READ avx2_read_double(const char* p, size_t i)
+{
+	__m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd((const double*)p + i));
+	__m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd((const double*)p + i+4));
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+#define DEFINE_AVX2_READ_PACKED(tin)					\
+AVX2_READ avx2_read_##tin(const char* p, size_t i)			\
+{									\
+	const unsigned char* pu = (const unsigned char*)p;		\
+	return _mm256_cvtepi32_ps(avx2_load_##tin(pu + i*tin##_SIZE));	\
+}
+
+DEFINE_AVX2_READ_PACKED(int16le)
+DEFINE_AVX2_READ_PACKED(int16be)
+DEFINE_AVX2_READ_PACKED(int24le)
+DEFINE_AVX2_READ_PACKED(int24be)
+DEFINE_AVX2_READ_PACKED(int32be)
+
+// Convert v clamped in [lo, hi] into int32 (as int16 pairs in 128 bits)
+static inline __attribute__((target("avx2")))
+__m256i avx2_clamp_epi32(__m256 v, float lo, float hi)
+{
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(lo)),
+	                  _mm256_set1_ps(hi));
+	return _mm256_cvtps_epi32(v);
+}
+
+AVX2_STEP avx2_narrow_int16_t(int16_t* d, __m256 v)
+{
+	__m256i vi = avx2_clamp_epi32(v, -32768.0f, 32767.0f);
+	vi = _mm256_permute4x64_epi64(_mm256_packs_epi32(vi, vi), 0x08);
+	_mm_storeu_si128((__m128i*)d, _mm256_castsi256_si128(vi));
+}
+
+AVX2_STEP avx2_narrow_uint16_t(uint16_t* d, __m256 v)
+{
+	__m256i vi = avx2_clamp_epi32(v, 0.0f, 65535.0f);
+	vi = _mm256_permute4x64_epi64(_mm256_packus_epi32(vi, vi), 0x08);
+	_mm_storeu_si128((__m128i*)d, _mm256_castsi256_si128(vi));
+}
+
+AVX2_STEP avx2_narrow_uint8_t(uint8_t* d, __m256 v)
+{
+	__m256i vi = avx2_clamp_epi32(v, 0.0f, 255.0f);
+	__m128i v16;
+	vi = _mm256_permute4x64_epi64(_mm256_packs_epi32(vi, vi), 0x08);
+	v16 = _mm256_castsi256_si128(vi);
+	_mm_storel_epi64((__m128i*)d, _mm_packus_epi16(v16, v16));
+}
+
+static inline __attribute__((target("avx2,f16c")))
+void avx2_narrow_half(half* d, __m256 v)
+{
+	_mm_storeu_si128((__m128i*)d,
+	                 _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+}
+
+// Prototype of an AVX2 cast function to a narrow type
+#define DEFINE_AVX2_NARROW_CAST_FN(name, tsrc, tdst, bsc)		\
+static __attribute__((target("avx2,f16c")))				\
+void avx2_##name##_##tsrc##_##tdst (void* restrict d, const void* restrict s, union gval sc, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	const char* src = s;						\
+	char* dst = d;							\
+	float scale = (bsc) ? sc.valfloat : 0;				\
+	size_t i, n = len / tsrc##_SIZE;				\
+	__m256 v;							\
+	while (ns--) {							\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i+avx2_W<=n; i+=avx2_W) {			\
+			v = avx2_read_##tsrc(src, i);			\
+			if (bsc)					\
+				v = _mm256_mul_ps(v, _mm256_set1_ps(scale)); \
+			avx2_narrow_##tdst(pd+i, v);			\
+		}							\
+		for (; i<n; i++)					\
+			pd[i] = to_##tdst((bsc) ? scale*READ_##tsrc(src, i) \
+			                        : READ_##tsrc(src, i));	\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+#define DEFINE_AVX2_NARROW_CAST_FNS(tsrc)				\
+DEFINE_AVX2_NARROW_CAST_FN(cast, tsrc, int16_t, 1)			\
+DEFINE_AVX2_NARROW_CAST_FN(cast, tsrc, half, 1)			\
+DEFINE_AVX2_NARROW_CAST_FN(cast, tsrc, uint8_t, 1)			\
+DEFINE_AVX2_NARROW_CAST_FN(cast, tsrc, uint16_t, 1)			\
+DEFINE_AVX2_NARROW_CAST_FN(castnosc, tsrc, int16_t, 0)		\
+DEFINE_AVX2_NARROW_CAST_FN(castnosc, tsrc, half, 0)			\
+DEFINE_AVX2_NARROW_CAST_FN(castnosc, tsrc, uint8_t, 0)		\
+DEFINE_AVX2_NARROW_CAST_FN(castnosc, tsrc, uint16_t, 0)
+
+DEFINE_AVX2_NARROW_CAST_FNS(int32_t)
+DEFINE_AVX2_NARROW_CAST_FNS(float)
+DEFINE_AVX2_NARROW_CAST_FNS(double)
+DEFINE_AVX2_NARROW_CAST_FNS(int16le)
+DEFINE_AVX2_NARROW_CAST_FNS(int16be)
+DEFINE_AVX2_NARROW_CAST_FNS(int24le)
+DEFINE_AVX2_NARROW_CAST_FNS(int24be)
+DEFINE_AVX2_NARROW_CAST_FNS(int32be)
+
+DEFINE_CONVTABLE(avx2_, avx2_)
+DEFINE_PACKEDTABLE(avx2_, avx2_)
+
+
+/*************************** AVX-512 *******************************/
+#define avx512_TARGET	"avx512f"
+#define avx512_W	16
+#define AVX512_STEP	static inline __attribute__((target("avx512f"))) void
+
+AVX512_STEP avx512_int32_t_int32_t(int32_t* d, const int32_t* s, int32_t sc, int bsc)
+{
+	__m512i v = _mm512_loadu_si512(s);
+	if (bsc)
+		v = _mm512_mullo_epi32(v, _mm512_set1_epi32(sc));
+	_mm512_storeu_si512(d, v);
+}
+
+AVX512_STEP avx512_int32_t_float(float* d, const int32_t* s, float sc, int bsc)
+{
+	__m512 v = _mm512_cvtepi32_ps(_mm512_loadu_si512(s));
+	if (bsc)
+		v = _mm512_mul_ps(v, _mm512_set1_ps(sc));
+	_mm512_storeu_ps(d, v);
+}
+
+AVX512_STEP avx512_int32_t_double(double* d, const int32_t* s, double sc, int bsc)
+{
+	__m512d lo = _mm512_cvtepi32_pd(_mm256_loadu_si256((const __m256i*)s));
+	__m512d hi = _mm512_cvtepi32_pd(_mm256_loadu_si256((const __m256i*)(s+8)));
+	if (bsc) {
+		lo = _mm512_mul_pd(lo, _mm512_set1_pd(sc));
+		hi = _mm512_mul_pd(hi, _mm512_set1_pd(sc));
+	}
+	_mm512_storeu_pd(d, lo);
+	_mm512_storeu_pd(d+8, hi);
+}
+
+AVX512_STEP avx512_float_int32_t(int32_t* d, const float* s, int32_t sc, int bsc)
+{
+	__m512i v = _mm512_cvttps_epi32(_mm512_loadu_ps(s));
+	if (bsc)
+		v = _mm512_mullo_epi32(v, _mm512_set1_epi32(sc));
+	_mm512_storeu_si512(d, v);
+}
+
+AVX512_STEP avx512_float_float(float* d, const float* s, float sc, int bsc)
+{
+	__m512 v = _mm512_loadu_ps(s);
+	if (bsc)
+		v = _mm512_mul_ps(v, _mm512_set1_ps(sc));
+	_mm512_storeu_ps(d, v);
+}
+
+AVX512_STEP avx512_float_double(double* d, const float* s, double sc, int bsc)
+{
+	__m512d lo = _mm512_cvtps_pd(_mm256_loadu_ps(s));
+	__m512d hi = _mm512_cvtps_pd(_mm256_loadu_ps(s+8));
+	if (bsc) {
+		lo = _mm512_mul_pd(lo, _mm512_set1_pd(sc));
+		hi = _mm512_mul_pd(hi, _mm512_set1_pd(sc));
+	}
+	_mm512_storeu_pd(d, lo);
+	_mm512_storeu_pd(d+8, hi);
+}
+
+AVX512_STEP avx512_double_int32_t(int32_t* d, const double* s, int32_t sc, int bsc)
+{
+	__m256i lo = _mm512_cvttpd_epi32(_mm512_loadu_pd(s));
+	__m256i hi = _mm512_cvttpd_epi32(_mm512_loadu_pd(s+8));
+	__m512i v = _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+	if (bsc)
+		v = _mm512_mullo_epi32(v, _mm512_set1_epi32(sc));
+	_mm512_storeu_si512(d, v);
+}
+
+AVX512_STEP avx512_double_float(float* d, const double* s, float sc, int bsc)
+{
+	__m256 lo = _mm512_cvtpd_ps(_mm512_loadu_pd(s));
+	__m256 hi = _mm512_cvtpd_ps(_mm512_loadu_pd(s+8));
+	if (bsc) {
+		lo = _mm256_mul_ps(lo, _mm256_set1_ps(sc));
+		hi = _mm256_mul_ps(hi, _mm256_set1_ps(sc));
+	}
+	_mm256_storeu_ps(d, lo);
+	_mm256_storeu_ps(d+8, hi);
+}
+
+AVX512_STEP avx512_double_double(double* d, const double* s, double sc, int bsc)
+{
+	__m512d lo = _mm512_loadu_pd(s);
+	__m512d hi = _mm512_loadu_pd(s+8);
+	if (bsc) {
+		lo = _mm512_mul_pd(lo, _mm512_set1_pd(sc));
+		hi = _mm512_mul_pd(hi, _mm512_set1_pd(sc));
+	}
+	_mm512_storeu_pd(d, lo);
+	_mm512_storeu_pd(d+8, hi);
+}
+
+DEFINE_SIMD_CAST_FNS(avx512)
+#define avx512_castnosc_int32_t_int32_t identity
+#define avx512_castnosc_float_float identity
+#define avx512_castnosc_double_double identity
+DEFINE_CONVTABLE(avx512_, avx2_)
+
+
+static
+int isa_supported(int isa)
+{
+	__builtin_cpu_init();
+
+	switch (isa) {
+	case EGDI_ISA_SCALAR: return 1;
+	case EGDI_ISA_SSE2: return __builtin_cpu_supports("sse2");
+	case EGDI_ISA_AVX2: return __builtin_cpu_supports("avx2")
+	                           && __builtin_cpu_supports("f16c");
+	case EGDI_ISA_AVX512: return __builtin_cpu_supports("avx512f")
+	                             && __builtin_cpu_supports("f16c");
+	}
+
+	return 0;
+}
+
+static cast_function (*isa_convtables[EGDI_NUM_ISA])[2][EGD_NUM_DTYPE] = {
+	[EGDI_ISA_SCALAR] = convtable,
+	[EGDI_ISA_SSE2] = sse2_convtable,
+	[EGDI_ISA_AVX2] = avx2_convtable,
+	[EGDI_ISA_AVX512] = avx512_convtable,
+};
+
+// ISAs without their own unpack kernels use those of the previous one
+static cast_function (*isa_packedtables[EGDI_NUM_ISA])[2][EGD_NUM_DTYPE] = {
+	[EGDI_ISA_SCALAR] = packedtable,
+	[EGDI_ISA_SSE2] = packedtable,
+	[EGDI_ISA_AVX2] = avx2_packedtable,
+	[EGDI_ISA_AVX512] = avx2_packedtable,
+};
+
+#else // HAVE_X86_SIMD
+
+static
+int isa_supported(int isa)
+{
+	return (isa == EGDI_ISA_SCALAR);
+}
+
+static cast_function (*isa_convtables[EGDI_NUM_ISA])[2][EGD_NUM_DTYPE] = {
+	[EGDI_ISA_SCALAR] = convtable,
+};
+
+static cast_function (*isa_packedtables[EGDI_NUM_ISA])[2][EGD_NUM_DTYPE] = {
+	[EGDI_ISA_SCALAR] = packedtable,
+};
+
+#endif // HAVE_X86_SIMD
+
+
+// Returns the most capable instruction set supported by the CPU. The
+// detection is run only once, the value is cached afterwards.
+static
+int get_best_isa(void)
+{
+	static int best_isa = -1;
+	int isa;
+
+	if (best_isa >= 0)
+		return best_isa;
+
+	for (isa = EGDI_NUM_ISA-1; isa > EGDI_ISA_SCALAR; isa--)
+		if (isa_supported(isa))
+			break;
+
+	best_isa = isa;
+	return isa;
+}
+
+
+/*******************************************************************
+ *             Cast functions with per-channel transform           *
+ *******************************************************************/
+// Bits selection of the input value (only meaningful for integer input)
+#define XFORM_IN_int32_t(v, xf) \
+	((int32_t)(((uint32_t)(v) & (xf)->mask) >> (xf)->shift))
+#define XFORM_IN_float(v, xf)	(v)
+#define XFORM_IN_double(v, xf)	(v)
+#define XFORM_IN_packed(v, xf)	XFORM_IN_int32_t(v, xf)
+
+// Prototype of a cast function applying a gain and an offset per channel.
+// The loop over the channels has no dependency, so it is left to the
+// vectorizer of the compiler
+#define DEFINE_XFORM_FN(tsrc, tdst)					\
+static void xform_##tsrc##_##tdst (void* restrict d, const void* restrict s, const struct cast_xform* xf, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	const char* src = s;						\
+	char* dst = d;							\
+	const tdst* restrict sc = xf->sc;				\
+	const tdst* restrict off = xf->off;				\
+	size_t i, n = len / sizeof(tsrc);				\
+	while (ns--) {							\
+		const tsrc* restrict ps = (const tsrc*)src;		\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i<n; i++)					\
+			pd[i] = sc[i]*((tdst)XFORM_IN_##tsrc(ps[i], xf)) \
+			        + off[i];				\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+DEFINE_XFORM_FN(int32_t, int32_t)
+DEFINE_XFORM_FN(int32_t, float)
+DEFINE_XFORM_FN(int32_t, double)
+DEFINE_XFORM_FN(float, int32_t)
+DEFINE_XFORM_FN(float, float)
+DEFINE_XFORM_FN(float, double)
+DEFINE_XFORM_FN(double, int32_t)
+DEFINE_XFORM_FN(double, float)
+DEFINE_XFORM_FN(double, double)
+
+// Same for packed input types
+#define DEFINE_PACKED_XFORM_FN(tin, tdst)				\
+static void xform_##tin##_##tdst (void* restrict d, const void* restrict s, const struct cast_xform* xf, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	const unsigned char* src = s;					\
+	char* dst = d;							\
+	const tdst* restrict sc = xf->sc;				\
+	const tdst* restrict off = xf->off;				\
+	size_t i, n = len / tin##_SIZE;					\
+	int32_t v;							\
+	while (ns--) {							\
+		const unsigned char* restrict ps = src;			\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i<n; i++) {					\
+			v = unpack_##tin(ps + i*tin##_SIZE);		\
+			pd[i] = sc[i]*((tdst)XFORM_IN_packed(v, xf))	\
+			        + off[i];				\
+		}							\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+#define DEFINE_PACKED_XFORM_FNS(tin)					\
+DEFINE_PACKED_XFORM_FN(tin, int32_t)					\
+DEFINE_PACKED_XFORM_FN(tin, float)					\
+DEFINE_PACKED_XFORM_FN(tin, double)
+
+DEFINE_PACKED_XFORM_FNS(int16le)
+DEFINE_PACKED_XFORM_FNS(int16be)
+DEFINE_PACKED_XFORM_FNS(int24le)
+DEFINE_PACKED_XFORM_FNS(int24be)
+DEFINE_PACKED_XFORM_FNS(int32be)
+
+// Same for narrow output types (sc and off are then arrays of float)
+#define XREAD_int32_t(p, i, xf)	\
+	((float)XFORM_IN_int32_t(((const int32_t*)(p))[i], xf))
+#define XREAD_float(p, i, xf)	READ_float(p, i)
+#define XREAD_double(p, i, xf)	READ_double(p, i)
+#define XREAD_PACKED(tin, p, i, xf)	\
+	((float)XFORM_IN_packed(unpack_##tin((const unsigned char*)(p) \
+	                                     + (i)*tin##_SIZE), xf))
+#define XREAD_int16le(p, i, xf)	XREAD_PACKED(int16le, p, i, xf)
+#define XREAD_int16be(p, i, xf)	XREAD_PACKED(int16be, p, i, xf)
+#define XREAD_int24le(p, i, xf)	XREAD_PACKED(int24le, p, i, xf)
+#define XREAD_int24be(p, i, xf)	XREAD_PACKED(int24be, p, i, xf)
+#define XREAD_int32be(p, i, xf)	XREAD_PACKED(int32be, p, i, xf)
+
+#define DEFINE_NARROW_XFORM_FN(tsrc, tdst)				\
+static void xform_##tsrc##_##tdst (void* restrict d, const void* restrict s, const struct cast_xform* xf, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	const char* src = s;						\
+	char* dst = d;							\
+	const float* restrict sc = xf->sc;				\
+	const float* restrict off = xf->off;				\
+	size_t i, n = len / tsrc##_SIZE;				\
+	while (ns--) {							\
+		tdst* restrict pd = (tdst*)dst;				\
+		for (i=0; i<n; i++)					\
+			pd[i] = to_##tdst(sc[i]*XREAD_##tsrc(src, i, xf) \
+			                  + off[i]);			\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+#define DEFINE_NARROW_XFORM_FNS(tsrc)					\
+DEFINE_NARROW_XFORM_FN(tsrc, int16_t)					\
+DEFINE_NARROW_XFORM_FN(tsrc, half)					\
+DEFINE_NARROW_XFORM_FN(tsrc, uint8_t)					\
+DEFINE_NARROW_XFORM_FN(tsrc, uint16_t)
+
+DEFINE_NARROW_XFORM_FNS(int32_t)
+DEFINE_NARROW_XFORM_FNS(float)
+DEFINE_NARROW_XFORM_FNS(double)
+DEFINE_NARROW_XFORM_FNS(int16le)
+DEFINE_NARROW_XFORM_FNS(int16be)
+DEFINE_NARROW_XFORM_FNS(int24le)
+DEFINE_NARROW_XFORM_FNS(int24be)
+DEFINE_NARROW_XFORM_FNS(int32be)
+
+#define XFORM_ENTRY(egdtype, datatype)					\
+	[egdtype] = {[EGD_INT32] = xform_##datatype##_int32_t,		\
+	             [EGD_FLOAT] = xform_##datatype##_float,		\
+	             [EGD_DOUBLE] = xform_##datatype##_double,		\
+	             [EGD_INT16] = xform_##datatype##_int16_t,		\
+	             [EGD_FLOAT16] = xform_##datatype##_half,		\
+	             [EGD_UINT8] = xform_##datatype##_uint8_t,		\
+	             [EGD_UINT16] = xform_##datatype##_uint16_t}
+
+static xform_function xformtable[3][EGD_NUM_DTYPE] = {
+	XFORM_ENTRY(EGD_INT32, int32_t),
+	XFORM_ENTRY(EGD_FLOAT, float),
+	XFORM_ENTRY(EGD_DOUBLE, double),
+};
+
+static xform_function packed_xformtable[EGDI_NUM_INDTYPE][EGD_NUM_DTYPE] = {
+	XFORM_ENTRY(EGDI_INT16LE-EGDI_FIRST_INDTYPE, int16le),
+	XFORM_ENTRY(EGDI_INT16BE-EGDI_FIRST_INDTYPE, int16be),
+	XFORM_ENTRY(EGDI_INT24LE-EGDI_FIRST_INDTYPE, int24le),
+	XFORM_ENTRY(EGDI_INT24BE-EGDI_FIRST_INDTYPE, int24be),
+	XFORM_ENTRY(EGDI_INT32BE-EGDI_FIRST_INDTYPE, int32be),
 };
 
 
 LOCAL_FN
-cast_function egd_get_cast_fn(unsigned int itype, unsigned int otype, unsigned int scaling)
+xform_function egdi_get_xform_fn(unsigned int itype, unsigned int otype)
 {
-	if ((itype >= EGD_NUM_DTYPE) || (otype >= EGD_NUM_DTYPE))
+	if (otype >= EGD_NUM_DTYPE)
+		return NULL;
+
+	// The narrow types are only output types
+	if (itype <= EGD_DOUBLE)
+		return xformtable[itype][otype];
+
+	itype -= EGDI_FIRST_INDTYPE;
+	if (itype >= EGDI_NUM_INDTYPE)
+		return NULL;
+
+	return packed_xformtable[itype][otype];
+}
+
+
+/*******************************************************************
+ *                  Copy functions (ringbuffer -> arrays)          *
+ *******************************************************************/
+// Both side contiguous: the whole transfer is one copy
+static void copy_contiguous(char* restrict dst, const char* restrict src, size_t len, size_t ns, size_t dstride, size_t sstride)
+{
+	(void)dstride;
+	(void)sstride;
+	memcpy(dst, src, len*ns);
+}
+
+// Prototype of a strided copy of blocks of fixed size (the compiler
+// replaces the memcpy by a few moves)
+#define DEFINE_COPY_FN(size)						\
+static void copy_##size (char* restrict dst, const char* restrict src, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	(void)len;							\
+	while (ns--) {							\
+		memcpy(dst, src, size);					\
+		src += sstride;						\
+		dst += dstride;						\
+	}								\
+}
+
+DEFINE_COPY_FN(4)
+DEFINE_COPY_FN(8)
+DEFINE_COPY_FN(16)
+DEFINE_COPY_FN(32)
+
+static void copy_generic(char* restrict dst, const char* restrict src, size_t len, size_t ns, size_t dstride, size_t sstride)
+{
+	while (ns--) {
+		memcpy(dst, src, len);
+		src += sstride;
+		dst += dstride;
+	}
+}
+
+
+LOCAL_FN
+copy_function egdi_get_copy_fn(size_t len, size_t dstride, size_t sstride)
+{
+	if (dstride == len && sstride == len)
+		return copy_contiguous;
+
+	switch (len) {
+	case 4: return copy_4;
+	case 8: return copy_8;
+	case 16: return copy_16;
+	case 32: return copy_32;
+	}
+
+	return copy_generic;
+}
+
+
+/*******************************************************************
+ *          Transposition (ringbuffer -> channel-major arrays)     *
+ *******************************************************************/
+/* The transpose functions follow the prototype of copy functions: the
+ * element k of the sample s located at src + s*sstride + k*tsize is
+ * written at dst + k*dstride + s*tsize (dstride being the channel stride).
+ * The work is split in blocks so that the lines of the ringbuffer and of
+ * the channels being written stay in cache */
+#define TRANSPOSE_BLOCK	64
+
+// Prototype of a scalar transposition of a tile of elements of size bytes
+#define DEFINE_TRANSPOSE_TILE(size)					\
+static inline void transpose_tile_##size (char* restrict dst, const char* restrict src, size_t nch, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	size_t k, s;							\
+	for (k=0; k<nch; k++)						\
+		for (s=0; s<ns; s++)					\
+			memcpy(dst + k*dstride + s*size,		\
+			       src + s*sstride + k*size, size);		\
+}
+
+// Prototype of a cache-blocked transposition using the tile function tile
+#define DEFINE_TRANSPOSE_FN(name, size, tile)				\
+static void name (char* restrict dst, const char* restrict src, size_t len, size_t ns, size_t dstride, size_t sstride)	\
+{									\
+	size_t s0, k0, sn, kn, nch = len / size;			\
+	for (s0=0; s0<ns; s0+=TRANSPOSE_BLOCK) {			\
+		sn = (ns-s0 < TRANSPOSE_BLOCK) ? ns-s0 : TRANSPOSE_BLOCK; \
+		for (k0=0; k0<nch; k0+=TRANSPOSE_BLOCK) {		\
+			kn = (nch-k0 < TRANSPOSE_BLOCK) ?		\
+			             nch-k0 : TRANSPOSE_BLOCK;		\
+			tile(dst + k0*dstride + s0*size,		\
+			     src + s0*sstride + k0*size,		\
+			     kn, sn, dstride, sstride);			\
+		}							\
+	}								\
+}
+
+DEFINE_TRANSPOSE_TILE(1)
+DEFINE_TRANSPOSE_TILE(2)
+DEFINE_TRANSPOSE_TILE(4)
+DEFINE_TRANSPOSE_TILE(8)
+DEFINE_TRANSPOSE_FN(transpose_1, 1, transpose_tile_1)
+DEFINE_TRANSPOSE_FN(transpose_2, 2, transpose_tile_2)
+DEFINE_TRANSPOSE_FN(transpose_4, 4, transpose_tile_4)
+DEFINE_TRANSPOSE_FN(transpose_8, 8, transpose_tile_8)
+
+#if HAVE_X86_SIMD
+// Transpose by 4x4 blocks of 4 bytes elements, the edges are done by the
+// scalar tile function
+static __attribute__((target("sse2")))
+void sse2_transpose_tile_4(char* restrict dst, const char* restrict src, size_t nch, size_t ns, size_t dstride, size_t sstride)
+{
+	size_t k, s, nch4 = nch & ~(size_t)3, ns4 = ns & ~(size_t)3;
+	__m128 r0, r1, r2, r3;
+
+	for (k=0; k<nch4; k+=4) {
+		for (s=0; s<ns4; s+=4) {
+			r0 = _mm_loadu_ps((const float*)(src + s*sstride + k*4));
+			r1 = _mm_loadu_ps((const float*)(src + (s+1)*sstride + k*4));
+			r2 = _mm_loadu_ps((const float*)(src + (s+2)*sstride + k*4));
+			r3 = _mm_loadu_ps((const float*)(src + (s+3)*sstride + k*4));
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			_mm_storeu_ps((float*)(dst + k*dstride + s*4), r0);
+			_mm_storeu_ps((float*)(dst + (k+1)*dstride + s*4), r1);
+			_mm_storeu_ps((float*)(dst + (k+2)*dstride + s*4), r2);
+			_mm_storeu_ps((float*)(dst + (k+3)*dstride + s*4), r3);
+		}
+	}
+
+	transpose_tile_4(dst + ns4*4, src + ns4*sstride,
+	                 nch4, ns-ns4, dstride, sstride);
+	transpose_tile_4(dst + nch4*dstride, src + nch4*4,
+	                 nch-nch4, ns, dstride, sstride);
+}
+
+
+// Transpose by 2x2 blocks of 8 bytes elements, the edges are done by the
+// scalar tile function
+static __attribute__((target("sse2")))
+void sse2_transpose_tile_8(char* restrict dst, const char* restrict src, size_t nch, size_t ns, size_t dstride, size_t sstride)
+{
+	size_t k, s, nch2 = nch & ~(size_t)1, ns2 = ns & ~(size_t)1;
+	__m128d r0, r1;
+
+	for (k=0; k<nch2; k+=2) {
+		for (s=0; s<ns2; s+=2) {
+			r0 = _mm_loadu_pd((const double*)(src + s*sstride + k*8));
+			r1 = _mm_loadu_pd((const double*)(src + (s+1)*sstride + k*8));
+			_mm_storeu_pd((double*)(dst + k*dstride + s*8),
+			              _mm_unpacklo_pd(r0, r1));
+			_mm_storeu_pd((double*)(dst + (k+1)*dstride + s*8),
+			              _mm_unpackhi_pd(r0, r1));
+		}
+	}
+
+	transpose_tile_8(dst + ns2*8, src + ns2*sstride,
+	                 nch2, ns-ns2, dstride, sstride);
+	transpose_tile_8(dst + nch2*dstride, src + nch2*8,
+	                 nch-nch2, ns, dstride, sstride);
+}
+
+DEFINE_TRANSPOSE_FN(sse2_transpose_4, 4, sse2_transpose_tile_4)
+DEFINE_TRANSPOSE_FN(sse2_transpose_8, 8, sse2_transpose_tile_8)
+#endif // HAVE_X86_SIMD
+
+
+LOCAL_FN
+copy_function egdi_get_transpose_fn(size_t tsize)
+{
+#if HAVE_X86_SIMD
+	if (isa_supported(EGDI_ISA_SSE2)) {
+		if (tsize == 4)
+			return sse2_transpose_4;
+		if (tsize == 8)
+			return sse2_transpose_8;
+	}
+#endif
+
+	switch (tsize) {
+	case 1: return transpose_1;
+	case 2: return transpose_2;
+	case 4: return transpose_4;
+	case 8: return transpose_8;
+	}
+
+	return NULL;
+}
+
+
+LOCAL_FN
+cast_function egdi_get_cast_fn_isa(unsigned int itype, unsigned int otype,
+                                   unsigned int scaling, int isa)
+{
+	if ((otype >= EGD_NUM_DTYPE)
+	   || (isa < 0) || (isa >= EGDI_NUM_ISA) || !isa_supported(isa))
 		return NULL;
 
 	scaling = scaling ? 1 : 0;
 
-	return convtable[itype][scaling][otype];
+	// The narrow types are only output types
+	if (itype <= EGD_DOUBLE)
+		return isa_convtables[isa][itype][scaling][otype];
+
+	itype -= EGDI_FIRST_INDTYPE;
+	if (itype >= EGDI_NUM_INDTYPE)
+		return NULL;
+
+	return isa_packedtables[isa][itype][scaling][otype];
+}
+
+
+LOCAL_FN
+cast_function egd_get_cast_fn(unsigned int itype, unsigned int otype, unsigned int scaling)
+{
+	return egdi_get_cast_fn_isa(itype, otype, scaling, get_best_isa());
 }
@@ -0,0 +1,207 @@
+/*
+    Copyright (C) 2010-2012  EPFL (Ecole Polytechnique Fédérale de Lausanne)
+    Laboratory CNBI (Chair in Non-Invasive Brain-Machine Interface)
+    Nicolas Bourdaud <nicolas.bourdaud@epfl.ch>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <mmthread.h>
+#include "coreinternals.h"
+
+struct worker {
+	struct worker_pool* pool;
+	unsigned int ipart;
+	mm_thread_t thid;
+};
+
+struct worker_pool {
+	unsigned int nworker;
+	struct worker* workers;
+
+	// Job being run, protected by lock
+	mm_thr_mutex_t lock;
+	mm_thr_cond_t start, done;
+	unsigned long generation;
+	unsigned int pending;
+	int quit;
+	job_function fn;
+	void* arg;
+
+	int busy;	// set while a job is dispatched to the workers
+};
+
+
+static
+void* worker_proc(void* arg)
+{
+	struct worker* w = arg;
+	struct worker_pool* pool = w->pool;
+	unsigned long generation = 0;
+	job_function fn;
+	void* jobarg;
+
+	mm_thr_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->generation == generation && !pool->quit)
+			mm_thr_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit)
+			break;
+
+		generation = pool->generation;
+		fn = pool->fn;
+		jobarg = pool->arg;
+		mm_thr_mutex_unlock(&pool->lock);
+
+		fn(jobarg, w->ipart, pool->nworker+1);
+
+		mm_thr_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			mm_thr_cond_signal(&pool->done);
+	}
+	mm_thr_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+/* Wait for the job being run and stop the worker threads. The jobs
+ * submitted afterwards are run by the calling thread alone. The pool stays
+ * allocated until egdi_destroy_worker_pool() so that a thread still
+ * submitting jobs can use it. */
+LOCAL_FN
+void egdi_stop_worker_pool(struct worker_pool* pool)
+{
+	unsigned int i;
+
+	if (!pool || !pool->nworker)
+		return;
+
+	// Keep the pool busy forever once the current job is done
+	while (__atomic_exchange_n(&pool->busy, 1, __ATOMIC_ACQUIRE)) {
+		mm_thr_mutex_lock(&pool->lock);
+		while (pool->pending)
+			mm_thr_cond_wait(&pool->done, &pool->lock);
+		mm_thr_mutex_unlock(&pool->lock);
+	}
+
+	mm_thr_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	mm_thr_cond_broadcast(&pool->start);
+	mm_thr_mutex_unlock(&pool->lock);
+
+	for (i=0; i<pool->nworker; i++)
+		mm_thr_join(pool->workers[i].thid, NULL);
+	pool->nworker = 0;
+}
+
+
+LOCAL_FN
+void egdi_destroy_worker_pool(struct worker_pool* pool)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	mm_thr_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	mm_thr_cond_broadcast(&pool->start);
+	mm_thr_mutex_unlock(&pool->lock);
+
+	for (i=0; i<pool->nworker; i++)
+		mm_thr_join(pool->workers[i].thid, NULL);
+
+	mm_thr_cond_deinit(&pool->done);
+	mm_thr_cond_deinit(&pool->start);
+	mm_thr_mutex_deinit(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+
+LOCAL_FN
+struct worker_pool* egdi_create_worker_pool(unsigned int nworker)
+{
+	int stinit = 0;
+	unsigned int i;
+	struct worker_pool* pool;
+
+	if (!(pool = calloc(1, sizeof(*pool)))
+	   || !(pool->workers = calloc(nworker, sizeof(*pool->workers)))
+	   || mm_thr_mutex_init(&pool->lock, 0) || !(++stinit)
+	   || mm_thr_cond_init(&pool->start, 0) || !(++stinit)
+	   || mm_thr_cond_init(&pool->done, 0))
+		goto fail;
+
+	// Part 0 of each job is run by the thread submitting it
+	for (i=0; i<nworker; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].ipart = i+1;
+		if (mm_thr_create(&pool->workers[i].thid,
+		                  worker_proc, pool->workers + i)) {
+			egdi_destroy_worker_pool(pool);
+			return NULL;
+		}
+		pool->nworker++;
+	}
+
+	return pool;
+
+fail:
+	if (stinit--)
+		mm_thr_cond_deinit(&pool->start);
+	if (stinit--)
+		mm_thr_mutex_deinit(&pool->lock);
+	if (pool)
+		free(pool->workers);
+	free(pool);
+	return NULL;
+}
+
+
+/* Run the job fn split in parts, one per worker plus one run by the calling
+ * thread, and wait for all of them to finish. If pool is NULL or already
+ * running a job (submitted by another thread), the job is run as a single
+ * part by the calling thread. */
+LOCAL_FN
+void egdi_run_job(struct worker_pool* pool, job_function fn, void* arg)
+{
+	if (!pool || __atomic_exchange_n(&pool->busy, 1, __ATOMIC_ACQUIRE)) {
+		fn(arg, 0, 1);
+		return;
+	}
+
+	mm_thr_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->pending = pool->nworker;
+	pool->generation++;
+	mm_thr_cond_broadcast(&pool->start);
+	mm_thr_mutex_unlock(&pool->lock);
+
+	fn(arg, 0, pool->nworker+1);
+
+	mm_thr_mutex_lock(&pool->lock);
+	while (pool->pending)
+		mm_thr_cond_wait(&pool->done, &pool->lock);
+	mm_thr_mutex_unlock(&pool->lock);
+
+	__atomic_store_n(&pool->busy, 0, __ATOMIC_RELEASE);
+}
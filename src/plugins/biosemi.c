@@ -20,6 +20,11 @@
 # include <config.h>
 #endif
 
+// pthread_setaffinity_np() and the CPU_* macros are GNU extensions
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE
+#endif
+
 // we need to define the following macro as libusb.h imports windows.h and we
 // want to prevent a massive inclusion of windows definitions
 #define WIN32_LEAN_AND_MEAN
@@ -27,6 +32,8 @@
 #include <eegdev-pluginapi.h>
 #include <libusb.h>
 #include <mmthread.h>
+#include <mmtime.h>
+#include <errno.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -40,9 +47,58 @@
 # endif //WORDS_BIGENDIAN
 #endif
 
-// It should ABSOLUTELY be a power of two or the read call will fail
-#define CHUNKSIZE	(64*1024)
-#define NUMURB		2
+#if defined(__SSE2__) && !WORDS_BIGENDIAN
+# define HAVE_SSE2	1
+# include <emmintrin.h>
+#else
+# define HAVE_SSE2	0
+#endif
+
+// The size of the URBs should ABSOLUTELY be a power of two or the read
+// call will fail. In automatic mode, the URBs hold at most the data of the
+// latency option and enough of them are queued to hold URB_QUEUE_MS of
+// data.
+#define HANDSHAKE_SIZE	(64*1024)
+#define MIN_CHUNKSIZE	512
+#define MAX_CHUNKSIZE	(1024*1024)
+#define MAX_NUMURB	64
+#define URB_QUEUE_MS	60
+
+// Each sample starts with the sync word followed by the status word
+#define SYNC_WORD	0xFFFFFF00
+#define STATUS_CH	1
+
+// Capture file of the raw USB chunks (see capture_chunk())
+#define CAPTURE_MAGIC	"ACT2RAW1"
+#define CAPTURE_HDRLEN	12
+#define CAPTURE_BUFSIZE	(1024*1024)
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+# define HAVE_LIBUSB_DEV_MEM	1
+#else
+# define HAVE_LIBUSB_DEV_MEM	0
+#endif
+
+// On Linux, the event thread can be run with a realtime priority on a
+// chosen CPU, and it waits on the file descriptors of libusb along with an
+// eventfd signaled to stop it
+#if defined(__linux__)
+# define HAVE_RT_EVENT_THREAD	1
+# include <pthread.h>
+# include <sched.h>
+#else
+# define HAVE_RT_EVENT_THREAD	0
+#endif
+
+#if HAVE_RT_EVENT_THREAD && defined(LIBUSB_API_VERSION) \
+    && (LIBUSB_API_VERSION >= 0x01000104)
+# define HAVE_LIBUSB_POLLFD	1
+# include <poll.h>
+# include <unistd.h>
+# include <sys/eventfd.h>
+#else
+# define HAVE_LIBUSB_POLLFD	0
+#endif
 
 
 struct act2_eegdev {
@@ -52,16 +108,35 @@ struct act2_eegdev {
 	//unsigned int nch;
 
 	int samplelen;	//number of int32 in a time sample
+	unsigned int fs;
 	int inoffset;	//offset in next chunk of a sample (in num of int32)
+	unsigned char* chcal;	//channels calibrated by the mappings
+	int decoded;	//all input groups decoded by act2_decode (atomic)
 
 	// USB communication related
 	mm_thread_t thread_id;
 	mm_thr_cond_t cond;
 	mm_thr_mutex_t mtx;
-	int stopusb, resubmit, num_running;
+	int num_running;
+	int stopusb, resubmit;	// written with atomics
+	int evfd;	// eventfd waking up the event thread (or -1)
+	int fdchanged;	// file descriptors of libusb changed (atomic)
 	libusb_context* ctx;
 	libusb_device_handle* hudev;
-	struct libusb_transfer* urb[NUMURB];
+
+	// Pool of URBs, their buffers being carved in urbmem
+	int numurb;
+	size_t chunksize;
+	unsigned char* urbmem;
+	int devmem;	// urbmem allocated by libusb_dev_mem_alloc()
+	struct libusb_transfer** urb;
+
+	// Capture of the raw USB chunks (only written by the thread
+	// completing the transfers). The arrival times are relative to the
+	// one of the first chunk (capstarted is set once it is captured).
+	FILE* capfile;
+	struct mm_timespec capstart;
+	int capstarted;
 };
 
 
@@ -92,17 +167,24 @@ static const struct egdi_signal_info act2_siginfo[2] = {
 		.min.valdouble = -262144.0, .max.valdouble = 262143.96875,
 		.unit = "uV", .transducer = "Active Electrode"
 	}, {
-		.isint = 1, .bsc = 0,
+		.isint = 1, .bsc = 0, .shift = 8,
 		.dtype = EGD_INT32, .mmtype = EGD_INT32,
 		.min.valint32_t = -8388608, .max.valint32_t = 8388607,
 		.unit = "Boolean", .transducer = "Triggers and Status"
 	}
 };
 
-enum {OPT_EEGMAP, OPT_SENSMAP, NOPT};
+enum {OPT_EEGMAP, OPT_SENSMAP, OPT_CHUNKSIZE, OPT_NUMURB, OPT_LATENCY,
+      OPT_RTPRIO, OPT_CPU, OPT_CAPTURE, NOPT};
 static const struct egdi_optname act2_options[] = {
 	[OPT_EEGMAP] = {.name = "eegmap", .defvalue = NULL},
 	[OPT_SENSMAP] = {.name = "sensormap", .defvalue = NULL},
+	[OPT_CHUNKSIZE] = {.name = "chunksize", .defvalue = "auto"},
+	[OPT_NUMURB] = {.name = "numurb", .defvalue = "auto"},
+	[OPT_LATENCY] = {.name = "latency", .defvalue = "4"},
+	[OPT_RTPRIO] = {.name = "rtprio", .defvalue = "0"},
+	[OPT_CPU] = {.name = "cpu", .defvalue = "any"},
+	[OPT_CAPTURE] = {.name = "capture", .defvalue = NULL},
 	[NOPT] = {.name = NULL}
 };
 
@@ -160,26 +242,200 @@ int proc_libusb_transfer_ret(int ret)
 }
 
 
+static
+void wake_event_thread(struct act2_eegdev* a2dev)
+{
+#if HAVE_LIBUSB_POLLFD
+	uint64_t one = 1;
+	ssize_t rsz;
+
+	if (a2dev->evfd >= 0) {
+		rsz = write(a2dev->evfd, &one, sizeof(one));
+		(void)rsz;
+	}
+#else
+	(void)a2dev;
+#endif
+}
+
+
+#if HAVE_LIBUSB_POLLFD
+static
+void LIBUSB_CALL pollfd_added(int fd, short events, void* data)
+{
+	struct act2_eegdev* a2dev = data;
+	(void)fd;
+	(void)events;
+
+	__atomic_store_n(&a2dev->fdchanged, 1, __ATOMIC_RELEASE);
+	wake_event_thread(a2dev);
+}
+
+
+static
+void LIBUSB_CALL pollfd_removed(int fd, void* data)
+{
+	pollfd_added(fd, 0, data);
+}
+
+
+// Returns the file descriptors to poll: the eventfd followed by those of
+// libusb
+static
+struct pollfd* get_pollfds(struct act2_eegdev* a2dev, nfds_t* nfds)
+{
+	const struct libusb_pollfd** usbfds;
+	struct pollfd* fds;
+	nfds_t i, n;
+
+	if (!(usbfds = libusb_get_pollfds(a2dev->ctx)))
+		return NULL;
+
+	for (n=0; usbfds[n]; n++);
+	if ((fds = malloc((n+1)*sizeof(*fds)))) {
+		fds[0].fd = a2dev->evfd;
+		fds[0].events = POLLIN;
+		for (i=0; i<n; i++) {
+			fds[i+1].fd = usbfds[i]->fd;
+			fds[i+1].events = usbfds[i]->events;
+		}
+		*nfds = n+1;
+	}
+	libusb_free_pollfds(usbfds);
+	return fds;
+}
+
+
+// Wait for the events of libusb and process them as soon as they occur.
+// The thread is woken up through the eventfd when it must stop or when the
+// file descriptors of libusb have changed. Returns if the acquisition is
+// stopped, if the file descriptors cannot be obtained or if poll() fails
+// (the error is then reported).
+static
+void poll_usb_events(struct act2_eegdev* a2dev)
+{
+	struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+	struct pollfd* fds = NULL;
+	nfds_t nfds = 0;
+	uint64_t cnt;
+	ssize_t rsz;
+
+	while (!__atomic_load_n(&a2dev->stopusb, __ATOMIC_ACQUIRE)) {
+		if (__atomic_exchange_n(&a2dev->fdchanged, 0,
+		                        __ATOMIC_ACQ_REL)) {
+			free(fds);
+			if (!(fds = get_pollfds(a2dev, &nfds)))
+				break;
+		}
+
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			a2dev->dev.ci.report_error(&a2dev->dev, errno);
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			rsz = read(a2dev->evfd, &cnt, sizeof(cnt));
+			(void)rsz;
+		}
+		libusb_handle_events_timeout(a2dev->ctx, &tv);
+	}
+
+	free(fds);
+}
+#endif //HAVE_LIBUSB_POLLFD
+
+
 static void* usb_event_handling_proc(void* arg)
 {
 	struct timeval tv = {.tv_sec = 0, .tv_usec = 200000};
 	struct act2_eegdev* a2dev = arg;
-	int quit;
 
-	while (1) {
-		mm_thr_mutex_lock(&a2dev->mtx);
-		quit = a2dev->stopusb;
-		mm_thr_mutex_unlock(&a2dev->mtx);
-		if (quit)
-			break;
+#if HAVE_LIBUSB_POLLFD
+	if (a2dev->evfd >= 0)
+		poll_usb_events(a2dev);
+#endif
 
+	while (!__atomic_load_n(&a2dev->stopusb, __ATOMIC_ACQUIRE))
 		libusb_handle_events_timeout(a2dev->ctx, &tv);
-	}
 
 	return NULL;
 }
 
 
+// Sets the realtime priority and the CPU of the event thread according to
+// the rtprio and cpu options. If thread_created is 0, the options are only
+// checked.
+static
+int setup_event_thread(struct act2_eegdev* a2dev, const char* optv[],
+                       int thread_created)
+{
+	long prio, cpu = -1;
+	char* end;
+	int ret = 0;
+#if HAVE_RT_EVENT_THREAD
+	struct sched_param param;
+	cpu_set_t cpuset;
+#endif
+
+	prio = strtol(optv[OPT_RTPRIO], &end, 0);
+	if (*end || prio < 0 || prio > 99)
+		ret = EINVAL;
+	if (strcmp(optv[OPT_CPU], "any")) {
+		cpu = strtol(optv[OPT_CPU], &end, 0);
+		if (*end || cpu < 0)
+			ret = EINVAL;
+	}
+
+#if HAVE_RT_EVENT_THREAD
+	if (cpu >= CPU_SETSIZE)
+		ret = EINVAL;
+
+	if (!ret && thread_created && prio) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = prio;
+		ret = pthread_setschedparam(a2dev->thread_id, SCHED_FIFO,
+		                            &param);
+	}
+	if (!ret && thread_created && cpu >= 0) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		ret = pthread_setaffinity_np(a2dev->thread_id,
+		                             sizeof(cpuset), &cpuset);
+	}
+#else
+	(void)a2dev;
+	(void)thread_created;
+	if (!ret && (prio || cpu >= 0))
+		ret = ENOSYS;
+#endif
+
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+
+static
+void stop_event_thread(struct act2_eegdev* a2dev)
+{
+	__atomic_store_n(&a2dev->stopusb, 1, __ATOMIC_RELEASE);
+	wake_event_thread(a2dev);
+	mm_thr_join(a2dev->thread_id, NULL);
+
+#if HAVE_LIBUSB_POLLFD
+	if (a2dev->evfd >= 0) {
+		libusb_set_pollfd_notifiers(a2dev->ctx, NULL, NULL, NULL);
+		close(a2dev->evfd);
+		a2dev->evfd = -1;
+	}
+#endif
+}
+
+
 static int act2_write(libusb_device_handle* hudev, void* buff, size_t size)
 {
 	int actual_length, ret;
@@ -193,11 +449,15 @@ static int act2_write(libusb_device_handle* hudev, void* buff, size_t size)
 }
 
 
-static int act2_open_dev(struct act2_eegdev* a2dev)
+static int act2_open_dev(struct act2_eegdev* a2dev, const char* optv[])
 {
 	libusb_device_handle *hudev = NULL;
 	libusb_context* ctx = NULL;
-	int ret, errnum;
+	int ret, errnum, stinit = 0;
+
+	a2dev->evfd = -1;
+	if (setup_event_thread(a2dev, optv, 0))
+		return -1;
 
 	// Initialize a session to libusb, open an Activetwo2 device
 	// and initialize the endpoints
@@ -213,22 +473,53 @@ static int act2_open_dev(struct act2_eegdev* a2dev)
 
 	a2dev->ctx = ctx;
 	a2dev->hudev = hudev;
+
+#if HAVE_LIBUSB_POLLFD
+	// Poll the file descriptors of libusb only if it does not need to
+	// be called for handling the timeouts
+	if (libusb_pollfds_handle_timeouts(ctx)
+	   && (a2dev->evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) >= 0) {
+		a2dev->fdchanged = 1;
+		libusb_set_pollfd_notifiers(ctx, pollfd_added,
+		                            pollfd_removed, a2dev);
+	}
+#endif
 	
-	if (mm_thr_cond_init(&a2dev->cond, 0)
-	  || mm_thr_mutex_init(&a2dev->mtx, 0)
+	if (mm_thr_cond_init(&a2dev->cond, 0) || !(++stinit)
+	  || mm_thr_mutex_init(&a2dev->mtx, 0) || !(++stinit)
 	  || mm_thr_create(&a2dev->thread_id,
-	                    usb_event_handling_proc, a2dev))
+	                    usb_event_handling_proc, a2dev) || !(++stinit))
+		goto error;
+
+	if (setup_event_thread(a2dev, optv, 1)) {
+		ret = errno;
 		goto error;
+	}
 	
 	return 0;
 
 
 error:
+	errnum = (ret > 0) ? ret : proc_libusb_error(ret);
+	if (stinit > 2)
+		stop_event_thread(a2dev);
+#if HAVE_LIBUSB_POLLFD
+	if (a2dev->evfd >= 0) {
+		libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+		close(a2dev->evfd);
+		a2dev->evfd = -1;
+	}
+#endif
+	if (stinit > 1)
+		mm_thr_mutex_deinit(&a2dev->mtx);
+	if (stinit > 0)
+		mm_thr_cond_deinit(&a2dev->cond);
 	if (hudev)
 		libusb_close(hudev);
 	if (ctx)
 		libusb_exit(ctx);
-	errnum = proc_libusb_error(ret);
+	a2dev->hudev = NULL;
+	a2dev->ctx = NULL;
 	errno = errnum ? errnum : EIO;
 	return -1;
 }
@@ -244,10 +535,7 @@ static int act2_close_dev(struct act2_eegdev* a2dev)
 
 	// Close the session to libusb
 	if (a2dev->ctx) {
-		mm_thr_mutex_lock(&a2dev->mtx);
-		a2dev->stopusb = 1;
-		mm_thr_mutex_unlock(&a2dev->mtx);
-		mm_thr_join(a2dev->thread_id, NULL);
+		stop_event_thread(a2dev);
 		mm_thr_mutex_deinit(&a2dev->mtx);
 		mm_thr_cond_deinit(&a2dev->cond);
 		libusb_exit(a2dev->ctx);
@@ -264,11 +552,12 @@ static
 void setup_channel_map(struct act2_eegdev* a2dev, int arrlen, int neeg,
                        struct blockmapping *mappings, const char* optv[])
 {
-	int i, nch;
+	int i, j, nch;
 	const struct egdi_chinfo *map;
 	struct devmodule* dev = &a2dev->dev;
 
 	int nmax[2] = {neeg, arrlen-2-neeg};
+	int first[2] = {STATUS_CH+1, STATUS_CH+1+neeg};
 	int types[2] = {EGD_EEG, EGD_SENSOR};
 	const char* options[2] = {optv[OPT_EEGMAP], optv[OPT_SENSMAP]};
 
@@ -276,6 +565,8 @@ void setup_channel_map(struct act2_eegdev* a2dev, int arrlen, int neeg,
 		map = dev->ci.get_conf_mapping(dev, options[i], &nch);
 		if (map) {
 			nch = (nch <= nmax[i]) ? nch : nmax[i];
+			for (j = 0; j < nch; j++)
+				a2dev->chcal[first[i]+j] = map[j].bcal;
 			mappings[i+1].nch = nch;
 			mappings[i+1].chmap = map;
 			mappings[i+1].num_skipped = nmax[i] - nch;
@@ -320,6 +611,9 @@ int parse_triggers(struct act2_eegdev* a2dev, uint32_t tri,
 	eeg_nmax = num_eeg_channels[mk-1][mode];
 	a2dev->samplelen = arr_size;
 
+	free(a2dev->chcal);
+	if (!(a2dev->chcal = calloc(arr_size, 1)))
+		return -1;
 	setup_channel_map(a2dev, arr_size, eeg_nmax, mappings, optv);
 
 	// Set the capabilities
@@ -327,6 +621,7 @@ int parse_triggers(struct act2_eegdev* a2dev, uint32_t tri,
 	cap.device_type = devtype;
 	cap.device_id = device_id;
 	cap.sampling_freq = samplerates[mk-1][mode];
+	a2dev->fs = cap.sampling_freq;
 	cap.num_mappings = 3;
 	cap.mappings = mappings;
 	cap.flags = EGDCAP_NOCP_DEVID;
@@ -342,28 +637,99 @@ int parse_triggers(struct act2_eegdev* a2dev, uint32_t tri,
 }
 
 
+/******************************************************************
+ *                  Capture of the raw USB chunks                 *
+ ******************************************************************/
+static
+int open_capture(struct act2_eegdev* a2dev, const char* path)
+{
+	FILE* f;
+
+	if (!path)
+		return 0;
+
+	if (!(f = fopen(path, "wb")))
+		return -1;
+	setvbuf(f, NULL, _IOFBF, CAPTURE_BUFSIZE);
+	if (fwrite(CAPTURE_MAGIC, 8, 1, f) != 1) {
+		fclose(f);
+		return -1;
+	}
+
+	a2dev->capstarted = 0;
+	a2dev->capfile = f;
+	return 0;
+}
+
+
+static
+void put_le(unsigned char* p, uint64_t v, int nbytes)
+{
+	int i;
+
+	for (i=0; i<nbytes; i++)
+		p[i] = (v >> (8*i)) & 0xFF;
+}
+
+
+// Append to the capture file a record made of the arrival time of the
+// chunk in ns since the one of the first captured chunk, i.e. the first
+// data streamed by the device (64 bits), its length in bytes
+// (32 bits), both in little endian, followed by the chunk as received
+// from the device. The capture is stopped at the first write error.
+static
+void capture_chunk(struct act2_eegdev* a2dev, const void* buf, size_t len)
+{
+	unsigned char hdr[CAPTURE_HDRLEN];
+	struct mm_timespec ts;
+	int64_t ns;
+
+	if (!a2dev->capfile)
+		return;
+
+	mm_gettime(MM_CLK_MONOTONIC, &ts);
+	if (!a2dev->capstarted) {
+		a2dev->capstart = ts;
+		a2dev->capstarted = 1;
+	}
+	ns = (int64_t)(ts.tv_sec - a2dev->capstart.tv_sec)*1000000000
+	     + (ts.tv_nsec - a2dev->capstart.tv_nsec);
+	put_le(hdr, ns, 8);
+	put_le(hdr+8, len, 4);
+
+	if ( fwrite(hdr, sizeof(hdr), 1, a2dev->capfile) != 1
+	  || fwrite(buf, len, 1, a2dev->capfile) != 1 ) {
+		a2dev->dev.ci.report_error(&(a2dev->dev), EIO);
+		fclose(a2dev->capfile);
+		a2dev->capfile = NULL;
+	}
+}
+
+
 static
 void process_usbbuf(struct act2_eegdev* a2dev, uint32_t* buf, ssize_t bs)
 {
 	int i, start, slen = a2dev->samplelen, inoffset = a2dev->inoffset;
 	const struct core_interface* ci = &(a2dev->dev.ci);
 
-#if WORDS_BIGENDIAN
-	for (i=0; i<bs; i++)
-		buf[i] = bswap_32(buf[i]);
-#endif //WORDS_BIGENDIAN
-
-	// check presence synchro code and shift trigger value         	
+	// check presence synchro code (the channels are decoded from the
+	// little endian words while being cast in the ringbuffer)
 	start = (slen - inoffset) % slen;
 	for (i=start; i<bs; i+=slen) {
-		if (buf[i] != 0xFFFFFF00) {
+		if (le_to_cpu_u32(buf[i]) != SYNC_WORD) {
 			ci->report_error(&(a2dev->dev), EIO);
 			return;
 		}
-		buf[i+1] >>= 8;
 	}
 	a2dev->inoffset = (inoffset + bs)%slen;
 
+#if WORDS_BIGENDIAN
+	// The built-in cast of the core library needs words in host order
+	if (!__atomic_load_n(&a2dev->decoded, __ATOMIC_ACQUIRE))
+		for (i=0; i<bs; i++)
+			buf[i] = bswap_32(buf[i]);
+#endif //WORDS_BIGENDIAN
+
 	// Update the eegdev structure with the new data
 	ci->update_ringbuffer(&(a2dev->dev), buf, bs*sizeof(*buf));
 }
@@ -379,9 +745,12 @@ static void LIBUSB_CALL req_completion_fn(struct libusb_transfer *transfer)
 	const struct core_interface* ci = &(a2dev->dev.ci);
 
 	// interpret the USB buffer content and update the ringbuffer
-	if (transfer->actual_length)
+	if (transfer->actual_length) {
+		capture_chunk(a2dev, transfer->buffer,
+		              transfer->actual_length);
 		process_usbbuf(a2dev, (uint32_t*)transfer->buffer,
 		               transfer->actual_length/sizeof(uint32_t));
+	}
 
 	// Check that no error occured
 	if ((ret = proc_libusb_transfer_ret(transfer->status))) {
@@ -389,22 +758,28 @@ static void LIBUSB_CALL req_completion_fn(struct libusb_transfer *transfer)
 		requeue = 0;
 	}
 
-	mm_thr_mutex_lock(&a2dev->mtx);
-
-	// requeue again the chunk buffer if still running
-	requeue = a2dev->resubmit ? requeue : 0;
-	if (requeue && (ret = libusb_submit_transfer(transfer))) {
-		ci->report_error(&(a2dev->dev), proc_libusb_error(ret));
-		requeue = 0;
+	// requeue again the chunk buffer if still running. If the
+	// acquisition is stopped meanwhile, act2_disable_handshake() may
+	// have failed to cancel it: cancel it here
+	requeue = __atomic_load_n(&a2dev->resubmit, __ATOMIC_SEQ_CST)
+	          ? requeue : 0;
+	if (requeue) {
+		if ((ret = libusb_submit_transfer(transfer))) {
+			ci->report_error(&(a2dev->dev),
+			                 proc_libusb_error(ret));
+			requeue = 0;
+		} else if (!__atomic_load_n(&a2dev->resubmit,
+		                            __ATOMIC_SEQ_CST))
+			libusb_cancel_transfer(transfer);
 	}
 
 	// Signal main thread that this urb stopped
 	if (!requeue) {
+		mm_thr_mutex_lock(&a2dev->mtx);
 		a2dev->num_running--;
 		mm_thr_cond_signal(&a2dev->cond);
+		mm_thr_mutex_unlock(&a2dev->mtx);
 	}
-
-	mm_thr_mutex_unlock(&a2dev->mtx);
 }
 
 
@@ -419,8 +794,8 @@ static int act2_disable_handshake(struct act2_eegdev* a2dev)
 
 	// Notify urb to cancel and wait for them to actually finish
 	mm_thr_mutex_lock(&a2dev->mtx);
-	a2dev->resubmit = 0;
-	for (i=0; i<NUMURB; i++)
+	__atomic_store_n(&a2dev->resubmit, 0, __ATOMIC_SEQ_CST);
+	for (i=0; i<a2dev->numurb; i++)
 		libusb_cancel_transfer(a2dev->urb[i]);
 	
 	while (a2dev->num_running)
@@ -447,13 +822,138 @@ uint32_t* realign_to_firstsync(uint32_t* buf, int* bsize)
 }
 
 
+static void* page_aligned_malloc(size_t len)
+{
+#if HAVE_POSIX_MEMALIGN && HAVE_SYSCONF
+	int ret;
+	void* memptr;
+	size_t pgsize = sysconf(_SC_PAGESIZE);
+	if ((ret = posix_memalign(&memptr, pgsize, len))) {
+		errno = ret;
+		return NULL;
+	}
+	else
+		return memptr;
+#else
+	return malloc(len);
+#endif
+}
+
+
+// Returns the size of the URBs set by the chunksize option, or computed
+// from the latency option so that a URB holds at most the data acquired
+// during the latency. Returns 0 if the option is invalid.
+static
+size_t get_chunksize(const struct act2_eegdev* a2dev, const char* optv[],
+                     unsigned int fs)
+{
+	size_t size, maxsize;
+	double latency;
+	char* end;
+
+	if (strcmp(optv[OPT_CHUNKSIZE], "auto")) {
+		size = strtoul(optv[OPT_CHUNKSIZE], &end, 0);
+		if (*end || size < MIN_CHUNKSIZE || size > MAX_CHUNKSIZE
+		   || (size & (size-1)))
+			return 0;
+		return size;
+	}
+
+	latency = strtod(optv[OPT_LATENCY], &end);
+	if (*end || !(latency > 0.0))
+		return 0;
+	maxsize = latency * 1e-3 * fs * a2dev->samplelen * sizeof(int32_t);
+	for (size = MIN_CHUNKSIZE; 2*size <= maxsize
+	                           && 2*size <= MAX_CHUNKSIZE; size *= 2);
+	return size;
+}
+
+
+// Returns the number of URBs set by the numurb option, or in automatic
+// mode the number of URBs of chunksize bytes holding URB_QUEUE_MS of
+// data. Returns 0 if the option is invalid.
+static
+int get_numurb(const struct act2_eegdev* a2dev, const char* optv[],
+               unsigned int fs, size_t chunksize)
+{
+	long num;
+	double queued;
+	char* end;
+
+	if (strcmp(optv[OPT_NUMURB], "auto")) {
+		num = strtol(optv[OPT_NUMURB], &end, 0);
+		if (*end || num < 1 || num > MAX_NUMURB)
+			return 0;
+		return num;
+	}
+
+	queued = URB_QUEUE_MS*1e-3 * fs * a2dev->samplelen*sizeof(int32_t);
+	num = queued / chunksize + 1;
+	if (num < 2)
+		num = 2;
+	return (num < MAX_NUMURB) ? num : MAX_NUMURB;
+}
+
+
+// Allocate the pool of URBs sized according to the options and the
+// sampling rate of the device, their buffers being carved out of a single
+// block of memory allocated by the USB stack if possible (zero-copy)
+static
+int setup_transfers(struct act2_eegdev* a2dev, const char* optv[])
+{
+	int i, numurb;
+	size_t chunksize;
+	unsigned char* mem = NULL;
+
+	chunksize = get_chunksize(a2dev, optv, a2dev->fs);
+	numurb = chunksize ? get_numurb(a2dev, optv, a2dev->fs, chunksize)
+	                   : 0;
+	if (!numurb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(a2dev->urb = calloc(numurb, sizeof(*a2dev->urb))))
+		return -1;
+	a2dev->numurb = numurb;
+	a2dev->chunksize = chunksize;
+
+#if HAVE_LIBUSB_DEV_MEM
+	if ((mem = libusb_dev_mem_alloc(a2dev->hudev, numurb*chunksize)))
+		a2dev->devmem = 1;
+#endif
+	if (!mem && !(mem = page_aligned_malloc(numurb*chunksize)))
+		return -1;
+	a2dev->urbmem = mem;
+
+	// Initialize the asynchronous USB bulk transfer 
+	for (i=0; i<numurb; i++) {
+		if (!(a2dev->urb[i] = libusb_alloc_transfer(0)))
+			return -1;
+
+		libusb_fill_bulk_transfer(a2dev->urb[i],
+		                          a2dev->hudev, ACT2_EP_IN,
+		                          mem + i*chunksize, chunksize,
+		                          req_completion_fn, a2dev,
+		                          ACT2_TIMEOUT);
+	}
+	
+	return 0;
+}
+
+
 static
 int act2_enable_handshake(struct act2_eegdev* a2dev, const char* optv[])
 {
 	unsigned char usb_data[64] = {0};
-	uint32_t* buf = (uint32_t*) a2dev->urb[0]->buffer;
+	uint32_t *buf, *hsbuf;
 	int transferred, ret, i;
 
+	if (open_capture(a2dev, optv[OPT_CAPTURE])
+	  || !(hsbuf = page_aligned_malloc(HANDSHAKE_SIZE)))
+		return -1;
+	buf = hsbuf;
+
 	// Init activetwo USB comm
 	usb_data[0] = 0x00;
 	act2_write(a2dev->hudev, usb_data, 64);
@@ -464,7 +964,7 @@ int act2_enable_handshake(struct act2_eegdev* a2dev, const char* optv[])
 
 	// Transfer the first chunk of data and check the first synchro
 	ret = libusb_bulk_transfer(a2dev->hudev, ACT2_EP_IN, 
-	                           (unsigned char*)buf, CHUNKSIZE,
+	                           (unsigned char*)buf, HANDSHAKE_SIZE,
 		                   &transferred, ACT2_TIMEOUT);
 	ret = proc_libusb_error(ret);
 	if ( ret || (transferred < 2)
@@ -474,6 +974,7 @@ int act2_enable_handshake(struct act2_eegdev* a2dev, const char* optv[])
 	}
 
 	// Realign to the first frame sync code
+	capture_chunk(a2dev, buf, transferred);
 	transferred /= sizeof(*buf);
 	buf = realign_to_firstsync(buf, &transferred);
 	if (transferred == 0) {
@@ -481,16 +982,19 @@ int act2_enable_handshake(struct act2_eegdev* a2dev, const char* optv[])
 		goto error;
 	}
 
-	// Parse the first trigger to get info about the system and transfer
-	// the buffer into the ringbuffer
-	parse_triggers(a2dev, le_to_cpu_u32(buf[1]), optv);
+	// Parse the first trigger to get info about the system, size the
+	// URBs accordingly and transfer the buffer into the ringbuffer
+	if ( parse_triggers(a2dev, le_to_cpu_u32(buf[STATUS_CH]), optv)
+	  || setup_transfers(a2dev, optv) )
+		goto error;
 	process_usbbuf(a2dev, buf, transferred);
+	free(hsbuf);
 
 	// Submit all the URB in advance in order to queue them into the
 	// USB host controller
 	mm_thr_mutex_lock(&a2dev->mtx);
-	a2dev->resubmit = 1;
-	for (i=0; i<NUMURB; i++) {
+	__atomic_store_n(&a2dev->resubmit, 1, __ATOMIC_SEQ_CST);
+	for (i=0; i<a2dev->numurb; i++) {
 		if ((ret = libusb_submit_transfer(a2dev->urb[i]))) {
 			mm_thr_mutex_unlock(&a2dev->mtx);
 			errno = proc_libusb_error(ret);
@@ -504,76 +1008,211 @@ int act2_enable_handshake(struct act2_eegdev* a2dev, const char* optv[])
 	return 0;
 
 error:
+	free(hsbuf);
 	usb_data[0] = 0x00;
 	act2_write(a2dev->hudev, usb_data, 64);
 	return -1;
 }
 
 
-static void* page_aligned_malloc(size_t len)
+static void destroy_act2dev(struct act2_eegdev* a2dev)
 {
-#if HAVE_POSIX_MEMALIGN && HAVE_SYSCONF
-	int ret;
-	void* memptr;
-	size_t pgsize = sysconf(_SC_PAGESIZE);
-	if ((ret = posix_memalign(&memptr, pgsize, len))) {
-		errno = ret;
-		return NULL;
-	}
+	int i;
+
+	if (a2dev == NULL)
+		return;
+
+	for (i=0; i<a2dev->numurb; i++)
+		libusb_free_transfer(a2dev->urb[i]);
+	free(a2dev->urb);
+#if HAVE_LIBUSB_DEV_MEM
+	if (a2dev->devmem)
+		libusb_dev_mem_free(a2dev->hudev, a2dev->urbmem,
+		                    a2dev->numurb*a2dev->chunksize);
 	else
-		return memptr;
-#else
-	return malloc(len);
 #endif
+		free(a2dev->urbmem);
+	free(a2dev->chcal);
+	if (a2dev->capfile)
+		fclose(a2dev->capfile);
+	act2_close_dev(a2dev);
 }
 
 
-static int init_act2dev(struct act2_eegdev* a2dev)
+/******************************************************************
+ *                    Decoding of the USB frames                  *
+ ******************************************************************/
+static inline
+int32_t read_le32(const char* p)
 {
- 	int i;
-	
-	if (act2_open_dev(a2dev))
-		return -1;
-		
-	// Initialize the asynchronous USB bulk transfer 
-	for (i=0; i<NUMURB; i++) {
-		if (!(a2dev->urb[i] = libusb_alloc_transfer(0))
-		  ||!(a2dev->urb[i]->buffer=page_aligned_malloc(CHUNKSIZE)))
-			goto error;
+	uint32_t v;
 
-		libusb_fill_bulk_transfer(a2dev->urb[i],
-		                          a2dev->hudev, ACT2_EP_IN,
-		                          a2dev->urb[i]->buffer, CHUNKSIZE,
-		                          req_completion_fn, a2dev,
-		                          ACT2_TIMEOUT);
+	memcpy(&v, p, sizeof(v));
+	return (int32_t)le_to_cpu_u32(v);
+}
+
+
+// The samples in the ringbuffer are not necessarily aligned on the type
+// of their channels
+#define STORE(dst, i, type, val)	do {			\
+	type v_ = (val);					\
+	memcpy((dst) + (i)*sizeof(type), &v_, sizeof(type));	\
+} while (0)
+
+
+// The status word holds the triggers and the status bits in its 24 upper
+// bits (the lower byte is always 0)
+static
+void decode_status(char* dst, const char* src, size_t ns,
+                   size_t dstride, size_t sstride, unsigned int type)
+{
+	int32_t v;
+
+	while (ns--) {
+		v = (int32_t)((uint32_t)read_le32(src) >> 8);
+		if (type == EGD_INT32)
+			STORE(dst, 0, int32_t, v);
+		else if (type == EGD_FLOAT)
+			STORE(dst, 0, float, (float)v);
+		else
+			STORE(dst, 0, double, (double)v);
+		src += sstride;
+		dst += dstride;
 	}
-	
-	return 0;
+}
 
-error:
-	for (i=0; i<NUMURB; i++) {
-		if (a2dev->urb[i]) {
-			free(a2dev->urb[i]->buffer);
-			libusb_free_transfer(a2dev->urb[i]);
+
+static
+void decode_int32(char* dst, const char* src, size_t n, size_t ns,
+                  size_t dstride, size_t sstride, int32_t sc)
+{
+	size_t i;
+
+	while (ns--) {
+		for (i=0; i<n; i++)
+			STORE(dst, i, int32_t,
+			      sc * read_le32(src + i*sizeof(int32_t)));
+		src += sstride;
+		dst += dstride;
+	}
+}
+
+
+static
+void decode_float(char* dst, const char* src, size_t n, size_t ns,
+                  size_t dstride, size_t sstride, float sc)
+{
+	size_t i;
+#if HAVE_SSE2
+	__m128i v;
+	__m128 vsc = _mm_set1_ps(sc);
+#endif
+
+	while (ns--) {
+		i = 0;
+#if HAVE_SSE2
+		for (; i+4<=n; i+=4) {
+			v = _mm_loadu_si128((const __m128i*)src + i/4);
+			_mm_storeu_ps((float*)dst + i,
+			              _mm_mul_ps(vsc, _mm_cvtepi32_ps(v)));
 		}
+#endif
+		for (; i<n; i++)
+			STORE(dst, i, float,
+			      sc * (float)read_le32(src + i*sizeof(int32_t)));
+		src += sstride;
+		dst += dstride;
 	}
-	act2_close_dev(a2dev);
-	return -1; 
 }
 
 
-static void destroy_act2dev(struct act2_eegdev* a2dev)
+static
+void decode_double(char* dst, const char* src, size_t n, size_t ns,
+                   size_t dstride, size_t sstride, double sc)
 {
-	int i;
+	size_t i;
+#if HAVE_SSE2
+	__m128i v;
+	__m128d vsc = _mm_set1_pd(sc);
+#endif
 
-	if (a2dev == NULL)
+	while (ns--) {
+		i = 0;
+#if HAVE_SSE2
+		for (; i+4<=n; i+=4) {
+			v = _mm_loadu_si128((const __m128i*)src + i/4);
+			_mm_storeu_pd((double*)dst + i,
+			              _mm_mul_pd(vsc, _mm_cvtepi32_pd(v)));
+			v = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+			_mm_storeu_pd((double*)dst + i+2,
+			              _mm_mul_pd(vsc, _mm_cvtepi32_pd(v)));
+		}
+#endif
+		for (; i<n; i++)
+			STORE(dst, i, double,
+			      sc * (double)read_le32(src + i*sizeof(int32_t)));
+		src += sstride;
+		dst += dstride;
+	}
+}
+
+
+// Decode kernel of the input groups (see can_decode()): the little endian
+// words of the USB frames are converted and scaled in a single pass, the
+// status word being shifted to keep only its meaningful bits. It produces
+// the same values as the built-in cast and transforms of the core library.
+static
+void act2_decode(void* dst, const void* src, size_t len, size_t ns,
+                 size_t dstride, size_t sstride,
+                 const struct selected_channels* sel, unsigned int skip,
+                 void* data)
+{
+	size_t n = len / sizeof(int32_t);
+	int bsc = sel->bsc;
+	(void)skip;
+	(void)data;
+
+	if (sel->in_offset == STATUS_CH*sizeof(int32_t)) {
+		decode_status(dst, src, ns, dstride, sstride, sel->typeout);
 		return;
+	}
 
-	for (i=0; i<NUMURB; i++) {
-		free(a2dev->urb[i]->buffer);
-		libusb_free_transfer(a2dev->urb[i]);
+	if (sel->typeout == EGD_INT32)
+		decode_int32(dst, src, n, ns, dstride, sstride,
+		             bsc ? sel->sc.valint32_t : 1);
+	else if (sel->typeout == EGD_FLOAT)
+		decode_float(dst, src, n, ns, dstride, sstride,
+		             bsc ? sel->sc.valfloat : 1.0f);
+	else
+		decode_double(dst, src, n, ns, dstride, sstride,
+		              bsc ? sel->sc.valdouble : 1.0);
+}
+
+
+// Returns 1 if the input group sel can be decoded by act2_decode(), ie, if
+// it maps the status word alone or channels without calibration, into a
+// type that is not obtained by the core library from float values
+static
+int can_decode(const struct act2_eegdev* a2dev,
+               const struct selected_channels* sel)
+{
+	unsigned int i, first, nch;
+
+	if ( sel->typein != EGD_INT32
+	  || (sel->typeout != EGD_INT32 && sel->typeout != EGD_FLOAT
+	      && sel->typeout != EGD_DOUBLE) )
+		return 0;
+
+	first = sel->in_offset / sizeof(int32_t);
+	nch = sel->inlen / sizeof(int32_t);
+	if (first <= STATUS_CH)
+		return (first == STATUS_CH && nch == 1);
+
+	for (i=first; i<first+nch; i++) {
+		if (a2dev->chcal[i])
+			return 0;
 	}
-	act2_close_dev(a2dev);
+	return 1;
 }
 
 
@@ -585,8 +1224,9 @@ int act2_open_device(struct devmodule* dev, const char* optv[])
 {
 	struct act2_eegdev* a2dev = get_act2(dev);
 
-	// alloc and initialize tructure
-	if (init_act2dev(a2dev))
+	// Open the device (the URBs are allocated during the handshake
+	// once the sampling rate is known)
+	if (act2_open_dev(a2dev, optv))
 		return -1;
 
 	// Start the communication
@@ -610,12 +1250,44 @@ static int act2_close_device(struct devmodule* dev)
 }
 
 
+static
+int act2_set_channel_groups(struct devmodule* dev, unsigned int ngrp,
+                            const struct grpconf* grp)
+{
+	struct act2_eegdev* a2dev = get_act2(dev);
+	struct selected_channels* selch;
+	unsigned int i, nsel, ndec = 0;
+	int all;
+
+	if (!(selch = dev->ci.split_input_groups(dev, ngrp, grp, &nsel)))
+		return -1;
+
+	for (i=0; i<nsel; i++)
+		ndec += can_decode(a2dev, selch+i);
+
+	// On big endian hosts, the USB buffers are swapped in place for the
+	// built-in cast unless all the groups are decoded by the plugin
+	all = (ndec == nsel);
+#if WORDS_BIGENDIAN
+	ndec = all ? ndec : 0;
+#endif
+	for (i=0; ndec && i<nsel; i++) {
+		if (can_decode(a2dev, selch+i))
+			dev->ci.set_input_decoder(dev, i, act2_decode, NULL);
+	}
+	__atomic_store_n(&a2dev->decoded, all, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
 API_EXPORTED
 const struct egdi_plugin_info eegdev_plugin_info = {
 	.plugin_abi = 	EEGDEV_PLUGIN_ABI_VERSION,
 	.struct_size = 	sizeof(struct act2_eegdev),
 	.open_device = 		act2_open_device,
 	.close_device = 	act2_close_device,
+	.set_channel_groups = 	act2_set_channel_groups,
 	.supported_opts = 	act2_options
 };
 
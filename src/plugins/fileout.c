@@ -113,6 +113,7 @@ void extract_file_info(struct xdfout_eegdev* xdfdev, const char* filename)
 		xdfdev->chmap[i].stype = stype;
 		xdfdev->chmap[i].label = label;
 		xdfdev->chmap[i].si = NULL;
+		xdfdev->chmap[i].bcal = 0;
 	}
 	tre_regfree(&triggre);
 	tre_regfree(&eegre);
@@ -124,7 +125,7 @@ void extract_file_info(struct xdfout_eegdev* xdfdev, const char* filename)
 	cap.device_type = xdfout_device_type;
 	cap.device_id = filename;
 	cap.flags = EGDCAP_NOCP_CHMAP | EGDCAP_NOCP_CHLABEL
-	                                              | EGDCAP_NOCP_DEVTYPE;
+	                          | EGDCAP_NOCP_DEVTYPE | EGDCAP_WHOLE_SAMPLES;
 	xdfdev->dev.ci.set_cap(&xdfdev->dev, &cap);
 }
 
@@ -363,13 +364,17 @@ static int xdfout_set_channel_groups(struct devmodule* dev, unsigned int ngrp,
 		return -1;
 
 	for (i=0; i<ngrp; i++) {
+		// Narrow types are converted by the core from float
 		type = grp[i].datatype;
+		if (type > EGD_DOUBLE)
+			type = EGD_FLOAT;
 		dsize = egd_get_data_size(type);
 
 		// Set parameters of (eeg -> ringbuffer)
 		selch[i].in_offset = offset;
 		selch[i].inlen = grp[i].nch * dsize;
-		selch[i].typeout = selch[i].typein = type;
+		selch[i].typein = type;
+		selch[i].typeout = grp[i].datatype;
 		selch[i].bsc = 0;
 		selch[i].iarray = grp[i].iarray;
 		selch[i].arr_offset = grp[i].arr_offset;
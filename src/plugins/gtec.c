@@ -24,9 +24,9 @@
 #include <mmlib.h>
 #include <mmsysio.h>
 #include <mmtime.h>
-#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #if DLOPEN_GUSBAMP
@@ -48,7 +48,6 @@
 struct gtec_acq_element {
 	char devname[16];
 	void* buff;
-	size_t bsize;
 	int ielt;
 };
 
@@ -60,9 +59,6 @@ struct gtec_eegdev {
 	void* buffer;
 
 	// Master/Slave acquisition
-	pthread_rwlock_t ms_lock;
-	pthread_mutex_t bfulllock;
-	pthread_cond_t bfullcond;
 	unsigned int num_elt;
 	struct gtec_acq_element elt[NUMELT_MAX];
 	
@@ -84,6 +80,17 @@ struct filtparam
 	int id;
 };
 
+// Filters supported by a model at a sampling rate: the bandpass filters
+// followed by the notch filters
+struct gtec_filters
+{
+	char model[16];
+	int fs, nbp, nnotch;
+	gt_filter_specification* filt;
+};
+
+#define FILTCACHE_HEADER	"eegdev-gtec-filters 1"
+
 #define get_gtec(dev_p) ((struct gtec_eegdev*)(dev_p))
 #define get_elt_gtdev(dev_p) \
 	((struct gtec_eegdev*)(((char*)(dev_p))-(offsetof(struct gtec_eegdev, elt)+((dev_p)->ielt * sizeof(struct gtec_acq_element)))))
@@ -226,33 +233,189 @@ static
 float valabs(float f) {return (f >= 0.0f) ? f : -f;} //avoid include libm
 
 
+// The model is the prefix of the serial number (UB-2009.10.06 -> UB)
+static
+void gtec_get_model(const char* devname, char* model, size_t len)
+{
+	size_t n = strcspn(devname, "-");
+
+	if (n >= len)
+		n = len-1;
+	memcpy(model, devname, n);
+	model[n] = '\0';
+}
+
+
+static
+int gtec_get_filtcache_path(const struct gtec_filters* flist,
+                            char* path, size_t len)
+{
+	const char* dir = mm_get_basedir(MM_CONFIG_HOME);
+	int ret;
+
+	if (!dir)
+		return -1;
+
+	ret = snprintf(path, len, "%s/%s/gtec-filters-%s-%i.cache",
+	               dir, PACKAGE_NAME, flist->model, flist->fs);
+	return (ret < 0 || (size_t)ret >= len) ? -1 : 0;
+}
+
+
+static
+int gtec_read_filtcache(struct gtec_filters* flist, const char* path)
+{
+	FILE* fp;
+	char header[32];
+	int i, nbp, nnotch, ntot, ok = 0;
+	unsigned long id;
+	gt_filter_specification* filt = NULL;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+
+	if (!fgets(header, sizeof(header), fp)
+	   || strncmp(header, FILTCACHE_HEADER, strlen(FILTCACHE_HEADER))
+	   || fscanf(fp, " bandpass %i notch %i", &nbp, &nnotch) != 2
+	   || nbp < 0 || nnotch < 0 || nbp > 4096 || nnotch > 4096)
+		goto exit;
+
+	ntot = nbp + nnotch;
+	if (ntot && !(filt = calloc(ntot, sizeof(*filt))))
+		goto exit;
+	for (i=0; i<ntot; i++) {
+		if (fscanf(fp, " %lu %f %f %f %f", &id, &filt[i].order,
+		           &filt[i].f_lower, &filt[i].f_upper,
+		           &filt[i].type) != 5)
+			goto exit;
+		filt[i].id = id;
+		filt[i].sample_rate = flist->fs;
+	}
+	ok = 1;
+
+exit:
+	fclose(fp);
+	if (!ok) {
+		free(filt);
+		return -1;
+	}
+	flist->nbp = nbp;
+	flist->nnotch = nnotch;
+	flist->filt = filt;
+	return 0;
+}
+
+
+// Write the cache in a temporary file renamed once complete so that a
+// concurrent open never reads a partial table. Failures are ignored: the
+// filters will be queried again at the next open.
+static
+void gtec_write_filtcache(const struct gtec_filters* flist, const char* path)
+{
+	char tmppath[strlen(path)+8], dirpath[strlen(path)+1];
+	const gt_filter_specification* filt = flist->filt;
+	int i, error;
+	FILE* fp;
+
+	strcpy(dirpath, path);
+	*strrchr(dirpath, '/') = '\0';
+	mm_mkdir(dirpath, 0777, MM_RECURSIVE);
+
+	sprintf(tmppath, "%s.tmp", path);
+	if (!(fp = fopen(tmppath, "w")))
+		return;
+
+	fprintf(fp, "%s\nbandpass %i notch %i\n", FILTCACHE_HEADER,
+	        flist->nbp, flist->nnotch);
+	for (i=0; i<flist->nbp+flist->nnotch; i++)
+		fprintf(fp, "%lu %.9g %.9g %.9g %.9g\n",
+		        (unsigned long)filt[i].id, filt[i].order,
+		        filt[i].f_lower, filt[i].f_upper, filt[i].type);
+
+	error = ferror(fp);
+	if (fclose(fp) || error || rename(tmppath, path))
+		remove(tmppath);
+}
+
+
+static
+int gtec_query_filters(const char* devname, struct gtec_filters* flist)
+{
+	gt_size fs = flist->fs;
+	int nbp, nnotch;
+	gt_filter_specification* filt;
+
+	nbp = GT_GetBandpassFilterListSize(devname, fs);
+	nnotch = GT_GetNotchFilterListSize(devname, fs);
+	if (nbp < 0 || nnotch < 0) {
+		errno = EIO;
+		return -1;
+	}
+	if (!(filt = malloc((nbp+nnotch+1)*sizeof(*filt))))
+		return -1;
+
+	if ((nbp && !GT_GetBandpassFilterList(devname, fs, filt,
+	                                      nbp*sizeof(*filt)))
+	   || (nnotch && !GT_GetNotchFilterList(devname, fs, filt+nbp,
+	                                        nnotch*sizeof(*filt)))) {
+		free(filt);
+		errno = EIO;
+		return -1;
+	}
+
+	flist->nbp = nbp;
+	flist->nnotch = nnotch;
+	flist->filt = filt;
+	return 0;
+}
+
+
+// Get the filters supported by the device at the sampling rate fs. The
+// tables are cached per model and sampling rate in the user configuration
+// folder since querying them slows down the opening of the device.
+static
+int gtec_load_filters(const char* devname, int fs, struct gtec_filters* flist)
+{
+	char path[512];
+	int cached;
+
+	gtec_get_model(devname, flist->model, sizeof(flist->model));
+	flist->fs = fs;
+	flist->filt = NULL;
+
+	cached = !gtec_get_filtcache_path(flist, path, sizeof(path));
+	if (cached && !gtec_read_filtcache(flist, path))
+		return 0;
+
+	if (gtec_query_filters(devname, flist))
+		return -1;
+
+	// An empty table is not cached: it may come from a transient failure
+	if (cached && (flist->nbp || flist->nnotch))
+		gtec_write_filtcache(flist, path);
+	return 0;
+}
+
+
 static 
-int gtec_find_bpfilter(const char* devname, gt_usbamp_config* conf,
-                       float fl, float fh, float order,
-		       struct filtparam* filtprm)
+void gtec_find_bpfilter(const struct gtec_filters* flist,
+                        float fl, float fh, float order,
+		        struct filtparam* filtprm)
 {
 	float score, minscore = 1e12;
-	int i, best = -1, nfilt;
-	gt_size fs = conf->sample_rate;
-	gt_filter_specification *filt = NULL;
+	int i, best = -1;
+	const gt_filter_specification* filt = flist->filt;
 
-	if ((fl == 0.0) && (fh == 0.0)) {
+	if (((fl == 0.0) && (fh == 0.0)) || !flist->nbp) {
 		filtprm->id = GT_FILTER_NONE;
 		filtprm->order = 0;
 		filtprm->fh = 0.0;
 		filtprm->fl = 0.0;
-		return 0;
+		return;
 	}
 
-	// Get available filters
-	nfilt = GT_GetBandpassFilterListSize(devname, fs);
-	filt = malloc(nfilt*sizeof(*filt));
-	if (filt == NULL)
-		return -1;
-	GT_GetBandpassFilterList(devname, fs, filt, nfilt*sizeof(*filt));
-	
 	// Test matching score of each filter
-	for (i=0; i<nfilt; i++) {
+	for (i=0; i<flist->nbp; i++) {
 		score = valabs(fl-filt[i].f_lower)/(fl < 1e-3 ? 1.0 : fl)
 		       + valabs(fh-filt[i].f_upper)/(fh < 1e-3 ? 1.0 : fh)
 		       + 1e-3*valabs(order-filt[i].order)/order;
@@ -265,38 +428,27 @@ int gtec_find_bpfilter(const char* devname, gt_usbamp_config* conf,
 	filtprm->order = filt[best].order;
 	filtprm->fh = filt[best].f_upper;
 	filtprm->fl = filt[best].f_lower;
-
-	free(filt);
-	return 0;
 }
 
 
 static 
-int gtec_find_notchfilter(const char* devname, gt_usbamp_config* conf,
-                          float freq, struct filtparam* filtprm)
+void gtec_find_notchfilter(const struct gtec_filters* flist,
+                           float freq, struct filtparam* filtprm)
 {
 	float score, minscore = 1e12;
-	int i, best = -1, nfilt;
-	gt_size fs = conf->sample_rate;
-	gt_filter_specification *filt = NULL;
+	int i, best = -1;
+	const gt_filter_specification* filt = flist->filt + flist->nbp;
 
-	if ((freq == 0.0)) {
+	if ((freq == 0.0) || !flist->nnotch) {
 		filtprm->id = GT_FILTER_NONE;
 		filtprm->order = 0;
 		filtprm->fh = 0.0;
 		filtprm->fl = 0.0;
-		return 0;
+		return;
 	}
 
-	// Get available filters
-	nfilt = GT_GetNotchFilterListSize(devname, fs);
-	filt = malloc(nfilt*sizeof(*filt));
-	if (filt == NULL)
-		return -1;
-	GT_GetNotchFilterList(devname, fs, filt, nfilt*sizeof(*filt));
-	
 	// Test matching score of each filter
-	for (i=0; i<nfilt; i++) {
+	for (i=0; i<flist->nnotch; i++) {
 		score = valabs(freq-0.5*(filt[i].f_lower+filt[i].f_upper));
 		if (score < minscore) {
 			best = i;
@@ -308,9 +460,6 @@ int gtec_find_notchfilter(const char* devname, gt_usbamp_config* conf,
 	filtprm->order = filt[best].order;
 	filtprm->fh = filt[best].f_upper;
 	filtprm->fl = filt[best].f_lower;
-
-	free(filt);
-	return 0;
 }
 
 
@@ -327,6 +476,7 @@ void gtec_setup_eegdev_core(struct gtec_eegdev* gtdev)
 		.device_id = gtdev->devid,
 		.flags = EGDCAP_NOCP_DEVID
 	};
+	struct egdi_input_column cols[gtdev->num_elt];
 	struct devmodule* dev = &gtdev->dev;
 
 	// Default conf: all systems provides EEG and 1 channel of trigger
@@ -336,12 +486,22 @@ void gtec_setup_eegdev_core(struct gtec_eegdev* gtdev)
 	// Advertise capabilities
 	dev->ci.set_cap(dev, &cap);
 	dev->ci.set_input_samlen(dev, gtdev->num_elt*ELT_SAMSIZE);
+
+	// In master/slave mode, each element writes its own channels
+	if (gtdev->num_elt > 1) {
+		for (i=0; i < gtdev->num_elt; i++) {
+			cols[i].offset = i*ELT_SAMSIZE;
+			cols[i].len = ELT_SAMSIZE;
+		}
+		dev->ci.set_input_producers(dev, gtdev->num_elt, cols);
+	}
 }
 
 
 static
-int gtec_setup_conf(const char* devname, gt_usbamp_config* conf,
-                    const struct gtec_options* gopt, char* filtstr)
+void gtec_setup_conf(const struct gtec_filters* flist,
+                     gt_usbamp_config* conf,
+                     const struct gtec_options* gopt, char* filtstr)
 {
 	int i;
 	char hpstr[16] = {0}, lpstr[16] = {0}, notchstr[32] = {0};
@@ -364,9 +524,8 @@ int gtec_setup_conf(const char* devname, gt_usbamp_config* conf,
 	}
 
 	// find best filters
-	if (gtec_find_bpfilter(devname, conf, gopt->hp, gopt->lp, 2, &bpprm)
-	    || gtec_find_notchfilter(devname, conf, gopt->notch, &notchprm))
-		return -1;
+	gtec_find_bpfilter(flist, gopt->hp, gopt->lp, 2, &bpprm);
+	gtec_find_notchfilter(flist, gopt->notch, &notchprm);
 	
 	// Setup prefiltering string
 	if (bpprm.fl)
@@ -388,7 +547,6 @@ int gtec_setup_conf(const char* devname, gt_usbamp_config* conf,
 		conf->bipolar[i] = GT_BIPOLAR_DERIVATION_NONE;
 		conf->analog_in_channel[i] = i+1;
 	}
-	return 0;
 }
 
 
@@ -398,10 +556,12 @@ int gtec_configure_device(struct gtec_eegdev *gtdev,
 {
 	unsigned int i;
 	const char* devname;
+	char model[16];
 	gt_usbamp_config conf;
 	gt_usbamp_asynchron_config as_conf = {
 		.digital_out = {GT_FALSE, GT_FALSE, GT_FALSE, GT_FALSE}
 	};
+	struct gtec_filters flist = {.filt = NULL};
 	gtdev->fs = gopt->fs;
 
 	if (gtdev->num_elt == 0)
@@ -409,7 +569,15 @@ int gtec_configure_device(struct gtec_eegdev *gtdev,
 	
 	for (i=0; i<gtdev->num_elt; i++) {
 		devname = gtdev->elt[i].devname;
-		gtec_setup_conf(devname, &conf, gopt, gtdev->prefiltering);
+
+		// Elements of the same model share the filter tables
+		gtec_get_model(devname, model, sizeof(model));
+		if (!flist.filt || strcmp(model, flist.model)) {
+			free(flist.filt);
+			if (gtec_load_filters(devname, gopt->fs, &flist))
+				return -1;
+		}
+		gtec_setup_conf(&flist, &conf, gopt, gtdev->prefiltering);
 
 		// First device is master, the rest are slaves
 		if (i!=0)
@@ -419,6 +587,7 @@ int gtec_configure_device(struct gtec_eegdev *gtdev,
 		GT_SetAsynchronConfiguration(devname, &as_conf);
 		GT_ApplyAsynchronConfiguration(devname);
 	}
+	free(flist.filt);
 
 	gtec_setup_eegdev_core(gtdev);
 	return 0;
@@ -475,105 +644,30 @@ void gtec_callback(void* data)
 }
 
 
-static
-size_t gtec_sync_buffer(struct gtec_acq_element* elt, size_t bsize)
-{
-	struct gtec_eegdev* gtdev = get_elt_gtdev(elt);
-	const struct core_interface* restrict ci = &gtdev->dev.ci;
-	pthread_rwlock_t* rwlock = &(gtdev->ms_lock);
-	size_t minsize = SIZE_MAX, maxsize = 0;
-	unsigned int i, nelt = gtdev->num_elt;
-	pthread_mutex_t* bfulllock = &(gtdev->bfulllock);
-
-	if (nelt == 0)
-		return 0;
-	
-	elt->bsize = bsize;
-
-	pthread_rwlock_unlock(rwlock);
-	pthread_rwlock_wrlock(rwlock);
-
-	// Calculate the smallest amount of data available in all element
-	// i.e. what can be currently to the ringbuffer
-	for (i=0; i<nelt; i++) {
-		if (minsize > gtdev->elt[i].bsize)
-			minsize = gtdev->elt[i].bsize;
-	}
-
-	// Send data to ringbuffer when all elements have some data
-	if (minsize > 0) {
-		char* buffer = gtdev->buffer;
-		ci->update_ringbuffer(&(gtdev->dev), buffer, nelt*minsize);
-		
-		pthread_mutex_lock(bfulllock);
-
-		// Empty from the common buffer the data sent
-		for (i=0; i<nelt; i++) {
-			if (maxsize < gtdev->elt[i].bsize)
-				maxsize = gtdev->elt[i].bsize;
-			gtdev->elt[i].bsize -= minsize;
-		}
-		if (minsize != maxsize)
-			memmove(buffer, buffer+nelt*minsize, 
-			                          nelt*(maxsize - minsize));
-
-		// unblock element whose buffer was full
-		if (maxsize == gtdev->buflen/nelt) 
-			pthread_cond_broadcast(&(gtdev->bfullcond));
-		
-		pthread_mutex_unlock(bfulllock);
-	}
-
-	pthread_rwlock_unlock(rwlock);
-	pthread_rwlock_rdlock(rwlock);
-
-	return elt->bsize;
-}
-
-
 static
 void gtec_callback_masterslave(void* data)
 {
 	struct gtec_acq_element* elt = data;
 	struct gtec_eegdev* gtdev = get_elt_gtdev(elt);
-	pthread_rwlock_t* rwlock = &(gtdev->ms_lock);
-	unsigned char *ebuff = elt->buff, *rbuff = gtdev->buffer;
-	unsigned int nelt = gtdev->num_elt, ielt = elt->ielt;
-	ssize_t sizetot, i, pos, size = 0;
-	ssize_t bsize, buflen = gtdev->buflen / nelt;
+	const struct core_interface* ci = &gtdev->dev.ci;
+	int sizetot, size = 0, buflen = gtdev->buflen;
 	const char* devname = elt->devname;
-	int runacq;
-	pthread_mutex_t* bfulllock = &(gtdev->bfulllock);
-
-	// Block while the element buffer is full
-	pthread_mutex_lock(bfulllock);
-	while ((elt->bsize == (size_t)buflen) && gtdev->runacq)
-		pthread_cond_wait(&(gtdev->bfullcond), bfulllock);
-	runacq = gtdev->runacq; // to avoid *harmless* race condition
-	pthread_mutex_unlock(bfulllock);
-	if (!runacq)
-		return;
 
-	pthread_rwlock_rdlock(rwlock);
-	bsize = elt->bsize;
+	if (!gtdev->runacq)
+		return;
 
-	// Transfer data to ringbuffer by chunks of buflen bytes max
+	// Transfer the channels of the element to the ringbuffer by chunks
+	// of buflen bytes max. The core publishes the samples once all the
+	// elements have written them.
 	sizetot = GT_GetSamplesAvailable(devname);
-	while ((sizetot > 0) && (bsize < buflen)) {
-		size = (sizetot < buflen-bsize) ? sizetot : buflen-bsize;
-		size = GT_GetData(devname, ebuff, size);
+	while (sizetot > 0) {
+		size = (sizetot < buflen) ? sizetot : buflen;
+		size = GT_GetData(devname, elt->buff, size);
 		if (size <= 0) 
 			break;
 
-		// Update the common buffer with the new data
-		for (i=0; i<size; i+=ELT_SAMSIZE) {
-			pos = nelt*(i+bsize) + ielt*ELT_SAMSIZE;
-			memcpy(rbuff+pos, ebuff+i, ELT_SAMSIZE);
-		}
-		bsize += size;
-		
-		// Synchronize with the other elements
-		bsize = gtec_sync_buffer(elt, bsize);
+		ci->update_ringbuffer_column(&gtdev->dev, elt->ielt,
+		                             elt->buff, size);
 
 		// Check that there is no recently added samples
 		sizetot -= size;
@@ -581,12 +675,10 @@ void gtec_callback_masterslave(void* data)
 			sizetot = GT_GetSamplesAvailable(devname);
 	}
 
-	pthread_rwlock_unlock(rwlock);
-
 	if (size < 0)
-		gtdev->dev.ci.report_error(&gtdev->dev, ENOMEM);
+		ci->report_error(&gtdev->dev, ENOMEM);
 	else if (sizetot < 0)
-		gtdev->dev.ci.report_error(&gtdev->dev, EIO);
+		ci->report_error(&gtdev->dev, EIO);
 }
 
 
@@ -599,24 +691,19 @@ int gtec_start_device_acq(struct gtec_eegdev* gtdev)
 	char* buff;
 	void* arg;
 
-	// prepare one buffer containing common buffer and element buffers
+	// prepare one buffer containing the element buffers
 	eltbuflen = ELT_SAMSIZE*(size_t)(0.1 * (double)gtdev->fs);
-	buff = malloc(2*num*eltbuflen);
+	buff = malloc(num*eltbuflen);
 	gtdev->runacq = 1;
-	
-	// Setup synchronization primitives
-	pthread_mutex_init(&(gtdev->bfulllock), NULL);
-	pthread_cond_init(&(gtdev->bfullcond), NULL);
-	pthread_rwlock_init(&(gtdev->ms_lock), NULL);
 
 	// Use the created buffer and set the acquisition callbacks
-	gtdev->buflen = num*eltbuflen;
+	gtdev->buflen = eltbuflen;
 	gtdev->buffer = buff;
 	cb = (num == 1) ? gtec_callback : gtec_callback_masterslave;
 	for (i=0; i<num; i++) {
 		arg = (num != 1) ? (void*) &(gtdev->elt[i]) : (void*)gtdev;
 		GT_SetDataReadyCallBack(gtdev->elt[i].devname, cb, arg);
-		gtdev->elt[i].buff =  buff + (num+i)*eltbuflen;
+		gtdev->elt[i].buff =  buff + i*eltbuflen;
 	}
 
 	// Start device acquisition (starting by slaves)
@@ -642,21 +729,12 @@ int gtec_stop_device_acq(struct gtec_eegdev* gtdev)
 {
 	int i;
 
-	// unlock any stalled callback
-	pthread_mutex_lock(&(gtdev->bfulllock));
 	gtdev->runacq = 0;
-	pthread_cond_broadcast(&(gtdev->bfullcond));
-	pthread_mutex_unlock(&(gtdev->bfulllock));
 
 	// Stop device acquisition (starting by slaves)
 	for (i=gtdev->num_elt-1; i>=0; i--)
 		GT_StopAcquisition(gtdev->elt[i].devname);
 
-	// Clean the synchronisation primitives
-	pthread_mutex_destroy(&(gtdev->bfulllock));
-	pthread_cond_destroy(&(gtdev->bfullcond));
-	pthread_rwlock_destroy(&(gtdev->ms_lock));
-
 	// prepare small buffer
 	free(gtdev->buffer);
 
@@ -215,7 +215,7 @@ int nsky_set_capability(struct nsky_eegdev* nskydev, const char* baddr)
 		.sampling_freq = 128, 
 		.nch = NCH,
 		.chmap = nsky_chmap,
-		.flags = EGDCAP_NOCP_CHMAP,
+		.flags = EGDCAP_NOCP_CHMAP | EGDCAP_WHOLE_SAMPLES,
 		.device_type = "Neurosky",
 		.device_id = baddr
 	};
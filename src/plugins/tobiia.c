@@ -25,6 +25,7 @@
 #include <mmsysio.h>
 #include <mmthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -84,6 +85,7 @@ static const struct egdi_optname tia_options[] = {
 
 
 #define XML_BSIZE	4096
+#define RECV_BATCH_SIZE	65536
 
 struct tia_eegdev {
 	struct devmodule dev;
@@ -95,11 +97,22 @@ struct tia_eegdev {
 	int fs, blocksize;
 	unsigned int nch, nsig;
 	int offset[TIA_NUM_SIG];
+	unsigned int sigdiv[TIA_NUM_SIG], signch[TIA_NUM_SIG];
+
+	// Producer of the columns of each signal sampled at the device rate
+	// (-1 for the other signals) and number of channels of each producer
+	int sigprod[TIA_NUM_SIG];
+	unsigned int nprod, prodch[TIA_NUM_SIG];
+
+	// Signals grouped by sampling rate (rate 0 is the one of the master
+	// signal)
+	unsigned int nrate;
+	unsigned int ratediv[TIA_NUM_SIG], ratench[TIA_NUM_SIG];
+	int sigrate[TIA_NUM_SIG];
 
 	struct egdi_chinfo* chmap;
 
-	tia_state_t reader_state;
-	mm_thr_mutex_t reader_state_lock;
+	tia_state_t reader_state;	// atomic
 };
 #define get_tia(dev_p) 	((struct tia_eegdev*)(dev_p))
 
@@ -181,23 +194,6 @@ int connect_server(const char *host, unsigned int short port)
 }
 
 
-static
-int fullread(int fd, void* buff, size_t count)
-{
-	do {
-		ssize_t rsiz = mm_read(fd, buff, count);
-		if (rsiz <= 0) {
-			if (rsiz == 0)
-				errno = EPIPE;
-			return -1;
-		}
-		count -= rsiz;
-		buff = ((char*)buff) + rsiz;
-	} while(count);
-	return 0;
-}
-
-
 static
 int fullwrite(int fd, const void* buff, size_t count)
 {
@@ -244,21 +240,44 @@ void parse_start_tiametainfo(struct parsingdata* data)
 }
 
 
+static
+int get_rate_index(struct tia_eegdev* tdev, unsigned int div)
+{
+	unsigned int r;
+
+	for (r=0; r<tdev->nrate; r++)
+		if (tdev->ratediv[r] == div)
+			return r;
+
+	tdev->ratediv[r] = div;
+	tdev->ratench[r] = 0;
+	tdev->nrate++;
+	return r;
+}
+
+
 static
 void parse_end_tiametainfo(struct parsingdata* data)
 {
 	struct tia_eegdev* tdev = data->tdev;
 	unsigned int i;
-	int signch, nch = 0;
+	int signch, r;
 
 	qsort(tdev->chmap, tdev->nch, sizeof(*tdev->chmap), ch_cmp);
 
+	// Samples are supplied separately for each rate: the offset of a
+	// signal is relative to the signals sampled at the same rate
+	tdev->nrate = 0;
+	get_rate_index(tdev, 1);
 	for (i=0; i<TIA_NUM_SIG; i++) {
 		if (tdev->offset[i] < 0)
 			continue;
 		signch = tdev->offset[i]+1;
-		tdev->offset[i] = nch;
-		nch += signch;
+		r = get_rate_index(tdev, tdev->sigdiv[i]);
+		tdev->signch[i] = signch;
+		tdev->sigrate[i] = r;
+		tdev->offset[i] = tdev->ratench[r];
+		tdev->ratench[r] += signch;
 	}
 }
 
@@ -284,7 +303,7 @@ int parse_start_mastersignal(struct parsingdata* data, const char **attr)
 static
 int parse_start_signal(struct parsingdata* data, const char **attr)
 {
-	unsigned int i, fs = 0;
+	unsigned int i, div, fs = 0;
 	int sig, tiatype, bs = 0;
 	struct egdi_chinfo *newchmap = data->tdev->chmap;
 	const char* ltype = NULL;
@@ -302,9 +321,12 @@ int parse_start_signal(struct parsingdata* data, const char **attr)
 			bs = atoi(attr[i+1]);
 	}
 
-	// For the moment we support only signal with the same samplerate
-	// as the mastersignal
-	if ((data->cap.sampling_freq != fs) || (tdev->blocksize != bs)) 
+	// Signals must be sampled at an integer fraction of the master
+	// signal rate and their blocks must cover the same period
+	if (!fs || (data->cap.sampling_freq % fs))
+		return -1;
+	div = data->cap.sampling_freq / fs;
+	if (tdev->blocksize != bs * (int)div)
 		return -1;
 
 	// fail if the read signal metadata has no type
@@ -325,11 +347,13 @@ int parse_start_signal(struct parsingdata* data, const char **attr)
 	if (tiatype < 0)
 		return -1;
 	tdev->offset[tiatype] += data->nch;
+	tdev->sigdiv[tiatype] = div;
 	
 	for (i=tdev->nch - data->nch; i<tdev->nch; i++) {
 		tdev->chmap[i].stype = sig;
 		tdev->chmap[i].label = NULL;
 		tdev->chmap[i].si = &sig_info[tiatype].si;
+		tdev->chmap[i].bcal = 0;
 	}
 	data->sig = sig;
 	strncpy(data->ltype, ltype, sizeof(data->ltype)-1);
@@ -584,7 +608,7 @@ struct data_hdr {
 
 static
 unsigned int parse_type_flags(uint32_t flags, const struct tia_eegdev* tdev,
-                              int offset[32])
+                              int offset[32], int rate[32], int prod[32])
 {
 	unsigned int i, nsig = 0;
 	int tiatype;
@@ -595,6 +619,8 @@ unsigned int parse_type_flags(uint32_t flags, const struct tia_eegdev* tdev,
 		mask = ((uint32_t)1) << i;
 		if (flags & mask) {
 			nsig++;
+			offset[nsig-1] = -1;
+			prod[nsig-1] = -1;
 
 			// Retrieve the type of flagged signal
 			if ((tiatype = get_tobiia_siginfo_mask(mask)) < 0)
@@ -603,6 +629,8 @@ unsigned int parse_type_flags(uint32_t flags, const struct tia_eegdev* tdev,
 			// setup the sample offset according to the type
 			// of the signal
 			offset[nsig-1] = tdev->offset[tiatype];
+			rate[nsig-1] = tdev->sigrate[tiatype];
+			prod[nsig-1] = tdev->sigprod[tiatype];
 		}
 	}
 
@@ -610,25 +638,65 @@ unsigned int parse_type_flags(uint32_t flags, const struct tia_eegdev* tdev,
 }
 
 
+// Offset (in number of values) of the samples of the rate r (r >= 1) in the
+// sample buffer (the signals of the device rate do not go through it)
+static
+size_t get_rate_sbuf_offset(const struct tia_eegdev* tdev, int r)
+{
+	int i;
+	size_t off = 0;
+
+	for (i=1; i<r; i++)
+		off += tdev->ratench[i] * (tdev->blocksize / tdev->ratediv[i]);
+
+	return off;
+}
+
+
+// Write the block of the signal supplied by the producer iprod. A single
+// producer holds the whole samples of the device rate: its block is then
+// passed as is.
+static
+int write_signal(struct tia_eegdev* tdev, int iprod, const float* in,
+                 size_t len)
+{
+	const struct core_interface* ci = &tdev->dev.ci;
+
+	if (tdev->nprod == 1)
+		return ci->update_ringbuffer(&tdev->dev, in, len);
+
+	return ci->update_ringbuffer_column(&tdev->dev, iprod, in, len);
+}
+
+
+// Write the signals of a packet. The packet holds the blocks of each signal
+// one after the other, each block being made of consecutive samples. The
+// core library casts the block of a signal sampled at the device rate
+// directly from the packet into the columns of the ringbuffer samples that
+// hold its channels, skipping the unselected ones. A signal of the device
+// rate missing from the packet is supplied with zeros (from zbuf) so that
+// the samples of the other signals get published. The signals of lower
+// rates are converted into arrays grouped by samples (one per rate) in sbuf.
 static
-size_t unpack_datapacket(const struct tia_eegdev* tdev,
-                         uint32_t type_flags, const void* pbuf, void* sbuf)
+int write_datapacket(struct tia_eegdev* tdev, uint32_t type_flags,
+                     const void* pbuf, void* sbuf, const float* zbuf,
+                     size_t len[])
 {
-	unsigned int i, ich, sig, nsig;
+	unsigned int i, ich, sig, nsig, stride, ns = 0;
 	const uint16_t *numch, *blocksize;
-	unsigned int stride = tdev->nch;
-	float* data = sbuf;
+	float* data;
 	const float* sigb;
-	int off[32];
+	int off[32], rate[32], prod[32];
+	char written[TIA_NUM_SIG] = {0};
 
 	// Parse type flags and packet pointer accordingly
-	nsig = parse_type_flags(type_flags, tdev, off);
+	nsig = parse_type_flags(type_flags, tdev, off, rate, prod);
 	numch = (const uint16_t*)pbuf;
 	blocksize = ((const uint16_t*)pbuf) + nsig;
 	sigb = (const float*)(((const uint16_t*)pbuf) + 2*nsig);
 
-	// convert array grouped by signal type into an array
-	// grouped by samples
+	// convert array grouped by signal type into arrays
+	// grouped by samples (one per sampling rate)
 	for (sig=0; sig<nsig; sig++) {
 		// negative offset means that signal should not be sent
 		if (off[sig] < 0) {
@@ -636,81 +704,207 @@ size_t unpack_datapacket(const struct tia_eegdev* tdev,
 			continue;
 		}
 
+		if (prod[sig] >= 0) {
+			if (numch[sig] != tdev->prodch[prod[sig]]
+			   || blocksize[sig] > tdev->blocksize
+			   || (ns && blocksize[sig] != ns)) {
+				errno = EPROTO;
+				return -1;
+			}
+			ns = blocksize[sig];
+			if (write_signal(tdev, prod[sig], sigb,
+			                 numch[sig]*ns*sizeof(float)))
+				return -1;
+			written[prod[sig]] = 1;
+			sigb += numch[sig]*ns;
+			continue;
+		}
+
+		stride = tdev->ratench[rate[sig]];
+		data = (float*)sbuf + get_rate_sbuf_offset(tdev, rate[sig]);
 		for (i=0; i<blocksize[sig]; i++) {
 			for (ich=0; ich<numch[sig]; ich++)
 				data[i*stride + off[sig] + ich] = sigb[ich];
 			sigb += numch[sig];
 		}
+		len[rate[sig]] = blocksize[sig]*stride*sizeof(float);
+	}
+
+	// Supply the signals of the device rate missing from the packet
+	if (!ns)
+		return 0;
+	for (i=0; i<tdev->nprod; i++) {
+		if (!written[i] && write_signal(tdev, i, zbuf,
+		                          tdev->prodch[i]*ns*sizeof(float)))
+			return -1;
+	}
+
+	return 0;
+}
+
+// Write the packets complete in the len bytes of buff. The payload of each
+// packet is first moved back over its header to be aligned on the type of
+// its values. Returns the number of bytes consumed or -1 in case of error.
+static
+ssize_t write_datapackets(struct tia_eegdev* tdev, char* buff, size_t len,
+                          void* sbuf, const float* zbuf)
+{
+	const struct core_interface* ci = &tdev->dev.ci;
+	struct data_hdr hdr;
+	size_t blen[TIA_NUM_SIG], pos = 0, plen;
+	unsigned int r;
+	char* pbuf;
+
+	while (len - pos >= DATHDR_LEN) {
+		memcpy(&(hdr.version), buff + pos, DATHDR_LEN);
+		if (hdr.size < DATHDR_LEN) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (len - pos < hdr.size)
+			break;
+
+		plen = hdr.size - DATHDR_LEN;
+		pbuf = buff + pos;
+		pbuf -= (uintptr_t)pbuf % sizeof(double);
+		memmove(pbuf, buff + pos + DATHDR_LEN, plen);
+		pos += hdr.size;
+
+		// Parse packet and update ringbuffers (lower rates after
+		// the master one)
+		memset(blen, 0, sizeof(blen));
+		if (write_datapacket(tdev, hdr.type_flags, pbuf, sbuf, zbuf,
+		                     blen))
+			return -1;
+		for (r=1; r<tdev->nrate; r++)
+			if (ci->update_subring(&tdev->dev, tdev->ratediv[r],
+			              (float*)sbuf
+				        + get_rate_sbuf_offset(tdev, r),
+			              blen[r]))
+				return -1;
 	}
 
-	return blocksize[0]*stride*sizeof(float);
+	return pos;
 }
 
+
 static
 void* data_fn(void *data)
 {
 	struct tia_eegdev* tdev = data;
 	const struct core_interface* restrict ci = &tdev->dev.ci;
-	struct data_hdr hdr;
-	size_t blen, pbsize;
+	size_t rbsize, sbsize, rlen = 0;
+	ssize_t rsiz;
+	uint32_t size;
 	int fd = tdev->datafd;
+	unsigned int i, zch = 0;
 	tia_state_t reader_state;
-	void *sbuf = NULL, *pbuf = NULL;
+	void *sbuf = NULL, *tmp;
+	char *rbuf = NULL;
+	float *zbuf = NULL;
 
-	mm_thr_mutex_lock(&tdev->reader_state_lock);
-	reader_state = tdev->reader_state;
-	mm_thr_mutex_unlock(&tdev->reader_state_lock);
+	reader_state = __atomic_load_n(&tdev->reader_state, __ATOMIC_ACQUIRE);
 
-	// Allocate utility packet and sample buffers
-	pbsize = tdev->nsig*2*sizeof(uint16_t)
+	// Allocate the receive buffer (large enough to get several packets
+	// per call) and the sample buffer
+	rbsize = DATHDR_LEN + tdev->nsig*2*sizeof(uint16_t)
 	         + tdev->blocksize*tdev->nch*sizeof(float);
-	pbuf = malloc(pbsize);
-	sbuf = malloc(tdev->nch*sizeof(float)*tdev->blocksize);
-
-	while (pbuf && sbuf && reader_state == RUNNING) {
-		// Read packet header
-		if (fullread(fd, &(hdr.version), DATHDR_LEN))
+	if (rbsize < RECV_BATCH_SIZE/2)
+		rbsize = RECV_BATCH_SIZE;
+	else
+		rbsize *= 2;
+	rbuf = malloc(rbsize);
+	sbsize = get_rate_sbuf_offset(tdev, tdev->nrate)*sizeof(float);
+	if (sbsize)
+		sbuf = malloc(sbsize);
+
+	// Zeros supplied for the signals missing from a packet
+	for (i=0; i<tdev->nprod; i++)
+		if (zch < tdev->prodch[i])
+			zch = tdev->prodch[i];
+	zbuf = calloc(tdev->blocksize*zch + 1, sizeof(float));
+
+	while (rbuf && (sbuf || !sbsize) && zbuf && reader_state == RUNNING) {
+		// Receive as many data as available
+		rsiz = mm_recv(fd, rbuf + rlen, rbsize - rlen, 0);
+		if (rsiz <= 0) {
+			if (rsiz == 0)
+				errno = EPIPE;
 			break;
-
-		// Resize packet buffer if too small
-		if (pbsize < hdr.size-DATHDR_LEN) {
-			pbsize = hdr.size-DATHDR_LEN;
-			free(pbuf);
-			if (!(pbuf = malloc(pbsize)))
-				break;
 		}
+		rlen += rsiz;
 
-		// Read packet data
-		if (fullread(fd, pbuf, hdr.size-DATHDR_LEN))
-			break;
-
-		// Parse packet and update ringbuffer
-		blen = unpack_datapacket(tdev, hdr.type_flags, pbuf, sbuf);
-		if (ci->update_ringbuffer(&tdev->dev, sbuf, blen))
+		// Write the complete packets and keep the rest for the next
+		// call
+		if ((rsiz = write_datapackets(tdev, rbuf, rlen, sbuf, zbuf)) < 0)
 			break;
+		rlen -= rsiz;
+		memmove(rbuf, rbuf + rsiz, rlen);
+
+		// Enlarge the receive buffer if the next packet cannot fit
+		if (rlen >= DATHDR_LEN) {
+			memcpy(&size, rbuf + offsetof(struct data_hdr, size)
+			                   - DATHDR_OFF, sizeof(size));
+			if (size > rbsize) {
+				if (!(tmp = realloc(rbuf, 2*size)))
+					break;
+				rbuf = tmp;
+				rbsize = 2*size;
+			}
+		}
 
-		mm_thr_mutex_lock(&tdev->reader_state_lock);
-		reader_state = tdev->reader_state;
-		mm_thr_mutex_unlock(&tdev->reader_state_lock);
+		reader_state = __atomic_load_n(&tdev->reader_state,
+		                               __ATOMIC_ACQUIRE);
 	}
 
 	if(reader_state == RUNNING) // if true there has been an error
 		ci->report_error(&tdev->dev, errno);
 
-	free(pbuf);
+	free(rbuf);
 	free(sbuf);
+	free(zbuf);
 
 	return NULL;
 }
 
 
+// Each signal sampled at the device rate is supplied by its own producer
+// of the columns holding its channels (see write_datapacket()). A single
+// signal supplies the whole samples: no producer is declared then.
+static
+int setup_signal_producers(struct tia_eegdev* tdev)
+{
+	struct egdi_input_column cols[TIA_NUM_SIG];
+	struct devmodule* dev = &tdev->dev;
+	unsigned int i, nprod = 0;
+
+	for (i=0; i<TIA_NUM_SIG; i++) {
+		tdev->sigprod[i] = -1;
+		if (tdev->offset[i] < 0 || tdev->sigrate[i] != 0)
+			continue;
+		cols[nprod].offset = tdev->offset[i]*sizeof(float);
+		cols[nprod].len = tdev->signch[i]*sizeof(float);
+		tdev->prodch[nprod] = tdev->signch[i];
+		tdev->sigprod[i] = nprod++;
+	}
+	tdev->nprod = nprod;
+
+	if (nprod < 2)
+		return 0;
+
+	return dev->ci.set_input_producers(dev, nprod, cols);
+}
+
+
 static
 int init_data_com(struct tia_eegdev* tdev, const char* host)
 {
 	int port;
 	struct devmodule* dev = &tdev->dev;
 
-	dev->ci.set_input_samlen(dev, tdev->nch*sizeof(float));
+	dev->ci.set_input_samlen(dev, tdev->ratench[0]*sizeof(float));
+	if (setup_signal_producers(tdev))
+		return -1;
 	tdev->reader_state = RUNNING;
 
 	if ( (port = tia_request(tdev, TIA_DATACONNECTION, NULL)) < 0
@@ -735,21 +929,39 @@ int setup_device_config(struct tia_eegdev* tdev, const char* url)
 {
 	struct parsingdata data = {.tdev = tdev};
 	struct devmodule* dev = &tdev->dev;
-	struct blockmapping mappings = {.num_skipped = 0};
+	struct blockmapping mappings[TIA_NUM_SIG];
+	unsigned int i, nmap = 0, div;
+	uint32_t mask;
 
 	// Request system information from server
 	if (tia_request(tdev, TIA_METAINFO, &data))
 		return -1;
 
-	// setup device capabilities with the digested metainfo
-	mappings.nch = tdev->nch;
-	mappings.chmap = tdev->chmap;
-	data.cap.mappings = &mappings;
-	data.cap.num_mappings = 1;
+	// At least one signal must be sampled at the master signal rate
+	if (!tdev->ratench[0]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// setup device capabilities with the digested metainfo: one
+	// mapping per run of channels sampled at the same rate
+	for (i=0; i<tdev->nch; i++) {
+		mask = get_tia_si(tdev->chmap[i].si)->mask;
+		div = tdev->sigdiv[get_tobiia_siginfo_mask(mask)];
+		if (!nmap || mappings[nmap-1].rate_div != div) {
+			memset(&mappings[nmap], 0, sizeof(mappings[nmap]));
+			mappings[nmap].chmap = tdev->chmap + i;
+			mappings[nmap].rate_div = div;
+			nmap++;
+		}
+		mappings[nmap-1].nch++;
+	}
+	data.cap.mappings = mappings;
+	data.cap.num_mappings = nmap;
 	data.cap.device_type = tia_device_type;
 	data.cap.device_id = url ? url : "local server";
 	data.cap.flags = EGDCAP_NOCP_CHMAP | EGDCAP_NOCP_CHLABEL
-	                                              | EGDCAP_NOCP_DEVTYPE;
+	                          | EGDCAP_NOCP_DEVTYPE | EGDCAP_WHOLE_SAMPLES;
 	dev->ci.set_cap(dev, &data.cap);
 
 	return 0;
@@ -777,9 +989,8 @@ int tia_close_device(struct devmodule* dev)
 
 	// Destroy data connection
 	if (tdev->datafd >= 0) {
-		mm_thr_mutex_lock(&tdev->reader_state_lock);
-		tdev->reader_state = STOP;
-		mm_thr_mutex_unlock(&tdev->reader_state_lock);
+		__atomic_store_n(&tdev->reader_state, STOP,
+		                 __ATOMIC_RELEASE);
 		mm_thr_join(tdev->thid, NULL);
 		mm_close(tdev->datafd);
 	}
@@ -788,7 +999,6 @@ int tia_close_device(struct devmodule* dev)
 	if (tdev->parser)
   		XML_ParserFree(tdev->parser);
 
-	mm_thr_mutex_deinit(&tdev->reader_state_lock);
 	return 0;
 }
 
@@ -804,7 +1014,6 @@ int tia_open_device(struct devmodule* dev, const char* optv[])
 	char* host = url ? hoststring : NULL;
 
 	tdev->datafd = tdev->ctrlfd = -1;
-	mm_thr_mutex_init(&tdev->reader_state_lock, 0);
 
 	if ( (url && parse_url(url, host, &port))
 	  || init_xml_parser(tdev)
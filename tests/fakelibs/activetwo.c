@@ -32,10 +32,24 @@
 /* keep those includes below because of windows imposing include order */
 #include <libusb.h>
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "fakeact2.h"
 
+// The completed transfers can be waited through an eventfd exported as the
+// file descriptor of the libusb context
+#if defined(__linux__) && defined(LIBUSB_API_VERSION) \
+    && (LIBUSB_API_VERSION >= 0x01000104)
+# define FAKE_POLLFD	1
+# include <poll.h>
+# include <unistd.h>
+# include <sys/eventfd.h>
+#else
+# define FAKE_POLLFD	0
+#endif
+
 #ifndef LIBUSB_CALL
 #define LIBUSB_CALL
 #endif
@@ -45,7 +59,11 @@
 #define ACT2_EP_OUT			0x01
 #define ACT2_EP_IN			0x82
 
-#define MAXREQ	8
+#define MAXREQ	80	// URBs queued by the plugin and control transfers
+
+// Capture file written by the capture option of the biosemi plugin
+#define CAPTURE_MAGIC	"ACT2RAW1"
+#define CAPTURE_HDRLEN	12
 
 struct usb_request {
 	struct libusb_transfer* transfer;
@@ -57,6 +75,7 @@ struct event_queue {
 	mm_thr_mutex_t lock;
 
 	int nqueued, free;
+	int efd;	// signaled at each enqueued transfer (or -1)
 	struct usb_request queue[MAXREQ];
 };
 
@@ -89,6 +108,7 @@ static
 void init_queue(struct event_queue* queue)
 {
 	memset(queue, 0, sizeof(*queue));
+	queue->efd = -1;
 
 	mm_thr_cond_init(&queue->cond, 0);
 	mm_thr_mutex_init(&queue->lock, 0);
@@ -122,7 +142,7 @@ struct libusb_transfer* peek_transfer(struct event_queue* eq, int req)
 	transfer = eq->queue[req].transfer;
 	eq->nqueued--;
 	memmove(&eq->queue[req], &eq->queue[req+1], 
-	        eq->nqueued * sizeof(eq->queue[0]));
+	        (eq->nqueued - req) * sizeof(eq->queue[0]));
 
 	return transfer;
 }
@@ -183,6 +203,13 @@ int enqueue_transfer(struct event_queue* eq, struct libusb_transfer* transfer, s
 	eq->queue[i].transfer = transfer;
 	memcpy(&eq->queue[i].ts, ts, sizeof(*ts));
 	mm_thr_cond_signal(&eq->cond);
+#if FAKE_POLLFD
+	if (eq->efd >= 0) {
+		uint64_t one = 1;
+		if (write(eq->efd, &one, sizeof(one)) < 0)
+			goto exit;
+	}
+#endif
 exit:
 	mm_thr_mutex_unlock(&eq->lock);
 
@@ -239,6 +266,14 @@ struct libusb_device_handle {
 	struct libusb_context* ctx;
 	struct event_queue ep_in, ep_out;
 	mm_thread_t th_ep_in, th_ep_out;
+
+	// Replay of a capture (protected by the lock of ep_in)
+	FILE* replay;
+	int rec_eof;
+	double replay_speed;	// 0 to replay as fast as possible
+	int64_t rec_ns;	// arrival time of the current record
+	unsigned char* rec;
+	size_t reclen, recoff, recsize;
 };
 
 static
@@ -401,6 +436,172 @@ void* endpoint_in_fn(void* data)
 }
 
 
+/*************************************************************
+ *                   Replay of a capture file                *
+ *************************************************************/
+// If FAKEACT2_REPLAY is set, the data of the IN endpoint is the content of
+// a capture file of the biosemi plugin instead of the synthetic signals.
+// Each acquisition replays the whole capture with the same chunks at their
+// recorded pace, sped up by the factor set in FAKEACT2_REPLAY_PACE, or as
+// fast as the transfers are submitted if it is "fast". The device is
+// reported as disconnected once the capture is exhausted.
+static
+int open_replay(struct libusb_device_handle* dev)
+{
+	const char *path, *pace;
+	char magic[8];
+
+	if (!(path = getenv("FAKEACT2_REPLAY")))
+		return 0;
+
+	if (!(dev->replay = fopen(path, "rb"))
+	  || fread(magic, sizeof(magic), 1, dev->replay) != 1
+	  || memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "fakeact2: invalid capture file %s\n", path);
+		if (dev->replay)
+			fclose(dev->replay);
+		dev->replay = NULL;
+		return -1;
+	}
+
+	pace = getenv("FAKEACT2_REPLAY_PACE");
+	if (!pace)
+		dev->replay_speed = 1.0;
+	else if (strcmp(pace, "fast"))
+		dev->replay_speed = (atof(pace) > 0.0) ? atof(pace) : 1.0;
+	dev->rec_eof = 1;
+	return 0;
+}
+
+
+static
+uint64_t get_le(const unsigned char* p, int nbytes)
+{
+	uint64_t v = 0;
+
+	while (nbytes--)
+		v = (v << 8) | p[nbytes];
+
+	return v;
+}
+
+
+static
+void read_record(struct libusb_device_handle* dev)
+{
+	unsigned char hdr[CAPTURE_HDRLEN];
+	size_t len;
+
+	dev->rec_eof = 1;
+	if (fread(hdr, sizeof(hdr), 1, dev->replay) != 1)
+		return;
+
+	len = get_le(hdr+8, 4);
+	if (len > dev->recsize) {
+		free(dev->rec);
+		dev->recsize = 0;
+		if (!(dev->rec = malloc(len)))
+			return;
+		dev->recsize = len;
+	}
+	if (len && fread(dev->rec, len, 1, dev->replay) != 1)
+		return;
+
+	dev->rec_ns = get_le(hdr, 8);
+	dev->reclen = len;
+	dev->recoff = 0;
+	dev->rec_eof = 0;
+}
+
+
+static
+void restart_replay(struct libusb_device_handle* dev)
+{
+	fseek(dev->replay, sizeof(CAPTURE_MAGIC)-1, SEEK_SET);
+	read_record(dev);
+}
+
+
+static
+int ts_replay(struct mm_timespec* ts, void* data)
+{
+	struct libusb_device_handle* dev = data;
+
+	if (!dev->streaming)
+		return -1;
+
+	memcpy(ts, &dev->start, sizeof(*ts));
+	if (dev->replay_speed > 0.0 && !dev->rec_eof)
+		mm_timeadd_ns(ts, dev->rec_ns / dev->replay_speed);
+	return 0;
+}
+
+
+// Fill the transfer with the data of the current record if it is due. A
+// record larger than the transfer is split over the next ones.
+static
+int replay_chunk(struct libusb_device_handle* dev,
+                 struct libusb_transfer* transfer)
+{
+	struct mm_timespec ts, now;
+	size_t len;
+
+	if (!dev->streaming)
+		return LIBUSB_TRANSFER_TIMED_OUT;
+	if (dev->rec_eof)
+		return LIBUSB_TRANSFER_NO_DEVICE;
+
+	ts_replay(&ts, dev);
+	mm_gettime(MM_CLK_REALTIME, &now);
+	if (mm_timediff_us(&now, &ts) < 0)
+		return LIBUSB_TRANSFER_TIMED_OUT;
+
+	len = dev->reclen - dev->recoff;
+	if (len > (size_t)transfer->length)
+		len = transfer->length;
+	memcpy(transfer->buffer, dev->rec + dev->recoff, len);
+	transfer->actual_length = len;
+
+	dev->recoff += len;
+	if (dev->recoff == dev->reclen)
+		read_record(dev);
+
+	return LIBUSB_TRANSFER_COMPLETED;
+}
+
+
+static
+void* endpoint_in_replay_fn(void* data)
+{
+	struct libusb_device_handle* dev = data;
+	struct libusb_context* ctx = dev->ctx;
+	struct libusb_transfer* transfer;
+	struct event_queue* eq = &dev->ep_in;
+	struct mm_timespec ts = {0, 0};
+	int req, status;
+
+	mm_thr_mutex_lock(&eq->lock);
+	while ((req = wait_transfer(eq, ts_replay, dev)) >= 0) {
+		transfer = peek_transfer(eq, req);
+		transfer->actual_length = 0;
+		status = transfer->status;
+		if (status != LIBUSB_TRANSFER_CANCELLED)
+			status = req ? LIBUSB_TRANSFER_TIMED_OUT
+			             : replay_chunk(dev, transfer);
+		transfer->status = status;
+		mm_thr_mutex_unlock(&eq->lock);
+
+		// Process transfer
+		enqueue_transfer(&ctx->queue, transfer, &ts);
+
+		mm_thr_mutex_lock(&eq->lock);
+	}
+	mm_thr_mutex_unlock(&eq->lock);
+
+	return NULL;
+}
+
+
 static
 int ts_out(struct mm_timespec* ts, void* data)
 {
@@ -440,6 +641,8 @@ void* endpoint_out_fn(void* data)
 		else if (transfer->buffer[0] == 0xFF) {
 			dev->streaming = 1;
 			mm_gettime(MM_CLK_REALTIME, &dev->start);
+			if (dev->replay)
+				restart_replay(dev);
 		}
 		mm_thr_cond_signal(&dev->ep_in.cond);
 		mm_thr_mutex_unlock(&dev->ep_in.lock);
@@ -466,7 +669,8 @@ void init_device(struct libusb_device_handle* dev, struct libusb_context* ctx)
 	init_queue(&dev->ep_in);
 	init_queue(&dev->ep_out);
 
-	mm_thr_create(&dev->th_ep_in, endpoint_in_fn, dev);
+	mm_thr_create(&dev->th_ep_in, dev->replay ? endpoint_in_replay_fn
+	                                          : endpoint_in_fn, dev);
 	mm_thr_create(&dev->th_ep_out, endpoint_out_fn, dev);
 }
 
@@ -476,6 +680,9 @@ void destroy_device(struct libusb_device_handle* dev)
 {
 	destroy_queue(&dev->ep_in, dev->th_ep_in);
 	destroy_queue(&dev->ep_out, dev->th_ep_out);
+	if (dev->replay)
+		fclose(dev->replay);
+	free(dev->rec);
 }
 
 
@@ -489,6 +696,9 @@ int libusb_init(libusb_context **context)
 	ctx = calloc(1,sizeof(*ctx));
 
 	init_queue(&ctx->queue);
+#if FAKE_POLLFD
+	ctx->queue.efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+#endif
 
 	*context = ctx;
 	return 0;
@@ -498,17 +708,83 @@ int libusb_init(libusb_context **context)
 LIBUSB_CALL
 void libusb_exit(libusb_context *ctx)
 {
+#if FAKE_POLLFD
+	if (ctx->queue.efd >= 0)
+		close(ctx->queue.efd);
+#endif
 	destroy_queue(&ctx->queue, 0);
 	free(ctx);
 }
 
 
+#if FAKE_POLLFD
+struct pollfd_list {
+	const struct libusb_pollfd* list[2];
+	struct libusb_pollfd pollfd;
+};
+
+
+LIBUSB_CALL
+const struct libusb_pollfd** libusb_get_pollfds(libusb_context *ctx)
+{
+	struct pollfd_list* fds;
+
+	if (ctx->queue.efd < 0 || !(fds = malloc(sizeof(*fds))))
+		return NULL;
+
+	fds->pollfd.fd = ctx->queue.efd;
+	fds->pollfd.events = POLLIN;
+	fds->list[0] = &fds->pollfd;
+	fds->list[1] = NULL;
+	return fds->list;
+}
+
+
+LIBUSB_CALL
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+	free((void*)pollfds);
+}
+
+
+// The file descriptor of the context never changes
+LIBUSB_CALL
+void libusb_set_pollfd_notifiers(libusb_context *ctx,
+                                 libusb_pollfd_added_cb added_cb,
+                                 libusb_pollfd_removed_cb removed_cb,
+                                 void *user_data)
+{
+	(void)ctx;
+	(void)added_cb;
+	(void)removed_cb;
+	(void)user_data;
+}
+
+
+// The timeouts are handled by the threads of the endpoints
+LIBUSB_CALL
+int libusb_pollfds_handle_timeouts(libusb_context *ctx)
+{
+	(void)ctx;
+	return 1;
+}
+#endif //FAKE_POLLFD
+
+
 LIBUSB_CALL
 int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
 {
 	int free_xfer;
 	struct libusb_transfer* xfer = NULL;
 	struct mm_timespec tots, curr, *to = NULL;
+#if FAKE_POLLFD
+	uint64_t cnt;
+
+	// Clear the notification of the transfers about to be processed
+	if (ctx->queue.efd >= 0
+	   && read(ctx->queue.efd, &cnt, sizeof(cnt)) < 0)
+		cnt = 0;
+#endif
 
 	// Setup timeout timestamp
 	if (tv) {
@@ -604,6 +880,27 @@ void libusb_free_transfer(struct libusb_transfer *transfer)
 }
 
 
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+LIBUSB_CALL
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev, size_t length)
+{
+	(void)dev;
+	return malloc(length);
+}
+
+
+LIBUSB_CALL
+int libusb_dev_mem_free(libusb_device_handle *dev, unsigned char *buffer,
+                        size_t length)
+{
+	(void)dev;
+	(void)length;
+	free(buffer);
+	return 0;
+}
+#endif
+
+
 struct sync_data {
 	int done, actual_length, status;
 	mm_thr_cond_t cond;
@@ -679,6 +976,10 @@ libusb_device_handle *libusb_open_device_with_vid_pid(libusb_context *ctx,
 		return NULL;
 
 	dev = calloc(1, sizeof(*dev));
+	if (open_replay(dev)) {
+		free(dev);
+		return NULL;
+	}
 	init_device(dev, ctx);
 	return dev;
 }
@@ -63,9 +63,11 @@ static mm_thr_cond_t cond = MM_THR_COND_INITIALIZER;
 static int acq_run = -1;
 static struct mm_timespec acq_ts;
 
-static const uint32_t type_flags = 0x00000001 | 0x00000002 | 0x00200000;
-static const unsigned int num_sig_ch[] = {16, 4, 1};
-static const char* chtype[] = {"eeg", "emg", "event"};
+static const uint32_t type_flags = 0x00000001 | 0x00000002 | 0x00000020
+                                   | 0x00200000;
+static const unsigned int num_sig_ch[] = {16, 4, NSUBCH, 1};
+static const unsigned int sig_div[] = {1, 1, SUBDIV, 1};
+static const char* chtype[] = {"eeg", "emg", "bp", "event"};
 static unsigned int samplingrate = 128;
 static unsigned int blocksize = 10;
 #define TIA_NSIG	(sizeof(num_sig_ch)/sizeof(num_sig_ch[0]))
@@ -123,14 +125,14 @@ int write_data_packet(char* buffer)
 	static size_t sam  = 0; 
 	static uint64_t packet_num = 0;
 
-	unsigned int i, j, k;
-	unsigned int nchtot = 0;
+	unsigned int i, j, k, bs;
+	unsigned int nval = 0;
 	struct data_hdr* hdr = (struct data_hdr*)buffer;
 	uint16_t* varhdr = (uint16_t*)(buffer+sizeof(*hdr));
 	float* data;
 
 	for (i=0; i<TIA_NSIG; i++)
-		nchtot += num_sig_ch[i];
+		nval += num_sig_ch[i]*(blocksize/sig_div[i]);
 	
 	data = (float*)(buffer+sizeof(*hdr) + (2*sizeof(uint16_t))*TIA_NSIG);
 	hdr->version = 3;
@@ -139,14 +141,17 @@ int write_data_packet(char* buffer)
 	hdr->number = packet_num++;
 	hdr->type_flags = type_flags;
 	hdr->size = sizeof(*hdr) + 2*sizeof(uint16_t)*TIA_NSIG
-	                         + sizeof(float)*nchtot*blocksize;
+	                         + sizeof(float)*nval;
 
+	// The j-th sample of a signal sampled at samplingrate/div is the
+	// one of the master signal at j*div
 	for (i=0; i<TIA_NSIG; i++) {
+		bs = blocksize/sig_div[i];
 		varhdr[i] = num_sig_ch[i];
-		varhdr[i+TIA_NSIG] = blocksize;
-		for (j=0; j<blocksize; j++) {
+		varhdr[i+TIA_NSIG] = bs;
+		for (j=0; j<bs; j++) {
 			for (k=0; k<num_sig_ch[i]; k++)
-				data[k] = (i < TIA_NSIG-1) ? get_analog_val(sam+j, k) : get_trigger_val(sam+j, k);
+				data[k] = (i < TIA_NSIG-1) ? get_analog_val(sam+j*sig_div[i], k) : get_trigger_val(sam+j, k);
 			data += num_sig_ch[i];
 		}
 	}
@@ -210,8 +215,8 @@ int write_metainfo(FILE* fp)
 	for (i=0; i<TIA_NSIG; i++) {
 		fprintf(fp, "<signal type=\"%s\" blockSize=\"%u\""
 		            " samplingRate=\"%u\" numChannels=\"%u\">\n",
-			    chtype[i], blocksize,
-			    samplingrate, num_sig_ch[i]);
+			    chtype[i], blocksize/sig_div[i],
+			    samplingrate/sig_div[i], num_sig_ch[i]);
 		for (j=0; j<num_sig_ch[i]; j++)
 			fprintf(fp, "  <channel label=\"tobi%s:%u\" "
 			                                "nr=\"%u\" />\n",
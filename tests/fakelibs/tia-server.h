@@ -18,6 +18,10 @@
 #ifndef TIA_SERVER_H
 #define TIA_SERVER_H
 
+// Signal sampled at a lower rate than the master signal
+#define NSUBCH	2
+#define SUBDIV	2
+
 static inline
 float get_analog_val(size_t sam, unsigned int ich)
 {
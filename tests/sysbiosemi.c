@@ -20,6 +20,7 @@
 # include <config.h>
 #endif
 #include <mmargparse.h>
+#include <mmtime.h>
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
@@ -28,6 +29,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <eegdev.h>
+#include <eegdev-pluginapi.h>
 #include "fakelibs/fakeact2.h"
 
 #define DURATION	4	// in seconds
@@ -38,6 +40,18 @@ int verbose = 0;
 
 static int checking = 0;
 static int nstot = 0, nsread = 0;
+static int numworkers = 0, castthread = 0, usestage = 0;
+static int eventcpu = -1;
+static const char* capture = NULL;
+static int duration = DURATION;
+
+// State of the stage negating the EEG channels in the ring buffer
+static struct {
+	int nsetup, nteardown, nrestart;
+	size_t samlen, ns;
+	unsigned int nspan;
+	struct egd_chspan spans[4];
+} negstage;
 
 static struct grpconf grp[3] = {
 	{
@@ -63,6 +77,76 @@ static struct grpconf grp[3] = {
 	}
 };
 
+static
+int neg_setup(void* data, const struct egd_stage_layout* layout)
+{
+	unsigned int i;
+	(void)data;
+
+	negstage.nsetup++;
+	negstage.samlen = layout->samlen;
+	negstage.nspan = 0;
+	for (i=0; i<layout->nspan; i++) {
+		if (layout->spans[i].stype != egd_sensor_type("eeg"))
+			continue;
+		if (negstage.nspan == 4)
+			return -1;
+		negstage.spans[negstage.nspan++] = layout->spans[i];
+	}
+	return 0;
+}
+
+
+static
+void neg_process(void* data, void* samples, size_t ns, int restart)
+{
+	unsigned int i, k;
+	size_t is;
+	char* val;
+	float vf;
+	double vd;
+	(void)data;
+
+	negstage.nrestart += restart;
+	negstage.ns += ns;
+	for (is=0; is<ns; is++) {
+		for (i=0; i<negstage.nspan; i++) {
+			val = (char*)samples + is*negstage.samlen
+			      + negstage.spans[i].offset;
+			// The values may not be aligned in the ring buffer
+			for (k=0; k<negstage.spans[i].nch; k++) {
+				if (negstage.spans[i].type == EGD_FLOAT) {
+					memcpy(&vf, val, sizeof(vf));
+					vf = -vf;
+					memcpy(val, &vf, sizeof(vf));
+					val += sizeof(vf);
+				} else {
+					memcpy(&vd, val, sizeof(vd));
+					vd = -vd;
+					memcpy(val, &vd, sizeof(vd));
+					val += sizeof(vd);
+				}
+			}
+		}
+	}
+}
+
+
+static
+void neg_teardown(void* data)
+{
+	(void)data;
+	negstage.nteardown++;
+}
+
+
+static const struct egd_stage neg_stage = {
+	.setup = neg_setup,
+	.process = neg_process,
+	.teardown = neg_teardown,
+};
+
+
 static
 int check_signals_f(size_t ns, const float* sig, const float* exg, const int32_t* tri)
 {
@@ -92,6 +176,8 @@ int check_signals_f(size_t ns, const float* sig, const float* exg, const int32_t
 		// Verify the values in the analog channels
 		for (ich=0; ich<neeg && !retval; ich++) {
 			expval = get_analog_valf(nstot, ich, 0);
+			if (usestage)
+				expval = -expval;
 			if (sig[i*neeg+ich] != expval) {
 				fprintf(stderr, "\tEEG value (%f) different from the one expected (%f) at sample %zu ch:%u\n", sig[i*neeg+ich], expval, i+nsread, ich);
 				retval = -1;
@@ -151,6 +237,8 @@ int check_signals_d(size_t ns, const double* sig, const double* exg, const int32
 		// Verify the values in the analog channels
 		for (ich=0; ich<neeg && !retval; ich++) {
 			expval = get_analog_vald(nstot, ich, 0);
+			if (usestage)
+				expval = -expval;
 			if (sig[i*neeg+ich] != expval) {
 				fprintf(stderr, "\tEEG value (%f) different from the one expected (%f) at sample %zu ch:%u\n", sig[i*neeg+ich], expval, i+nsread, ich);
 				retval = -1;
@@ -294,9 +382,28 @@ struct eegdev* open_device(struct grpconf group[3])
 	struct eegdev* dev;
 	char devicestr[256] = "biosemi";
 
+	// Split every conversion and copy across the workers
+	if (numworkers)
+		sprintf(devicestr + strlen(devicestr),
+		        "|workers|%i|workers_minsize|0", numworkers);
+	if (castthread)
+		strcat(devicestr, "|cast_thread|true");
+	if (eventcpu >= 0)
+		sprintf(devicestr + strlen(devicestr), "|cpu|%i", eventcpu);
+	if (capture)
+		snprintf(devicestr + strlen(devicestr),
+		         sizeof(devicestr) - strlen(devicestr),
+		         "|capture|%s", capture);
+
 	if (!(dev = egd_open(devicestr)))
 		return NULL;
 
+	memset(&negstage, 0, sizeof(negstage));
+	if (usestage && egd_add_stage(dev, &neg_stage, NULL)) {
+		egd_close(dev);
+		return NULL;
+	}
+
 	group[0].nch = egd_get_numch(dev, egd_sensor_type("eeg"));
 	group[1].nch = egd_get_numch(dev, egd_sensor_type("undefined"));
 	group[2].nch = egd_get_numch(dev, egd_sensor_type("trigger"));
@@ -314,6 +421,7 @@ int read_eegsignal(int bsigcheck, int pass)
 	void *eeg_t = NULL, *exg_t = NULL;
 	int32_t *tri_t = NULL;
 	int ntri, fs, i, baddata, retcode = 1;
+	struct mm_timespec start, stop;
 	size_t tsize = (type == EGD_FLOAT ? sizeof(float) : sizeof(double));
 
 	// Reset global variable used to track the expected signal
@@ -349,8 +457,9 @@ int read_eegsignal(int bsigcheck, int pass)
 
 	if (egd_start(dev))
 		goto exit;
+	mm_gettime(MM_CLK_MONOTONIC, &start);
 	
-	for (i=0; i < fs*DURATION; i += NSAMPLE) {
+	for (i=0; i < fs*duration; i += NSAMPLE) {
 		if (egd_get_data(dev, NSAMPLE, eeg_t, exg_t, tri_t) < 0) {
 			fprintf(stderr, "\tAcq failed at sample %i\n",i);
 			goto exit;
@@ -377,10 +486,22 @@ int read_eegsignal(int bsigcheck, int pass)
 	if (egd_stop(dev))
 		goto exit;
 
+	mm_gettime(MM_CLK_MONOTONIC, &stop);
+	if (verbose)
+		printf("\tread %i samples in %li ms\n",
+		       i, (long)mm_timediff_ms(&stop, &start));
+
 	if (egd_close(dev))
 		goto exit;
 	dev = NULL;
 
+	if (usestage && (negstage.nsetup != 1 || negstage.nteardown != 1
+	                 || negstage.nrestart != 1 || !negstage.nspan
+	                 || negstage.ns < (size_t)(fs*duration))) {
+		fprintf(stderr, "\tstage not run as expected\n");
+		retcode = 2;
+	}
+
 	if (retcode == 1)
 		retcode = 0;
 exit:
@@ -413,6 +534,18 @@ int main(int argc, char *argv[])
 			"set verbosity level."},
 		{"p", MM_OPT_OPTINT, NULL, {.iptr = &numpass},
 			"number of passes."},
+		{"w", MM_OPT_OPTINT, NULL, {.iptr = &numworkers},
+			"number of core worker threads."},
+		{"t", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &castthread},
+			"cast the data in a dedicated thread."},
+		{"g", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &usestage},
+			"negate the EEG channels in a processing stage."},
+		{"a", MM_OPT_INT, NULL, {.iptr = &eventcpu},
+			"pin the USB event thread on this CPU."},
+		{"o", MM_OPT_STR, NULL, {.sptr = &capture},
+			"capture the raw USB chunks in this file."},
+		{"s", MM_OPT_INT, NULL, {.iptr = &duration},
+			"duration of the acquisition in seconds."},
 	};
 	struct mm_arg_parser parser = {
 		.optv = arg_options,
@@ -41,7 +41,7 @@
 static const char* devhost = NULL;
 static int verbose = 0;
 
-static struct grpconf grp[3] = {
+static struct grpconf grp[4] = {
 	{
 		.index = 0,
 		.iarray = 0,
@@ -62,16 +62,24 @@ static struct grpconf grp[3] = {
 		.arr_offset = 0,
 		.nch = 1,
 		.datatype = EGD_INT32
+	},
+	{
+		.index = NEXG,
+		.iarray = 3,
+		.arr_offset = 0,
+		.nch = NSUBCH,
+		.datatype = EGD_FLOAT
 	}
 };
 
 
-int check_signals_f(size_t ns, const float* sig, const float* exg, const int32_t* tri)
+int check_signals_f(size_t ns, const float* sig, const float* exg, const int32_t* tri, const float* sub)
 {
 	size_t i=0;
 	int neeg = grp[0].nch;
 	int nexg = grp[1].nch;
 	int ntri = grp[2].nch;
+	int nsub = grp[3].nch;
 	int ich;
 	float expval;
 	int32_t exptri;
@@ -108,6 +116,15 @@ int check_signals_f(size_t ns, const float* sig, const float* exg, const int32_t
 				retval = -1;
 			}
 		}
+
+		// Verify the values in the channels sampled at lower rate
+		for (ich=0; ich<nsub && !retval && !(nstot%SUBDIV); ich++) {
+			expval = get_analog_val(nstot, ich);
+			if (sub[(i/SUBDIV)*nsub+ich] != expval) {
+				fprintf(stderr, "\tSub-rate value (%f) different from the one expected (%f) at sample %zu ch:%u\n", sub[(i/SUBDIV)*nsub+ich], expval, i+nsread, ich);
+				retval = -1;
+			}
+		}
 		nstot++;
 	}
 
@@ -118,12 +135,13 @@ int check_signals_f(size_t ns, const float* sig, const float* exg, const int32_t
 
 
 static
-struct eegdev* open_device(struct grpconf group[3])
+struct eegdev* open_device(struct grpconf group[4])
 {
 	struct eegdev* dev;
 	int i;
 	char devstring[256] = "device=tobiia\n";
-	const char* const sname[3] = {"eeg", "undefined", "trigger"};
+	const char* const sname[4] = {"eeg", "undefined", "trigger",
+	                              "undefined"};
 
 	if (devhost)
 		sprintf(devstring+strlen(devstring), "host=%s\n", devhost);
@@ -136,6 +154,10 @@ struct eegdev* open_device(struct grpconf group[3])
 		group[i].nch = egd_get_numch(dev, group[i].sensortype);
 	}
 
+	// The last sensor channels are sampled at a lower rate
+	group[1].nch -= NSUBCH;
+	group[3].sensortype = egd_sensor_type(sname[3]);
+
 	return dev;
 }
 
@@ -175,9 +197,9 @@ int print_cap(struct eegdev* dev)
 int read_eegsignal(int bsigcheck)
 {
 	struct eegdev* dev;
-	size_t strides[3];
+	size_t strides[4];
 	size_t tsize = sizeof(scaled_t);
-	void *eeg_t = NULL, *exg_t = NULL;
+	void *eeg_t = NULL, *exg_t = NULL, *sub_t = NULL;
 	int32_t *tri_t = NULL;
 	int i, fs, retcode = 1;
 
@@ -188,29 +210,31 @@ int read_eegsignal(int bsigcheck)
 	strides[0] = grp[0].nch*tsize;
 	strides[1] = grp[1].nch*tsize;
 	strides[2] = grp[2].nch*sizeof(int32_t);
+	strides[3] = grp[3].nch*tsize;
 
 	eeg_t = calloc(strides[0], NSAMPLE);
 	exg_t = calloc(strides[1], NSAMPLE);
 	tri_t = calloc(strides[2], NSAMPLE);
+	sub_t = calloc(strides[3], NSAMPLE/SUBDIV);
 
 
 	fs = print_cap(dev);
 	
 
-	if (egd_acq_setup(dev, 3, strides, 3, grp))
+	if (egd_acq_setup(dev, 4, strides, 4, grp))
 	    	goto exit;
 
 	if (egd_start(dev))
 		goto exit;
 	
 	for (i=0; i < fs*DURATION; i += NSAMPLE) {
-		if (egd_get_data(dev, NSAMPLE, eeg_t, exg_t, tri_t) < 0) {
+		if (egd_get_data(dev, NSAMPLE, eeg_t, exg_t, tri_t, sub_t) < 0) {
 			fprintf(stderr, "\tAcq failed at sample %i\n",i);
 			goto exit;
 		}
 
 		if (bsigcheck
-		   && check_signals_f(NSAMPLE, eeg_t, exg_t, tri_t)) {
+		   && check_signals_f(NSAMPLE, eeg_t, exg_t, tri_t, sub_t)) {
 			retcode = 2;
 			break;
 		}
@@ -233,6 +257,7 @@ exit:
 	free(eeg_t);
 	free(exg_t);
 	free(tri_t);
+	free(sub_t);
 
 	return retcode;
 }
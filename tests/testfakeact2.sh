@@ -14,5 +14,33 @@ then
 	retval=1
 fi
 
+if ! $prg -d 1 -c 1 -w 3
+then
+	retval=1
+fi
+
+if ! $prg -d 0 -c 1 -t
+then
+	retval=1
+fi
+
+if ! $prg -d 1 -c 1 -g
+then
+	retval=1
+fi
+
+if ! $prg -d 0 -c 1 -a 0
+then
+	retval=1
+fi
+
+# Replay the raw USB chunks captured by the plugin
+if ! $prg -d 0 -c 1 -p 1 -s 6 -o act2-capture.raw \
+   || ! FAKEACT2_REPLAY=act2-capture.raw $prg -d 0 -c 1
+then
+	retval=1
+fi
+rm -f act2-capture.raw
+
 exit $retval
 
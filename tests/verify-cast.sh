@@ -43,4 +43,76 @@ then
 	retval=1
 fi
 
+if ! $prog -s 64 -S 72 -c 720 -w
+then
+	echo "\tcast function fails when whole samples are declared"
+	retval=1
+fi
+
+if ! $prog -k
+then
+	echo "\tcast functions of some instruction set differ from scalar ones"
+	retval=1
+fi
+
+if ! $prog -t
+then
+	echo "\ttranspose functions fail"
+	retval=1
+fi
+
+if ! $prog -p
+then
+	echo "\tunpacking of packed input types fails"
+	retval=1
+fi
+
+if ! $prog -n
+then
+	echo "\tconversions to narrow types fail"
+	retval=1
+fi
+
+if ! $prog -r
+then
+	echo "\tresampler fails"
+	retval=1
+fi
+
+if ! $prog -f
+then
+	echo "\tfilter bank fails"
+	retval=1
+fi
+
+if ! $prog -d
+then
+	echo "\tderived channels fail"
+	retval=1
+fi
+
+if ! $prog -q
+then
+	echo "\tsignal-quality statistics fail"
+	retval=1
+fi
+
+if ! $prog -b
+then
+	echo "\tband-power stage fails"
+	retval=1
+fi
+
+if ! $prog -x
+then
+	echo "\tcast functions with per-channel transform fail"
+	retval=1
+fi
+
+if ! $prog -g
+then
+	echo "\tper-channel gains fail when chunks split the samples"
+	retval=1
+fi
+
 exit $retval
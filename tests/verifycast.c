@@ -19,11 +19,13 @@
 #if HAVE_CONFIG_H
 # include <config.h>
 #endif
+#include <errno.h>
 #include <mmargparse.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <math.h>
 #include "src/core/eegdev-pluginapi.h"
 #include "src/core/coreinternals.h"
 
@@ -32,6 +34,18 @@ unsigned int orignumch = 64;
 unsigned int innumch = 72;
 unsigned int chunklen = 72;
 unsigned int inbuff_offset = 0;
+int whole_samples = 0;
+int check_isa = 0;
+int check_transpose = 0;
+int check_packed = 0;
+int check_narrow = 0;
+int check_resampling = 0;
+int check_filtering = 0;
+int check_deriving = 0;
+int check_monitoring = 0;
+int check_bandpow = 0;
+int check_gains = 0;
+int check_xform = 0;
 #define NS	8192
 #define NPOINT	(orignumch*NS)
 #define INNPOINT	(innumch*NS)
@@ -46,7 +60,31 @@ struct mm_arg_opt arg_options[] = {
 	{"o", MM_OPT_OPTUINT, NULL, {.uiptr = &inbuff_offset},
 		"set input buffer offset."},
 	{"c", MM_OPT_OPTUINT, NULL, {.uiptr = &chunklen},
-		"set chunk length."}
+		"set chunk length."},
+	{"w", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &whole_samples},
+		"declare that chunks hold whole samples."},
+	{"k", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_isa},
+		"check the cast functions of every instruction set."},
+	{"t", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_transpose},
+		"check the transpose functions."},
+	{"p", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_packed},
+		"check the unpacking of packed input types."},
+	{"n", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_narrow},
+		"check the conversions to narrow output types."},
+	{"r", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_resampling},
+		"check the resampler."},
+	{"f", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_filtering},
+		"check the filter bank."},
+	{"d", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_deriving},
+		"check the derived channels."},
+	{"q", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_monitoring},
+		"check the signal-quality statistics."},
+	{"b", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_bandpow},
+		"check the band-power stage."},
+	{"g", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_gains},
+		"check the per-channel gains of chunks splitting samples."},
+	{"x", MM_OPT_NOVAL|MM_OPT_INT, "1", {.iptr = &check_xform},
+		"check the cast functions with per-channel transform."}
 };
 
 
@@ -108,6 +146,958 @@ void copy_buffers(scaled_t* restrict out, scaled_t* restrict in, unsigned int ns
 	}
 }
 
+#define KNCH	37	// not a multiple of any SIMD width
+#define KNS	5
+#define KSTRIDE	(KNCH+3)
+
+static const uint32_t nan_payload = 0x7FE1234F;
+
+static
+void init_kernel_input(void* in, unsigned int type)
+{
+	int i;
+
+	if (type >= EGDI_FIRST_INDTYPE) {
+		for (i=0; i<KSTRIDE*KNS*4; i++)
+			((unsigned char*)in)[i] = (i*7919) % 251;
+		return;
+	}
+
+	for (i=0; i<KSTRIDE*KNS; i++) {
+		if (type == EGD_INT32)
+			((int32_t*)in)[i] = (i*7919 % 20011) - 10000;
+		else if (type == EGD_FLOAT)
+			((float*)in)[i] = (i - 97) * 13.37f;
+		else
+			((double*)in)[i] = (i - 97) * 13.37;
+	}
+
+	// Infinities and NaN (with payload and sign) in the SIMD body and
+	// in the scalar tail
+	if (type == EGD_FLOAT) {
+		for (i=0; i<KSTRIDE*KNS; i+=KSTRIDE) {
+			((float*)in)[i+1] = INFINITY;
+			((float*)in)[i+2] = -INFINITY;
+			((float*)in)[i+KNCH-1] = -NAN;
+			memcpy((float*)in + i+KNCH-2, &nan_payload,
+			       sizeof(nan_payload));
+		}
+	} else if (type == EGD_DOUBLE) {
+		for (i=0; i<KSTRIDE*KNS; i+=KSTRIDE) {
+			((double*)in)[i+1] = INFINITY;
+			((double*)in)[i+2] = -INFINITY;
+			((double*)in)[i+KNCH-1] = -NAN;
+		}
+	}
+}
+
+
+/* Verify that the cast function of every instruction set supported by the
+ * CPU gives bit-identical results to the scalar cast functions. Functions
+ * are tested with strides on both side and a number of channels that
+ * exercise the scalar tail of SIMD loops */
+static
+int check_isa_kernels(void)
+{
+	unsigned int i, it, ot, bsc;
+	unsigned int intypes[] = {EGD_INT32, EGD_FLOAT, EGD_DOUBLE,
+	                          EGDI_INT16LE, EGDI_INT16BE, EGDI_INT24LE,
+	                          EGDI_INT24BE, EGDI_INT32BE};
+	int isa, retval = 0;
+	size_t isize, osize;
+	union gval sc;
+	cast_function ref_fn, fn;
+	char in[KSTRIDE*KNS*sizeof(double)];
+	char ref[KSTRIDE*KNS*sizeof(double)], test[KSTRIDE*KNS*sizeof(double)];
+
+	for (i=0; i<MM_NELEM(intypes); i++) {
+		it = intypes[i];
+		init_kernel_input(in, it);
+		isize = egd_get_data_size(it);
+		for (ot=0; ot<EGD_NUM_DTYPE; ot++) {
+			osize = egd_get_data_size(ot);
+			egdi_set_gval(&sc, ot, (ot == EGD_INT32) ? 3 : 1.7);
+			for (bsc=0; bsc<2; bsc++) {
+				ref_fn = egdi_get_cast_fn_isa(it, ot, bsc,
+				                              EGDI_ISA_SCALAR);
+				memset(ref, 0, sizeof(ref));
+				ref_fn(ref, in, sc, KNCH*isize, KNS,
+				       KSTRIDE*osize, KSTRIDE*isize);
+
+				for (isa=1; isa<EGDI_NUM_ISA; isa++) {
+					fn = egdi_get_cast_fn_isa(it, ot, bsc, isa);
+					if (!fn)
+						continue;
+
+					memset(test, 0, sizeof(test));
+					fn(test, in, sc, KNCH*isize, KNS,
+					   KSTRIDE*osize, KSTRIDE*isize);
+					if (memcmp(ref, test, sizeof(ref))) {
+						fprintf(stderr, "isa %i differs "
+						        "(in=%u out=%u sc=%u)\n",
+						        isa, it, ot, bsc);
+						retval = 1;
+					}
+				}
+			}
+		}
+	}
+
+	return retval;
+}
+
+
+#define PNVAL	19	// not a multiple of any SIMD width
+
+// Write val in the wire format of the packed type
+static
+void pack_value(unsigned char* p, unsigned int type, int32_t val)
+{
+	uint32_t v = val;
+
+	switch (type) {
+	case EGDI_INT16LE: p[0] = v; p[1] = v >> 8; break;
+	case EGDI_INT16BE: p[0] = v >> 8; p[1] = v; break;
+	case EGDI_INT24LE: p[0] = v; p[1] = v >> 8; p[2] = v >> 16; break;
+	case EGDI_INT24BE: p[0] = v >> 16; p[1] = v >> 8; p[2] = v; break;
+	case EGDI_INT32BE: p[0] = v >> 24; p[1] = v >> 16;
+	                   p[2] = v >> 8; p[3] = v; break;
+	}
+}
+
+/* Verify that the values of packed input types are recovered (including
+ * the sign) whatever the output type */
+static
+int check_packed_types(void)
+{
+	unsigned int i, it, ot;
+	size_t isize;
+	int32_t val[PNVAL], maxval;
+	unsigned char in[PNVAL*4];
+	double out[PNVAL], expval;
+	union gval sc;
+	cast_function fn;
+	int retval = 0;
+
+	for (it=EGDI_FIRST_INDTYPE;
+	     it<EGDI_FIRST_INDTYPE+EGDI_NUM_INDTYPE; it++) {
+		isize = egd_get_data_size(it);
+		maxval = (isize == 4) ? INT32_MAX : (1 << (8*isize-1)) - 1;
+		for (i=0; i<PNVAL; i++) {
+			val[i] = (i%2 ? -1 : 1) * (int32_t)(i*(maxval/PNVAL));
+			val[i] = (i == PNVAL-1) ? -maxval-1 : val[i];
+			pack_value(in + i*isize, it, val[i]);
+		}
+
+		for (ot=0; ot<=EGD_DOUBLE; ot++) {
+			egdi_set_gval(&sc, ot, (ot == EGD_INT32) ? 1 : 0.5);
+			fn = egd_get_cast_fn(it, ot, 1);
+			fn(out, in, sc, PNVAL*isize, 1, 0, 0);
+			for (i=0; i<PNVAL; i++) {
+				expval = (ot == EGD_INT32) ? val[i] : 0.5*val[i];
+				if ( (ot == EGD_INT32 && ((int32_t*)out)[i] != val[i])
+				  || (ot == EGD_FLOAT && ((float*)out)[i] != (float)expval)
+				  || (ot == EGD_DOUBLE && out[i] != expval) ) {
+					fprintf(stderr, "packed type %u to "
+					        "%u: value %u differs\n",
+					        it, ot, i);
+					retval = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	return retval;
+}
+
+
+/* Values converted to narrow types and the expected results (the values
+ * are repeated so that the SIMD loops are used). NaN gives the minimum of
+ * the integer types */
+#define NNVAL	15
+static const float narrow_in[NNVAL] = {
+	0.0f, 1.0f, -1.5f, 2.5f, 254.7f, -70000.0f,
+	70000.0f, 65504.0f, 65520.0f, 1e-7f, -0.0f, 0.333333f,
+	INFINITY, -INFINITY, NAN
+};
+static const int16_t narrow_int16[NNVAL] = {
+	0, 1, -2, 2, 255, -32768, 32767, 32767, 32767, 0, 0, 0,
+	32767, -32768, -32768
+};
+static const uint8_t narrow_uint8[NNVAL] = {
+	0, 1, 0, 2, 255, 0, 255, 255, 255, 0, 0, 0,
+	255, 0, 0
+};
+static const uint16_t narrow_uint16[NNVAL] = {
+	0, 1, 0, 2, 255, 0, 65535, 65504, 65520, 0, 0, 0,
+	65535, 0, 0
+};
+static const uint16_t narrow_half[NNVAL] = {
+	0x0000, 0x3C00, 0xBE00, 0x4100, 0x5BF6, 0xFC00,
+	0x7C00, 0x7BFF, 0x7C00, 0x0002, 0x8000, 0x3555,
+	0x7C00, 0xFC00, 0x7E00
+};
+
+/* Verify the rounding and saturation of the conversions to narrow types
+ * for each instruction set */
+static
+int check_narrow_types(void)
+{
+	unsigned int i, ot;
+	int isa, retval = 0;
+	float in[4*NNVAL];
+	uint16_t out[4*NNVAL];
+	const void* expected;
+	size_t osize;
+	cast_function fn;
+	union gval sc = {.valfloat = 1.0f};
+
+	for (i=0; i<4*NNVAL; i++)
+		in[i] = narrow_in[i % NNVAL];
+
+	// The narrow types are not supported as input
+	for (ot=EGD_INT16; ot<EGD_NUM_DTYPE; ot++) {
+		if (egdi_get_cast_fn_isa(ot, EGD_FLOAT, 1, EGDI_ISA_SCALAR)
+		   || egdi_get_xform_fn(ot, EGD_FLOAT)) {
+			fprintf(stderr, "type %u accepted as input\n", ot);
+			retval = 1;
+		}
+	}
+
+	for (ot=EGD_INT16; ot<EGD_NUM_DTYPE; ot++) {
+		osize = egd_get_data_size(ot);
+		expected = (ot == EGD_INT16) ? (const void*)narrow_int16 :
+		           (ot == EGD_UINT8) ? (const void*)narrow_uint8 :
+		           (ot == EGD_UINT16) ? (const void*)narrow_uint16 :
+		                                (const void*)narrow_half;
+		for (isa=0; isa<EGDI_NUM_ISA; isa++) {
+			if (!(fn = egdi_get_cast_fn_isa(EGD_FLOAT, ot, 1, isa)))
+				continue;
+			fn(out, in, sc, sizeof(in), 1, 0, 0);
+			for (i=0; i<4; i++) {
+				if (memcmp((char*)out + i*NNVAL*osize,
+				           expected, NNVAL*osize)) {
+					fprintf(stderr, "conversion to type "
+					        "%u differs (isa %i)\n", ot, isa);
+					retval = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	return retval;
+}
+
+
+#define XMASK	0x000FFF00
+#define XSHIFT	4
+
+// Fill the per-channel gains and offsets of the transform to type in sc
+// and off (exact in float, some gains being negative)
+static
+void init_xform_coefs(char* sc, char* off, unsigned int type)
+{
+	unsigned int k, ct = egdi_get_calc_type(type);
+	size_t csize = egd_get_data_size(ct);
+	union gval val;
+
+	for (k=0; k<KNCH; k++) {
+		egdi_set_gval(&val, ct, (k%9)*0.25 - 0.75 + (k%2));
+		memcpy(sc + k*csize, &val, csize);
+		egdi_set_gval(&val, ct, (double)(k%5) - 2.0);
+		memcpy(off + k*csize, &val, csize);
+	}
+}
+
+// Read as double the coefficient k of the transform to type
+static
+double get_xform_coef(const char* coefs, unsigned int k, unsigned int type)
+{
+	unsigned int ct = egdi_get_calc_type(type);
+	union gval val;
+
+	memcpy(&val, coefs + k*egd_get_data_size(ct), egd_get_data_size(ct));
+	if (ct == EGD_INT32)
+		return val.valint32_t;
+	return (ct == EGD_FLOAT) ? val.valfloat : val.valdouble;
+}
+
+/* Verify the cast functions with per-channel transform against a reference
+ * computed from the plain scalar casts: the values of the input (with the
+ * bits selected for integer input) are scaled and offset per channel in
+ * double, the values being chosen so that the result is exact. The
+ * results in narrow types are compared to the conversion of the
+ * reference by the cast functions of every instruction set. */
+static
+int check_xform_kernels(void)
+{
+	unsigned int i, k, s, it, ot;
+	unsigned int intypes[] = {EGD_INT32, EGD_FLOAT, EGD_DOUBLE,
+	                          EGDI_INT16LE, EGDI_INT16BE, EGDI_INT24LE,
+	                          EGDI_INT24BE, EGDI_INT32BE};
+	int isa, retval = 0;
+	size_t isize, osize, pos;
+	union gval one = {.valfloat = 1.0f};
+	struct cast_xform xf = {.mask = XMASK, .shift = XSHIFT};
+	xform_function xform_fn;
+	cast_function fn;
+	char sc[KNCH*sizeof(double)], off[KNCH*sizeof(double)];
+	char in[KSTRIDE*KNS*sizeof(double)];
+	char ref[KSTRIDE*KNS*sizeof(double)], test[KSTRIDE*KNS*sizeof(double)];
+	double val[KNCH*KNS], y;
+	float yf[KSTRIDE*KNS];
+
+	for (i=0; i<MM_NELEM(intypes); i++) {
+		it = intypes[i];
+		isize = egd_get_data_size(it);
+
+		// Exact input values: the bits of integers are selected
+		init_kernel_input(in, it);
+		for (pos=0; it == EGD_FLOAT && pos<KSTRIDE*KNS; pos++)
+			((float*)in)[pos] = ((pos*37)%201 - 100.0f) * 0.5f;
+		for (pos=0; it == EGD_DOUBLE && pos<KSTRIDE*KNS; pos++)
+			((double*)in)[pos] = ((pos*37)%201 - 100.0) * 0.5;
+		fn = egdi_get_cast_fn_isa(it, EGD_DOUBLE, 0, EGDI_ISA_SCALAR);
+		fn(val, in, one, KNCH*isize, KNS, KNCH*sizeof(double),
+		   KSTRIDE*isize);
+		for (k=0; k<KNCH*KNS && it != EGD_FLOAT && it != EGD_DOUBLE;
+		     k++)
+			val[k] = (int32_t)(((uint32_t)(int32_t)val[k] & XMASK)
+			                   >> XSHIFT);
+
+		for (ot=0; ot<EGD_NUM_DTYPE; ot++) {
+			osize = egd_get_data_size(ot);
+			init_xform_coefs(sc, off, ot);
+			xf.sc = sc;
+			xf.off = off;
+			xform_fn = egdi_get_xform_fn(it, ot);
+
+			memset(test, 0, sizeof(test));
+			xform_fn(test, in, &xf, KNCH*isize, KNS,
+			         KSTRIDE*osize, KSTRIDE*isize);
+
+			// Reference computed in double
+			memset(ref, 0, sizeof(ref));
+			memset(yf, 0, sizeof(yf));
+			for (s=0; s<KNS; s++) {
+				for (k=0; k<KNCH; k++) {
+					y = val[s*KNCH+k];
+					y = (ot == EGD_INT32) ? trunc(y) : y;
+					y = get_xform_coef(sc, k, ot)*y
+					    + get_xform_coef(off, k, ot);
+					pos = s*KSTRIDE + k;
+					yf[pos] = y;
+					if (ot == EGD_INT32)
+						((int32_t*)ref)[pos] = y;
+					else if (ot == EGD_FLOAT)
+						((float*)ref)[pos] = y;
+					else if (ot == EGD_DOUBLE)
+						((double*)ref)[pos] = y;
+				}
+			}
+
+			for (isa=0; isa<EGDI_NUM_ISA; isa++) {
+				if (ot > EGD_DOUBLE) {
+					fn = egdi_get_cast_fn_isa(EGD_FLOAT, ot,
+					                          0, isa);
+					if (!fn)
+						continue;
+					memset(ref, 0, sizeof(ref));
+					fn(ref, yf, one, KNCH*sizeof(float),
+					   KNS, KSTRIDE*osize,
+					   KSTRIDE*sizeof(float));
+				} else if (isa != EGDI_ISA_SCALAR)
+					break;
+
+				if (memcmp(ref, test, sizeof(ref))) {
+					fprintf(stderr, "transform differs "
+					        "(in=%u out=%u isa=%i)\n",
+					        it, ot, isa);
+					retval = 1;
+				}
+			}
+		}
+	}
+
+	return retval;
+}
+
+
+#define GNCH	4	// channels of gain 100, 200, 300 and 400
+#define GNS	16
+
+/* Verify that the per-channel gains and offsets of a narrow output type
+ * are applied to the right channels when the chunks supplied by the device
+ * start in the middle of the samples */
+static
+int check_split_gains(void)
+{
+	struct egdi_signal_info si[GNCH];
+	struct egdi_chinfo ch[GNCH];
+	struct blockmapping map = {.nch = GNCH, .chmap = ch};
+	struct plugincap cap = {
+		.num_mappings = 1, .mappings = &map,
+		.flags = EGDCAP_NOCP_CHMAP, .sampling_freq = 64,
+		.device_type = "test_type", .device_id = "test_id"
+	};
+	struct grpconf grp = {.sensortype = 0, .nch = GNCH,
+	                      .datatype = EGD_INT16};
+	size_t stride = GNCH*sizeof(int16_t), chunks[] = {16, 8, 4, 12, 20};
+	float in[GNS*GNCH];
+	const int16_t* ring;
+	struct eegdev* dev;
+	unsigned int i, k, ic;
+	size_t pos, len;
+	int retval = 0;
+
+	memset(si, 0, sizeof(si));
+	memset(ch, 0, sizeof(ch));
+	for (k=0; k<GNCH; k++) {
+		si[k].dtype = EGD_FLOAT;
+		si[k].bsc = 1;
+		si[k].scale = 100.0*(k+1);
+		si[k].offset = k;
+		ch[k].si = si + k;
+	}
+	for (i=0; i<GNS*GNCH; i++)
+		in[i] = (i/GNCH % 2) ? -1.0f : 1.0f;
+
+	for (ic=0; ic<MM_NELEM(chunks) && !retval; ic++) {
+		dev = egdi_create_eegdev(&info);
+		dev->module.ci.set_cap(&dev->module, &cap);
+		dev->module.ci.set_input_samlen(&dev->module, sizeof(in)/GNS);
+		if (egd_acq_setup(dev, 1, &stride, 1, &grp)) {
+			fprintf(stderr, "setup failed: %s\n", strerror(errno));
+			egd_destroy_eegdev(dev);
+			return 1;
+		}
+		dev->acquiring = 1;
+		dev->rings[0].state = RING_RUNNING;
+
+		for (pos=0; pos<sizeof(in); pos+=len) {
+			len = chunks[ic];
+			len = (pos+len < sizeof(in)) ? len : sizeof(in)-pos;
+			dev->module.ci.update_ringbuffer(&dev->module,
+			                             (char*)in + pos, len);
+		}
+
+		ring = (const int16_t*)dev->rings[0].buffer;
+		for (i=0; i<GNS*GNCH; i++) {
+			k = i % GNCH;
+			if (ring[i] != in[i]*100*(int)(k+1) + (int)k) {
+				fprintf(stderr, "chunks of %zu bytes: channel"
+				        " %u of sample %u is %i\n", chunks[ic],
+				        k, i/GNCH, ring[i]);
+				retval = 1;
+				break;
+			}
+		}
+		egd_destroy_eegdev(dev);
+	}
+
+	return retval;
+}
+
+
+#define RNCH	70	// not a multiple of the channel block
+#define RNS	1000	// samples in the ring
+#define RDC	5.0f
+
+/* Verify that the resampler produces the expected number of samples and
+ * keeps a constant signal unchanged, including at the start of the ring
+ * where the first sample is held */
+static
+int check_resampler(void)
+{
+	unsigned int ratios[][2] = {{1, 4}, {3, 2}, {75, 128}, {1, 1}};
+	unsigned int i, c;
+	int retval = 0;
+	uint64_t j, j1;
+	float* ring = malloc(RNS*RNCH*sizeof(*ring));
+	float* out = malloc(3*RNS*RNCH*sizeof(*out));
+	struct resampler* rs;
+	struct resample_src src = {
+		.buffer = (const char*)ring,
+		.buffsize = RNS*RNCH*sizeof(*ring),
+		.samlen = RNCH*sizeof(*ring),
+		.nch = RNCH,
+	};
+
+	for (i=0; i<RNS*RNCH; i++)
+		ring[i] = RDC;
+
+	for (i=0; i<sizeof(ratios)/sizeof(ratios[0]); i++) {
+		rs = egdi_create_resampler(ratios[i][0], ratios[i][1]);
+		if (!rs) {
+			fprintf(stderr, "cannot create resampler %u/%u\n",
+			        ratios[i][0], ratios[i][1]);
+			retval = 1;
+			continue;
+		}
+
+		j1 = egdi_get_resampled_index(rs, RNS);
+		if (j1 != (RNS*ratios[i][0] + ratios[i][1]-1) / ratios[i][1]) {
+			fprintf(stderr, "wrong output length (ratio %u/%u)\n",
+			        ratios[i][0], ratios[i][1]);
+			retval = 1;
+		}
+
+		egdi_resample(rs, EGD_FLOAT, &src, (char*)out,
+		              RNCH*sizeof(*out), sizeof(*out), 0, j1);
+		for (j=0; j<j1; j++) {
+			for (c=0; c<RNCH; c++) {
+				if (out[j*RNCH+c] < RDC-1e-5f
+				   || out[j*RNCH+c] > RDC+1e-5f) {
+					fprintf(stderr, "DC not preserved "
+					        "(ratio %u/%u, sample %u)\n",
+					        ratios[i][0], ratios[i][1],
+					        (unsigned int)j);
+					retval = 1;
+					j = j1;
+					break;
+				}
+			}
+		}
+		egdi_destroy_resampler(rs);
+	}
+
+	free(ring);
+	free(out);
+	return retval;
+}
+
+
+#define FNCH	70	// filtered channels (not a multiple of SIMD width)
+#define FNS	700	// samples in the ring
+#define FDC	1000.0f
+
+/* Verify that the filter bank removes a constant offset from the first
+ * sample, that it works across the end of the ring and that splitting
+ * the channels in parts does not change the result */
+static
+int check_filter(void)
+{
+	struct filter_spec spec = {.hp = 1.0, .notch = 50.0, .order = 4};
+	struct filter_span span = {.offset = sizeof(float), .nch = FNCH,
+	                           .type = EGD_FLOAT};
+	size_t samlen = (FNCH+1)*sizeof(float), buffsize = FNS*samlen;
+	struct filter_bank *fb1, *fb3;
+	float *ring1, *ring3;
+	unsigned int i, ipart;
+	int retval = 0;
+
+	ring1 = malloc(buffsize);
+	ring3 = malloc(buffsize);
+	fb1 = egdi_create_filter_bank(&spec, 512.0, 1, &span);
+	fb3 = egdi_create_filter_bank(&spec, 512.0, 1, &span);
+	if (!ring1 || !ring3 || !fb1 || !fb3) {
+		retval = 1;
+		goto exit;
+	}
+
+	for (i=0; i<FNS*(FNCH+1); i++)
+		ring1[i] = ring3[i] = FDC;
+
+	// Filter 2 runs of samples, the second crossing the end of ring
+	egdi_filter_samples(fb1, (char*)ring1, buffsize, samlen,
+	                    (FNS-200)*samlen, 100, 1, 0, 1);
+	egdi_filter_samples(fb1, (char*)ring1, buffsize, samlen,
+	                    (FNS-100)*samlen, 300, 0, 0, 1);
+	for (ipart=0; ipart<3; ipart++)
+		egdi_filter_samples(fb3, (char*)ring3, buffsize, samlen,
+		                    (FNS-200)*samlen, 100, 1, ipart, 3);
+	for (ipart=0; ipart<3; ipart++)
+		egdi_filter_samples(fb3, (char*)ring3, buffsize, samlen,
+		                    (FNS-100)*samlen, 300, 0, ipart, 3);
+
+	if (memcmp(ring1, ring3, buffsize)) {
+		fprintf(stderr, "filtering split in parts differs\n");
+		retval = 1;
+	}
+	for (i=0; i<FNS*(FNCH+1); i++) {
+		// Untouched channel and samples
+		if (i % (FNCH+1) == 0 || (i >= 200*(FNCH+1)
+		                          && i < (FNS-200)*(FNCH+1))) {
+			if (ring1[i] != FDC)
+				break;
+		} else if (ring1[i] > 1e-3f || ring1[i] < -1e-3f)
+			break;
+	}
+	if (i < FNS*(FNCH+1)) {
+		fprintf(stderr, "wrong filtered value at %u: %g\n",
+		        i, ring1[i]);
+		retval = 1;
+	}
+
+exit:
+	egdi_destroy_filter_bank(fb1);
+	egdi_destroy_filter_bank(fb3);
+	free(ring1);
+	free(ring3);
+	return retval;
+}
+
+
+#define DNIN	37	// inputs (not a multiple of SIMD width)
+#define DNOUT	5
+#define DNS	300	// samples in the ring
+
+// Fill w with a dense matrix (common average references) if dense is set
+// or with a sparse one (bipolar derivations) otherwise
+static
+void set_derivation_weights(double* w, int dense)
+{
+	unsigned int r, k;
+
+	for (r=0; r<DNOUT; r++) {
+		for (k=0; k<DNIN; k++)
+			w[r*DNIN+k] = dense ? -1.0/DNIN : 0.0;
+		w[r*DNIN + 3*r] += 1.0;
+		if (!dense)
+			w[r*DNIN + 3*r+1] = -0.5;
+	}
+}
+
+
+// Verify the derived channels of the ring (in float) against the
+// weights
+static
+int verify_derived(const float* ring, const double* w)
+{
+	unsigned int s, r, k;
+	double ref, err;
+
+	for (s=0; s<DNS; s++) {
+		for (r=0; r<DNOUT; r++) {
+			ref = 0.0;
+			for (k=0; k<DNIN; k++)
+				ref += w[r*DNIN+k] * ring[s*(DNIN+DNOUT)+k];
+			err = ring[s*(DNIN+DNOUT)+DNIN+r] - ref;
+			if (err > 1e-4 || err < -1e-4) {
+				fprintf(stderr, "wrong derived value %g "
+				        "(expected %g) at sample %u, row %u\n",
+				        ring[s*(DNIN+DNOUT)+DNIN+r], ref, s, r);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/* Verify that dense and sparse derivations compute the right values across
+ * the end of the ring when split in parts, and that the expressions of
+ * derived channels are parsed into the right weights */
+static
+int check_derivation(void)
+{
+	struct egdi_chinfo chmap[] = {
+		{.label = "Fz"}, {.label = "Cz"}, {.label = "Pz"},
+		{.label = "EOG"}, {.label = "Oz"}
+	};
+	static const double refrow[] = {1.75, -0.25, -0.75, 0.0, 0.75};
+	unsigned int srcch[DNIN], k, ipart;
+	size_t samlen = (DNIN+DNOUT)*sizeof(float), buffsize = DNS*samlen;
+	double w[DNOUT*DNIN], row[MM_NELEM(chmap)] = {0.0};
+	struct derivation* dv;
+	float* ring;
+	int dense, retval = 0;
+
+	if (!(ring = malloc(buffsize)))
+		return 1;
+
+	for (k=0; k<DNIN; k++)
+		srcch[k] = k;
+
+	for (dense=0; dense<2 && !retval; dense++) {
+		set_derivation_weights(w, dense);
+		if (!(dv = egdi_create_derivation(DNOUT, DNIN, srcch, w, NULL))) {
+			retval = 1;
+			break;
+		}
+		dv->type = EGD_FLOAT;
+		dv->dst_offset = DNIN*sizeof(float);
+		for (k=0; k<DNIN; k++)
+			dv->src_offset[k] = k*sizeof(float);
+
+		for (k=0; k<DNS*(DNIN+DNOUT); k++)
+			ring[k] = (float)((k * 37) % 101) - 50.0f;
+
+		// 2 runs, the second crossing the end of ring and split
+		egdi_derive_samples(dv, (char*)ring, buffsize, samlen,
+		                    (DNS-250)*samlen, 203, 0, 1);
+		for (ipart=0; ipart<3; ipart++)
+			egdi_derive_samples(dv, (char*)ring, buffsize, samlen,
+			                    (DNS-47)*samlen, 97, ipart, 3);
+		retval = verify_derived(ring, w);
+		egdi_destroy_derivation(dv);
+	}
+
+	// Expressions referring channels by label, type:index and mean:type
+	for (k=0; k<MM_NELEM(chmap); k++)
+		chmap[k].stype = egd_sensor_type((k == 3) ? "eog" : "eeg");
+	if (egdi_parse_derivation("2*Fz - 0.5*eeg:2+-1 * mean:eeg + Oz",
+	                          MM_NELEM(chmap), chmap, NULL, row)
+	   || memcmp(row, refrow, sizeof(row))) {
+		fprintf(stderr, "derivation expression wrongly parsed\n");
+		retval = 1;
+	}
+	if (!egdi_parse_derivation("Fz - Unknown", MM_NELEM(chmap),
+	                           chmap, NULL, row)
+	   || !egdi_parse_derivation("Fz -", MM_NELEM(chmap),
+	                             chmap, NULL, row)) {
+		fprintf(stderr, "invalid derivation expression accepted\n");
+		retval = 1;
+	}
+
+	free(ring);
+	return retval;
+}
+
+
+#define QNCH	21	// monitored channels (not a multiple of SIMD width)
+#define QNS	500	// samples in the ring
+#define QWIN	150	// samples of a window
+
+/* Verify the statistics of the last window published by a quality monitor
+ * fed across the end of the ring, the channels being split in parts. The
+ * channel 0 is not monitored, 1 is flat, 2 saturates every 10 samples and
+ * the others hold a DC offset plus a square wave of known RMS. */
+static
+int check_quality(void)
+{
+	struct egd_chspan span = {.offset = sizeof(double), .nch = QNCH,
+	                           .index = 0, .type = EGD_DOUBLE};
+	struct egd_quality q[QNCH+1];
+	size_t samlen = (QNCH+1)*sizeof(double), buffsize = QNS*samlen;
+	double limits[2*QNCH], *ring, dev;
+	unsigned int s, c, ipart, ns[] = {130, 90, 111};
+	size_t ind = (QNS-100)*samlen;
+	struct quality_monitor* qm;
+	int retval = 0;
+
+	for (c=0; c<QNCH; c++) {
+		limits[2*c] = -100.0;
+		limits[2*c+1] = 100.0;
+	}
+	ring = malloc(buffsize);
+	qm = egdi_create_quality_monitor(QWIN, 1, &span, limits);
+	if (!ring || !qm) {
+		retval = 1;
+		goto exit;
+	}
+
+	for (s=0; s<QNS; s++) {
+		ring[s*(QNCH+1)] = 1000.0;
+		ring[s*(QNCH+1)+1] = 5.0;
+		ring[s*(QNCH+1)+2] = (s % 10) ? 1.0 : 100.0;
+		for (c=3; c<=QNCH; c++)
+			ring[s*(QNCH+1)+c] = c + ((s % 2) ? c : -(double)c);
+	}
+
+	// 3 updates of 331 samples in total, each ending a window in its
+	// middle: the first window crosses the end of ring and the last
+	// complete one spans the ring samples 50 to 200
+	egdi_reset_quality(qm);
+	for (s=0; s<MM_NELEM(ns); s++) {
+		for (ipart=0; ipart<3; ipart++)
+			egdi_update_quality(qm, (char*)ring, buffsize, samlen,
+			                    ind, ns[s], ipart, 3);
+		egdi_advance_quality(qm, ns[s]);
+		ind = (ind + ns[s]*samlen) % buffsize;
+	}
+
+	memset(q, 0xff, sizeof(q));
+	q[QNCH].ns = 42;
+	egdi_read_quality(qm, 0, q);
+	for (c=0; c<QNCH; c++) {
+		dev = (c+1 == 2) ? 99.0*sqrt(0.09) : ((c+1 > 2) ? c+1 : 0.0);
+		if (q[c].ns != QWIN
+		   || fabs(q[c].dc - ((c+1 == 1) ? 5.0
+		                      : (c+1 == 2) ? 10.9 : c+1)) > 1e-9
+		   || fabs(q[c].rms - dev) > 1e-9
+		   || q[c].nsat != ((c+1 == 2) ? QWIN/10 : 0)
+		   || q[c].flat != (c+1 == 1)) {
+			fprintf(stderr, "wrong statistics of channel %u: "
+			        "dc=%g rms=%g nsat=%u flat=%i ns=%u\n", c,
+			        q[c].dc, q[c].rms, q[c].nsat, q[c].flat,
+			        q[c].ns);
+			retval = 1;
+		}
+	}
+	if (q[QNCH].ns != 42) {
+		fprintf(stderr, "statistics written out of bounds\n");
+		retval = 1;
+	}
+
+exit:
+	egdi_destroy_quality_monitor(qm);
+	free(ring);
+	return retval;
+}
+
+
+#define BNCH	11	// double channels (not a multiple of SIMD width)
+#define BNFL	3	// float channels
+#define BFS	256.0
+#define BNS	1024	// samples in the ring
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+/* Verify the log band power computed by the band-power stage from a ring
+ * of sinusoids fed across its end, whose samples are not aligned. The
+ * double channel c is a sinusoid of amplitude c+1 at 10 Hz if c is even,
+ * 20 Hz otherwise, except the last one which is null. The float channels
+ * are sinusoids of amplitude 1 at 10 Hz. With a window of BFS samples, the
+ * power of a sinusoid of amplitude A at an integer frequency falls in 3
+ * bins, hence a mean PSD of A^2/10 over a band of 5 bins around it. */
+static
+int check_bandpower(void)
+{
+	struct bandpower_spec spec = {.nband = 2, .lo = {8.0, 18.0},
+	                              .hi = {12.0, 22.0},
+	                              .window = 1.0, .step = 0.25};
+	struct egd_chspan spans[2] = {
+		{.offset = 1, .nch = BNCH, .index = 0, .type = EGD_DOUBLE,
+		 .stype = 0},
+		{.offset = 1+BNCH*sizeof(double), .nch = BNFL, .index = 0,
+		 .type = EGD_FLOAT, .stype = 1},
+	};
+	size_t samlen = 1 + BNCH*sizeof(double) + BNFL*sizeof(float);
+	size_t buffsize = BNS*samlen, ind, ns, ret = 0;
+	double logpow[2*BNCH+1], ref, t, vd;
+	float vf;
+	char* ring;
+	struct bandpower* bp;
+	unsigned int s, c, b, chunk, try;
+	size_t total;
+	int retval = 0;
+
+	ring = calloc(BNS, samlen);
+	bp = ring ? egdi_create_bandpower(&spec, BFS, 2, spans, ring,
+	                                  buffsize, samlen) : NULL;
+	if (!bp) {
+		retval = 1;
+		goto exit;
+	}
+
+	// 400 samples written by chunks from the sample BNS-100, the last
+	// window processed ending after 384 samples
+	ind = (BNS-100)*samlen;
+	for (total=0; total<400; total+=chunk) {
+		chunk = (total + 37 <= 400) ? 37 : 400-total;
+		egdi_reserve_bandpower(bp, chunk);
+		for (s=0; s<chunk; s++) {
+			t = (total+s)/BFS;
+			for (c=0; c<BNCH; c++) {
+				vd = (c == BNCH-1) ? 0.0
+				     : (c+1)*sin(2*M_PI*((c%2) ? 20 : 10)*t);
+				memcpy(ring + ind + 1 + c*sizeof(vd),
+				       &vd, sizeof(vd));
+			}
+			vf = sin(2*M_PI*10*t);
+			for (c=0; c<BNFL; c++)
+				memcpy(ring + ind + spans[1].offset
+				       + c*sizeof(vf), &vf, sizeof(vf));
+			ind = (ind + samlen) % buffsize;
+		}
+		egdi_update_bandpower(bp, chunk, ind, total == 0);
+	}
+
+	// Wait for the result of the last window
+	for (try=0; try<1000; try++) {
+		logpow[2*BNCH] = 42.0;
+		if ((ret = egdi_read_bandpower(bp, 0, logpow)) == 384)
+			break;
+		usleep(1000);
+	}
+	if (ret != 384 || logpow[2*BNCH] != 42.0) {
+		fprintf(stderr, "band power not published or written out of "
+		        "bounds (ns=%u)\n", (unsigned int)ret);
+		retval = 1;
+		goto exit;
+	}
+
+	for (c=0; c<BNCH; c++) {
+		for (b=0; b<2; b++) {
+			ref = log((c+1)*(c+1)/10.0);
+			if (c == BNCH-1 ? !isinf(logpow[2*c+b])
+			    : (b == c%2) ? fabs(logpow[2*c+b] - ref) > 1e-6
+			    : logpow[2*c+b] > ref - 20.0) {
+				fprintf(stderr, "wrong power of channel %u "
+				        "in band %u: %g\n", c, b,
+				        logpow[2*c+b]);
+				retval = 1;
+			}
+		}
+	}
+
+	ns = egdi_read_bandpower(bp, 1, logpow);
+	if (ns != 384 || fabs(logpow[0] - log(0.1)) > 1e-5
+	   || fabs(logpow[2*BNFL-2] - log(0.1)) > 1e-5
+	   || logpow[2*BNFL-1] > log(0.1) - 10.0) {
+		fprintf(stderr, "wrong power of float channels\n");
+		retval = 1;
+	}
+
+exit:
+	egdi_destroy_bandpower(bp);
+	free(ring);
+	return retval;
+}
+
+
+#define TNCH	70	// not a multiple of tile nor block sizes
+#define TNS	131
+#define TSTRIDE	(TNS+5)	// channel stride in elements
+
+/* Verify that the transpose functions write the element k of the sample s
+ * at the right place of a channel-major array and nothing else */
+static
+int check_transpose_fn(void)
+{
+	size_t tsizes[] = {1, 2, 4, 8};
+	size_t i, k, s, tsize, sstride;
+	int retval = 0;
+	unsigned char *in, *out, *ref;
+	copy_function fn;
+
+	in = malloc(TNS*(TNCH+1)*8);
+	out = malloc(TNCH*TSTRIDE*8);
+	ref = malloc(TNCH*TSTRIDE*8);
+	for (i=0; i<TNS*(TNCH+1)*8; i++)
+		in[i] = (i * 131) % 251;
+
+	for (i=0; i<MM_NELEM(tsizes); i++) {
+		tsize = tsizes[i];
+		sstride = (TNCH+1)*tsize;
+		memset(ref, 0xAA, TNCH*TSTRIDE*tsize);
+		memset(out, 0xAA, TNCH*TSTRIDE*tsize);
+		for (k=0; k<TNCH; k++)
+			for (s=0; s<TNS; s++)
+				memcpy(ref + k*TSTRIDE*tsize + s*tsize,
+				       in + s*sstride + k*tsize, tsize);
+
+		fn = egdi_get_transpose_fn(tsize);
+		fn((char*)out, (char*)in, TNCH*tsize, TNS,
+		   TSTRIDE*tsize, sstride);
+		if (memcmp(ref, out, TNCH*TSTRIDE*tsize)) {
+			fprintf(stderr, "transpose of %u bytes elements "
+			        "fails\n", (unsigned int)tsize);
+			retval = 1;
+		}
+	}
+
+	free(in);
+	free(out);
+	free(ref);
+	return retval;
+}
+
+
 int main(int argc, char* argv[])
 {
 	int retval = 0;
@@ -115,6 +1105,7 @@ int main(int argc, char* argv[])
 	unsigned int i;
 
 	struct eegdev* dev;
+	struct ringbuffer* rb;
 	scaled_t* inbuffer, *origbuffer;
 	char* ref, *test;
 	struct mm_arg_parser parser = {
@@ -124,6 +1115,28 @@ int main(int argc, char* argv[])
 	};
 
 	mm_arg_parse(&parser, argc, argv);
+	if (check_isa)
+		return check_isa_kernels();
+	if (check_transpose)
+		return check_transpose_fn();
+	if (check_packed)
+		return check_packed_types();
+	if (check_narrow)
+		return check_narrow_types();
+	if (check_resampling)
+		return check_resampler();
+	if (check_filtering)
+		return check_filter();
+	if (check_deriving)
+		return check_derivation();
+	if (check_monitoring)
+		return check_quality();
+	if (check_bandpow)
+		return check_bandpower();
+	if (check_gains)
+		return check_split_gains();
+	if (check_xform)
+		return check_xform_kernels();
 
 	origbuffer = malloc(NS*orignumch*sizeof(scaled_t));
 	inbuffer = malloc(NS*innumch*sizeof(scaled_t));
@@ -131,18 +1144,22 @@ int main(int argc, char* argv[])
 	copy_buffers(inbuffer, origbuffer, NS);
 
 	dev = egdi_create_eegdev(&info);
-	dev->inbuffgrp = malloc(NGRP*sizeof(*(dev->inbuffgrp)));
-	dev->ngrp = NGRP;
-	init_inbufgrp(dev->inbuffgrp, NGRP);
+	rb = dev->rings;
+	dev->inbuffgrp = calloc(NGRP, sizeof(*(dev->inbuffgrp)));
+	rb->inbuffgrp = dev->inbuffgrp;
+	rb->ngrp = NGRP;
+	init_inbufgrp(rb->inbuffgrp, NGRP);
 	dev->acquiring = 1;
+	rb->state = RING_RUNNING;
 	size_t buffer_len = NS * orignumch * sizeof(scaled_t);
-	dev->buffer = malloc(buffer_len);
+	rb->buffer = malloc(buffer_len);
 	dev->strides = NULL;
 	dev->arrconf = NULL;
-	dev->in_samlen = innumch*sizeof(scaled_t);
-	dev->buff_samlen = orignumch*sizeof(scaled_t);
-	dev->buffsize = NPOINT*sizeof(scaled_t);
-	dev->buff_ns = NS;
+	rb->in_samlen = innumch*sizeof(scaled_t);
+	rb->buff_samlen = orignumch*sizeof(scaled_t);
+	rb->buffsize = NPOINT*sizeof(scaled_t);
+	rb->buff_ns = NS;
+	dev->cap.flags = whole_samples ? EGDCAP_WHOLE_SAMPLES : 0;
 
 	i = 0;
 	while (i<INNPOINT) {
@@ -153,15 +1170,15 @@ int main(int argc, char* argv[])
 	}
 
 	ref = (char*)origbuffer;
-	test = (char*)dev->buffer;
+	test = (char*)rb->buffer;
 	for (i=0; i<NS; i++) {
-		if (memcmp(ref, test, dev->buff_samlen)) {
+		if (memcmp(ref, test, rb->buff_samlen)) {
 			fprintf(stderr, "mismatch at sample %i\n", i);
 			retval = 1;
 			break;
 		}
-		ref += dev->buff_samlen;
-		test += dev->buff_samlen;
+		ref += rb->buff_samlen;
+		test += rb->buff_samlen;
 	}
 
 	egd_destroy_eegdev(dev);
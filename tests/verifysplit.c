@@ -34,13 +34,17 @@ struct egdi_signal_info siginfo[] = {
 	[EGD_DOUBLE] = {.dtype = EGD_DOUBLE},
 };
 
+// int32 channel whose bits must be selected (a split should occur)
+static
+struct egdi_signal_info shifted_siginfo = {.dtype = EGD_INT32, .shift = 8};
+
 static
 struct egdi_chinfo channels[] = {
 	{.si = &siginfo[EGD_FLOAT], .stype = 0},
 	{.si = &siginfo[EGD_FLOAT], .stype = 0},
 	{.si = &siginfo[EGD_FLOAT], .stype = 0},
 	{.si = &siginfo[EGD_INT32], .stype = 1},
-	{.si = &siginfo[EGD_INT32], .stype = 1},
+	{.si = &shifted_siginfo, .stype = 1},
 	{.si = &siginfo[EGD_FLOAT], .stype = 1},
 	{.si = &siginfo[EGD_DOUBLE], .stype = 0},
 	{.si = &siginfo[EGD_DOUBLE], .stype = 0},
@@ -63,7 +67,8 @@ struct grpconf grp[] = {
 
 struct selected_channels expected_selch[] = {
 	{.in_offset = (6+2)*4 + 2*8, .inlen = 4, .typein = EGD_FLOAT, .typeout = EGD_DOUBLE, .arr_offset = 0, .iarray = 1},
-	{.in_offset = 3*4, .inlen = 2*4, .typein = EGD_INT32, .typeout = EGD_FLOAT, .arr_offset = 0, .iarray = 0},
+	{.in_offset = 3*4, .inlen = 4, .typein = EGD_INT32, .typeout = EGD_FLOAT, .arr_offset = 0, .iarray = 0},
+	{.in_offset = 4*4, .inlen = 4, .typein = EGD_INT32, .typeout = EGD_FLOAT, .arr_offset = 4, .iarray = 0},
 	{.in_offset = (3+2)*4, .inlen = 4, .typein = EGD_FLOAT, .typeout = EGD_FLOAT, .arr_offset = 2*4, .iarray = 0},
 	{.in_offset = 2*4, .inlen = 4, .typein = EGD_FLOAT, .typeout = EGD_FLOAT, .arr_offset = 3*4, .iarray = 0},
 	{.in_offset = (4+2)*4, .inlen = 2*8, .typein = EGD_DOUBLE, .typeout = EGD_FLOAT, .arr_offset = 4*4, .iarray = 0},
@@ -72,12 +77,19 @@ struct selected_channels expected_selch[] = {
 };
 #define NEXPSELCH	(sizeof(expected_selch)/sizeof(expected_selch[0]))
 
+// Index in channels of the first channel of each expected_selch
+int expected_first[NEXPSELCH] = {10, 3, 4, 5, 2, 6, 8, 11};
+
 static
 int test_split(struct eegdev* dev)
 {
 	if (egdi_split_alloc_chgroups(dev, NGRP, grp))
 		return -1;
 	
+	if (dev->nsel != NEXPSELCH
+	  || memcmp(expected_first, dev->selchmap, sizeof(expected_first)))
+		return -1;
+
 	return memcmp(expected_selch, dev->selch, sizeof(expected_selch));
 }
 